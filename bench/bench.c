@@ -0,0 +1,56 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xport.h"
+#include "simnet.h"
+#include "bench.h"
+
+void BENCH_split(char *s, const char *sep, struct BENCH_List *list)
+{
+	char *save = NULL, *tok;
+	list->n = 0;
+	for(tok = strtok_r(s, sep, &save); tok && list->n < BENCH_MAX_LIST;
+			tok = strtok_r(NULL, sep, &save))
+		list->item[list->n++] = tok;
+}
+
+size_t BENCH_parseSize(const char *s)
+{
+	char *end;
+	double v = strtod(s, &end);
+	switch(*end){
+	case 'k': case 'K': v *= 1e3; break;
+	case 'm': case 'M': v *= 1e6; break;
+	case 'g': case 'G': v *= 1e9; break;
+	}
+	return (size_t)v;
+}
+
+int BENCH_simulate(const char *spec)
+{
+	struct SIM_Link link = {0};
+	if(SIM_parse(spec, &link) != 0){
+		fprintf(stderr, "Bad link description: %s\n", spec);
+		return -1;
+	}
+	SIM_configure(&link);
+	XP_use(&SIM_ops);
+	return 0;
+}
+
+FILE *BENCH_report(void)
+{
+	fflush(stdout);
+	FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+	if(!report){
+		perror("fdopen");
+		return NULL;
+	}
+	dup2(STDERR_FILENO, STDOUT_FILENO);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	return report;
+}
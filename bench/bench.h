@@ -0,0 +1,36 @@
+#ifndef BENCH_H_202610192000
+#define BENCH_H_202610192000
+
+#include <stdio.h>
+#include <stddef.h>
+
+/**
+ * Pieces shared by the benchmark modes. Each mode takes getopt options,
+ * sweeps the combinations it was given and writes one CSV row or JSON object
+ * per result to the report stream.
+ **/
+#define BENCH_MAX_LIST 32
+
+struct BENCH_List
+{
+	int n;
+	char *item[BENCH_MAX_LIST];
+};
+
+// Split s in place at any of the characters in sep
+void BENCH_split(char *s, const char *sep, struct BENCH_List *list);
+// "100", "64k", "1m", "2g"
+size_t BENCH_parseSize(const char *s);
+// Switch to the simulator with a link description; -1 if it does not parse
+int BENCH_simulate(const char *spec);
+// The real stdout for results. Everything else printed to stdout, like the
+// protocol trace of a debug build, goes to stderr from now on.
+FILE *BENCH_report(void);
+
+int BENCH_throughput(int argc, char **argv);
+int BENCH_latency(int argc, char **argv);
+int BENCH_kernels(int argc, char **argv);
+int BENCH_scale(int argc, char **argv);
+int BENCH_replay(int argc, char **argv);
+
+#endif
@@ -0,0 +1,312 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chksum.h"
+#include "sock.h"
+#include "s_gbn.h"
+#include "xport.h"
+#include "simnet.h"
+#include "xfer.h"
+#include "bench.h"
+
+// Microbenchmarks of the per-packet kernels, one at a time on hot buffers.
+// Each is run in batches big enough to time (which also warms it up), then
+// the batch is repeated and the median, minimum and spread of ns per call
+// reported. Kernels with several implementations are run on each one the
+// CPU has. Last come whole RDT_send/RDT_recv paths on the simulator, as CPU
+// per packet, for the parts (packetizer, receive ring) that only exist there.
+
+#define BENCH_BATCH_NSEC 200000 // shortest batch worth timing
+#define BENCH_MAX_REPS 1000
+
+static char *src, *dst;
+static gbnhdr hdr;
+static char packet[RDT_PACKET_LEN];
+static enum RDT_Integrity integrity;
+static volatile uint32_t sink; // keeps results alive
+
+static void kSum(size_t len) { sink += CK_sum(src, len); }
+static void kCopySum(size_t len) { sink += CK_copy_sum(dst, src, len); }
+static void kCrc(size_t len) { sink += CK_crc32c(0, src, len); }
+static void kInet(size_t len) { sink += RDT_inet_chksum(src, len); }
+static void kBuild(size_t len) { RDT_packet_build(integrity, packet, len, src, len); }
+static void kIntact(size_t len) { sink += RDT_packet_intact(integrity, packet); }
+static void kInit(size_t len) { init_header(&hdr, DATA, len, src, len); }
+static void kChecksum2(size_t len) { sink += checksum2(&hdr, len); }
+static void kSerialize(size_t len) { serialize_gbnhdr(dst, &hdr, len + GBN_HDRLEN); }
+static void kDeserialize(size_t len) { deserialize_gbnhdr(dst, &hdr, len); }
+
+enum Family { FAM_NONE, FAM_SUM, FAM_CRC, FAM_MODE };
+
+struct Kernel
+{
+	const char *name;
+	void (*run)(size_t len);
+	enum Family family;
+	size_t max_len; // calls take at most this many bytes, 0 for no limit
+};
+
+static const struct Kernel kernels[] = {
+	{"CK_sum", kSum, FAM_SUM, 0},
+	{"CK_copy_sum", kCopySum, FAM_SUM, 0},
+	{"RDT_inet_chksum", kInet, FAM_SUM, 0},
+	{"CK_crc32c", kCrc, FAM_CRC, 0},
+	{"RDT_packet_build", kBuild, FAM_MODE, RDT_PAYLOAD_LEN},
+	{"RDT_packet_intact", kIntact, FAM_MODE, RDT_PAYLOAD_LEN},
+	{"init_header", kInit, FAM_NONE, DATALEN},
+	{"checksum2", kChecksum2, FAM_NONE, DATALEN},
+	{"serialize_gbnhdr", kSerialize, FAM_NONE, DATALEN},
+	{"deserialize_gbnhdr", kDeserialize, FAM_NONE, DATALEN},
+};
+
+static const char *sumImpls[] = {"avx2", "sse2", "generic", NULL};
+static const char *crcImpls[] = {"sse4.2", "table", NULL};
+static const char *modes[] = {"inet", "crc32c", "none", NULL};
+
+struct Sample
+{
+	size_t iters;
+	double median, min, stddev; // ns per call
+};
+
+static uint64_t nowNsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t batch(void (*run)(size_t), size_t len, size_t iters)
+{
+	uint64_t start = nowNsec();
+	size_t i;
+	for(i = 0; i < iters; ++i)
+		run(len);
+	return nowNsec() - start;
+}
+
+static int compareDouble(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void summarize(double *ns, int reps, struct Sample *out)
+{
+	double sum = 0, sq = 0;
+	int i;
+	qsort(ns, reps, sizeof(*ns), compareDouble);
+	for(i = 0; i < reps; ++i)
+		sum += ns[i];
+	for(i = 0; i < reps; ++i)
+		sq += (ns[i] - sum / reps) * (ns[i] - sum / reps);
+	out->median = reps % 2 ? ns[reps / 2] : (ns[reps / 2 - 1] + ns[reps / 2]) / 2;
+	out->min = ns[0];
+	out->stddev = reps > 1 ? sqrt(sq / (reps - 1)) : 0;
+}
+
+static void measure(void (*run)(size_t), size_t len, int reps, struct Sample *out)
+{
+	double ns[BENCH_MAX_REPS];
+	size_t iters = 1;
+	int i;
+	// grow the batch until it is long enough to time; this is the warmup
+	while(batch(run, len, iters) < BENCH_BATCH_NSEC)
+		iters *= 2;
+	for(i = 0; i < reps; ++i)
+		ns[i] = (double)batch(run, len, iters) / iters;
+	out->iters = iters;
+	summarize(ns, reps, out);
+}
+
+static void usage(const char *mode)
+{
+	fprintf(stderr,
+		"Usage: benchmark %s [options]\n"
+		"  -s 64,100,1k,64k      bytes per call (default 64,100,256,1k,1500,64k)\n"
+		"  -k CK_sum,...         kernels to run (default all)\n"
+		"  -r 15                 timed repetitions of each batch\n"
+		"  -n 1m                 bytes per simulated transfer, 0 to skip them\n"
+		"  -f csv|json           output format (default csv)\n", mode);
+}
+
+static bool wanted(struct BENCH_List *only, const char *name)
+{
+	int i;
+	if(only->n == 0)
+		return true;
+	for(i = 0; i < only->n; ++i)
+		if(strcmp(only->item[i], name) == 0)
+			return true;
+	return false;
+}
+
+static bool first = true;
+
+static void emit(FILE *report, bool json, const char *kernel, const char *variant,
+	size_t len, const struct Sample *s)
+{
+	double gbps = s->median > 0 ? len / s->median : 0; // bytes per ns
+	if(json){
+		fprintf(report, "%s  {\"kernel\": \"%s\", \"variant\": \"%s\", \"bytes\": %zu, "
+			"\"iters\": %zu, \"ns_median\": %.2f, \"ns_min\": %.2f, \"ns_stddev\": %.2f, "
+			"\"gb_per_s\": %.3f}", first ? "" : ",\n", kernel, variant, len, s->iters,
+			s->median, s->min, s->stddev, gbps);
+	} else {
+		fprintf(report, "%s,%s,%zu,%zu,%.2f,%.2f,%.2f,%.3f\n", kernel, variant, len,
+			s->iters, s->median, s->min, s->stddev, gbps);
+	}
+	fflush(report);
+	first = false;
+}
+
+// Whole transfers on the simulator: CPU per data packet of the two threads
+static void transfers(FILE *report, bool json, size_t len, int reps)
+{
+	static const enum XFER_Proto protos[] = {XFER_SP, XFER_SR};
+	char *data = malloc(len), *out = malloc(len);
+	double ns[BENCH_MAX_REPS];
+	size_t p, i;
+	if(!data || !out)
+		goto done;
+	for(i = 0; i < len; ++i)
+		data[i] = rand();
+	XP_use(&SIM_ops);
+	for(p = 0; p < sizeof(protos) / sizeof(*protos); ++p){
+		struct XFER_Params params = {0};
+		struct XFER_Result res;
+		struct Sample s;
+		int r, ok = 0;
+		params.proto = protos[p];
+		params.window = 32;
+		params.port = 5000;
+		for(r = 0; r < reps; ++r){
+			int ret = XFER_run(&params, data, len, out, &res);
+			SIM_drain();
+			if(ret != 0 || !res.ok)
+				continue;
+			ns[ok++] = res.cpu_sec * 1e9 / res.ideal;
+		}
+		if(ok == 0)
+			continue;
+		summarize(ns, ok, &s);
+		s.iters = res.ideal;
+		char name[64];
+		snprintf(name, sizeof(name), "RDT_send+RDT_recv/%s", XFER_name(protos[p]));
+		emit(report, json, name, "sim", RDT_PAYLOAD_LEN, &s);
+	}
+	XP_use(&XP_udp);
+done:
+	free(data);
+	free(out);
+}
+
+int BENCH_kernels(int argc, char **argv)
+{
+	char sizes[256] = "64,100,256,1k,1500,64k";
+	char only[1024] = "";
+	bool json = false;
+	int reps = 15;
+	size_t xfer_len = 1000000;
+	int opt;
+
+	while((opt = getopt(argc, argv, "s:k:r:n:f:h")) != -1){
+		switch(opt){
+		case 's': snprintf(sizes, sizeof(sizes), "%s", optarg); break;
+		case 'k': snprintf(only, sizeof(only), "%s", optarg); break;
+		case 'r': reps = atoi(optarg); break;
+		case 'n': xfer_len = BENCH_parseSize(optarg); break;
+		case 'f': json = strcmp(optarg, "json") == 0; break;
+		default: usage("kernels"); return 1;
+		}
+	}
+	if(reps < 1 || reps > BENCH_MAX_REPS){
+		fprintf(stderr, "Repetitions must be 1 to %d\n", BENCH_MAX_REPS);
+		return 1;
+	}
+
+	struct BENCH_List ls, lk;
+	BENCH_split(sizes, ",", &ls);
+	BENCH_split(only, ",", &lk);
+	FILE *report = BENCH_report();
+	if(!report)
+		return 1;
+
+	size_t max_len = DATALEN + GBN_HDRLEN;
+	int a, b;
+	for(a = 0; a < ls.n; ++a)
+		if(BENCH_parseSize(ls.item[a]) > max_len)
+			max_len = BENCH_parseSize(ls.item[a]);
+	src = malloc(max_len);
+	dst = malloc(max_len);
+	if(!src || !dst){
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	srand(1);
+	size_t i;
+	for(i = 0; i < max_len; ++i)
+		src[i] = rand();
+	init_header(&hdr, DATA, 1, src, DATALEN);
+	serialize_gbnhdr(dst, &hdr, DATALEN + GBN_HDRLEN);
+
+	// restored after each sweep over the implementations
+	char sum_impl[16], crc_impl[16];
+	snprintf(sum_impl, sizeof(sum_impl), "%s", CK_impl());
+	snprintf(crc_impl, sizeof(crc_impl), "%s", CK_crc_impl());
+
+	if(!json)
+		fprintf(report, "kernel,variant,bytes,iters,ns_median,ns_min,ns_stddev,gb_per_s\n");
+	else
+		fprintf(report, "[\n");
+	for(a = 0; a < (int)(sizeof(kernels) / sizeof(*kernels)); ++a){
+		const struct Kernel *k = &kernels[a];
+		if(!wanted(&lk, k->name))
+			continue;
+		const char *none[] = {CK_impl(), NULL};
+		const char **variants = k->family == FAM_SUM ? sumImpls :
+			k->family == FAM_CRC ? crcImpls : k->family == FAM_MODE ? modes : none;
+		const char **v;
+		for(v = variants; *v; ++v){
+			if(k->family == FAM_SUM && CK_select(*v) != 0)
+				continue; // not on this CPU
+			if(k->family == FAM_CRC && CK_crc_select(*v) != 0)
+				continue;
+			if(k->family == FAM_MODE)
+				integrity = v - modes == 0 ? RDT_INTEGRITY_INET :
+					v - modes == 1 ? RDT_INTEGRITY_CRC32C : RDT_INTEGRITY_NONE;
+			size_t last = 0;
+			for(b = 0; b < ls.n; ++b){
+				size_t len = BENCH_parseSize(ls.item[b]);
+				if(k->max_len && len > k->max_len)
+					len = k->max_len;
+				if(len == last)
+					continue; // clamped to the same size as before
+				last = len;
+				if(k->run == kIntact)
+					RDT_packet_build(integrity, packet, 1, src, len);
+				struct Sample s;
+				measure(k->run, len, reps, &s);
+				emit(report, json, k->name, *v, len, &s);
+			}
+		}
+		CK_select(sum_impl);
+		CK_crc_select(crc_impl);
+	}
+	if(xfer_len && wanted(&lk, "RDT_send+RDT_recv"))
+		transfers(report, json, xfer_len, reps < 5 ? reps : 5);
+	if(json)
+		fprintf(report, "\n]\n");
+	fclose(report);
+	free(src);
+	free(dst);
+	return 0;
+}
@@ -0,0 +1,177 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xport.h"
+#include "simnet.h"
+#include "xfer.h"
+#include "bench.h"
+
+// Request/response latency: a client sends a fixed-size message over an
+// established connection and waits for the server to echo it. Round trips
+// are reported as percentiles; the handshake is timed on its own, once per
+// run, since every run opens a new connection.
+
+static void usage(const char *mode)
+{
+	fprintf(stderr,
+		"Usage: benchmark %s [options]\n"
+		"  -p SP,SR,GBN          protocols (default SP,SR,GBN)\n"
+		"  -m 100,1k             message sizes (default 100,1k)\n"
+		"  -n 2000               round trips per run\n"
+		"  -i 'none;loss=0.001'  impairment specs, ';' separated (default none)\n"
+		"  -w 10                 SR/GBN window\n"
+		"  -r 1                  runs (connections) of each combination\n"
+		"  -f csv|json           output format (default csv)\n"
+		"  -P 20000              first port; each run takes the next two\n"
+		"  -S 'rate=10m,...'     run on the simulator with this link instead\n"
+		"Protocol chatter goes to stderr, results to stdout.\n", mode);
+}
+
+static int compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+// Nearest-rank percentile of n sorted samples
+static uint64_t percentile(const uint64_t *sorted, size_t n, double p)
+{
+	if(n == 0)
+		return 0;
+	size_t rank = (size_t)(p / 100 * n + 0.999999);
+	return sorted[rank ? rank - 1 : 0];
+}
+
+int BENCH_latency(int argc, char **argv)
+{
+	char protos[256] = "SP,SR,GBN";
+	char sizes[256] = "100,1k";
+	char impairs[1024] = "none";
+	const char *link_spec = NULL;
+	bool json = false;
+	int window = 10;
+	int runs = 1;
+	size_t count = 2000;
+	int port = 20000 + getpid() % 20000;
+	int opt;
+
+	while((opt = getopt(argc, argv, "p:m:n:i:w:r:f:P:S:h")) != -1){
+		switch(opt){
+		case 'p': snprintf(protos, sizeof(protos), "%s", optarg); break;
+		case 'm': snprintf(sizes, sizeof(sizes), "%s", optarg); break;
+		case 'n': count = BENCH_parseSize(optarg); break;
+		case 'i': snprintf(impairs, sizeof(impairs), "%s", optarg); break;
+		case 'w': window = atoi(optarg); break;
+		case 'r': runs = atoi(optarg); break;
+		case 'f': json = strcmp(optarg, "json") == 0; break;
+		case 'P': port = atoi(optarg); break;
+		case 'S': link_spec = optarg; break;
+		default: usage("latency"); return 1;
+		}
+	}
+
+	struct BENCH_List lp, lm, li;
+	BENCH_split(protos, ",", &lp);
+	BENCH_split(sizes, ",", &lm);
+	BENCH_split(impairs, ";", &li);
+
+	if(link_spec && BENCH_simulate(link_spec) != 0)
+		return 1;
+	FILE *report = BENCH_report();
+	if(!report)
+		return 1;
+
+	size_t max_len = 1;
+	int a, b, c, run;
+	for(b = 0; b < lm.n; ++b)
+		if(BENCH_parseSize(lm.item[b]) > max_len)
+			max_len = BENCH_parseSize(lm.item[b]);
+	char *msg = malloc(max_len);
+	uint64_t *rtt = malloc(sizeof(*rtt) * (count ? count : 1));
+	if(!msg || !rtt){
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	srand(1);
+	size_t i;
+	for(i = 0; i < max_len; ++i)
+		msg[i] = rand();
+
+	if(json)
+		fprintf(report, "[\n");
+	else
+		fprintf(report, "transport,protocol,msg_bytes,wire_bytes,impairment,window,run,"
+			"status,round_trips,connect_usec,accept_usec,p50_usec,p99_usec,p999_usec,"
+			"max_usec,mean_usec,msgs_per_sec\n");
+	bool first = true;
+	for(a = 0; a < lp.n; ++a){
+		struct XFER_Params params = {0};
+		if(XFER_parse(lp.item[a], &params.proto) != 0){
+			fprintf(stderr, "Protocol Unknown: %s\n", lp.item[a]);
+			return 1;
+		}
+		params.window = window;
+		for(b = 0; b < lm.n; ++b)
+		for(c = 0; c < li.n; ++c)
+		for(run = 0; run < runs; ++run){
+			size_t len = BENCH_parseSize(lm.item[b]);
+			params.impair = strcmp(li.item[c], "none") == 0 ? NULL : li.item[c];
+			params.port = port;
+			port += 2;
+
+			struct XFER_Ping res;
+			const char *status;
+			if(XFER_ping(&params, msg, len, count, rtt, &res) != 0)
+				status = "setup-failed";
+			else if(!res.supported)
+				status = "unsupported";
+			else
+				status = res.ok ? "ok" : "failed";
+			if(XP_virtual())
+				SIM_drain();
+
+			uint64_t sum = 0;
+			for(i = 0; i < res.done; ++i)
+				sum += rtt[i];
+			qsort(rtt, res.done, sizeof(*rtt), compare);
+			double mean = res.done ? (double)sum / res.done : 0;
+			double rate = res.usec ? res.done / (res.usec / 1e6) : 0;
+			unsigned long long p50 = percentile(rtt, res.done, 50);
+			unsigned long long p99 = percentile(rtt, res.done, 99);
+			unsigned long long p999 = percentile(rtt, res.done, 99.9);
+			unsigned long long max = res.done ? rtt[res.done - 1] : 0;
+			if(json){
+				fprintf(report, "%s  {\"transport\": \"%s\", \"protocol\": \"%s\", "
+					"\"msg_bytes\": %zu, \"wire_bytes\": %zu, \"impairment\": \"%s\", "
+					"\"window\": %d, \"run\": %d, \"status\": \"%s\", "
+					"\"round_trips\": %zu, \"connect_usec\": %llu, \"accept_usec\": %llu, "
+					"\"p50_usec\": %llu, \"p99_usec\": %llu, \"p999_usec\": %llu, "
+					"\"max_usec\": %llu, \"mean_usec\": %.1f, \"msgs_per_sec\": %.1f}",
+					first ? "" : ",\n", XP_current()->name, XFER_name(params.proto),
+					len, res.len, li.item[c], window, run, status, res.done,
+					(unsigned long long)res.connect_usec,
+					(unsigned long long)res.accept_usec, p50, p99, p999, max, mean, rate);
+			} else {
+				fprintf(report, "%s,%s,%zu,%zu,\"%s\",%d,%d,%s,%zu,%llu,%llu,%llu,%llu,"
+					"%llu,%llu,%.1f,%.1f\n",
+					XP_current()->name, XFER_name(params.proto), len, res.len,
+					li.item[c], window, run, status, res.done,
+					(unsigned long long)res.connect_usec,
+					(unsigned long long)res.accept_usec, p50, p99, p999, max, mean, rate);
+			}
+			fflush(report);
+			first = false;
+		}
+	}
+	if(json)
+		fprintf(report, "\n]\n");
+	fclose(report);
+	free(msg);
+	free(rtt);
+	return 0;
+}
@@ -0,0 +1,23 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "bench.h"
+
+int main(int argc, char **argv)
+{
+	// without a mode it is the throughput matrix
+	if(argc < 2 || argv[1][0] == '-')
+		return BENCH_throughput(argc, argv);
+	if(strcmp(argv[1], "throughput") == 0)
+		return BENCH_throughput(argc - 1, argv + 1);
+	if(strcmp(argv[1], "latency") == 0)
+		return BENCH_latency(argc - 1, argv + 1);
+	if(strcmp(argv[1], "kernels") == 0)
+		return BENCH_kernels(argc - 1, argv + 1);
+	if(strcmp(argv[1], "scale") == 0)
+		return BENCH_scale(argc - 1, argv + 1);
+	if(strcmp(argv[1], "replay") == 0)
+		return BENCH_replay(argc - 1, argv + 1);
+	fprintf(stderr, "Usage: %s [throughput|latency|kernels|scale|replay] [options], -h for each\n", argv[0]);
+	return 1;
+}
@@ -0,0 +1,507 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#include "xport.h"
+#include "capture.h"
+#include "xfer.h"
+#include "sock.h"
+#include "s_gbn.h"
+#include "bench.h"
+
+// Replay: the receiving side of one connection in a capture (capture.h) is
+// run again, with the datagrams its peer sent fed back in the order and at
+// the times they arrived. A transport backend stands in for the network:
+// its clock is the capture's, it hands out the captured datagrams and
+// discards what the receiver sends, only comparing it with what the
+// original receiver sent. Timers fire where they fired in the captured run,
+// so every run of the same capture does the same work, and the wall time
+// that takes is what the receive path costs.
+
+#define RPL_FDS 1024
+#define RPL_FIRST_PORT 40000 // what sockets bound to port 0 get
+#define RPL_LOOKAHEAD 64     // past the last match, where a send is looked for
+
+static struct
+{
+	struct CAP_Datagram *in;  // from the peer, in arrival order
+	struct CAP_Datagram *out; // what the original receiver sent it
+	size_t n_in, n_out;
+	size_t next_in, next_out; // next_out: the oldest out datagram still unmatched
+	size_t after;             // one past the last out datagram matched
+	bool *used;               // out datagrams matched so far
+	uint64_t start_ns;        // stamp of the peer's SYN
+	uint64_t now;             // usec since then
+	uint64_t sent, matched;
+	bool ended;
+	int next_fd;
+	struct sockaddr_in local[RPL_FDS];
+} RPL;
+
+static void usage(const char *mode)
+{
+	fprintf(stderr,
+		"Usage: benchmark %s [options] capture.pcapng\n"
+		"The capture is one written with RDT_CAPTURE, holding the connection\n"
+		"from its SYN on.\n"
+		"  -p SP|SR|GBN          protocol of the connection (default SR)\n"
+		"  -c port               the peer's port (default: sender of the first\n"
+		"                        SYN received)\n"
+		"  -w 10                 SR/GBN window, as the receiver had it\n"
+		"  -r 5                  runs\n"
+		"  -o file               write the last run's received data here\n"
+		"  -f csv|json           output format (default csv)\n", mode);
+}
+
+static uint64_t RPL_arrival(const struct CAP_Datagram *d)
+{
+	return d->ns > RPL.start_ns ? (d->ns - RPL.start_ns) / 1000 : 0;
+}
+
+// The capture is used up: whatever the receiver was doing ends with its thread
+static void RPL_end(void)
+{
+	RPL.ended = true;
+	pthread_exit(NULL);
+}
+
+static int RPL_socket(int domain, int type, int protocol)
+{
+	if(RPL.next_fd >= RPL_FDS){
+		errno = EMFILE;
+		return -1;
+	}
+	memset(&RPL.local[RPL.next_fd], 0, sizeof(RPL.local[0]));
+	return RPL.next_fd++;
+}
+
+static int RPL_bind(int s, const struct sockaddr *addr, socklen_t len)
+{
+	memcpy(&RPL.local[s], addr, sizeof(RPL.local[s]));
+	if(RPL.local[s].sin_port == 0)
+		RPL.local[s].sin_port = htons(RPL_FIRST_PORT + s);
+	return 0;
+}
+
+static int RPL_connect(int s, const struct sockaddr *addr, socklen_t len)
+{
+	return 0;
+}
+
+// The capture only holds what left the original receiver's impairments,
+// which may have dropped, duplicated or held back what it sent, so a send
+// is matched with the oldest unmatched datagram like it, a little way ahead
+static ssize_t RPL_sendto(int s, const void *buf, size_t len, int flags,
+	const struct sockaddr *to, socklen_t tolen)
+{
+	size_t i, end = RPL.after + RPL_LOOKAHEAD;
+	RPL.sent++;
+	for(i = RPL.next_out; i < RPL.n_out && i < end; ++i){
+		const struct CAP_Datagram *d = &RPL.out[i];
+		if(!RPL.used[i] && d->len == len && memcmp(d->data, buf, len) == 0){
+			RPL.used[i] = true;
+			RPL.matched++;
+			if(i + 1 > RPL.after)
+				RPL.after = i + 1;
+			break;
+		}
+	}
+	// what lies far behind the last match will not be sent again
+	if(RPL.next_out + RPL_LOOKAHEAD < RPL.after)
+		RPL.next_out = RPL.after - RPL_LOOKAHEAD;
+	while(RPL.next_out < RPL.n_out && RPL.used[RPL.next_out])
+		RPL.next_out++;
+	return len;
+}
+
+static ssize_t RPL_recvmsg(int s, struct msghdr *msg, int flags)
+{
+	if(RPL.next_in == RPL.n_in)
+		RPL_end();
+	const struct CAP_Datagram *d = &RPL.in[RPL.next_in];
+	if(RPL_arrival(d) > RPL.now)
+		RPL.now = RPL_arrival(d);
+	size_t i, at = 0;
+	for(i = 0; i < (size_t)msg->msg_iovlen && at < d->len; ++i){
+		size_t n = msg->msg_iov[i].iov_len;
+		if(n > d->len - at)
+			n = d->len - at;
+		memcpy(msg->msg_iov[i].iov_base, d->data + at, n);
+		at += n;
+	}
+	if(msg->msg_name && msg->msg_namelen >= sizeof(d->src)){
+		memcpy(msg->msg_name, &d->src, sizeof(d->src));
+		msg->msg_namelen = sizeof(d->src);
+	}
+	msg->msg_flags = at < d->len ? MSG_TRUNC : 0;
+	if(!(flags & MSG_PEEK))
+		RPL.next_in++;
+	return (flags & MSG_TRUNC) ? (ssize_t)d->len : (ssize_t)at;
+}
+
+// Readable once the clock reaches the next arrival; the clock jumps there,
+// or by the whole timeout if the datagram is later than that
+static int RPL_poll(int s, int64_t usec)
+{
+	if(RPL.next_in == RPL.n_in)
+		RPL_end();
+	uint64_t at = RPL_arrival(&RPL.in[RPL.next_in]);
+	if(usec < 0 || at <= RPL.now + usec){
+		if(at > RPL.now)
+			RPL.now = at;
+		return 1;
+	}
+	RPL.now += usec;
+	return 0;
+}
+
+static int RPL_getsockname(int s, struct sockaddr *addr, socklen_t *len)
+{
+	memcpy(addr, &RPL.local[s], sizeof(RPL.local[s]));
+	*len = sizeof(RPL.local[s]);
+	return 0;
+}
+
+static int RPL_close(int s)
+{
+	return 0;
+}
+
+static uint64_t RPL_now(void)
+{
+	return RPL.now;
+}
+
+static const struct XP_Ops RPL_ops = {
+	"replay",
+	true,
+	RPL_socket,
+	RPL_bind,
+	RPL_connect,
+	RPL_sendto,
+	RPL_recvmsg,
+	RPL_poll,
+	RPL_getsockname,
+	RPL_close,
+	RPL_now,
+	NULL
+};
+
+// A connection request, which is where the peer is told from the rest
+static bool RPL_isSyn(enum XFER_Proto proto, const struct CAP_Datagram *d)
+{
+	if(proto == XFER_GBN)
+		return d->len >= GBN_HDRLEN && d->data[0] == SYN;
+	return d->len == RDT_PACKET_LEN && (d->data[2] & 0x12) == 0x02;
+}
+
+// Capture order by time, then by position in the file. Each thread of the
+// capturing process kept its own ring, so the file may interleave them late.
+static const struct CAP_Datagram *RPL_sorting;
+
+static int RPL_byTime(const void *a, const void *b)
+{
+	size_t i = *(const size_t *)a, j = *(const size_t *)b;
+	uint64_t ti = RPL_sorting[i].ns, tj = RPL_sorting[j].ns;
+	if(ti != tj)
+		return ti < tj ? -1 : 1;
+	return i < j ? -1 : i > j;
+}
+
+// Pull the connection's datagrams out of the capture, from the first SYN
+// the peer sent on. Returns -1 if the file does not read or holds no SYN.
+static int RPL_load(const char *path, int peer_port, enum XFER_Proto proto)
+{
+	struct CAP_Reader r;
+	struct CAP_Datagram *all = NULL;
+	size_t *order = NULL;
+	size_t n_all = 0, cap_all = 0, i, first;
+	struct sockaddr_in peer = {0};
+	int ret;
+	if(CAP_open(&r, path) != 0){
+		fprintf(stderr, "Cannot read %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	for(;;){
+		if(n_all == cap_all){
+			cap_all = cap_all ? cap_all * 2 : 1024;
+			struct CAP_Datagram *grown = realloc(all, cap_all * sizeof(*all));
+			if(!grown){
+				fprintf(stderr, "Out of memory\n");
+				ret = -2;
+				break;
+			}
+			all = grown;
+		}
+		if((ret = CAP_next(&r, &all[n_all])) != 1)
+			break;
+		++n_all;
+	}
+	CAP_close(&r);
+	if(ret == -1)
+		fprintf(stderr, "%s is not a capture this program wrote\n", path);
+	if(ret == 0 && n_all && (order = malloc(n_all * sizeof(*order))) == NULL){
+		fprintf(stderr, "Out of memory\n");
+		ret = -2;
+	}
+	if(ret < 0){
+		free(all);
+		return -1;
+	}
+
+	for(i = 0; i < n_all; ++i)
+		order[i] = i;
+	RPL_sorting = all;
+	qsort(order, n_all, sizeof(*order), RPL_byTime);
+	for(first = 0; first < n_all; ++first){
+		const struct CAP_Datagram *d = &all[order[first]];
+		if(!d->out && RPL_isSyn(proto, d) &&
+				(!peer_port || ntohs(d->src.sin_port) == peer_port))
+			break;
+	}
+	if(first == n_all){
+		fprintf(stderr, "No SYN from the peer in %s\n", path);
+		free(order);
+		free(all);
+		return -1;
+	}
+	peer = all[order[first]].src;
+	RPL.start_ns = all[order[first]].ns;
+
+	RPL.in = malloc(n_all * sizeof(*RPL.in));
+	RPL.out = malloc(n_all * sizeof(*RPL.out));
+	RPL.used = malloc(n_all * sizeof(*RPL.used));
+	if(!RPL.in || !RPL.out || !RPL.used){
+		fprintf(stderr, "Out of memory\n");
+		free(order);
+		free(all);
+		return -1;
+	}
+	for(i = first; i < n_all; ++i){
+		const struct CAP_Datagram *d = &all[order[i]];
+		const struct sockaddr_in *other = d->out ? &d->dst : &d->src;
+		if(other->sin_port != peer.sin_port || other->sin_addr.s_addr != peer.sin_addr.s_addr)
+			continue;
+		struct CAP_Datagram *list = d->out ? RPL.out : RPL.in;
+		size_t *n = d->out ? &RPL.n_out : &RPL.n_in;
+		// only as many bytes as the datagram has
+		memcpy(&list[(*n)++], d, offsetof(struct CAP_Datagram, data) + d->len);
+	}
+	free(order);
+	free(all);
+	fprintf(stderr, "Replaying %zu datagrams from %s:%d (%zu sent to it)\n", RPL.n_in,
+		inet_ntoa(peer.sin_addr), ntohs(peer.sin_port), RPL.n_out);
+	return 0;
+}
+
+// The one input an RDT receiver draws itself is the sequence number of its
+// SYNACK, from rand(); find a seed that makes rand() draw the captured one
+static int RPL_seed(void)
+{
+	size_t i;
+	for(i = 0; i < RPL.n_out; ++i){
+		const struct CAP_Datagram *d = &RPL.out[i];
+		if(d->len == RDT_PACKET_LEN && (d->data[2] & 0x12) == 0x12){
+			unsigned seed;
+			for(seed = 1; seed < 1u << 20; ++seed){
+				srand(seed);
+				if(rand() % 256 == (uint8_t)d->data[0])
+					return seed;
+			}
+		}
+	}
+	return 1;
+}
+
+struct RPL_Run
+{
+	enum XFER_Proto proto;
+	int window;
+	char *buf;
+	size_t cap, got;
+	uint16_t port; // where the listener was
+};
+
+static void RPL_keep(struct RPL_Run *run, const char *data, size_t len)
+{
+	if(run->got + len > run->cap){
+		size_t cap = run->cap ? run->cap : 1 << 20;
+		while(run->got + len > cap)
+			cap *= 2;
+		char *grown = realloc(run->buf, cap);
+		if(!grown)
+			return;
+		run->buf = grown;
+		run->cap = cap;
+	}
+	memcpy(run->buf + run->got, data, len);
+	run->got += len;
+}
+
+static void *RPL_rdtReceiver(void *arg)
+{
+	struct RPL_Run *run = arg;
+	char buf[RDT_PAYLOAD_LEN * 100];
+	int listener = RDT_socket(run->proto == XFER_SP ? SINGLE_PACKET : SELECTIVE_REPEAT);
+	if(run->window > 0)
+		RDT_set_window(listener, run->window);
+	RDT_bind(listener, "0.0.0.0", htons(run->port));
+	RDT_listen(listener, 1);
+	srand(RPL_seed());
+	int conn = RDT_accept(listener);
+	if(conn < 0)
+		return NULL;
+	while(RDT_info_connected(conn)){
+		int copied = RDT_recv(conn, buf, sizeof(buf));
+		if(copied > 0)
+			RPL_keep(run, buf, copied);
+	}
+	RDT_close(conn);
+	RDT_close(listener);
+	return NULL;
+}
+
+static void *RPL_gbnReceiver(void *arg)
+{
+	struct RPL_Run *run = arg;
+	char buf[DATALEN * 16];
+	struct sockaddr_in addr = {0};
+	socklen_t len = sizeof(addr);
+	int s = gbn_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if(run->window > 0)
+		gbn_setwindow(s, run->window);
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(run->port);
+	gbn_bind(s, (struct sockaddr *)&addr, sizeof(addr));
+	gbn_listen(s, 1);
+	if(gbn_accept(s, (struct sockaddr *)&addr, &len) == 0){
+		ssize_t n;
+		while((n = gbn_recv(s, buf, sizeof(buf), 0)) > 0)
+			RPL_keep(run, buf, n);
+		gbn_close(s);
+	}
+	XP_close(s);
+	return NULL;
+}
+
+static double RPL_seconds(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// FNV-1a of what arrived, to tell runs apart
+static uint64_t RPL_digest(const char *data, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+	size_t i;
+	for(i = 0; i < len; ++i)
+		h = (h ^ (uint8_t)data[i]) * 1099511628211ULL;
+	return h;
+}
+
+int BENCH_replay(int argc, char **argv)
+{
+	const char *save = NULL;
+	struct RPL_Run run = {XFER_SR, 0};
+	bool json = false;
+	int runs = 5, peer_port = 0;
+	int opt, i;
+
+	while((opt = getopt(argc, argv, "f:p:c:w:r:o:h")) != -1){
+		switch(opt){
+		case 'f': json = strcmp(optarg, "json") == 0; break;
+		case 'p':
+			if(XFER_parse(optarg, &run.proto) != 0 || run.proto == XFER_RDT_GBN){
+				fprintf(stderr, "Protocol Unknown: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'c': peer_port = atoi(optarg); break;
+		case 'w': run.window = atoi(optarg); break;
+		case 'r': runs = atoi(optarg); break;
+		case 'o': save = optarg; break;
+		default: usage("replay"); return 1;
+		}
+	}
+	if(optind != argc - 1){
+		usage("replay");
+		return 1;
+	}
+	if(RPL_load(argv[optind], peer_port, run.proto) != 0)
+		return 1;
+	run.port = ntohs(RPL.in[0].dst.sin_port);
+	XP_use(&RPL_ops);
+	FILE *report = BENCH_report();
+	if(!report)
+		return 1;
+
+	if(json)
+		fprintf(report, "[\n");
+	else
+		fprintf(report, "protocol,run,status,datagrams,replayed,sent,matched,bytes,digest,"
+			"capture_usec,wall_usec,cpu_sec,datagrams_per_sec,mbit_per_sec\n");
+	for(i = 0; i < runs; ++i){
+		pthread_t tid;
+		RPL.next_in = RPL.next_out = RPL.after = 0;
+		memset(RPL.used, 0, RPL.n_out * sizeof(*RPL.used));
+		RPL.now = RPL.sent = RPL.matched = 0;
+		RPL.ended = false;
+		RPL.next_fd = 3;
+		run.got = 0;
+		double wall = RPL_seconds(CLOCK_MONOTONIC), cpu = RPL_seconds(CLOCK_PROCESS_CPUTIME_ID);
+		if(pthread_create(&tid, NULL, run.proto == XFER_GBN ? RPL_gbnReceiver : RPL_rdtReceiver,
+				&run) != 0){
+			perror("pthread_create");
+			return 1;
+		}
+		pthread_join(tid, NULL);
+		wall = RPL_seconds(CLOCK_MONOTONIC) - wall;
+		cpu = RPL_seconds(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+
+		// "ended" when the capture ran out before the receiver was done
+		const char *status = RPL.ended ? "ended" : "ok";
+		unsigned long long digest = RPL_digest(run.buf, run.got);
+		double rate = wall > 0 ? RPL.next_in / wall : 0;
+		double mbit = wall > 0 ? run.got * 8 / wall / 1e6 : 0;
+		if(json){
+			fprintf(report, "%s  {\"protocol\": \"%s\", \"run\": %d, \"status\": \"%s\", "
+				"\"datagrams\": %zu, \"replayed\": %zu, \"sent\": %llu, \"matched\": %llu, "
+				"\"bytes\": %zu, \"digest\": \"%016llx\", \"capture_usec\": %llu, "
+				"\"wall_usec\": %.0f, \"cpu_sec\": %.3f, \"datagrams_per_sec\": %.1f, "
+				"\"mbit_per_sec\": %.1f}",
+				i ? ",\n" : "", XFER_name(run.proto), i, status, RPL.n_in, RPL.next_in,
+				(unsigned long long)RPL.sent, (unsigned long long)RPL.matched, run.got,
+				digest, (unsigned long long)RPL.now, wall * 1e6, cpu, rate, mbit);
+		} else {
+			fprintf(report, "%s,%d,%s,%zu,%zu,%llu,%llu,%zu,%016llx,%llu,%.0f,%.3f,%.1f,%.1f\n",
+				XFER_name(run.proto), i, status, RPL.n_in, RPL.next_in,
+				(unsigned long long)RPL.sent, (unsigned long long)RPL.matched, run.got,
+				digest, (unsigned long long)RPL.now, wall * 1e6, cpu, rate, mbit);
+		}
+		fflush(report);
+	}
+	if(json)
+		fprintf(report, "\n]\n");
+	fclose(report);
+
+	if(save){
+		FILE *f = fopen(save, "wb");
+		if(!f || fwrite(run.buf, 1, run.got, f) != run.got)
+			fprintf(stderr, "Cannot write %s: %s\n", save, strerror(errno));
+		if(f)
+			fclose(f);
+	}
+	free(run.buf);
+	return 0;
+}
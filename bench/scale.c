@@ -0,0 +1,449 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+#include "sock.h"
+#include "xport.h"
+#include "capture.h"
+#include "xfer.h"
+#include "bench.h"
+
+// Connection scaling: N client pipes against one listening server on
+// loopback. The server is a child process, so its memory and CPU can be
+// measured on their own; it accepts every connection on one thread and then
+// serves them from a few worker threads. The client opens the pipes from as
+// many threads, sends rounds of one message on each, and closes them.
+//
+// Pipes block, so the two sides walk their connections in the same order:
+// client thread g and server worker g own the connections i with
+// i % threads == g, and the server tells them apart by the client's port,
+// first port + 1 + i.
+
+#define BENCH_MAX_THREADS 64
+
+struct Config
+{
+	enum RDT_Protocol protocol;
+	int conns;
+	int threads;
+	size_t msg_len;
+	int rounds;
+	int port;
+};
+
+// What the server measured, sent back to the parent over a pipe
+struct ServerReport
+{
+	int accepted;
+	int errors;             // short or mismatched messages
+	double cpu_accept;      // seconds of CPU accepting every connection
+	double cpu_traffic;     // and then serving and closing them
+	long rss_start_kb, rss_accepted_kb, rss_peak_kb;
+};
+
+struct Side
+{
+	const struct Config *cfg;
+	int *pipes;             // by connection index
+	const char *msg;
+	double *busy;           // client: seconds spent sending, per connection
+	int errors;
+};
+
+struct Worker
+{
+	struct Side *side;
+	int group;
+};
+
+static double cpuSec(void)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+// "VmRSS" or "VmHWM" from /proc/self/status, in kB
+static long procKb(const char *field)
+{
+	char line[256];
+	long kb = 0;
+	size_t n = strlen(field);
+	FILE *f = fopen("/proc/self/status", "r");
+	if(!f)
+		return 0;
+	while(fgets(line, sizeof(line), f))
+		if(strncmp(line, field, n) == 0 && line[n] == ':')
+			kb = atol(line + n + 1);
+	fclose(f);
+	return kb;
+}
+
+static bool recvAll(int pipe, char *buf, size_t len)
+{
+	size_t got = 0;
+	while(got < len){
+		int n = RDT_recv(pipe, buf + got, len - got);
+		if(n <= 0)
+			return false;
+		got += n;
+	}
+	return true;
+}
+
+static void *serve(void *arg)
+{
+	struct Worker *w = arg;
+	struct Side *s = w->side;
+	const struct Config *cfg = s->cfg;
+	char *buf = malloc(cfg->msg_len);
+	int r, i, errors = 0;
+	for(r = 0; r < cfg->rounds; ++r)
+		for(i = w->group; i < cfg->conns; i += cfg->threads)
+			if(!recvAll(s->pipes[i], buf, cfg->msg_len) ||
+					memcmp(buf, s->msg, cfg->msg_len) != 0)
+				++errors;
+	for(i = w->group; i < cfg->conns; i += cfg->threads){
+		// take the FIN, then close our end
+		while(RDT_recv(s->pipes[i], buf, cfg->msg_len) > 0)
+			++errors;
+		RDT_close(s->pipes[i]);
+	}
+	free(buf);
+	__atomic_add_fetch(&s->errors, errors, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static void server(const struct Config *cfg, const char *msg, int ready, int results)
+{
+	struct ServerReport rep = {0};
+	struct Side side = {cfg, calloc(cfg->conns, sizeof(int)), msg, NULL, 0};
+	int listener = RDT_socket(cfg->protocol);
+	int i;
+	for(i = 0; side.pipes && i < cfg->conns; ++i)
+		side.pipes[i] = -1;
+	rep.rss_start_kb = procKb("VmRSS");
+	if(!side.pipes || listener < 0 ||
+			RDT_bind(listener, "127.0.0.1", htons(cfg->port)) != 0 ||
+			RDT_listen(listener, cfg->conns) != 0 ||
+			RDT_set_window(listener, 10) != 0){
+		write(ready, "x", 1);
+		exit(1);
+	}
+	write(ready, "r", 1);
+
+	double cpu = cpuSec();
+	while(rep.accepted < cfg->conns){
+		int pipe = RDT_accept(listener);
+		if(pipe < 0)
+			exit(1);
+		i = RDT_info_port_rem(pipe) - cfg->port - 1;
+		if(i < 0 || i >= cfg->conns || side.pipes[i] >= 0){
+			RDT_close(pipe);
+			continue;
+		}
+		side.pipes[i] = pipe;
+		++rep.accepted;
+	}
+	rep.cpu_accept = cpuSec() - cpu;
+	rep.rss_accepted_kb = procKb("VmRSS");
+
+	cpu = cpuSec();
+	pthread_t tid[BENCH_MAX_THREADS];
+	struct Worker w[BENCH_MAX_THREADS];
+	int g;
+	for(g = 0; g < cfg->threads; ++g){
+		w[g].side = &side;
+		w[g].group = g;
+		pthread_create(&tid[g], NULL, serve, &w[g]);
+	}
+	for(g = 0; g < cfg->threads; ++g)
+		pthread_join(tid[g], NULL);
+	rep.cpu_traffic = cpuSec() - cpu;
+	rep.rss_peak_kb = procKb("VmHWM");
+	rep.errors = side.errors;
+	RDT_close(listener);
+	write(results, &rep, sizeof(rep));
+	exit(0);
+}
+
+static void *connectAll(void *arg)
+{
+	struct Worker *w = arg;
+	struct Side *s = w->side;
+	const struct Config *cfg = s->cfg;
+	int i;
+	for(i = w->group; i < cfg->conns; i += cfg->threads){
+		int pipe = RDT_socket(cfg->protocol);
+		if(pipe < 0 || RDT_bind(pipe, "127.0.0.1", htons(cfg->port + 1 + i)) != 0 ||
+				RDT_set_window(pipe, 10) != 0 ||
+				RDT_connect(pipe, "127.0.0.1", htons(cfg->port)) != 0){
+			RDT_close(pipe);
+			__atomic_add_fetch(&s->errors, 1, __ATOMIC_RELAXED);
+			s->pipes[i] = -1;
+			continue;
+		}
+		s->pipes[i] = pipe;
+	}
+	return NULL;
+}
+
+static void *sendAll(void *arg)
+{
+	struct Worker *w = arg;
+	struct Side *s = w->side;
+	const struct Config *cfg = s->cfg;
+	int r, i;
+	for(r = 0; r < cfg->rounds; ++r)
+		for(i = w->group; i < cfg->conns; i += cfg->threads){
+			uint64_t start = XP_now_usec();
+			RDT_send(s->pipes[i], s->msg, cfg->msg_len);
+			s->busy[i] += (XP_now_usec() - start) / 1e6;
+		}
+	return NULL;
+}
+
+static void *closeAll(void *arg)
+{
+	struct Worker *w = arg;
+	int i;
+	for(i = w->group; i < w->side->cfg->conns; i += w->side->cfg->threads)
+		RDT_close(w->side->pipes[i]);
+	return NULL;
+}
+
+// Run fn on every client thread and return the seconds it took
+static double phase(struct Side *side, void *(*fn)(void *))
+{
+	pthread_t tid[BENCH_MAX_THREADS];
+	struct Worker w[BENCH_MAX_THREADS];
+	uint64_t start = XP_now_usec();
+	int g;
+	for(g = 0; g < side->cfg->threads; ++g){
+		w[g].side = side;
+		w[g].group = g;
+		pthread_create(&tid[g], NULL, fn, &w[g]);
+	}
+	for(g = 0; g < side->cfg->threads; ++g)
+		pthread_join(tid[g], NULL);
+	return (XP_now_usec() - start) / 1e6;
+}
+
+struct Result
+{
+	const char *status;
+	double connect_sec, traffic_sec, close_sec;
+	double fairness, min_share; // Jain's index and the worst connection's share
+	struct ServerReport server;
+};
+
+static void run(const struct Config *cfg, const char *msg, struct Result *res)
+{
+	int ready[2], results[2];
+	memset(res, 0, sizeof(*res));
+	res->status = "setup-failed";
+	if(pipe(ready) != 0 || pipe(results) != 0)
+		return;
+	// a capture starts here, so the server's goes to a file of its own
+	CAP_init();
+	fflush(NULL);
+	pid_t pid = fork();
+	if(pid < 0)
+		return;
+	if(pid == 0){
+		close(ready[0]);
+		close(results[0]);
+		server(cfg, msg, ready[1], results[1]);
+	}
+	close(ready[1]);
+	close(results[1]);
+	char c = 0;
+	struct Side side = {cfg, calloc(cfg->conns, sizeof(int)), msg,
+		calloc(cfg->conns, sizeof(double)), 0};
+	if(read(ready[0], &c, 1) != 1 || c != 'r' || !side.pipes || !side.busy){
+		kill(pid, SIGKILL);
+		goto done;
+	}
+
+	res->connect_sec = phase(&side, connectAll);
+	if(side.errors){
+		// the server would wait for them forever, and so would closing the
+		// others; they are left open and the sweep ends here
+		res->status = "connect-failed";
+		kill(pid, SIGKILL);
+		goto done;
+	}
+	res->traffic_sec = phase(&side, sendAll);
+	res->close_sec = phase(&side, closeAll);
+
+	if(read(results[0], &res->server, sizeof(res->server)) != sizeof(res->server)){
+		res->status = "server-failed";
+		goto done;
+	}
+	res->status = res->server.errors ? "failed" : "ok";
+
+	// Jain's fairness over each connection's goodput while it was sending
+	double sum = 0, sq = 0, least = INFINITY;
+	int i;
+	for(i = 0; i < cfg->conns; ++i){
+		double rate = side.busy[i] > 0 ? cfg->msg_len * cfg->rounds / side.busy[i] : 0;
+		sum += rate;
+		sq += rate * rate;
+		if(rate < least)
+			least = rate;
+	}
+	res->fairness = sq > 0 ? sum * sum / (cfg->conns * sq) : 0;
+	res->min_share = sum > 0 ? least / (sum / cfg->conns) : 0;
+done:
+	waitpid(pid, NULL, 0);
+	close(ready[0]);
+	close(results[0]);
+	free(side.pipes);
+	free(side.busy);
+}
+
+static void usage(const char *mode)
+{
+	fprintf(stderr,
+		"Usage: benchmark %s [options]\n"
+		"  -n 100,1k,10k         connection counts (default 100,1000,10000)\n"
+		"  -p SP,SR              protocols (default SP)\n"
+		"  -m 100                message bytes (default 100)\n"
+		"  -r 10                 messages per connection\n"
+		"  -t 4                  client threads, and server workers\n"
+		"  -f csv|json           output format (default csv)\n"
+		"  -P 20000              server port; client i binds the port after it + i\n"
+		"Protocol chatter goes to stderr, results to stdout.\n", mode);
+}
+
+int BENCH_scale(int argc, char **argv)
+{
+	char counts[256] = "100,1000,10000";
+	char protos[256] = "SP";
+	struct Config cfg = {0};
+	bool json = false;
+	int opt;
+	cfg.msg_len = 100;
+	cfg.rounds = 10;
+	cfg.threads = 4;
+	cfg.port = 20000;
+
+	while((opt = getopt(argc, argv, "n:p:m:r:t:f:P:h")) != -1){
+		switch(opt){
+		case 'n': snprintf(counts, sizeof(counts), "%s", optarg); break;
+		case 'p': snprintf(protos, sizeof(protos), "%s", optarg); break;
+		case 'm': cfg.msg_len = BENCH_parseSize(optarg); break;
+		case 'r': cfg.rounds = atoi(optarg); break;
+		case 't': cfg.threads = atoi(optarg); break;
+		case 'f': json = strcmp(optarg, "json") == 0; break;
+		case 'P': cfg.port = atoi(optarg); break;
+		default: usage("scale"); return 1;
+		}
+	}
+	if(cfg.threads < 1 || cfg.threads > BENCH_MAX_THREADS || cfg.msg_len == 0 ||
+			cfg.rounds < 0){
+		usage("scale");
+		return 1;
+	}
+
+	struct BENCH_List ln, lp;
+	BENCH_split(counts, ",", &ln);
+	BENCH_split(protos, ",", &lp);
+
+	// every connection is a socket on each side
+	struct rlimit rl;
+	if(getrlimit(RLIMIT_NOFILE, &rl) == 0){
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	FILE *report = BENCH_report();
+	if(!report)
+		return 1;
+	char *msg = malloc(cfg.msg_len);
+	if(!msg){
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	srand(1);
+	size_t i;
+	for(i = 0; i < cfg.msg_len; ++i)
+		msg[i] = rand();
+
+	if(json)
+		fprintf(report, "[\n");
+	else
+		fprintf(report, "protocol,connections,msg_bytes,rounds,threads,status,connect_sec,"
+			"handshakes_per_sec,traffic_sec,goodput_mbps,fairness,min_share,close_sec,"
+			"server_rss_kb,server_kb_per_conn,server_peak_rss_kb,server_cpu_accept_sec,"
+			"server_cpu_traffic_sec,server_cpu_usec_per_msg\n");
+	bool first = true;
+	int a, b;
+	for(a = 0; a < lp.n; ++a){
+		enum XFER_Proto proto;
+		if(XFER_parse(lp.item[a], &proto) != 0 || (proto != XFER_SP && proto != XFER_SR)){
+			fprintf(stderr, "Protocol Unknown: %s\n", lp.item[a]);
+			return 1;
+		}
+		cfg.protocol = proto == XFER_SR ? SELECTIVE_REPEAT : SINGLE_PACKET;
+		for(b = 0; b < ln.n; ++b){
+			cfg.conns = BENCH_parseSize(ln.item[b]);
+			if(cfg.conns < 1 || cfg.port + 1 + cfg.conns > 65535){
+				fprintf(stderr, "Bad connection count: %s\n", ln.item[b]);
+				continue;
+			}
+			struct Result res;
+			run(&cfg, msg, &res);
+
+			const struct ServerReport *s = &res.server;
+			double msgs = (double)cfg.conns * cfg.rounds;
+			double hs = res.connect_sec > 0 ? cfg.conns / res.connect_sec : 0;
+			double mbps = res.traffic_sec > 0 ? msgs * cfg.msg_len * 8 / res.traffic_sec / 1e6 : 0;
+			double per_conn = (double)(s->rss_accepted_kb - s->rss_start_kb) / cfg.conns;
+			double usec_per_msg = msgs > 0 ? s->cpu_traffic * 1e6 / msgs : 0;
+			if(json){
+				fprintf(report, "%s  {\"protocol\": \"%s\", \"connections\": %d, "
+					"\"msg_bytes\": %zu, \"rounds\": %d, \"threads\": %d, \"status\": \"%s\", "
+					"\"connect_sec\": %.6f, \"handshakes_per_sec\": %.1f, "
+					"\"traffic_sec\": %.6f, \"goodput_mbps\": %.3f, \"fairness\": %.4f, "
+					"\"min_share\": %.4f, \"close_sec\": %.6f, \"server_rss_kb\": %ld, "
+					"\"server_kb_per_conn\": %.2f, \"server_peak_rss_kb\": %ld, "
+					"\"server_cpu_accept_sec\": %.6f, \"server_cpu_traffic_sec\": %.6f, "
+					"\"server_cpu_usec_per_msg\": %.2f}",
+					first ? "" : ",\n", XFER_name(proto), cfg.conns, cfg.msg_len,
+					cfg.rounds, cfg.threads, res.status, res.connect_sec, hs,
+					res.traffic_sec, mbps, res.fairness, res.min_share, res.close_sec,
+					s->rss_accepted_kb, per_conn, s->rss_peak_kb, s->cpu_accept,
+					s->cpu_traffic, usec_per_msg);
+			} else {
+				fprintf(report, "%s,%d,%zu,%d,%d,%s,%.6f,%.1f,%.6f,%.3f,%.4f,%.4f,%.6f,"
+					"%ld,%.2f,%ld,%.6f,%.6f,%.2f\n",
+					XFER_name(proto), cfg.conns, cfg.msg_len, cfg.rounds, cfg.threads,
+					res.status, res.connect_sec, hs, res.traffic_sec, mbps, res.fairness,
+					res.min_share, res.close_sec, s->rss_accepted_kb, per_conn,
+					s->rss_peak_kb, s->cpu_accept, s->cpu_traffic, usec_per_msg);
+			}
+			fflush(report);
+			first = false;
+			if(strcmp(res.status, "connect-failed") == 0)
+				goto out;
+		}
+	}
+out:
+	if(json)
+		fprintf(report, "\n]\n");
+	fclose(report);
+	free(msg);
+	return 0;
+}
@@ -0,0 +1,170 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xport.h"
+#include "simnet.h"
+#include "xfer.h"
+#include "bench.h"
+
+// Throughput matrix: every combination of protocol, size, impairment, window
+// and write size, each run as a loopback transfer between two threads of
+// this process. One CSV row (or JSON object) per run.
+
+static void usage(const char *mode)
+{
+	fprintf(stderr,
+		"Usage: benchmark %s [options]\n"
+		"  -p SP,SR,GBN,RDT-GBN  protocols (default SP,SR,GBN,RDT-GBN)\n"
+		"  -s 100k,1m            transfer sizes (default 100k,1m)\n"
+		"  -i 'none;loss=0.001'  impairment specs, ';' separated (default none)\n"
+		"  -w 10,32              SR/GBN windows (default 10,32)\n"
+		"  -b 100k               bytes per send call (default 100k)\n"
+		"  -r 1                  runs of each combination\n"
+		"  -f csv|json           output format (default csv)\n"
+		"  -P 20000              first port; each run takes the next two\n"
+		"  -S 'rate=10m,...'     run on the simulator with this link instead\n"
+		"Protocol chatter goes to stderr, results to stdout.\n", mode);
+}
+
+int BENCH_throughput(int argc, char **argv)
+{
+	char protos[256] = "SP,SR,GBN,RDT-GBN";
+	char sizes[256] = "100k,1m";
+	char impairs[1024] = "none";
+	char windows[256] = "10,32";
+	char writes[256] = "100k";
+	const char *link_spec = NULL;
+	bool json = false;
+	int runs = 1;
+	int port = 20000 + getpid() % 20000;
+	int opt;
+
+	while((opt = getopt(argc, argv, "p:s:i:w:b:r:f:P:S:h")) != -1){
+		switch(opt){
+		case 'p': snprintf(protos, sizeof(protos), "%s", optarg); break;
+		case 's': snprintf(sizes, sizeof(sizes), "%s", optarg); break;
+		case 'i': snprintf(impairs, sizeof(impairs), "%s", optarg); break;
+		case 'w': snprintf(windows, sizeof(windows), "%s", optarg); break;
+		case 'b': snprintf(writes, sizeof(writes), "%s", optarg); break;
+		case 'r': runs = atoi(optarg); break;
+		case 'f': json = strcmp(optarg, "json") == 0; break;
+		case 'P': port = atoi(optarg); break;
+		case 'S': link_spec = optarg; break;
+		default: usage("throughput"); return 1;
+		}
+	}
+
+	struct BENCH_List lp, ls, li, lw, lb;
+	BENCH_split(protos, ",", &lp);
+	BENCH_split(sizes, ",", &ls);
+	BENCH_split(impairs, ";", &li);
+	BENCH_split(windows, ",", &lw);
+	BENCH_split(writes, ",", &lb);
+
+	if(link_spec && BENCH_simulate(link_spec) != 0)
+		return 1;
+	FILE *report = BENCH_report();
+	if(!report)
+		return 1;
+
+	size_t max_len = 0;
+	int a, b, c, d, e, run;
+	for(a = 0; a < ls.n; ++a)
+		if(BENCH_parseSize(ls.item[a]) > max_len)
+			max_len = BENCH_parseSize(ls.item[a]);
+	char *data = malloc(max_len ? max_len : 1);
+	char *out = malloc(max_len ? max_len : 1);
+	if(!data || !out){
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	srand(1);
+	size_t i;
+	for(i = 0; i < max_len; ++i)
+		data[i] = rand();
+
+	if(json)
+		fprintf(report, "[\n");
+	else
+		fprintf(report, "transport,protocol,bytes,impairment,window,write,run,status,"
+			"seconds,goodput_mbps,datagrams,ideal,retx_ratio,cpu_sec,cpu_sec_per_gb\n");
+	bool first = true;
+	for(a = 0; a < lp.n; ++a){
+		struct XFER_Params params = {0};
+		if(XFER_parse(lp.item[a], &params.proto) != 0){
+			fprintf(stderr, "Protocol Unknown: %s\n", lp.item[a]);
+			return 1;
+		}
+		// only the windowed protocols sweep the window
+		int nwin = params.proto == XFER_SR || params.proto == XFER_GBN ? lw.n : 1;
+		for(b = 0; b < ls.n; ++b)
+		for(c = 0; c < li.n; ++c)
+		for(d = 0; d < nwin; ++d)
+		for(e = 0; e < lb.n; ++e)
+		for(run = 0; run < runs; ++run){
+			size_t len = BENCH_parseSize(ls.item[b]);
+			params.impair = strcmp(li.item[c], "none") == 0 ? NULL : li.item[c];
+			// RDT-GBN has no window to report; SP's is always 1
+			if(params.proto == XFER_SR || params.proto == XFER_GBN)
+				params.window = atoi(lw.item[d]);
+			else
+				params.window = params.proto == XFER_SP ? 1 : 0;
+			char window[16] = "";
+			if(params.window > 0)
+				snprintf(window, sizeof(window), "%d", params.window);
+			params.write_len = BENCH_parseSize(lb.item[e]);
+			params.port = port;
+			port += 2;
+
+			struct XFER_Result res;
+			const char *status;
+			memset(out, 0, len);
+			if(XFER_run(&params, data, len, out, &res) != 0)
+				status = "setup-failed";
+			else if(!res.supported)
+				status = "unsupported";
+			else
+				status = res.ok ? "ok" : "corrupt";
+			if(XP_virtual())
+				SIM_drain();
+
+			double sec = res.usec / 1e6;
+			double goodput = sec > 0 ? res.bytes * 8 / sec / 1e6 : 0;
+			double retx = res.ideal && res.sent > res.ideal ?
+				(double)(res.sent - res.ideal) / res.ideal : 0;
+			double cpu_gb = res.bytes ? res.cpu_sec / (res.bytes / 1e9) : 0;
+			if(json){
+				fprintf(report, "%s  {\"transport\": \"%s\", \"protocol\": \"%s\", "
+					"\"bytes\": %zu, \"impairment\": \"%s\", \"window\": %s, "
+					"\"write\": %zu, \"run\": %d, \"status\": \"%s\", "
+					"\"seconds\": %.6f, \"goodput_mbps\": %.3f, \"datagrams\": %llu, "
+					"\"ideal\": %llu, \"retx_ratio\": %.4f, \"cpu_sec\": %.6f, "
+					"\"cpu_sec_per_gb\": %.3f}",
+					first ? "" : ",\n", XP_current()->name, XFER_name(params.proto),
+					len, li.item[c], *window ? window : "null", params.write_len, run, status,
+					sec, goodput, (unsigned long long)res.sent,
+					(unsigned long long)res.ideal, retx, res.cpu_sec, cpu_gb);
+			} else {
+				fprintf(report, "%s,%s,%zu,\"%s\",%s,%zu,%d,%s,%.6f,%.3f,%llu,%llu,"
+					"%.4f,%.6f,%.3f\n",
+					XP_current()->name, XFER_name(params.proto), len, li.item[c],
+					window, params.write_len, run, status, sec, goodput,
+					(unsigned long long)res.sent, (unsigned long long)res.ideal,
+					retx, res.cpu_sec, cpu_gb);
+			}
+			fflush(report);
+			first = false;
+		}
+	}
+	if(json)
+		fprintf(report, "\n]\n");
+	fclose(report);
+	free(data);
+	free(out);
+	return 0;
+}
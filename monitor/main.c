@@ -0,0 +1,460 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <arpa/inet.h>
+
+#include "sock.h"
+#include "metrics.h"
+#include "trace.h"
+
+// Live view of a process's RDT pipes, read from its metrics segment (run it
+// with RDT_METRICS set). Without a pid it lists the processes that have one;
+// with one it prints each pipe's rates every interval, like nstat, or with
+// -t the totals so far, or with -l latency percentiles. -H exports the
+// process's latency histogram for HdrHistogram's tools. With -T it decodes a
+// trace written under RDT_TRACE.
+
+static const char *protoNames[] = {"SP", "GBN", "SR"};
+static const char *stateNames[] = {"free", "open", "listen", "estab"};
+static const char *gbnStateNames[] = {"CLOSED", "SYN_SENT", "SYN_RCVD", "ESTABLISHED",
+	"FIN_SENT", "FIN_RCVD"};
+static const char *eventNames[] = {"send", "retransmit", "ack", "timeout", "recv",
+	"duplicate", "state", "error", "dropped", "clock"};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] [pid]\n"
+		"  -i 1          seconds between samples\n"
+		"  -c 0          samples to print, 0 for no limit\n"
+		"  -t            print the counters so far once instead of rates\n"
+		"  -l            print latency percentiles once instead of rates\n"
+		"  -H rtt|deliv  export the process's merged histogram (msec)\n"
+		"  -T file       print the events of a trace in time order\n"
+		"Without a pid, lists the processes publishing metrics.\n", prog);
+}
+
+// Process totals: what closed pipes left behind plus every open one
+static void totals(const struct MET_Segment *seg, struct RDT_Stats *sum, int *open)
+{
+	struct MET_Pipe p;
+	uint32_t i, n = __atomic_load_n(&seg->high_water, __ATOMIC_ACQUIRE);
+	*sum = seg->proc.closed;
+	*open = 0;
+	for(i = 0; i < n && i < seg->max_pipes; ++i){
+		if(!MET_readPipe(seg, i, &p) || p.state == MET_FREE)
+			continue;
+		++*open;
+		sum->bytes_sent += p.stats.bytes_sent;
+		sum->bytes_received += p.stats.bytes_received;
+		sum->packets_sent += p.stats.packets_sent;
+		sum->packets_received += p.stats.packets_received;
+		sum->retransmits += p.stats.retransmits;
+		sum->timeouts += p.stats.timeouts;
+		sum->duplicates += p.stats.duplicates;
+		sum->checksum_failures += p.stats.checksum_failures;
+	}
+}
+
+static void command(int pid, char *buf, size_t len)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/comm", pid);
+	FILE *f = fopen(path, "r");
+	snprintf(buf, len, "?");
+	if(f){
+		if(fgets(buf, len, f))
+			buf[strcspn(buf, "\n")] = '\0';
+		fclose(f);
+	}
+}
+
+static int list(void)
+{
+	DIR *dir = opendir("/dev/shm");
+	struct dirent *e;
+	if(!dir){
+		fprintf(stderr, "/dev/shm: %s\n", strerror(errno));
+		return 1;
+	}
+	printf("%-8s %-16s %6s %8s %8s %8s %12s %12s %8s\n", "PID", "COMMAND", "PIPES",
+		"CONNECTS", "ACCEPTS", "CLOSED", "TX_PKTS", "RX_PKTS", "RETX");
+	while((e = readdir(dir)) != NULL){
+		int pid;
+		if(sscanf(e->d_name, "rdt-metrics.%d", &pid) != 1)
+			continue;
+		size_t len;
+		const struct MET_Segment *seg = MET_attach(pid, &len);
+		if(!seg)
+			continue;
+		char comm[32];
+		bool alive = kill(pid, 0) == 0 || errno == EPERM;
+		if(alive)
+			command(pid, comm, sizeof(comm));
+		else
+			snprintf(comm, sizeof(comm), "(exited)");
+		struct RDT_Stats sum;
+		int open;
+		totals(seg, &sum, &open);
+		printf("%-8d %-16s %6d %8llu %8llu %8llu %12llu %12llu %8llu\n", pid, comm, open,
+			(unsigned long long)seg->proc.connects, (unsigned long long)seg->proc.accepts,
+			(unsigned long long)seg->proc.pipes_closed,
+			(unsigned long long)sum.packets_sent, (unsigned long long)sum.packets_received,
+			(unsigned long long)sum.retransmits);
+		MET_detach(seg, len);
+	}
+	closedir(dir);
+	return 0;
+}
+
+static void endpoint(uint32_t addr, uint16_t port, char *buf, size_t len)
+{
+	struct in_addr in = {addr};
+	char ip[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &in, ip, sizeof(ip));
+	snprintf(buf, len, "%s:%u", ip, port);
+}
+
+// Counters of the slots at the previous sample, to take rates against
+struct Prev
+{
+	uint32_t seq; // the slot was reopened if this changed
+	struct RDT_Stats stats;
+};
+
+// Baseline for the first rates
+static void remember(const struct MET_Segment *seg, struct Prev *prev)
+{
+	struct MET_Pipe p;
+	uint32_t i, n = __atomic_load_n(&seg->high_water, __ATOMIC_ACQUIRE);
+	for(i = 0; i < n && i < seg->max_pipes; ++i){
+		if(MET_readPipe(seg, i, &p) && p.state != MET_FREE){
+			prev[i].seq = p.seq;
+			prev[i].stats = p.stats;
+		}
+	}
+}
+
+#define RATE(f) (dt > 0 ? (double)(p.stats.f - old.f) / dt : 0)
+
+static void sample(const struct MET_Segment *seg, struct Prev *prev, double dt, bool rates)
+{
+	struct MET_Pipe p;
+	uint32_t i, n = __atomic_load_n(&seg->high_water, __ATOMIC_ACQUIRE);
+	if(rates)
+		printf("%-6s %-4s %-6s %-21s %-21s %8s %8s %8s %4s %4s %9s %9s %11s %11s %7s %6s %6s %6s\n",
+			"PIPE", "PROT", "STATE", "LOCAL", "REMOTE", "SRTT_MS", "RTTV_MS", "RTO_MS",
+			"CWND", "INFL", "TXPKT/S", "RXPKT/S", "TXB/S", "RXB/S", "RETX/S", "TO/S",
+			"DUP/S", "CKERR/S");
+	else
+		printf("%-6s %-4s %-6s %-21s %-21s %8s %8s %8s %4s %4s %9s %9s %11s %11s %7s %6s %6s %6s\n",
+			"PIPE", "PROT", "STATE", "LOCAL", "REMOTE", "SRTT_MS", "RTTV_MS", "RTO_MS",
+			"CWND", "INFL", "TXPKT", "RXPKT", "TXBYTES", "RXBYTES", "RETX", "TO",
+			"DUP", "CKERR");
+	for(i = 0; i < n && i < seg->max_pipes; ++i){
+		if(!MET_readPipe(seg, i, &p) || p.state == MET_FREE){
+			prev[i].seq = 0;
+			continue;
+		}
+		struct RDT_Stats old = {0};
+		if(rates && prev[i].seq == p.seq)
+			old = prev[i].stats;
+		prev[i].seq = p.seq;
+		prev[i].stats = p.stats;
+		if(!rates)
+			dt = 1;
+		char loc[32], rem[32];
+		endpoint(p.local_addr, p.local_port, loc, sizeof(loc));
+		endpoint(p.remote_addr, p.remote_port, rem, sizeof(rem));
+		printf("%-6u %-4s %-6s %-21s %-21s %8.3f %8.3f %8.1f %4u %4u %9.0f %9.0f %11.0f "
+			"%11.0f %7.0f %6.0f %6.0f %6.0f\n", i,
+			p.protocol < 3 ? protoNames[p.protocol] : "?",
+			p.state < 4 ? stateNames[p.state] : "?", loc, rem,
+			p.stats.srtt_usec / 1e3, p.stats.rttvar_usec / 1e3, p.stats.rto_usec / 1e3,
+			p.stats.cwnd, p.stats.in_flight, RATE(packets_sent), RATE(packets_received),
+			RATE(bytes_sent), RATE(bytes_received), RATE(retransmits), RATE(timeouts),
+			RATE(duplicates), RATE(checksum_failures));
+	}
+}
+
+// A record in the trace and its place in the file, to break ties
+struct Event
+{
+	struct TRC_Record rec;
+	size_t order;
+};
+
+static int byStamp(const void *a, const void *b)
+{
+	const struct Event *x = a, *y = b;
+	if(x->rec.tsc != y->rec.tsc)
+		return x->rec.tsc < y->rec.tsc ? -1 : 1;
+	return x->order < y->order ? -1 : x->order > y->order;
+}
+
+static const char *stateName(uint8_t protocol, uint32_t state)
+{
+	if(protocol == GOBACKN)
+		return state < 6 ? gbnStateNames[state] : "?";
+	return state < 4 ? stateNames[state] : "?";
+}
+
+static void detail(const struct TRC_Record *r, char *buf, size_t len)
+{
+	switch(r->event){
+	case TRC_SEND:
+	case TRC_RETRANSMIT:
+	case TRC_RECV:
+		snprintf(buf, len, "seq %u len %u", r->a, r->b);
+		break;
+	case TRC_ACK:
+		if(r->b)
+			snprintf(buf, len, "seq %u rtt %.3f ms", r->a, r->b / 1e3);
+		else
+			snprintf(buf, len, "seq %u", r->a);
+		break;
+	case TRC_TIMEOUT:
+		snprintf(buf, len, "seq %u after %u retransmits", r->a, r->b);
+		break;
+	case TRC_DUPLICATE:
+		snprintf(buf, len, "seq %u", r->a);
+		break;
+	case TRC_STATE:
+		snprintf(buf, len, "%s -> %s", stateName(r->protocol, r->b),
+			stateName(r->protocol, r->a));
+		break;
+	case TRC_ERROR:
+		snprintf(buf, len, "line %u: %s", r->a, r->b ? strerror(r->b) : "no errno");
+		break;
+	case TRC_DROPPED:
+		snprintf(buf, len, "%u events lost, ring full", r->a);
+		break;
+	default:
+		snprintf(buf, len, "%u %u", r->a, r->b);
+		break;
+	}
+}
+
+// Print a trace in time order. The rings of several threads are drained
+// into the file in turn, so it is sorted first; stamps become seconds since
+// the trace began by the clock records spanning it.
+static int decode(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	struct TRC_FileHeader hdr;
+	if(!f){
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	if(fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, TRC_MAGIC, sizeof(hdr.magic)) != 0 ||
+			hdr.version != TRC_VERSION || hdr.record_size != sizeof(struct TRC_Record)){
+		fprintf(stderr, "%s: not a trace of this version\n", path);
+		fclose(f);
+		return 1;
+	}
+
+	struct Event *events = NULL;
+	size_t n = 0, cap = 0, clocks = 0;
+	uint64_t tsc0 = 0, ns0 = 0, tsc1 = 0, ns1 = 0;
+	struct TRC_Record rec;
+	while(fread(&rec, sizeof(rec), 1, f) == 1){
+		if(rec.event == TRC_CLOCK){
+			uint64_t ns = (uint64_t)rec.a << 32 | rec.b;
+			if(clocks++ == 0){
+				tsc0 = rec.tsc;
+				ns0 = ns;
+			}
+			tsc1 = rec.tsc;
+			ns1 = ns;
+			continue;
+		}
+		if(n == cap){
+			cap = cap ? cap * 2 : 4096;
+			struct Event *more = realloc(events, cap * sizeof(*events));
+			if(!more){
+				fprintf(stderr, "Out of memory\n");
+				free(events);
+				fclose(f);
+				return 1;
+			}
+			events = more;
+		}
+		events[n].rec = rec;
+		events[n].order = n;
+		++n;
+	}
+	fclose(f);
+	qsort(events, n, sizeof(*events), byStamp);
+
+	double ns_per_tick = 1;
+	if(hdr.tsc && tsc1 > tsc0)
+		ns_per_tick = (double)(ns1 - ns0) / (tsc1 - tsc0);
+	else if(hdr.tsc)
+		fprintf(stderr, "%s: no clock span, times are in TSC ticks\n", path);
+	printf("# pid %d, %zu events over %.6f s\n", hdr.pid, n, (ns1 - ns0) / 1e9);
+	printf("%12s %4s %-4s %6s %-10s %s\n", "SEC", "THR", "PROT", "PIPE", "EVENT", "DETAIL");
+	size_t i;
+	for(i = 0; i < n; ++i){
+		const struct TRC_Record *r = &events[i].rec;
+		char pipe[16], what[96];
+		if(r->pipe < 0)
+			snprintf(pipe, sizeof(pipe), "-");
+		else
+			snprintf(pipe, sizeof(pipe), "%d", r->pipe);
+		detail(r, what, sizeof(what));
+		printf("%12.6f %4u %-4s %6s %-10s %s\n",
+			(double)(int64_t)(r->tsc - tsc0) * ns_per_tick / 1e9, r->thread,
+			r->event == TRC_DROPPED ? "-" : r->protocol < 3 ? protoNames[r->protocol] : "?",
+			pipe, r->event <= TRC_CLOCK ? eventNames[r->event] : "?", what);
+	}
+	free(events);
+	return 0;
+}
+
+static void percentiles(const char *pipe, const char *proto, const char *what,
+	const struct HST_Hist *h)
+{
+	printf("%-6s %-4s %-5s %10llu %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f\n", pipe, proto, what,
+		(unsigned long long)h->count, h->count ? (double)h->sum / h->count / 1e3 : 0,
+		HST_percentile(h, 50) / 1e3, HST_percentile(h, 90) / 1e3,
+		HST_percentile(h, 99) / 1e3, HST_percentile(h, 99.9) / 1e3, h->max / 1e3);
+}
+
+// Histograms of every open pipe merged into those the closed ones left
+static void merged(const struct MET_Segment *seg, struct HST_Hist *rtt,
+	struct HST_Hist *delivery, bool print)
+{
+	struct MET_Pipe p;
+	uint32_t i, n = __atomic_load_n(&seg->high_water, __ATOMIC_ACQUIRE);
+	*rtt = seg->proc.closed_rtt;
+	*delivery = seg->proc.closed_delivery;
+	for(i = 0; i < n && i < seg->max_pipes; ++i){
+		if(!MET_readPipe(seg, i, &p) || p.state == MET_FREE)
+			continue;
+		if(print && (p.rtt.count || p.delivery.count)){
+			char id[16];
+			const char *proto = p.protocol < 3 ? protoNames[p.protocol] : "?";
+			snprintf(id, sizeof(id), "%u", i);
+			percentiles(id, proto, "rtt", &p.rtt);
+			percentiles(id, proto, "deliv", &p.delivery);
+		}
+		HST_merge(rtt, &p.rtt);
+		HST_merge(delivery, &p.delivery);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	double interval = 1;
+	long count = 0;
+	bool once = false, lat = false;
+	const char *export = NULL;
+	int opt;
+
+	while((opt = getopt(argc, argv, "i:c:tlH:T:h")) != -1){
+		switch(opt){
+		case 'i': interval = atof(optarg); break;
+		case 'c': count = atol(optarg); break;
+		case 't': once = true; break;
+		case 'l': lat = true; break;
+		case 'H': export = optarg; break;
+		case 'T': return decode(optarg);
+		default: usage(argv[0]); return 1;
+		}
+	}
+	if(optind == argc)
+		return list();
+	if(interval <= 0 || (export && strcmp(export, "rtt") != 0 && strcmp(export, "deliv") != 0)){
+		usage(argv[0]);
+		return 1;
+	}
+
+	int pid = atoi(argv[optind]);
+	size_t len;
+	const struct MET_Segment *seg = MET_attach(pid, &len);
+	if(!seg){
+		fprintf(stderr, "No metrics for pid %d (is RDT_METRICS set there?)\n", pid);
+		return 1;
+	}
+	struct Prev *prev = calloc(seg->max_pipes, sizeof(*prev));
+	if(!prev){
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	struct RDT_Stats sum, last;
+	int open;
+	totals(seg, &last, &open);
+	if(lat || export){
+		struct HST_Hist rtt, delivery;
+		if(lat)
+			printf("%-6s %-4s %-5s %10s %9s %9s %9s %9s %9s %9s\n", "PIPE", "PROT", "HIST",
+				"COUNT", "MEAN_MS", "P50_MS", "P90_MS", "P99_MS", "P99.9_MS", "MAX_MS");
+		merged(seg, &rtt, &delivery, lat);
+		if(lat){
+			percentiles("all", "-", "rtt", &rtt);
+			percentiles("all", "-", "deliv", &delivery);
+		} else {
+			HST_print(stdout, strcmp(export, "rtt") == 0 ? &rtt : &delivery, 1e3);
+		}
+		MET_detach(seg, len);
+		free(prev);
+		return 0;
+	}
+	if(once){
+		sample(seg, prev, 0, false);
+		printf("total: %d open, %llu connects, %llu accepts, %llu closed, %llu/%llu pkts "
+			"out/in, %llu/%llu bytes out/in, %llu retx, %llu timeouts, %llu dup, %llu ckerr\n",
+			open, (unsigned long long)seg->proc.connects,
+			(unsigned long long)seg->proc.accepts, (unsigned long long)seg->proc.pipes_closed,
+			(unsigned long long)last.packets_sent, (unsigned long long)last.packets_received,
+			(unsigned long long)last.bytes_sent, (unsigned long long)last.bytes_received,
+			(unsigned long long)last.retransmits, (unsigned long long)last.timeouts,
+			(unsigned long long)last.duplicates, (unsigned long long)last.checksum_failures);
+		MET_detach(seg, len);
+		free(prev);
+		return 0;
+	}
+
+	remember(seg, prev);
+
+	struct timespec ts = {(time_t)interval, (long)((interval - (time_t)interval) * 1e9)};
+	long n;
+	for(n = 0; count == 0 || n < count; ++n){
+		nanosleep(&ts, NULL);
+		if(kill(pid, 0) != 0 && errno == ESRCH){
+			printf("pid %d exited\n", pid);
+			break;
+		}
+		time_t now = time(NULL);
+		char when[32];
+		strftime(when, sizeof(when), "%H:%M:%S", localtime(&now));
+		printf("--- %s pid %d\n", when, pid);
+		sample(seg, prev, interval, true);
+		totals(seg, &sum, &open);
+		printf("total: %d open, %.0f pkts/s out, %.0f pkts/s in, %.0f B/s out, %.0f B/s in, "
+			"%.0f retx/s, %.0f timeouts/s, %.0f dup/s, %.0f ckerr/s\n", open,
+			(sum.packets_sent - last.packets_sent) / interval,
+			(sum.packets_received - last.packets_received) / interval,
+			(sum.bytes_sent - last.bytes_sent) / interval,
+			(sum.bytes_received - last.bytes_received) / interval,
+			(sum.retransmits - last.retransmits) / interval,
+			(sum.timeouts - last.timeouts) / interval,
+			(sum.duplicates - last.duplicates) / interval,
+			(sum.checksum_failures - last.checksum_failures) / interval);
+		fflush(stdout);
+		last = sum;
+	}
+	MET_detach(seg, len);
+	free(prev);
+	return 0;
+}
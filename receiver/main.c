@@ -58,11 +58,16 @@ int main(int argc, char** argv)
 
 	signal(SIGINT, onsigint);
 
-	server = RDT_socket(protocol);
+	int listener = RDT_socket(protocol);
 
-	RDT_bind(server, "localhost", atoi(argv[2]));
-	RDT_listen(server, 1);
-	RDT_accept(server);
+	RDT_bind(listener, "localhost", atoi(argv[2]));
+	RDT_listen(listener, 1);
+	server = RDT_accept(listener);
+	RDT_close(listener);
+	if(server < 0){
+		fprintf(stderr, "Error accepting a connection\n");
+		return 1;
+	}
 
 	out = fopen(argv[3], "wb");
 	if(!out){
@@ -89,5 +94,13 @@ int main(int argc, char** argv)
 	}
 	fclose(out);
 
+	struct RDT_Stats stats;
+	if(RDT_info_stats(server, &stats) == 0){
+		printf("received %llu bytes in %llu packets, %llu duplicates, %llu failed checksums\n",
+			(unsigned long long)stats.bytes_received,
+			(unsigned long long)stats.packets_received,
+			(unsigned long long)stats.duplicates,
+			(unsigned long long)stats.checksum_failures);
+	}
 	RDT_close(server);
 }
\ No newline at end of file
@@ -8,13 +8,43 @@
 
 #include "s_gbn.h"
 #include "s_helper.h"
+#include <sys/uio.h>
+
+/* gbn_recv fills RECV_LEN bytes at a time, IOV_BATCH of them per writev */
+#define RECV_LEN  (DATALEN * 64)
+#define IOV_BATCH 8
+
+static char bufs[IOV_BATCH][RECV_LEN];
+
+/* writev the whole batch, picking up after short writes */
+static int write_batch(int fd, struct iovec* iov, int iovcnt){
+	while (iovcnt > 0){
+		ssize_t n = writev(fd, iov, iovcnt);
+		if (n < 0){
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len){
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0){
+			iov->iov_base = (char*)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
 
 int gbn_main(int argc, char *argv[])
 {
 	int sockfd;
 	int newSockfd;
 	int numRead;
-	char buf[DATALEN];
+	struct iovec iov[IOV_BATCH];
+	int iovcnt = 0;
 	struct sockaddr_in server;
 	struct sockaddr_in client;
 	FILE *outputFile;
@@ -68,13 +98,25 @@ int gbn_main(int argc, char *argv[])
 	
 	/*----- Reading from the socket and dumping it to the file -----*/
     while(1){
-        if ((numRead = gbn_recv(sockfd, buf, DATALEN, 0)) == -1){
+        if ((numRead = gbn_recv(sockfd, bufs[iovcnt], RECV_LEN, 0)) == -1){
             perror("gbn_recv");
             exit(-1);
         }
-        else if (numRead == 0)
+        if (numRead > 0){
+            iov[iovcnt].iov_base = bufs[iovcnt];
+            iov[iovcnt].iov_len = numRead;
+            iovcnt++;
+        }
+        /* flush once every buffer is used, and at end of stream */
+        if (iovcnt == IOV_BATCH || (numRead == 0 && iovcnt > 0)){
+            if (write_batch(fileno(outputFile), iov, iovcnt) == -1){
+                perror("writev");
+                exit(-1);
+            }
+            iovcnt = 0;
+        }
+        if (numRead == 0)
             break;
-        fwrite(buf, 1, numRead, outputFile);
     }
 
 	/*----- Closing the socket -----*/
@@ -4,9 +4,21 @@
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
+#include <pthread.h>
 
 #include "global.h"
 #include "sock.h"
+#include "spsc.h"
+
+// File chunks handed from the reader thread to RDT_send
+#define CHUNK_LEN (RDT_PAYLOAD_LEN * 1000)
+#define CHUNK_DEPTH 4
+
+struct Chunk
+{
+	size_t len;
+	char data[CHUNK_LEN];
+};
 
 #ifdef DEBUG_
 	char* debrel = "Debug";
@@ -29,13 +41,31 @@ void onsigint(int signum){
 	exit(1);
 }
 
+// Reader stage: read the file ahead of the network into the chunk ring
+void* reader(void* arg){
+	struct SPSC_Ring* ring = arg;
+	struct Chunk* chunk;
+	while((chunk = SPSC_write_slot(ring)) != NULL){
+		chunk->len = fread(chunk->data, 1, CHUNK_LEN, in);
+		if(chunk->len == 0){
+			break;
+		}
+		SPSC_write_commit(ring);
+		if(chunk->len < CHUNK_LEN){
+			break;
+		}
+	}
+	SPSC_close(ring);
+	return NULL;
+}
+
 int main(int argc, char** argv)
 {
 	printf("Send compiled for %s\n", debrel);
 
-	if(argc != 5){
-		fprintf(stderr, "Usage: %s <SP|SR|GBN> <recv_host> <recv_port> <send_file>\n",
-			argv[0]);
+	if(argc != 5 && argc != 6){
+		fprintf(stderr, "Usage: %s <SP|SR|GBN> <recv_host> <recv_port> <send_file> "
+			"[SR_window]\n", argv[0]);
 		return 1;
 	}
 
@@ -60,46 +90,62 @@ int main(int argc, char** argv)
 
 	signal(SIGINT, onsigint);
 
-	int client = RDT_socket(protocol);
+	client = RDT_socket(protocol);
+	if(argc == 6 && RDT_set_window(client, atoi(argv[5])) != 0){
+		fprintf(stderr, "Bad window: %s\n", argv[5]);
+		RDT_close(client);
+		return 1;
+	}
 
 	RDT_bind(client, "localhost", 5791);
 	RDT_connect(client, argv[2], atoi(argv[3]));
 
-	FILE* in = fopen(argv[4], "rb");
+	in = fopen(argv[4], "rb");
 	if(!in){
 		fprintf(stderr, "Error opening %s: %s\n", argv[4], strerror(errno));
 		RDT_close(client);
 		return 1;
 	}
 
-	int ret = fseek(in, 0, SEEK_END);
-	if(ret != 0){
-		fprintf(stderr, "Error finding end of file: %s\n", strerror(errno));
-		RDT_close(client);
-		return 1;
-	}
-	int len = ftell(in);
-	if(len < 0){
-		fprintf(stderr, "Error finding end of file: %s\n", strerror(errno));
+	struct SPSC_Ring chunks;
+	if(SPSC_init(&chunks, CHUNK_DEPTH, sizeof(struct Chunk)) != 0){
+		fprintf(stderr, "Error allocating read buffers\n");
+		fclose(in);
 		RDT_close(client);
 		return 1;
 	}
-	fseek(in, 0, SEEK_SET);
-
-	char* msg = malloc(len);
-	ret = fread(msg, 1, len, in);
-	if(ret != len){
-		fprintf(stderr, "Error reading file\n");
-		free(msg);
+	pthread_t read_thread;
+	if(pthread_create(&read_thread, NULL, reader, &chunks) != 0){
+		fprintf(stderr, "Error starting reader thread\n");
+		SPSC_destroy(&chunks);
 		fclose(in);
 		RDT_close(client);
 		return 1;
 	}
 
-	RDT_send(client, msg, len);
+	struct Chunk* chunk;
+	while((chunk = SPSC_read_slot(&chunks)) != NULL){
+		RDT_send(client, chunk->data, chunk->len);
+		SPSC_read_release(&chunks);
+	}
+	pthread_join(read_thread, NULL);
 
-	free(msg);
+	int ret = 0;
+	if(ferror(in)){
+		fprintf(stderr, "Error reading file\n");
+		ret = 1;
+	}
+	SPSC_destroy(&chunks);
 	fclose(in);
-
+	in = NULL;
+
+	struct RDT_Stats stats;
+	if(RDT_info_stats(client, &stats) == 0){
+		printf("sent %llu bytes in %llu packets, %llu retransmits, %llu timeouts, "
+			"srtt %u usec\n", (unsigned long long)stats.bytes_sent,
+			(unsigned long long)stats.packets_sent, (unsigned long long)stats.retransmits,
+			(unsigned long long)stats.timeouts, stats.srtt_usec);
+	}
 	RDT_close(client);
-}
\ No newline at end of file
+	return ret;
+}
@@ -10,14 +10,38 @@
 
 #include "s_gbn.h"
 #include "s_helper.h"
+#include "spsc.h"
+#include <pthread.h>
 
 #define h_addr h_addr_list[0]
 
+/* chunks of the input file read ahead of gbn_send */
+#define READ_DEPTH 2
+
+struct chunk {
+	int len;
+	char data[DATALEN * N];
+};
+
+/* reader thread, keeps the next chunk of the file ready while gbn_send runs */
+static void* read_ahead(void* arg){
+	FILE* inputFile = ((void**)arg)[0];
+	struct SPSC_Ring* ring = ((void**)arg)[1];
+	struct chunk* c;
+	while ((c = SPSC_write_slot(ring)) != NULL){
+		if ((c->len = fread(c->data, 1, DATALEN * N, inputFile)) <= 0)
+			break;
+		SPSC_write_commit(ring);
+	}
+	SPSC_close(ring);
+	return NULL;
+}
+
 int gbn_main(int argc, char *argv[]){
 	int sockfd;          /* socket file descriptor of the client            */
-	int numRead;
 	socklen_t socklen;	 /* length of the socket structure sockaddr         */
-	char buf[DATALEN * N];   /* buffer to send packets                       */
+	struct SPSC_Ring chunks; /* chunks read ahead by the reader thread      */
+	pthread_t reader;    /* reader thread                                   */
 	struct hostent *he;	 /* structure for resolving names into IP addresses */
 	FILE *inputFile;     /* input file pointer                              */
 	struct sockaddr_in server;
@@ -67,13 +91,28 @@ int gbn_main(int argc, char *argv[]){
 		exit(-1);
 	}
 	
+	/*----- Starting the reader thread -----*/
+	if (SPSC_init(&chunks, READ_DEPTH, sizeof(struct chunk)) != 0){
+		perror("SPSC_init");
+		exit(-1);
+	}
+	void* reader_args[2] = {inputFile, &chunks};
+	if (pthread_create(&reader, NULL, read_ahead, reader_args) != 0){
+		perror("pthread_create");
+		exit(-1);
+	}
+
 	/*----- Reading from the file and sending it through the socket -----*/
-    while ((numRead = fread(buf, 1, DATALEN * N, inputFile)) > 0){
-        if (gbn_send(sockfd, buf, numRead, 0) == -1){
+	struct chunk* c;
+    while ((c = SPSC_read_slot(&chunks)) != NULL){
+        if (gbn_send(sockfd, c->data, c->len, 0) == -1){
             perror("gbn_send");
             exit(-1);
         }
+        SPSC_read_release(&chunks);
     }
+    pthread_join(reader, NULL);
+    SPSC_destroy(&chunks);
     
     /*----- Closing the socket -----*/
 	if (gbn_close(sockfd) == -1){
@@ -0,0 +1,458 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "capture.h"
+#include "drain.h"
+#include "xport.h"
+
+// pcapng block types and the options written here
+#define CAP_SHB 0x0A0D0D0A
+#define CAP_IDB 1
+#define CAP_ISB 5
+#define CAP_EPB 6
+#define CAP_BOM 0x1A2B3C4D
+#define CAP_LINKTYPE_IPV4 228
+#define CAP_IF_TSRESOL 9
+#define CAP_EPB_FLAGS 2
+#define CAP_ISB_IFDROP 5
+#define CAP_INBOUND 1
+#define CAP_OUTBOUND 2
+
+#define CAP_HEADERS 28 // IPv4 and UDP in front of every datagram
+
+// A datagram on its way to the file
+struct CAP_Record
+{
+	uint64_t ns;
+	struct sockaddr_in local, remote;
+	uint32_t len;    // on the wire
+	uint32_t caplen; // kept in data
+	bool out;
+	char data[CAP_SNAPLEN];
+};
+
+// Addresses of a socket, learnt when it is bound or connected
+struct CAP_Ends
+{
+	struct sockaddr_in local, peer;
+	bool known; // local is final
+};
+
+bool CAP_on = false;
+
+static void CAP_writeHeader(void);
+static bool CAP_drain(void);
+static void CAP_writeStats(void);
+static void CAP_forked(void);
+
+static struct DRN_Set CAP_rings = {CAP_RING_RECORDS, sizeof(struct CAP_Record), CAP_DRAIN_MSEC,
+	&CAP_on, CAP_writeHeader, CAP_drain, CAP_writeStats, CAP_forked, PTHREAD_MUTEX_INITIALIZER};
+static __thread struct DRN_Ring *CAP_mine;
+
+static struct
+{
+	pthread_once_t once;
+	struct CAP_Ends *fds;
+	uint64_t dropped; // from all rings, counted by their owners
+	uint16_t ip_id;   // drainer only
+} CAP_state = {PTHREAD_ONCE_INIT};
+
+// Real time, or the simulator's while it runs, so a capture of a simulated
+// run shows the simulated spacing
+static uint64_t CAP_now(void)
+{
+	struct timespec ts;
+	if(XP_virtual())
+		return XP_now_usec() * 1000;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct CAP_Ends *CAP_ends(int s)
+{
+	if(s < 0 || s >= CAP_MAX_FDS)
+		return NULL;
+	struct CAP_Ends *e = &CAP_state.fds[s];
+	// an unbound socket gets its port with its first send
+	if(!e->known){
+		socklen_t len = sizeof(e->local);
+		if(XP_getsockname(s, (struct sockaddr *)&e->local, &len) == 0
+				&& e->local.sin_port != 0)
+			e->known = true;
+	}
+	return e;
+}
+
+// Slot for the next datagram of this thread, or NULL if it is not captured
+static struct CAP_Record *CAP_slot(void)
+{
+	struct DRN_Ring *r = CAP_mine ? CAP_mine : (CAP_mine = DRN_attach(&CAP_rings));
+	if(!r)
+		return NULL;
+	struct CAP_Record *rec = SPSC_try_write_slot(&r->ring);
+	if(!rec)
+		__atomic_add_fetch(&CAP_state.dropped, 1, __ATOMIC_RELAXED);
+	return rec;
+}
+
+void CAP_sent(int s, const void *buf, size_t len, const struct sockaddr *to)
+{
+	struct CAP_Record *rec = CAP_slot();
+	if(!rec)
+		return;
+	struct CAP_Ends *e = CAP_ends(s);
+	rec->ns = CAP_now();
+	rec->out = true;
+	rec->len = len;
+	rec->caplen = len < CAP_SNAPLEN ? len : CAP_SNAPLEN;
+	memcpy(rec->data, buf, rec->caplen);
+	memset(&rec->local, 0, sizeof(rec->local));
+	memset(&rec->remote, 0, sizeof(rec->remote));
+	if(e){
+		rec->local = e->local;
+		rec->remote = e->peer;
+	}
+	if(to && to->sa_family == AF_INET)
+		memcpy(&rec->remote, to, sizeof(rec->remote));
+	SPSC_write_commit(&CAP_mine->ring);
+}
+
+void CAP_received(int s, const struct msghdr *msg, size_t len)
+{
+	struct CAP_Record *rec = CAP_slot();
+	if(!rec)
+		return;
+	struct CAP_Ends *e = CAP_ends(s);
+	size_t i, at = 0;
+	rec->ns = CAP_now();
+	rec->out = false;
+	rec->len = len;
+	rec->caplen = len < CAP_SNAPLEN ? len : CAP_SNAPLEN;
+	for(i = 0; i < (size_t)msg->msg_iovlen && at < rec->caplen; ++i){
+		size_t n = msg->msg_iov[i].iov_len;
+		if(n > rec->caplen - at)
+			n = rec->caplen - at;
+		memcpy(rec->data + at, msg->msg_iov[i].iov_base, n);
+		at += n;
+	}
+	rec->caplen = at;
+	memset(&rec->local, 0, sizeof(rec->local));
+	memset(&rec->remote, 0, sizeof(rec->remote));
+	if(e){
+		rec->local = e->local;
+		rec->remote = e->peer;
+	}
+	if(msg->msg_name && msg->msg_namelen >= sizeof(struct sockaddr_in)
+			&& ((struct sockaddr *)msg->msg_name)->sa_family == AF_INET)
+		memcpy(&rec->remote, msg->msg_name, sizeof(rec->remote));
+	SPSC_write_commit(&CAP_mine->ring);
+}
+
+void CAP_bound(int s)
+{
+	if(s >= 0 && s < CAP_MAX_FDS){
+		CAP_state.fds[s].known = false;
+		CAP_ends(s);
+	}
+}
+
+void CAP_connected(int s, const struct sockaddr *addr)
+{
+	if(s >= 0 && s < CAP_MAX_FDS && addr->sa_family == AF_INET){
+		memcpy(&CAP_state.fds[s].peer, addr, sizeof(struct sockaddr_in));
+		CAP_ends(s);
+	}
+}
+
+void CAP_closed(int s)
+{
+	if(s >= 0 && s < CAP_MAX_FDS)
+		memset(&CAP_state.fds[s], 0, sizeof(struct CAP_Ends));
+}
+
+// Block writing. Lock held.
+
+static void CAP_put32(uint32_t v)
+{
+	fwrite(&v, sizeof(v), 1, CAP_rings.out);
+}
+
+static void CAP_put16(uint16_t v)
+{
+	fwrite(&v, sizeof(v), 1, CAP_rings.out);
+}
+
+static void CAP_writeHeader(void)
+{
+	int64_t section = -1; // length unknown
+	CAP_put32(CAP_SHB);
+	CAP_put32(28);
+	CAP_put32(CAP_BOM);
+	CAP_put16(1);
+	CAP_put16(0);
+	fwrite(&section, sizeof(section), 1, CAP_rings.out);
+	CAP_put32(28);
+
+	CAP_put32(CAP_IDB);
+	CAP_put32(32);
+	CAP_put16(CAP_LINKTYPE_IPV4);
+	CAP_put16(0);
+	CAP_put32(65535);
+	CAP_put16(CAP_IF_TSRESOL);
+	CAP_put16(1);
+	fwrite("\x09\0\0", 4, 1, CAP_rings.out); // nanoseconds, padded
+	CAP_put32(0); // end of options
+	CAP_put32(32);
+}
+
+static uint16_t CAP_ipChecksum(const uint8_t *p, size_t len)
+{
+	uint32_t sum = 0;
+	size_t i;
+	for(i = 0; i + 1 < len; i += 2)
+		sum += (p[i] << 8) | p[i + 1];
+	while(sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return htons(~sum & 0xffff);
+}
+
+static void CAP_writePacket(const struct CAP_Record *rec)
+{
+	const struct sockaddr_in *src = rec->out ? &rec->local : &rec->remote;
+	const struct sockaddr_in *dst = rec->out ? &rec->remote : &rec->local;
+	uint32_t caplen = CAP_HEADERS + rec->caplen, pad = (4 - caplen % 4) % 4;
+	uint32_t total = 28 + caplen + pad + 12 + 4;
+	uint8_t hdr[CAP_HEADERS] = {0x45, 0};
+	uint16_t v;
+
+	v = htons(CAP_HEADERS + rec->len);
+	memcpy(hdr + 2, &v, 2);
+	v = htons(CAP_state.ip_id++);
+	memcpy(hdr + 4, &v, 2);
+	hdr[6] = 0x40; // don't fragment
+	hdr[8] = 64;
+	hdr[9] = 17;   // UDP
+	memcpy(hdr + 12, &src->sin_addr, 4);
+	memcpy(hdr + 16, &dst->sin_addr, 4);
+	v = CAP_ipChecksum(hdr, 20);
+	memcpy(hdr + 10, &v, 2);
+	memcpy(hdr + 20, &src->sin_port, 2);
+	memcpy(hdr + 22, &dst->sin_port, 2);
+	v = htons(8 + rec->len);
+	memcpy(hdr + 24, &v, 2); // no UDP checksum, as IPv4 allows
+
+	CAP_put32(CAP_EPB);
+	CAP_put32(total);
+	CAP_put32(0);
+	CAP_put32(rec->ns >> 32);
+	CAP_put32((uint32_t)rec->ns);
+	CAP_put32(caplen);
+	CAP_put32(CAP_HEADERS + rec->len);
+	fwrite(hdr, sizeof(hdr), 1, CAP_rings.out);
+	fwrite(rec->data, rec->caplen, 1, CAP_rings.out);
+	fwrite("\0\0\0", pad, 1, CAP_rings.out);
+	CAP_put16(CAP_EPB_FLAGS);
+	CAP_put16(4);
+	CAP_put32(rec->out ? CAP_OUTBOUND : CAP_INBOUND);
+	CAP_put32(0);
+	CAP_put32(total);
+}
+
+// How many datagrams the capture lost to full rings, written at the end
+static void CAP_writeStats(void)
+{
+	uint64_t ns = CAP_now();
+	uint64_t dropped = __atomic_load_n(&CAP_state.dropped, __ATOMIC_RELAXED);
+	CAP_put32(CAP_ISB);
+	CAP_put32(40);
+	CAP_put32(0);
+	CAP_put32(ns >> 32);
+	CAP_put32((uint32_t)ns);
+	CAP_put16(CAP_ISB_IFDROP);
+	CAP_put16(8);
+	fwrite(&dropped, sizeof(dropped), 1, CAP_rings.out);
+	CAP_put32(0);
+	CAP_put32(40);
+}
+
+// Write out everything captured so far, merging the rings by timestamp
+static bool CAP_drain(void)
+{
+	bool wrote = false;
+	for(;;){
+		struct DRN_Ring *r, *oldest = NULL;
+		const struct CAP_Record *rec, *first = NULL;
+		for(r = CAP_rings.rings; r; r = r->next){
+			if((rec = SPSC_try_read_slot(&r->ring)) != NULL && (!first || rec->ns < first->ns)){
+				first = rec;
+				oldest = r;
+			}
+		}
+		if(!first)
+			return wrote;
+		CAP_writePacket(first);
+		SPSC_read_release(&oldest->ring);
+		wrote = true;
+	}
+}
+
+// What the parent lost is in the parent's file
+static void CAP_forked(void)
+{
+	CAP_state.dropped = 0;
+}
+
+static void CAP_start(void)
+{
+	const char *path = getenv("RDT_CAPTURE");
+	if(!path || !*path)
+		return;
+	if((CAP_state.fds = calloc(CAP_MAX_FDS, sizeof(struct CAP_Ends))) == NULL)
+		return;
+	if(DRN_start(&CAP_rings, path))
+		CAP_on = true;
+}
+
+void CAP_init(void)
+{
+	pthread_once(&CAP_state.once, CAP_start);
+}
+
+// Reading
+
+int CAP_open(struct CAP_Reader *r, const char *path)
+{
+	r->ns_per_tick = 1000; // pcapng's default is microseconds
+	return (r->f = fopen(path, "rb")) ? 0 : -1;
+}
+
+void CAP_close(struct CAP_Reader *r)
+{
+	if(r->f)
+		fclose(r->f);
+	r->f = NULL;
+}
+
+static uint32_t CAP_get32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static uint16_t CAP_get16(const uint8_t *p)
+{
+	uint16_t v;
+	memcpy(&v, p, 2);
+	return v;
+}
+
+// The value of an option in a block's option list, or NULL
+static const uint8_t *CAP_option(const uint8_t *p, size_t len, uint16_t code,
+	uint16_t *vlen)
+{
+	while(len >= 4){
+		uint16_t c = CAP_get16(p), l = CAP_get16(p + 2);
+		size_t step = 4 + ((l + 3) & ~3u);
+		if(c == 0 || step > len)
+			return NULL;
+		if(c == code){
+			*vlen = l;
+			return p + 4;
+		}
+		p += step;
+		len -= step;
+	}
+	return NULL;
+}
+
+static int CAP_epb(struct CAP_Reader *r, const uint8_t *b, size_t len,
+	struct CAP_Datagram *d)
+{
+	if(len < 20)
+		return -1;
+	uint32_t caplen = CAP_get32(b + 12), pad = (4 - caplen % 4) % 4;
+	if(caplen + pad > len - 20)
+		return -1;
+	const uint8_t *ip = b + 20, *v;
+	uint16_t vlen;
+	d->ns = (((uint64_t)CAP_get32(b + 4) << 32) | CAP_get32(b + 8)) * r->ns_per_tick;
+	d->out = false;
+	if((v = CAP_option(ip + caplen + pad, len - 20 - caplen - pad, CAP_EPB_FLAGS, &vlen))
+			&& vlen == 4)
+		d->out = (CAP_get32(v) & 3) == CAP_OUTBOUND;
+	size_t ihl = (ip[0] & 0x0f) * 4;
+	if(caplen < 20 || (ip[0] >> 4) != 4 || ip[9] != 17 || caplen < ihl + 8)
+		return 0; // not UDP over IPv4; skipped
+	memset(&d->src, 0, sizeof(d->src));
+	memset(&d->dst, 0, sizeof(d->dst));
+	d->src.sin_family = d->dst.sin_family = AF_INET;
+	memcpy(&d->src.sin_addr, ip + 12, 4);
+	memcpy(&d->dst.sin_addr, ip + 16, 4);
+	memcpy(&d->src.sin_port, ip + ihl, 2);
+	memcpy(&d->dst.sin_port, ip + ihl + 2, 2);
+	d->len = caplen - ihl - 8;
+	if(d->len > ntohs(CAP_get16(ip + ihl + 4)) - 8)
+		d->len = ntohs(CAP_get16(ip + ihl + 4)) - 8;
+	if(d->len > CAP_SNAPLEN)
+		d->len = CAP_SNAPLEN;
+	memcpy(d->data, ip + ihl + 8, d->len);
+	return 1;
+}
+
+int CAP_next(struct CAP_Reader *r, struct CAP_Datagram *d)
+{
+	static __thread uint8_t *block;
+	static __thread size_t size;
+	uint32_t head[2];
+	for(;;){
+		if(fread(head, sizeof(head), 1, r->f) != 1)
+			return 0;
+		if(head[1] < 12 || head[1] % 4 != 0)
+			return -1;
+		size_t len = head[1] - 8;
+		if(len > size){
+			uint8_t *grown = realloc(block, len);
+			if(!grown)
+				return -1;
+			block = grown;
+			size = len;
+		}
+		if(fread(block, len, 1, r->f) != 1)
+			return 0; // cut short, as by a crash; the rest still counts
+		len -= 4; // the trailing length
+		const uint8_t *v;
+		uint16_t vlen;
+		int ret;
+		switch(head[0]){
+		case CAP_SHB:
+			if(len < 16 || CAP_get32(block) != CAP_BOM)
+				return -1; // written with the other byte order
+			break;
+		case CAP_IDB:
+			if(len < 8 || CAP_get16(block) != CAP_LINKTYPE_IPV4)
+				return -1;
+			if((v = CAP_option(block + 8, len - 8, CAP_IF_TSRESOL, &vlen)) && vlen == 1){
+				uint64_t tick = 1000000000;
+				int i;
+				if(*v & 0x80)
+					return -1; // powers of two
+				for(i = 0; i < *v && tick > 1; ++i)
+					tick /= 10;
+				r->ns_per_tick = tick;
+			}
+			break;
+		case CAP_EPB:
+			if((ret = CAP_epb(r, block, len, d)) != 0)
+				return ret;
+			break;
+		}
+	}
+}
@@ -0,0 +1,64 @@
+#ifndef CAPTURE_H_202610200110
+#define CAPTURE_H_202610200110
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/**
+ * Datagram capture: with RDT_CAPTURE naming a file, every datagram the
+ * transport layer (xport.c) sends or receives is written there as pcapng,
+ * wrapped in IPv4 and UDP headers with the socket's real addresses, with a
+ * nanosecond timestamp and its direction, so Wireshark or tcpdump read it
+ * as is. Like the event trace, each thread copies its datagrams into a
+ * ring of its own, without locks or syscalls, and a background thread
+ * writes them out every CAP_DRAIN_MSEC; a datagram that finds its ring
+ * full is dropped from the capture (never from the network) and counted in
+ * the file's interface statistics. A forked child writes to the name plus
+ * ".<pid>".
+ *
+ * Only datagrams of up to CAP_SNAPLEN bytes are kept whole; RDT packets
+ * and GBN packets both fit.
+ **/
+#define CAP_SNAPLEN 1472
+#define CAP_RING_RECORDS 2048 // per thread, a power of two
+#define CAP_DRAIN_MSEC 5
+#define CAP_MAX_FDS (1 << 17)  // sockets whose addresses are remembered
+
+extern bool CAP_on;
+
+// Start capturing if RDT_CAPTURE is set; any number of calls
+void CAP_init(void);
+// Hooks for xport.c. to/from may be NULL for a connected socket.
+void CAP_sent(int s, const void *buf, size_t len, const struct sockaddr *to);
+void CAP_received(int s, const struct msghdr *msg, size_t len);
+void CAP_bound(int s);
+void CAP_connected(int s, const struct sockaddr *addr);
+void CAP_closed(int s);
+
+// One datagram read back from a capture
+struct CAP_Datagram
+{
+	uint64_t ns;  // since the epoch
+	bool out;     // sent by the capturing process
+	struct sockaddr_in src, dst;
+	size_t len;
+	char data[CAP_SNAPLEN];
+};
+
+struct CAP_Reader
+{
+	FILE *f;
+	uint64_t ns_per_tick; // 1 for the nanosecond stamps written here
+};
+
+// Read captures this file writes (raw IPv4 pcapng). CAP_next returns 1 with
+// the next UDP datagram, 0 at the end and -1 on a malformed file.
+int CAP_open(struct CAP_Reader *r, const char *path);
+int CAP_next(struct CAP_Reader *r, struct CAP_Datagram *d);
+void CAP_close(struct CAP_Reader *r);
+
+#endif
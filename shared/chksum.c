@@ -0,0 +1,358 @@
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "chksum.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CK_X86
+#include <immintrin.h>
+#endif
+
+// Adding 64-bit words with end-around carry keeps the one's-complement sum
+// intact (2^64 = 1 mod 0xFFFF), so wide words can be summed and folded once.
+static inline uint64_t CK_add64(uint64_t sum, uint64_t v)
+{
+	sum += v;
+	return sum + (sum < v);
+}
+
+// Fold to 16 bits and turn the native-order sum into a host-order value
+static inline uint16_t CK_fold(uint64_t sum)
+{
+	sum = (sum >> 32) + (sum & 0xFFFFFFFF);
+	sum = (sum >> 32) + (sum & 0xFFFFFFFF);
+	sum = (sum >> 16) + (sum & 0xFFFF);
+	sum = (sum >> 16) + (sum & 0xFFFF);
+	return ntohs((uint16_t)sum);
+}
+
+static uint64_t CK_sum_generic(const unsigned char *p, size_t len, uint64_t sum)
+{
+	uint64_t v;
+	for(; len >= 8; p += 8, len -= 8){
+		memcpy(&v, p, 8);
+		sum = CK_add64(sum, v);
+	}
+	if(len >= 4){
+		uint32_t w;
+		memcpy(&w, p, 4);
+		sum = CK_add64(sum, w);
+		p += 4;
+		len -= 4;
+	}
+	if(len >= 2){
+		uint16_t w;
+		memcpy(&w, p, 2);
+		sum = CK_add64(sum, w);
+		p += 2;
+		len -= 2;
+	}
+	if(len){
+		// pad the odd byte with zero, in memory order
+		uint16_t w = 0;
+		memcpy(&w, p, 1);
+		sum = CK_add64(sum, w);
+	}
+	return sum;
+}
+
+static uint16_t CK_sum_c(const void *buf, size_t len)
+{
+	return CK_fold(CK_sum_generic(buf, len, 0));
+}
+
+static uint16_t CK_copy_sum_c(void *dst, const void *src, size_t len)
+{
+	memcpy(dst, src, len);
+	return CK_fold(CK_sum_generic(dst, len, 0));
+}
+
+#ifdef CK_X86
+// Each 128-bit block is widened into 64-bit lanes holding 32-bit words, so
+// the accumulators cannot overflow for any buffer that fits in memory.
+__attribute__((target("sse2")))
+static uint64_t CK_reduce_sse2(__m128i acc, uint64_t sum)
+{
+	uint64_t lanes[2];
+	_mm_storeu_si128((__m128i *)lanes, acc);
+	sum = CK_add64(sum, lanes[0]);
+	return CK_add64(sum, lanes[1]);
+}
+
+__attribute__((target("sse2")))
+static uint16_t CK_sum_sse2(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc = zero;
+	for(; len >= 16; p += 16, len -= 16){
+		__m128i v = _mm_loadu_si128((const __m128i *)p);
+		acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+		acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+	}
+	return CK_fold(CK_sum_generic(p, len, CK_reduce_sse2(acc, 0)));
+}
+
+__attribute__((target("sse2")))
+static uint16_t CK_copy_sum_sse2(void *dst, const void *src, size_t len)
+{
+	const unsigned char *s = src;
+	unsigned char *d = dst;
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc = zero;
+	for(; len >= 16; s += 16, d += 16, len -= 16){
+		__m128i v = _mm_loadu_si128((const __m128i *)s);
+		_mm_storeu_si128((__m128i *)d, v);
+		acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+		acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+	}
+	memcpy(d, s, len);
+	return CK_fold(CK_sum_generic(d, len, CK_reduce_sse2(acc, 0)));
+}
+
+__attribute__((target("avx2")))
+static uint64_t CK_reduce_avx2(__m256i acc, uint64_t sum)
+{
+	uint64_t lanes[4];
+	int i;
+	_mm256_storeu_si256((__m256i *)lanes, acc);
+	for(i = 0; i < 4; ++i)
+		sum = CK_add64(sum, lanes[i]);
+	return sum;
+}
+
+__attribute__((target("avx2")))
+static uint16_t CK_sum_avx2(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc0 = zero, acc1 = zero;
+	for(; len >= 64; p += 64, len -= 64){
+		__m256i v0 = _mm256_loadu_si256((const __m256i *)p);
+		__m256i v1 = _mm256_loadu_si256((const __m256i *)(p + 32));
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v0, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v0, zero));
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v1, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v1, zero));
+	}
+	for(; len >= 32; p += 32, len -= 32){
+		__m256i v = _mm256_loadu_si256((const __m256i *)p);
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v, zero));
+	}
+	uint64_t sum = CK_reduce_avx2(_mm256_add_epi64(acc0, acc1), 0);
+	return CK_fold(CK_sum_generic(p, len, sum));
+}
+
+__attribute__((target("avx2")))
+static uint16_t CK_copy_sum_avx2(void *dst, const void *src, size_t len)
+{
+	const unsigned char *s = src;
+	unsigned char *d = dst;
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc = zero;
+	for(; len >= 32; s += 32, d += 32, len -= 32){
+		__m256i v = _mm256_loadu_si256((const __m256i *)s);
+		_mm256_storeu_si256((__m256i *)d, v);
+		acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(v, zero));
+		acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(v, zero));
+	}
+	memcpy(d, s, len);
+	return CK_fold(CK_sum_generic(d, len, CK_reduce_avx2(acc, 0)));
+}
+#endif
+
+struct CK_Impl
+{
+	const char *name;
+	uint16_t (*sum)(const void *buf, size_t len);
+	uint16_t (*copy_sum)(void *dst, const void *src, size_t len);
+};
+
+static const struct CK_Impl CK_impls[] = {
+#ifdef CK_X86
+	{"avx2", CK_sum_avx2, CK_copy_sum_avx2},
+	{"sse2", CK_sum_sse2, CK_copy_sum_sse2},
+#endif
+	{"generic", CK_sum_c, CK_copy_sum_c},
+};
+#define CK_NIMPLS (sizeof(CK_impls) / sizeof(CK_impls[0]))
+
+static const struct CK_Impl *CK_active = &CK_impls[CK_NIMPLS - 1];
+
+// CRC32C, reflected polynomial 0x1EDC6F41
+#define CK_CRC32C_POLY 0x82F63B78
+
+static uint32_t CK_crc_table[8][256];
+
+static void CK_crc_table_init(void)
+{
+	uint32_t i, k;
+	for(i = 0; i < 256; ++i){
+		uint32_t crc = i;
+		for(k = 0; k < 8; ++k)
+			crc = (crc >> 1) ^ (CK_CRC32C_POLY & (0 - (crc & 1)));
+		CK_crc_table[0][i] = crc;
+	}
+	for(i = 0; i < 256; ++i)
+		for(k = 1; k < 8; ++k)
+			CK_crc_table[k][i] = (CK_crc_table[k - 1][i] >> 8) ^
+				CK_crc_table[0][CK_crc_table[k - 1][i] & 0xFF];
+}
+
+// Slicing-by-8: eight table lookups per 8 bytes instead of one per byte
+static uint32_t CK_crc32c_table(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	crc = ~crc;
+	for(; len >= 8; p += 8, len -= 8){
+		uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+			(uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+		crc = CK_crc_table[7][lo & 0xFF] ^ CK_crc_table[6][(lo >> 8) & 0xFF] ^
+			CK_crc_table[5][(lo >> 16) & 0xFF] ^ CK_crc_table[4][lo >> 24] ^
+			CK_crc_table[3][p[4]] ^ CK_crc_table[2][p[5]] ^
+			CK_crc_table[1][p[6]] ^ CK_crc_table[0][p[7]];
+	}
+	while(len--)
+		crc = (crc >> 8) ^ CK_crc_table[0][(crc ^ *p++) & 0xFF];
+	return ~crc;
+}
+
+#ifdef CK_X86
+__attribute__((target("sse4.2")))
+static uint32_t CK_crc32c_sse42(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	crc = ~crc;
+#ifdef __x86_64__
+	uint64_t crc64 = crc;
+	for(; len >= 8; p += 8, len -= 8){
+		uint64_t v;
+		memcpy(&v, p, 8);
+		crc64 = _mm_crc32_u64(crc64, v);
+	}
+	crc = (uint32_t)crc64;
+#endif
+	for(; len >= 4; p += 4, len -= 4){
+		uint32_t v;
+		memcpy(&v, p, 4);
+		crc = _mm_crc32_u32(crc, v);
+	}
+	while(len--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return ~crc;
+}
+#endif
+
+struct CK_CrcImpl
+{
+	const char *name;
+	uint32_t (*crc)(uint32_t crc, const void *buf, size_t len);
+};
+
+static const struct CK_CrcImpl CK_crc_impls[] = {
+#ifdef CK_X86
+	{"sse4.2", CK_crc32c_sse42},
+#endif
+	{"table", CK_crc32c_table},
+};
+#define CK_NCRCIMPLS (sizeof(CK_crc_impls) / sizeof(CK_crc_impls[0]))
+
+static const struct CK_CrcImpl *CK_crc_active = &CK_crc_impls[CK_NCRCIMPLS - 1];
+
+static int CK_supported(const struct CK_Impl *impl)
+{
+#ifdef CK_X86
+	__builtin_cpu_init();
+	if(strcmp(impl->name, "avx2") == 0)
+		return __builtin_cpu_supports("avx2");
+	if(strcmp(impl->name, "sse2") == 0)
+		return __builtin_cpu_supports("sse2");
+#endif
+	return 1;
+}
+
+static int CK_crc_supported(const struct CK_CrcImpl *impl)
+{
+#ifdef CK_X86
+	__builtin_cpu_init();
+	if(strcmp(impl->name, "sse4.2") == 0)
+		return __builtin_cpu_supports("sse4.2");
+#endif
+	return 1;
+}
+
+// Pick the widest kernel the CPU runs before main() starts any threads
+__attribute__((constructor))
+static void CK_init(void)
+{
+	size_t i;
+	CK_crc_table_init();
+	for(i = 0; i < CK_NIMPLS; ++i){
+		if(CK_supported(&CK_impls[i])){
+			CK_active = &CK_impls[i];
+			break;
+		}
+	}
+	for(i = 0; i < CK_NCRCIMPLS; ++i){
+		if(CK_crc_supported(&CK_crc_impls[i])){
+			CK_crc_active = &CK_crc_impls[i];
+			break;
+		}
+	}
+}
+
+int CK_select(const char *name)
+{
+	size_t i;
+	for(i = 0; i < CK_NIMPLS; ++i){
+		if(strcmp(CK_impls[i].name, name) == 0 && CK_supported(&CK_impls[i])){
+			CK_active = &CK_impls[i];
+			return 0;
+		}
+	}
+	return -1;
+}
+
+const char *CK_impl(void)
+{
+	return CK_active->name;
+}
+
+uint16_t CK_sum(const void *buf, size_t len)
+{
+	return CK_active->sum(buf, len);
+}
+
+uint16_t CK_copy_sum(void *dst, const void *src, size_t len)
+{
+	return CK_active->copy_sum(dst, src, len);
+}
+
+int CK_crc_select(const char *name)
+{
+	size_t i;
+	for(i = 0; i < CK_NCRCIMPLS; ++i){
+		if(strcmp(CK_crc_impls[i].name, name) == 0 && CK_crc_supported(&CK_crc_impls[i])){
+			CK_crc_active = &CK_crc_impls[i];
+			return 0;
+		}
+	}
+	return -1;
+}
+
+const char *CK_crc_impl(void)
+{
+	return CK_crc_active->name;
+}
+
+uint32_t CK_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	return CK_crc_active->crc(crc, buf, len);
+}
+
+uint16_t CK_add(uint16_t a, uint16_t b)
+{
+	uint32_t sum = (uint32_t)a + b;
+	return (uint16_t)((sum & 0xFFFF) + (sum >> 16));
+}
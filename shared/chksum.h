@@ -0,0 +1,44 @@
+#ifndef CHKSUM_H_202610191430
+#define CHKSUM_H_202610191430
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Internet (RFC 1071) one's-complement sums.
+ * Words are taken in network byte order and the result is in host order, so
+ * CK_sum() of a buffer equals adding up ntohs() of each of its 16-bit words
+ * with end-around carry. An odd trailing byte is padded with a zero byte.
+ * The kernel is picked once at startup: AVX2 or SSE2 where the CPU has them,
+ * a portable 64-bit loop otherwise.
+ **/
+
+// Folded one's-complement sum of len bytes (not complemented)
+uint16_t CK_sum(const void *buf, size_t len);
+
+// Copy len bytes from src to dst and return CK_sum() of them, in one pass
+uint16_t CK_copy_sum(void *dst, const void *src, size_t len);
+
+// One's-complement add two partial sums. The first part must cover an even
+// number of bytes for the result to equal the sum of the concatenation.
+uint16_t CK_add(uint16_t a, uint16_t b);
+
+// Name of the kernel in use ("avx2", "sse2" or "generic")
+const char *CK_impl(void);
+
+// Force a kernel by name, for benchmarks and testing. Returns -1 if the
+// name is unknown or the CPU lacks the instructions.
+int CK_select(const char *name);
+
+/**
+ * CRC32C (Castagnoli), as used by iSCSI and SCTP. Pass 0 to start and the
+ * previous result to continue over more data, like zlib's crc32(). Runs on
+ * the SSE4.2 crc32 instruction when present, slicing-by-8 tables otherwise.
+ **/
+uint32_t CK_crc32c(uint32_t crc, const void *buf, size_t len);
+
+// Name of the CRC32C kernel in use ("sse4.2" or "table")
+const char *CK_crc_impl(void);
+int CK_crc_select(const char *name);
+
+#endif
@@ -0,0 +1,187 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "drain.h"
+
+// Every started set, for the exit and fork handlers
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_once_t once;
+	struct DRN_Set *sets;
+} DRN_all = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_ONCE_INIT};
+
+// Called at thread exit with the thread's ring
+static void DRN_detach(void *arg)
+{
+	struct DRN_Ring *r = arg;
+	__atomic_store_n(&r->exited, true, __ATOMIC_RELEASE);
+}
+
+struct DRN_Ring *DRN_attach(struct DRN_Set *set)
+{
+	struct DRN_Ring *r = calloc(1, sizeof(*r));
+	if(!r || SPSC_init(&r->ring, set->records, set->record_size) != 0){
+		free(r);
+		return NULL;
+	}
+	pthread_mutex_lock(&set->lock);
+	r->thread = ++set->threads;
+	r->next = set->rings;
+	set->rings = r;
+	pthread_mutex_unlock(&set->lock);
+	pthread_setspecific(set->key, r);
+	return r;
+}
+
+// Write out everything recorded so far and free the rings of exited
+// threads. Lock held.
+static void DRN_drain(struct DRN_Set *set)
+{
+	struct DRN_Ring **link, *r;
+	// read before popping, so a ring is only freed once truly empty
+	for(r = set->rings; r; r = r->next)
+		r->gone = __atomic_load_n(&r->exited, __ATOMIC_ACQUIRE);
+	if(set->drain())
+		fflush(set->out);
+	link = &set->rings;
+	while(*link){
+		r = *link;
+		if(r->gone){
+			*link = r->next;
+			SPSC_destroy(&r->ring);
+			free(r);
+		} else {
+			link = &r->next;
+		}
+	}
+}
+
+static void *DRN_drainer(void *arg)
+{
+	struct DRN_Set *set = arg;
+	struct timespec pause = {set->drain_msec / 1000, set->drain_msec % 1000 * 1000000L};
+	for(;;){
+		nanosleep(&pause, NULL);
+		pthread_mutex_lock(&set->lock);
+		if(set->stopping){
+			pthread_mutex_unlock(&set->lock);
+			return NULL;
+		}
+		DRN_drain(set);
+		pthread_mutex_unlock(&set->lock);
+	}
+}
+
+// Start a file and the thread draining into it
+static bool DRN_open(struct DRN_Set *set, const char *path)
+{
+	pthread_t tid;
+	if((set->out = fopen(path, "wb")) == NULL)
+		return false;
+	set->begin();
+	fflush(set->out);
+	if(pthread_create(&tid, NULL, DRN_drainer, set) != 0){
+		fclose(set->out);
+		set->out = NULL;
+		return false;
+	}
+	pthread_detach(tid);
+	return true;
+}
+
+static void DRN_finish(void)
+{
+	struct DRN_Set *set;
+	pthread_mutex_lock(&DRN_all.lock);
+	for(set = DRN_all.sets; set; set = set->next_set){
+		pthread_mutex_lock(&set->lock);
+		if(set->out){
+			DRN_drain(set);
+			set->end();
+			fclose(set->out);
+			set->out = NULL;
+		}
+		set->stopping = true;
+		pthread_mutex_unlock(&set->lock);
+	}
+	pthread_mutex_unlock(&DRN_all.lock);
+}
+
+static void DRN_prepare(void)
+{
+	struct DRN_Set *set;
+	pthread_mutex_lock(&DRN_all.lock);
+	for(set = DRN_all.sets; set; set = set->next_set)
+		pthread_mutex_lock(&set->lock);
+}
+
+static void DRN_parent(void)
+{
+	struct DRN_Set *set;
+	for(set = DRN_all.sets; set; set = set->next_set)
+		pthread_mutex_unlock(&set->lock);
+	pthread_mutex_unlock(&DRN_all.lock);
+}
+
+static void DRN_child(void)
+{
+	struct DRN_Set *set;
+	for(set = DRN_all.sets; set; set = set->next_set){
+		struct DRN_Ring *mine = pthread_getspecific(set->key), *r, *next;
+		for(r = set->rings; r; r = next){
+			next = r->next;
+			if(r != mine){
+				SPSC_destroy(&r->ring);
+				free(r);
+			}
+		}
+		set->rings = mine;
+		if(mine){
+			mine->next = NULL;
+			while(SPSC_try_read_slot(&mine->ring))
+				SPSC_read_release(&mine->ring);
+			mine->reported = mine->dropped;
+		}
+		if(set->forked)
+			set->forked();
+		char path[sizeof(set->path) + 16];
+		snprintf(path, sizeof(path), "%s.%d", set->path, (int)getpid());
+		if(set->out)
+			fclose(set->out); // drained and flushed before the lock was let go
+		set->out = NULL;
+		if(!set->stopping && !DRN_open(set, path))
+			*set->on = false;
+		pthread_mutex_unlock(&set->lock);
+	}
+	pthread_mutex_unlock(&DRN_all.lock);
+}
+
+static void DRN_register(void)
+{
+	atexit(DRN_finish);
+	pthread_atfork(DRN_prepare, DRN_parent, DRN_child);
+}
+
+bool DRN_start(struct DRN_Set *set, const char *path)
+{
+	snprintf(set->path, sizeof(set->path), "%s", path);
+	if(pthread_key_create(&set->key, DRN_detach) != 0)
+		return false;
+	if(!DRN_open(set, set->path)){
+		pthread_key_delete(set->key);
+		return false;
+	}
+	pthread_once(&DRN_all.once, DRN_register);
+	pthread_mutex_lock(&DRN_all.lock);
+	set->next_set = DRN_all.sets;
+	DRN_all.sets = set;
+	pthread_mutex_unlock(&DRN_all.lock);
+	return true;
+}
@@ -0,0 +1,64 @@
+#ifndef DRAIN_H_202610200230
+#define DRAIN_H_202610200230
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "spsc.h"
+
+/**
+ * Per-thread rings drained to a file, the machinery shared by the event
+ * trace and the datagram capture. A thread gets a ring of its own the first
+ * time it records, and only it pushes while only the drainer pops, so
+ * recording takes no locks and makes no syscalls. Every drain_msec a
+ * background thread takes the set's lock and has the owner's drain callback
+ * write out what the rings hold; rings of threads that exited are freed
+ * once drained. At exit the rings are drained a last time and the file is
+ * finished. A forked child, where only the forking thread came along, drops
+ * what the rings hold (it is the parent's to write) and starts a file of
+ * its own at the path plus ".<pid>".
+ **/
+struct DRN_Ring
+{
+	struct SPSC_Ring ring;
+	struct DRN_Ring *next;
+	uint64_t dropped;  // records that found the ring full, by the owner
+	uint64_t reported; // of those, written out already, by the drain callback
+	uint16_t thread;   // from 1, in order of first use
+	bool exited;       // the owner is gone; freed once drained
+	bool gone;         // exited as of the start of this drain
+};
+
+struct DRN_Set
+{
+	// Filled in by the owner. The callbacks run with the lock held and
+	// write to out; drain returns whether it wrote anything.
+	size_t records;     // per ring, a power of two
+	size_t record_size;
+	unsigned drain_msec;
+	bool *on;           // cleared if a child cannot start its file
+	void (*begin)(void);
+	bool (*drain)(void);
+	void (*end)(void);
+	void (*forked)(void); // optional, for counters of the parent's
+
+	// The lock covers the list of rings and the file
+	pthread_mutex_t lock;
+	pthread_key_t key;
+	struct DRN_Ring *rings;
+	uint16_t threads;
+	FILE *out;
+	bool stopping;
+	struct DRN_Set *next_set;
+	char path[1024];
+};
+
+// Open path, start draining into it and finish it at exit. Returns false,
+// with nothing started, if that fails.
+bool DRN_start(struct DRN_Set *set, const char *path);
+// The calling thread's new ring, or NULL; the caller keeps it for reuse
+struct DRN_Ring *DRN_attach(struct DRN_Set *set);
+
+#endif
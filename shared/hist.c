@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "hist.h"
+
+static int HST_bucket(uint64_t value)
+{
+	if(value > UINT32_MAX)
+		value = UINT32_MAX;
+	if(value < 2 * HST_SUB)
+		return value;
+	int shift = (31 - __builtin_clz((uint32_t)value)) - HST_SUB_BITS;
+	return (shift + 1) * HST_SUB + (int)(value >> shift) - HST_SUB;
+}
+
+uint64_t HST_lower(int bucket)
+{
+	if(bucket < 2 * HST_SUB)
+		return bucket;
+	int shift = bucket / HST_SUB - 1;
+	return (uint64_t)(HST_SUB + bucket % HST_SUB) << shift;
+}
+
+uint64_t HST_upper(int bucket)
+{
+	if(bucket < 2 * HST_SUB)
+		return bucket;
+	return HST_lower(bucket) + ((uint64_t)1 << (bucket / HST_SUB - 1)) - 1;
+}
+
+void HST_record(struct HST_Hist *h, uint64_t value)
+{
+	h->buckets[HST_bucket(value)]++;
+	h->count++;
+	h->sum += value;
+	if(value > h->max)
+		h->max = value;
+}
+
+void HST_merge(struct HST_Hist *into, const struct HST_Hist *from)
+{
+	int i;
+	for(i = 0; i < HST_BUCKETS; ++i)
+		into->buckets[i] += from->buckets[i];
+	into->count += from->count;
+	into->sum += from->sum;
+	if(from->max > into->max)
+		into->max = from->max;
+}
+
+void HST_mergeAtomic(struct HST_Hist *into, const struct HST_Hist *from)
+{
+	int i;
+	for(i = 0; i < HST_BUCKETS; ++i){
+		if(from->buckets[i])
+			__atomic_add_fetch(&into->buckets[i], from->buckets[i], __ATOMIC_RELAXED);
+	}
+	__atomic_add_fetch(&into->count, from->count, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&into->sum, from->sum, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&into->max, __ATOMIC_RELAXED);
+	while(from->max > max && !__atomic_compare_exchange_n(&into->max, &max, from->max,
+			true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+// Highest value of a bucket, but no more than the largest value seen; the
+// last bucket also holds everything past its range
+static uint64_t HST_value(const struct HST_Hist *h, int bucket)
+{
+	if(bucket == HST_BUCKETS - 1 || HST_upper(bucket) > h->max)
+		return h->max;
+	return HST_upper(bucket);
+}
+
+static uint64_t HST_valueAtRank(const struct HST_Hist *h, uint64_t rank)
+{
+	uint64_t seen = 0;
+	int i;
+	for(i = 0; i < HST_BUCKETS; ++i){
+		seen += h->buckets[i];
+		if(seen >= rank)
+			return HST_value(h, i);
+	}
+	return h->max;
+}
+
+uint64_t HST_percentile(const struct HST_Hist *h, double p)
+{
+	if(h->count == 0)
+		return 0;
+	uint64_t rank = (uint64_t)(p / 100 * h->count + 0.5);
+	return HST_valueAtRank(h, rank < 1 ? 1 : rank);
+}
+
+void HST_print(FILE *out, const struct HST_Hist *h, double scale)
+{
+	fprintf(out, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount",
+		"1/(1-Percentile)");
+	uint64_t seen = 0;
+	int i;
+	for(i = 0; i < HST_BUCKETS && seen < h->count; ++i){
+		if(h->buckets[i] == 0)
+			continue;
+		seen += h->buckets[i];
+		double q = (double)seen / h->count;
+		uint64_t value = HST_value(h, i);
+		if(seen < h->count)
+			fprintf(out, "%12.3f %14.12f %10llu %14.2f\n", value / scale, q,
+				(unsigned long long)seen, 1 / (1 - q));
+		else
+			fprintf(out, "%12.3f %14.12f %10llu\n", value / scale, q,
+				(unsigned long long)seen);
+	}
+	// the deviation can only be had from bucket midpoints
+	double mean = h->count ? (double)h->sum / h->count : 0, var = 0;
+	for(i = 0; i < HST_BUCKETS && h->count; ++i){
+		double d = (HST_lower(i) + HST_upper(i)) / 2.0 - mean;
+		var += h->buckets[i] * d * d / h->count;
+	}
+	fprintf(out, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean / scale,
+		sqrt(var) / scale);
+	fprintf(out, "#[Max     = %12.3f, Total count    = %12llu]\n", h->max / scale,
+		(unsigned long long)h->count);
+	fprintf(out, "#[Buckets = %12d, SubBuckets     = %12d]\n", HST_BUCKETS, HST_SUB);
+}
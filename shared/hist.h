@@ -0,0 +1,45 @@
+#ifndef HIST_H_202610200040
+#define HIST_H_202610200040
+
+#include <stdio.h>
+#include <stdint.h>
+
+// 8 sub-buckets per power of two: values up to 15 are exact, larger ones
+// land in a bucket at most 12.5% wide. Values past UINT32_MAX go in the
+// last bucket; max keeps the true value.
+#define HST_SUB_BITS 3
+#define HST_SUB (1 << HST_SUB_BITS)
+#define HST_BUCKETS ((33 - HST_SUB_BITS) * HST_SUB)
+
+/**
+ * Log-bucketed latency histogram in the style of HdrHistogram, in fixed
+ * memory (about 1 KB). Recording is a few shifts and an increment, with no
+ * allocation and no lock; each histogram has a single writer. Histograms
+ * with the same layout merge by adding their buckets, so one of a whole
+ * process is the sum of its pipes'.
+ **/
+struct HST_Hist
+{
+	uint64_t count;
+	uint64_t sum; // of the recorded values, for the mean
+	uint64_t max;
+	uint32_t buckets[HST_BUCKETS];
+};
+
+void HST_record(struct HST_Hist *h, uint64_t value);
+void HST_merge(struct HST_Hist *into, const struct HST_Hist *from);
+// Same, for a histogram that other threads merge into at the same time
+void HST_mergeAtomic(struct HST_Hist *into, const struct HST_Hist *from);
+
+// Smallest and largest value a bucket holds
+uint64_t HST_lower(int bucket);
+uint64_t HST_upper(int bucket);
+// Value at or below which p percent of the samples fall, to the bucket's
+// precision; 0 for an empty histogram
+uint64_t HST_percentile(const struct HST_Hist *h, double p);
+
+// Export in HdrHistogram's percentile distribution text format, values
+// divided by scale (1000 turns usec into msec), as its plotters read it
+void HST_print(FILE *out, const struct HST_Hist *h, double scale);
+
+#endif
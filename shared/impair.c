@@ -0,0 +1,416 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+
+#include "pool.h"
+#include "impair.h"
+#include "xport.h"
+
+// A datagram waiting on the delay line
+struct IMP_Pending
+{
+	uint64_t due;  // usec, XP_now_usec()
+	uint64_t order; // FIFO among datagrams due at the same time
+	struct IMP_Link *link;
+	int fd;
+	int flags;
+	struct sockaddr_storage to;
+	socklen_t tolen;
+	size_t len;
+	char *data;
+};
+
+// One delay line serves every link: a min-heap on due time drained by a
+// thread that starts with the first delayed datagram
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_once_t once;
+	bool running;
+	uint64_t order;
+	struct IMP_Pending *heap;
+	size_t len, cap;
+} IMP_line = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_ONCE_INIT};
+
+// The transport's clock, so delays and rates follow a virtual one
+static uint64_t IMP_now(void)
+{
+	return XP_now_usec();
+}
+
+// splitmix64: small, fast and good enough for drawing impairments
+static uint64_t IMP_next(struct IMP_Link *link)
+{
+	uint64_t z = (link->rng += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+// Uniform in [0, 1)
+static double IMP_uniform(struct IMP_Link *link)
+{
+	return (IMP_next(link) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static bool IMP_chance(struct IMP_Link *link, double p)
+{
+	return p > 0 && IMP_uniform(link) < p;
+}
+
+static bool IMP_lost(struct IMP_Link *link)
+{
+	struct IMP_Config *cfg = &link->cfg;
+	if(cfg->ge_p <= 0)
+		return IMP_chance(link, cfg->loss);
+	if(link->ge_bad){
+		if(IMP_chance(link, cfg->ge_r))
+			link->ge_bad = false;
+	} else if(IMP_chance(link, cfg->ge_p)){
+		link->ge_bad = true;
+	}
+	return IMP_chance(link, link->ge_bad ? cfg->ge_loss_bad : cfg->ge_loss_good);
+}
+
+static bool IMP_before(const struct IMP_Pending *a, const struct IMP_Pending *b)
+{
+	return a->due < b->due || (a->due == b->due && a->order < b->order);
+}
+
+static void IMP_swap(struct IMP_Pending *a, struct IMP_Pending *b)
+{
+	struct IMP_Pending t = *a;
+	*a = *b;
+	*b = t;
+}
+
+static void IMP_siftDown(size_t i)
+{
+	struct IMP_Pending *h = IMP_line.heap;
+	while(true){
+		size_t l = 2 * i + 1, r = l + 1, m = i;
+		if(l < IMP_line.len && IMP_before(&h[l], &h[m]))
+			m = l;
+		if(r < IMP_line.len && IMP_before(&h[r], &h[m]))
+			m = r;
+		if(m == i)
+			return;
+		IMP_swap(&h[i], &h[m]);
+		i = m;
+	}
+}
+
+static void IMP_heapPop(void)
+{
+	IMP_line.heap[0] = IMP_line.heap[--IMP_line.len];
+	IMP_siftDown(0);
+}
+
+static void *IMP_lineThread(void *arg)
+{
+	pthread_mutex_lock(&IMP_line.lock);
+	while(true){
+		if(IMP_line.len == 0){
+			pthread_cond_wait(&IMP_line.wake, &IMP_line.lock);
+			continue;
+		}
+		struct IMP_Pending p = IMP_line.heap[0];
+		uint64_t now = IMP_now();
+		if(p.due > now){
+			struct timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			uint64_t ns = ts.tv_nsec + (p.due - now) * 1000;
+			ts.tv_sec += ns / 1000000000;
+			ts.tv_nsec = ns % 1000000000;
+			pthread_cond_timedwait(&IMP_line.wake, &IMP_line.lock, &ts);
+			continue;
+		}
+		IMP_heapPop();
+		// still counted as queued while it is sent, so the link's later
+		// datagrams cannot overtake it
+		pthread_mutex_unlock(&IMP_line.lock);
+		XP_sendto(p.fd, p.data, p.len, p.flags,
+			p.tolen ? (struct sockaddr *)&p.to : NULL, p.tolen);
+		POOL_free(p.data);
+		pthread_mutex_lock(&IMP_line.lock);
+		p.link->queued--;
+	}
+	return NULL;
+}
+
+static void IMP_lineStart(void)
+{
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_destroy(&IMP_line.wake);
+	pthread_cond_init(&IMP_line.wake, &attr);
+	pthread_condattr_destroy(&attr);
+
+	pthread_t thread;
+	if(pthread_create(&thread, NULL, IMP_lineThread, NULL) == 0){
+		pthread_detach(thread);
+		IMP_line.running = true;
+	}
+}
+
+// Queue a copy of the datagram to go out at due. Called with the line locked.
+static int IMP_enqueue(struct IMP_Link *link, uint64_t due, int fd, const void *buf,
+	size_t len, int flags, const struct sockaddr *to, socklen_t tolen)
+{
+	if(IMP_line.len == IMP_line.cap){
+		size_t cap = IMP_line.cap ? IMP_line.cap * 2 : 64;
+		struct IMP_Pending *heap = realloc(IMP_line.heap, cap * sizeof(*heap));
+		if(!heap)
+			return -1;
+		IMP_line.heap = heap;
+		IMP_line.cap = cap;
+	}
+	struct IMP_Pending *p = &IMP_line.heap[IMP_line.len];
+	if((p->data = POOL_alloc(len)) == NULL)
+		return -1;
+	memcpy(p->data, buf, len);
+	p->due = due;
+	p->order = IMP_line.order++;
+	p->link = link;
+	p->fd = fd;
+	p->flags = flags;
+	p->len = len;
+	p->tolen = to ? tolen : 0;
+	if(to)
+		memcpy(&p->to, to, tolen);
+
+	// sift up
+	size_t i = IMP_line.len++;
+	while(i > 0 && IMP_before(&IMP_line.heap[i], &IMP_line.heap[(i - 1) / 2])){
+		IMP_swap(&IMP_line.heap[i], &IMP_line.heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	link->queued++;
+	if(i == 0)
+		pthread_cond_signal(&IMP_line.wake);
+	return 0;
+}
+
+// Send now if nothing of this link is still waiting, otherwise line up behind it.
+// On a virtual clock the transport holds the datagram instead: a delay line
+// running on real time would neither see the clock nor let it move.
+static void IMP_emit(struct IMP_Link *link, uint64_t due, uint64_t now, int fd,
+	const void *buf, size_t len, int flags, const struct sockaddr *to, socklen_t tolen)
+{
+	if(XP_virtual()){
+		if(due > now && XP_sendto_at(fd, buf, len, flags, to, to ? tolen : 0, due) >= 0){
+			pthread_mutex_lock(&link->lock);
+			link->stats.delayed++;
+			pthread_mutex_unlock(&link->lock);
+			return;
+		}
+		XP_sendto(fd, buf, len, flags, to, to ? tolen : 0);
+		return;
+	}
+	pthread_mutex_lock(&IMP_line.lock);
+	if(due <= now && link->queued == 0){
+		pthread_mutex_unlock(&IMP_line.lock);
+		XP_sendto(fd, buf, len, flags, to, to ? tolen : 0);
+		return;
+	}
+	pthread_once(&IMP_line.once, IMP_lineStart);
+	if(!IMP_line.running || IMP_enqueue(link, due, fd, buf, len, flags, to, tolen) != 0){
+		// no delay line: degrade to sending right away
+		pthread_mutex_unlock(&IMP_line.lock);
+		XP_sendto(fd, buf, len, flags, to, to ? tolen : 0);
+		return;
+	}
+	link->stats.delayed++;
+	pthread_mutex_unlock(&IMP_line.lock);
+}
+
+ssize_t IMP_sendto(struct IMP_Link *link, int fd, const void *buf, size_t len,
+	int flags, const struct sockaddr *to, socklen_t tolen)
+{
+	struct IMP_Config *cfg = &link->cfg;
+	pthread_mutex_lock(&link->lock);
+	link->stats.sent++;
+
+	if(IMP_lost(link)){
+		link->stats.dropped++;
+		pthread_mutex_unlock(&link->lock);
+		return len;
+	}
+
+	// Decide everything up front so the draws do not depend on timing
+	bool corrupt = len > 0 && IMP_chance(link, cfg->corrupt);
+	size_t bit = corrupt ? IMP_next(link) % (len * 8) : 0;
+	bool dup = IMP_chance(link, cfg->duplicate);
+	bool reorder = IMP_chance(link, cfg->reorder);
+	int64_t delay = cfg->delay_usec;
+	if(cfg->jitter_usec)
+		delay += (int64_t)(IMP_next(link) % (2 * (uint64_t)cfg->jitter_usec + 1)) -
+			cfg->jitter_usec;
+	if(reorder)
+		delay += cfg->reorder_usec;
+	if(delay < 0)
+		delay = 0;
+
+	uint64_t now = IMP_now();
+	uint64_t depart = now;
+	if(cfg->rate_bps){
+		// the datagram leaves once the link has finished the previous ones
+		depart = link->next_free > now ? link->next_free : now;
+		link->next_free = depart + (uint64_t)len * 8 * 1000000 / cfg->rate_bps;
+		depart = link->next_free;
+	}
+	uint64_t due = depart + delay;
+
+	link->stats.corrupted += corrupt;
+	link->stats.duplicated += dup;
+	link->stats.reordered += reorder;
+	pthread_mutex_unlock(&link->lock);
+
+	const void *out = buf;
+	char *copy = NULL;
+	if(corrupt){
+		if((copy = POOL_alloc(len)) != NULL){
+			memcpy(copy, buf, len);
+			copy[bit / 8] ^= 1 << (bit % 8);
+			out = copy;
+		}
+	}
+	IMP_emit(link, due, now, fd, out, len, flags, to, tolen);
+	if(dup)
+		IMP_emit(link, due, now, fd, buf, len, flags, to, tolen);
+	POOL_free(copy);
+	return len;
+}
+
+int IMP_init(struct IMP_Link *link, const struct IMP_Config *cfg)
+{
+	memset(link, 0, sizeof(*link));
+	link->cfg = *cfg;
+	link->rng = cfg->seed;
+	return pthread_mutex_init(&link->lock, NULL) == 0 ? 0 : -1;
+}
+
+void IMP_salt(struct IMP_Link *link, uint64_t salt)
+{
+	pthread_mutex_lock(&link->lock);
+	link->rng = link->cfg.seed ^ salt << 32;
+	pthread_mutex_unlock(&link->lock);
+}
+
+// Wait for the link's queued datagrams to leave. Called with the line locked.
+static void IMP_waitIdle(struct IMP_Link *link)
+{
+	while(link->queued > 0){
+		pthread_mutex_unlock(&IMP_line.lock);
+		struct timespec ts = {0, 100000};
+		nanosleep(&ts, NULL);
+		pthread_mutex_lock(&IMP_line.lock);
+	}
+}
+
+void IMP_drain(struct IMP_Link *link)
+{
+	pthread_mutex_lock(&IMP_line.lock);
+	IMP_waitIdle(link);
+	pthread_mutex_unlock(&IMP_line.lock);
+}
+
+void IMP_destroy(struct IMP_Link *link)
+{
+	size_t i;
+	pthread_mutex_lock(&IMP_line.lock);
+	for(i = 0; i < IMP_line.len; ){
+		if(IMP_line.heap[i].link == link){
+			POOL_free(IMP_line.heap[i].data);
+			IMP_line.heap[i] = IMP_line.heap[--IMP_line.len];
+			link->queued--;
+		} else {
+			++i;
+		}
+	}
+	// rebuild the heap over what is left
+	for(i = IMP_line.len / 2; i-- > 0; )
+		IMP_siftDown(i);
+	// one of ours may be in flight on the line thread
+	IMP_waitIdle(link);
+	pthread_mutex_unlock(&IMP_line.lock);
+	pthread_mutex_destroy(&link->lock);
+}
+
+static int IMP_number(const char *val, double *out)
+{
+	char *end;
+	errno = 0;
+	*out = strtod(val, &end);
+	if(errno || end == val)
+		return -1;
+	switch(*end){
+	case 'k': case 'K': *out *= 1e3; ++end; break;
+	case 'm': case 'M': *out *= 1e6; ++end; break;
+	case 'g': case 'G': *out *= 1e9; ++end; break;
+	}
+	return *end == '\0' ? 0 : -1;
+}
+
+int IMP_parse(const char *spec, struct IMP_Config *cfg)
+{
+	char buf[512];
+	char *save = NULL, *tok;
+	if(!spec || strlen(spec) >= sizeof(buf))
+		return spec ? -1 : 0;
+	strcpy(buf, spec);
+
+	for(tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)){
+		char *val = strchr(tok, '=');
+		double v;
+		if(!val)
+			return -1;
+		*val++ = '\0';
+		if(strcasecmp(tok, "ge") == 0){
+			// p:r[:loss_good:loss_bad]
+			double ge[4] = {0, 0, 0, 1};
+			int n = 0;
+			char *save2 = NULL, *part;
+			for(part = strtok_r(val, ":", &save2); part && n < 4;
+					part = strtok_r(NULL, ":", &save2))
+				if(IMP_number(part, &ge[n++]) != 0)
+					return -1;
+			if(n < 2)
+				return -1;
+			cfg->ge_p = ge[0];
+			cfg->ge_r = ge[1];
+			cfg->ge_loss_good = ge[2];
+			cfg->ge_loss_bad = ge[3];
+			continue;
+		}
+		if(IMP_number(val, &v) != 0 || v < 0)
+			return -1;
+		if(strcasecmp(tok, "seed") == 0)
+			cfg->seed = (uint64_t)v;
+		else if(strcasecmp(tok, "loss") == 0)
+			cfg->loss = v;
+		else if(strcasecmp(tok, "corrupt") == 0)
+			cfg->corrupt = v;
+		else if(strcasecmp(tok, "dup") == 0)
+			cfg->duplicate = v;
+		else if(strcasecmp(tok, "reorder") == 0)
+			cfg->reorder = v;
+		else if(strcasecmp(tok, "reorder_usec") == 0)
+			cfg->reorder_usec = (uint32_t)v;
+		else if(strcasecmp(tok, "delay") == 0)
+			cfg->delay_usec = (uint32_t)v;
+		else if(strcasecmp(tok, "jitter") == 0)
+			cfg->jitter_usec = (uint32_t)v;
+		else if(strcasecmp(tok, "rate") == 0)
+			cfg->rate_bps = (uint64_t)v;
+		else
+			return -1;
+	}
+	return 0;
+}
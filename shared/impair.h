@@ -0,0 +1,76 @@
+#ifndef IMPAIR_H_202610191700
+#define IMPAIR_H_202610191700
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/**
+ * Network impairment models applied to outgoing datagrams. Every decision
+ * comes from the link's own seeded generator, so a run can be repeated
+ * exactly. Probabilities are in [0, 1], times in microseconds.
+ **/
+struct IMP_Config
+{
+	uint64_t seed;
+
+	// Loss: Bernoulli with probability loss, or, when ge_p > 0, a
+	// Gilbert-Elliott chain that moves good->bad with ge_p and bad->good with
+	// ge_r, losing ge_loss_good / ge_loss_bad of the packets in each state
+	double loss;
+	double ge_p, ge_r;
+	double ge_loss_good, ge_loss_bad;
+
+	double corrupt;   // flip one random bit of the datagram
+	double duplicate; // send a second copy
+	double reorder;   // hold the datagram back reorder_usec so later ones pass it
+	uint32_t reorder_usec;
+
+	uint32_t delay_usec;  // one-way delay added to every datagram
+	uint32_t jitter_usec; // uniform +/- variation of the delay
+	uint64_t rate_bps;    // bandwidth cap in bits per second, 0 for none
+};
+
+struct IMP_Stats
+{
+	uint64_t sent, dropped, corrupted, duplicated, reordered, delayed;
+};
+
+struct IMP_Link
+{
+	struct IMP_Config cfg;
+	pthread_mutex_t lock;
+	uint64_t rng;      // from cfg.seed, see IMP_salt
+	bool ge_bad;       // Gilbert-Elliott state
+	uint64_t next_free; // when the capped link finishes its current datagram
+	unsigned queued;   // datagrams of this link waiting on the delay line
+	struct IMP_Stats stats;
+};
+
+// Parse "key=value,..." (seed, loss, ge=p:r[:good:bad], corrupt, dup, reorder,
+// reorder_usec, delay, jitter, rate with optional k/m/g suffix) on top of cfg.
+// Returns -1 on an unknown key or malformed value.
+int IMP_parse(const char *spec, struct IMP_Config *cfg);
+
+int IMP_init(struct IMP_Link *link, const struct IMP_Config *cfg);
+// Reseed the link from its seed mixed with salt, so links sharing a config,
+// like the two ends of a connection, draw differently. The salt must not
+// depend on the run (ports do), or the run cannot be repeated. Call before
+// the link's first send.
+void IMP_salt(struct IMP_Link *link, uint64_t salt);
+// Drops any of the link's datagrams still waiting on the delay line
+void IMP_destroy(struct IMP_Link *link);
+// Blocks until the link's delayed datagrams have all been sent
+void IMP_drain(struct IMP_Link *link);
+
+// sendto() through the link's impairments. Lost datagrams still report
+// success, like a real network would; delayed ones are sent later by a
+// background delay line, or held by the transport when its clock is virtual
+// (XP_sendto_at). A NULL to sends on a connected socket.
+ssize_t IMP_sendto(struct IMP_Link *link, int fd, const void *buf, size_t len,
+	int flags, const struct sockaddr *to, socklen_t tolen);
+
+#endif
@@ -0,0 +1,232 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "metrics.h"
+
+static struct MET_Segment *MET_seg = NULL;
+static size_t MET_len;
+static char MET_shmName[64];
+
+static void MET_unlink(void)
+{
+	shm_unlink(MET_shmName);
+}
+
+static int MET_create(void)
+{
+	snprintf(MET_shmName, sizeof(MET_shmName), MET_NAME, (int)getpid());
+	int fd = shm_open(MET_shmName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd >= 0 && ftruncate(fd, MET_len) != 0){
+		close(fd);
+		shm_unlink(MET_shmName);
+		return -1;
+	}
+	return fd;
+}
+
+// A forked child would otherwise write its pipes into its parent's segment.
+// It gets a segment of its own, a copy of the parent's mapped at the same
+// address, so pointers into it stay good.
+static void MET_forked(void)
+{
+	size_t used = sizeof(*MET_seg) + (size_t)MET_seg->high_water * sizeof(struct MET_Pipe);
+	int fd = MET_create();
+	if(fd < 0 || write(fd, MET_seg, used) != (ssize_t)used ||
+			mmap(MET_seg, MET_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0)
+				== MAP_FAILED){
+		// the parent's view will show our pipes too; better than no counters
+		if(fd >= 0){
+			close(fd);
+			shm_unlink(MET_shmName);
+		}
+		return;
+	}
+	close(fd);
+	MET_seg->pid = getpid();
+}
+
+// The segment as a shared memory object, NULL if that cannot be had. Its
+// pages come from tmpfs as slots are touched, so the size is mostly virtual.
+static struct MET_Segment *MET_share(void)
+{
+	int fd = MET_create();
+	if(fd < 0)
+		return NULL;
+	void *mem = mmap(NULL, MET_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(mem == MAP_FAILED){
+		shm_unlink(MET_shmName);
+		return NULL;
+	}
+	atexit(MET_unlink);
+	pthread_atfork(NULL, NULL, MET_forked);
+	return mem;
+}
+
+int MET_open(uint32_t max_pipes)
+{
+	if(MET_seg)
+		return 0;
+	MET_len = sizeof(struct MET_Segment) + (size_t)max_pipes * sizeof(struct MET_Pipe);
+	struct MET_Segment *seg = NULL;
+	if(getenv("RDT_METRICS"))
+		seg = MET_share();
+	if(!seg && (seg = calloc(1, MET_len)) == NULL)
+		return -1;
+	seg->version = MET_VERSION;
+	seg->pipe_size = sizeof(struct MET_Pipe);
+	seg->max_pipes = max_pipes;
+	seg->pid = getpid();
+	seg->start_sec = time(NULL);
+	// readers check the magic last
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(seg->magic, MET_MAGIC, sizeof(seg->magic));
+	MET_seg = seg;
+	return 0;
+}
+
+struct RDT_Stats *MET_stats(int slot)
+{
+	return &MET_seg->pipes[slot].stats;
+}
+
+struct HST_Hist *MET_rtt(int slot)
+{
+	return &MET_seg->pipes[slot].rtt;
+}
+
+struct HST_Hist *MET_delivery(int slot)
+{
+	return &MET_seg->pipes[slot].delivery;
+}
+
+// Sequence lock around changes to a slot; only its pipe's owner writes it
+static void MET_writeBegin(struct MET_Pipe *p)
+{
+	__atomic_store_n(&p->seq, p->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void MET_writeEnd(struct MET_Pipe *p)
+{
+	__atomic_store_n(&p->seq, p->seq + 1, __ATOMIC_RELEASE);
+}
+
+void MET_pipeOpen(int slot, enum RDT_Protocol protocol)
+{
+	struct MET_Pipe *p = &MET_seg->pipes[slot];
+	MET_writeBegin(p);
+	p->state = MET_OPEN;
+	p->protocol = protocol;
+	p->local_port = p->remote_port = 0;
+	p->local_addr = p->remote_addr = 0;
+	memset(&p->stats, 0, sizeof(p->stats));
+	memset(&p->rtt, 0, sizeof(p->rtt));
+	memset(&p->delivery, 0, sizeof(p->delivery));
+	MET_writeEnd(p);
+	if((uint32_t)slot >= MET_seg->high_water)
+		__atomic_store_n(&MET_seg->high_water, slot + 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&MET_seg->proc.pipes_opened, 1, __ATOMIC_RELAXED);
+}
+
+void MET_pipeState(int slot, enum MET_State state, const struct sockaddr_in *local)
+{
+	struct MET_Pipe *p = &MET_seg->pipes[slot];
+	MET_writeBegin(p);
+	p->state = state;
+	if(local){
+		p->local_addr = local->sin_addr.s_addr;
+		p->local_port = ntohs(local->sin_port);
+	}
+	MET_writeEnd(p);
+}
+
+void MET_pipeConnected(int slot, const struct sockaddr_in *remote, bool accepted)
+{
+	struct MET_Pipe *p = &MET_seg->pipes[slot];
+	MET_writeBegin(p);
+	p->state = MET_CONNECTED;
+	p->remote_addr = remote->sin_addr.s_addr;
+	p->remote_port = ntohs(remote->sin_port);
+	MET_writeEnd(p);
+	__atomic_add_fetch(accepted ? &MET_seg->proc.accepts : &MET_seg->proc.connects, 1,
+		__ATOMIC_RELAXED);
+}
+
+#define MET_FOLD(f) __atomic_add_fetch(&closed->f, p->stats.f, __ATOMIC_RELAXED)
+
+void MET_pipeClose(int slot)
+{
+	struct MET_Pipe *p = &MET_seg->pipes[slot];
+	struct RDT_Stats *closed = &MET_seg->proc.closed;
+	MET_FOLD(bytes_sent);
+	MET_FOLD(bytes_received);
+	MET_FOLD(packets_sent);
+	MET_FOLD(packets_received);
+	MET_FOLD(retransmits);
+	MET_FOLD(timeouts);
+	MET_FOLD(duplicates);
+	MET_FOLD(checksum_failures);
+	HST_mergeAtomic(&MET_seg->proc.closed_rtt, &p->rtt);
+	HST_mergeAtomic(&MET_seg->proc.closed_delivery, &p->delivery);
+	MET_writeBegin(p);
+	p->state = MET_FREE;
+	MET_writeEnd(p);
+	__atomic_add_fetch(&MET_seg->proc.pipes_closed, 1, __ATOMIC_RELAXED);
+}
+
+const struct MET_Segment *MET_attach(pid_t pid, size_t *len)
+{
+	char name[64];
+	struct stat st;
+	snprintf(name, sizeof(name), MET_NAME, (int)pid);
+	int fd = shm_open(name, O_RDONLY, 0);
+	if(fd < 0)
+		return NULL;
+	void *mem = MAP_FAILED;
+	if(fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct MET_Segment))
+		mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(mem == MAP_FAILED)
+		return NULL;
+	const struct MET_Segment *seg = mem;
+	*len = st.st_size;
+	if(memcmp(seg->magic, MET_MAGIC, sizeof(seg->magic)) != 0 ||
+			seg->version != MET_VERSION || seg->pipe_size != sizeof(struct MET_Pipe) ||
+			sizeof(*seg) + (size_t)seg->max_pipes * seg->pipe_size > *len){
+		munmap(mem, *len);
+		return NULL;
+	}
+	return seg;
+}
+
+void MET_detach(const struct MET_Segment *seg, size_t len)
+{
+	munmap((void *)seg, len);
+}
+
+bool MET_readPipe(const struct MET_Segment *seg, uint32_t slot, struct MET_Pipe *out)
+{
+	const struct MET_Pipe *p = &seg->pipes[slot];
+	int tries;
+	for(tries = 0; tries < 100; ++tries){
+		uint32_t seq = __atomic_load_n(&p->seq, __ATOMIC_ACQUIRE);
+		if(seq & 1)
+			continue;
+		memcpy(out, p, sizeof(*out));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&p->seq, __ATOMIC_RELAXED) == seq)
+			return true;
+	}
+	return false;
+}
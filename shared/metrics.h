@@ -0,0 +1,91 @@
+#ifndef METRICS_H_202610192300
+#define METRICS_H_202610192300
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "sock.h"
+#include "hist.h"
+
+/**
+ * Metrics segment: the counters of every pipe and of the process, laid out
+ * so that other processes can read them. With RDT_METRICS set in the
+ * environment the segment is the shared memory object named by MET_NAME
+ * (see rdtstat); otherwise it is private memory with the same layout.
+ *
+ * A pipe's RDT_Stats and latency histograms live in its slot and are bumped
+ * in place by whichever thread is driving the pipe, so publishing them costs
+ * the data path no syscalls and no locks. The fields naming a slot (state,
+ * protocol, addresses) only change on socket, connect, accept and close,
+ * under the slot's sequence lock; a reader retries a copy that overlapped a
+ * change.
+ **/
+#define MET_MAGIC "RDTMET1"
+#define MET_VERSION 2
+#define MET_NAME "/rdt-metrics.%d" // of the writer's pid
+
+enum MET_State {
+	MET_FREE,
+	MET_OPEN,
+	MET_LISTENING,
+	MET_CONNECTED
+};
+
+struct MET_Pipe
+{
+	uint32_t seq;         // odd while the fields below change
+	uint8_t state;        // enum MET_State
+	uint8_t protocol;     // enum RDT_Protocol
+	uint16_t local_port, remote_port;
+	uint32_t local_addr, remote_addr; // network order
+	struct RDT_Stats stats;
+	struct HST_Hist rtt;      // ACK RTT samples, usec
+	struct HST_Hist delivery; // RDT_send call to the ACK of its last packet, usec
+};
+
+struct MET_Process
+{
+	uint64_t pipes_opened, pipes_closed;
+	uint64_t connects, accepts;
+	// Counters and histograms of the pipes closed so far, so process totals
+	// never go back
+	struct RDT_Stats closed;
+	struct HST_Hist closed_rtt, closed_delivery;
+};
+
+struct MET_Segment
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t pipe_size;   // sizeof(struct MET_Pipe), checked by readers
+	uint32_t max_pipes;
+	uint32_t high_water;  // slots used so far; readers scan below it
+	int32_t pid;
+	uint32_t reserved;
+	uint64_t start_sec;   // wall clock at creation
+	struct MET_Process proc;
+	struct MET_Pipe pipes[];
+};
+
+// Writer side, used by sock.c. MET_open makes the segment once, for slots
+// 0 to max_pipes - 1; it only fails if not even private memory is left.
+int MET_open(uint32_t max_pipes);
+struct RDT_Stats *MET_stats(int slot);
+struct HST_Hist *MET_rtt(int slot);
+struct HST_Hist *MET_delivery(int slot);
+void MET_pipeOpen(int slot, enum RDT_Protocol protocol);
+void MET_pipeState(int slot, enum MET_State state, const struct sockaddr_in *local);
+// Also counts the process's connects, or accepts
+void MET_pipeConnected(int slot, const struct sockaddr_in *remote, bool accepted);
+void MET_pipeClose(int slot);
+
+// Reader side, used by rdtstat. MET_attach maps pid's segment read-only.
+const struct MET_Segment *MET_attach(pid_t pid, size_t *len);
+void MET_detach(const struct MET_Segment *seg, size_t len);
+// Consistent copy of a slot; false if it kept changing
+bool MET_readPipe(const struct MET_Segment *seg, uint32_t slot, struct MET_Pipe *out);
+
+#endif
@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+#define POOL_CLASSES 9 // 64, 128, ... 16384
+#define POOL_HUGE 0xFF // class of buffers that bypassed the pool
+
+struct POOL_Cache;
+
+// Sits in front of every buffer. The long double member makes its size a
+// multiple of _Alignof(long double) (32 bytes on x86-64), so the buffer
+// after it keeps malloc's alignment.
+union POOL_Header
+{
+	struct
+	{
+		union POOL_Header *next;  // free list link while cached
+		struct POOL_Cache *owner; // cache it goes back to, NULL for malloc
+		uint8_t cls;
+	} h;
+	long double align;
+};
+
+struct POOL_Cache
+{
+	union POOL_Header *free[POOL_CLASSES];
+	unsigned count[POOL_CLASSES];
+	// Buffers other threads released, pushed without locks and taken all at
+	// once by the owner when its own list of a class runs dry
+	union POOL_Header *remote;
+	struct POOL_Cache *next_retired;
+};
+
+static __thread struct POOL_Cache *POOL_cache;
+static pthread_key_t POOL_key;
+static pthread_once_t POOL_once = PTHREAD_ONCE_INIT;
+
+// Caches of finished threads. Buffers still out keep pointing at them, so
+// they are never freed but handed to the next new thread instead.
+static struct POOL_Cache *POOL_retired;
+static pthread_mutex_t POOL_retiredLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Keep a released buffer in the owner's list of its class, or hand it back
+// to malloc once that list is full
+static void POOL_keep(struct POOL_Cache *cache, union POOL_Header *hdr)
+{
+	int c = hdr->h.cls;
+	if(cache->count[c] >= POOL_CACHE_LIMIT){
+		free(hdr);
+		return;
+	}
+	hdr->h.next = cache->free[c];
+	cache->free[c] = hdr;
+	++cache->count[c];
+}
+
+// Move what other threads released into the owner's lists
+static void POOL_collect(struct POOL_Cache *cache)
+{
+	union POOL_Header *hdr = __atomic_exchange_n(&cache->remote, NULL, __ATOMIC_ACQUIRE);
+	while(hdr){
+		union POOL_Header *next = hdr->h.next;
+		POOL_keep(cache, hdr);
+		hdr = next;
+	}
+}
+
+// Give a finished thread's cached buffers back to malloc and retire its cache
+static void POOL_release(void *arg)
+{
+	struct POOL_Cache *cache = arg;
+	int c;
+	POOL_collect(cache);
+	for(c = 0; c < POOL_CLASSES; ++c){
+		while(cache->free[c]){
+			union POOL_Header *hdr = cache->free[c];
+			cache->free[c] = hdr->h.next;
+			free(hdr);
+		}
+		cache->count[c] = 0;
+	}
+	pthread_mutex_lock(&POOL_retiredLock);
+	cache->next_retired = POOL_retired;
+	POOL_retired = cache;
+	pthread_mutex_unlock(&POOL_retiredLock);
+}
+
+static void POOL_keyInit(void)
+{
+	pthread_key_create(&POOL_key, POOL_release);
+}
+
+static struct POOL_Cache *POOL_threadCache(void)
+{
+	if(!POOL_cache){
+		pthread_once(&POOL_once, POOL_keyInit);
+		pthread_mutex_lock(&POOL_retiredLock);
+		if((POOL_cache = POOL_retired) != NULL)
+			POOL_retired = POOL_cache->next_retired;
+		pthread_mutex_unlock(&POOL_retiredLock);
+		if(!POOL_cache)
+			POOL_cache = calloc(1, sizeof(*POOL_cache));
+		if(POOL_cache)
+			pthread_setspecific(POOL_key, POOL_cache);
+	}
+	return POOL_cache;
+}
+
+static int POOL_class(size_t size)
+{
+	int c = 0;
+	size_t cap = POOL_MIN_SIZE;
+	while(cap < size){
+		cap <<= 1;
+		++c;
+	}
+	return c;
+}
+
+void *POOL_alloc(size_t size)
+{
+	union POOL_Header *hdr;
+	if(size > POOL_MAX_SIZE){
+		hdr = malloc(sizeof(*hdr) + size);
+		if(!hdr)
+			return NULL;
+		hdr->h.owner = NULL;
+		hdr->h.cls = POOL_HUGE;
+		return hdr + 1;
+	}
+
+	int c = POOL_class(size);
+	struct POOL_Cache *cache = POOL_threadCache();
+	if(cache && !cache->free[c] && __atomic_load_n(&cache->remote, __ATOMIC_RELAXED))
+		POOL_collect(cache);
+	if(cache && cache->free[c]){
+		hdr = cache->free[c];
+		cache->free[c] = hdr->h.next;
+		--cache->count[c];
+	} else {
+		hdr = malloc(sizeof(*hdr) + ((size_t)POOL_MIN_SIZE << c));
+		if(!hdr)
+			return NULL;
+		hdr->h.cls = c;
+	}
+	hdr->h.owner = cache;
+	return hdr + 1;
+}
+
+void POOL_free(void *buf)
+{
+	if(!buf)
+		return;
+	union POOL_Header *hdr = (union POOL_Header *)buf - 1;
+	struct POOL_Cache *owner = hdr->h.owner;
+	if(!owner){
+		free(hdr);
+		return;
+	}
+	if(owner == POOL_cache){
+		POOL_keep(owner, hdr);
+		return;
+	}
+	// another thread's buffer: back onto its remote list
+	union POOL_Header *head = __atomic_load_n(&owner->remote, __ATOMIC_RELAXED);
+	do
+		hdr->h.next = head;
+	while(!__atomic_compare_exchange_n(&owner->remote, &head, hdr, true,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
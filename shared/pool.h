@@ -0,0 +1,31 @@
+#ifndef POOL_H_202610191620
+#define POOL_H_202610191620
+
+#include <stddef.h>
+
+/**
+ * Size-classed buffer pool for packets and per-packet bookkeeping.
+ * Each thread keeps its own free lists, so allocation and release take no
+ * locks. A buffer released by another thread than the one that allocated it
+ * goes back to the allocating thread, through a list it collects when its own
+ * run dry, so producer/consumer pairs recycle their buffers too. Requests
+ * larger than the biggest class, and buffers beyond a class's cache limit, go
+ * to malloc/free. A thread's cached buffers are returned to malloc when it
+ * exits, and its cache goes to the next thread started.
+ *
+ * Users: the SPSC rings of the send pipeline (spsc.c), the datagrams held
+ * by the impairment delay line (impair.c) and those in flight in the
+ * simulator (simnet.c). The RDT and GBN packet paths keep their packets in
+ * per-connection rings and allocate nothing per packet.
+ **/
+
+// Smallest and largest size classes; classes double in between
+#define POOL_MIN_SIZE 64
+#define POOL_MAX_SIZE 16384
+// Free buffers a thread keeps per class before handing them back to free()
+#define POOL_CACHE_LIMIT 64
+
+void *POOL_alloc(size_t size);
+void POOL_free(void *buf);
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef PROBE_H_202610200010
+#define PROBE_H_202610200010
+
+/**
+ * USDT probes for perf, bpftrace and SystemTap, all under the provider
+ * "rdt", e.g.
+ *
+ *   bpftrace -e 'usdt:./send:rdt:retransmit { printf("%d %d\n", arg0, arg1); }'
+ *
+ * A probe site is a single nop plus an ELF note naming it and saying where
+ * its arguments are; it costs nothing beyond having the arguments at hand
+ * until a tracer attaches. sys/sdt.h is used where it is installed. Without
+ * it the same notes are emitted here on x86-64 and AArch64, with every
+ * argument widened to a signed 64-bit value; elsewhere probes compile away.
+ *
+ * Arguments start with the RDT pipe index (GBN: socket fd), then sequence
+ * numbers and lengths; see the PROBE uses in sock.c and s_gbn3.c.
+ **/
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define PROBE_SDT_H
+#endif
+#endif
+
+#if defined(PROBE_SDT_H)
+
+#include <sys/sdt.h>
+#define PROBE1(name, a1) DTRACE_PROBE1(rdt, name, a1)
+#define PROBE2(name, a1, a2) DTRACE_PROBE2(rdt, name, a1, a2)
+#define PROBE3(name, a1, a2, a3) DTRACE_PROBE3(rdt, name, a1, a2, a3)
+#define PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(rdt, name, a1, a2, a3, a4)
+
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__aarch64__))
+
+// The note layout of sys/sdt.h (version 3), with no semaphore
+#define PROBE_NOTE(name, args) \
+	"990: nop\n" \
+	".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+	".balign 4\n" \
+	".4byte 992f-991f, 994f-993f, 3\n" \
+	"991: .asciz \"stapsdt\"\n" \
+	"992: .balign 4\n" \
+	"993: .8byte 990b\n" \
+	".8byte _.stapsdt.base\n" \
+	".8byte 0\n" \
+	".asciz \"rdt\"\n" \
+	".asciz \"" #name "\"\n" \
+	".asciz \"" args "\"\n" \
+	"994: .balign 4\n" \
+	".popsection\n" \
+	".ifndef _.stapsdt.base\n" \
+	".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+	".weak _.stapsdt.base\n" \
+	".hidden _.stapsdt.base\n" \
+	"_.stapsdt.base: .space 1\n" \
+	".size _.stapsdt.base, 1\n" \
+	".popsection\n" \
+	".endif\n"
+
+#define PROBE_ARG(n, x) [a##n] "nor" ((long long)(x))
+
+#define PROBE1(name, a1) \
+	__asm__ __volatile__(PROBE_NOTE(name, "-8@%[a1]") :: PROBE_ARG(1, a1))
+#define PROBE2(name, a1, a2) \
+	__asm__ __volatile__(PROBE_NOTE(name, "-8@%[a1] -8@%[a2]") \
+		:: PROBE_ARG(1, a1), PROBE_ARG(2, a2))
+#define PROBE3(name, a1, a2, a3) \
+	__asm__ __volatile__(PROBE_NOTE(name, "-8@%[a1] -8@%[a2] -8@%[a3]") \
+		:: PROBE_ARG(1, a1), PROBE_ARG(2, a2), PROBE_ARG(3, a3))
+#define PROBE4(name, a1, a2, a3, a4) \
+	__asm__ __volatile__(PROBE_NOTE(name, "-8@%[a1] -8@%[a2] -8@%[a3] -8@%[a4]") \
+		:: PROBE_ARG(1, a1), PROBE_ARG(2, a2), PROBE_ARG(3, a3), PROBE_ARG(4, a4))
+
+#else
+
+#define PROBE1(name, a1) do{ (void)(a1); }while(0)
+#define PROBE2(name, a1, a2) do{ (void)(a1); (void)(a2); }while(0)
+#define PROBE3(name, a1, a2, a3) do{ (void)(a1); (void)(a2); (void)(a3); }while(0)
+#define PROBE4(name, a1, a2, a3, a4) \
+	do{ (void)(a1); (void)(a2); (void)(a3); (void)(a4); }while(0)
+
+#endif
+
+#endif
@@ -11,7 +11,7 @@
 #include<sys/types.h>
 #include<sys/socket.h>
 #include<sys/ioctl.h>
-#include<signal.h>
+#include<poll.h>
 #include<unistd.h>
 #include<fcntl.h>
 #include<stdio.h>
@@ -28,11 +28,14 @@ extern int h_errno;
 extern int errno;
 
 /*----- Protocol parameters -----*/
-#define LOSS_PRO 1e-2    /* loss probability                            */
-#define CORR_PRO 1e-3    /* corruption probability                      */
+#define LOSS_PRO 1e-2    /* default loss probability, see gbn_setimpair  */
+#define CORR_PRO 1e-3    /* default corruption probability              */
 #define DATALEN   1024    /* length of the payload                       */
-#define N          256    /* Max number of packets a single call to gbn_send can process */
-#define TIMEOUT      1    /* timeout to resend packets (1 second)        */
+#define N          256    /* packets per chunk the sender hands to gbn_send */
+#define GBN_WINDOW  64    /* default number of packets in flight         */
+#define GBN_MAX_WINDOW (1u << 16) /* largest window gbn_setwindow accepts */
+#define TIMEOUT      1    /* timeout to resend SYN packets (1 second)    */
+#define ACK_TIMEOUT 250000 /* usec to wait for DATAACK/FINACK packets    */
 
 /*----- Packet types -----*/
 #define SYN      0        /* Opens a connection                          */
@@ -46,15 +49,35 @@ extern int errno;
 /*----- Go-Back-n packet format -----*/
 typedef struct {
 	uint8_t  type;            /* packet type (e.g. SYN, DATA, ACK, FIN)     */
-	uint8_t  seqnum;          /* sequence number of the packet              */
+	uint32_t seqnum;          /* sequence number of the packet              */
     uint16_t checksum;        /* header and payload checksum                */
     uint8_t data[DATALEN];    /* pointer to the payload                     */
 } __attribute__((packed)) gbnhdr;
 
+#define GBN_HDRLEN 7              /* type, seqnum and checksum on the wire   */
+
+/* an un-ACK'd packet kept for retransmission */
+struct gbn_slot {
+    int len;
+    uint8_t data[DATALEN];
+};
+
+/* per-connection control block, one per socket */
 typedef struct state_t{
+	int used;                 /* set once gbn_socket created this socket    */
 	int state;
-    uint8_t ex_seqnum;
-    uint8_t winsize;
+    uint32_t ex_seqnum;       /* seqnum expected to receive                 */
+    uint32_t window;          /* packets gbn_send keeps in flight           */
+    uint32_t snd_base;        /* oldest un-ACK'd seqnum                     */
+    uint32_t snd_next;        /* next seqnum to send                        */
+    struct gbn_slot* sndbuf;  /* in-flight packets, indexed seqnum % sndcap */
+    uint32_t sndcap;          /* power of two, so the index survives wrap   */
+    int attempts;             /* consecutive timeouts of snd_base           */
+    struct timespec deadline; /* retransmission deadline of snd_base        */
+    uint8_t rcvbuf[DATALEN];  /* tail of a packet gbn_recv could not fit    */
+    int rcv_off, rcv_len;
+    long timeout;             /* usec to wait for an ACK before resending   */
+    struct IMP_Link* impair;  /* network impairments under maybe_sendto     */
     struct sockaddr addr;
     socklen_t len;
 } state_t;
@@ -68,13 +91,17 @@ enum {
 	FIN_RCVD
 };
 
-extern state_t s;
+state_t* gbn_state(int sockfd);   /* control block of a socket, NULL if none */
 
 void gbn_init();
 int gbn_connect(int sockfd, const struct sockaddr *server, socklen_t socklen);
 int gbn_listen(int sockfd, int backlog);
 int gbn_bind(int sockfd, const struct sockaddr *server, socklen_t socklen);
 int gbn_socket(int domain, int type, int protocol);
+int gbn_setwindow(int sockfd, uint32_t window);
+/* impairments of maybe_sendto as "key=value,..." (see impair.h) on top of  */
+/* LOSS_PRO/CORR_PRO; new sockets take the GBN_IMPAIR environment variable  */
+int gbn_setimpair(int sockfd, const char* spec);
 int gbn_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
 int gbn_close(int sockfd);
 ssize_t gbn_send(int sockfd, const void *buf, size_t len, int flags);
@@ -85,7 +112,13 @@ ssize_t  maybe_sendto(int  s, const void *buf, size_t len, int flags, \
 
 uint16_t checksum(uint16_t *buf, int nwords);
 
-int timed_recvfrom(int sockfd, void* buffer, size_t blen,
-                 int flag, struct sockaddr* addr, socklen_t* socklen);
+/*----- Per-packet kernels, public for the microbenchmarks -----*/
+uint16_t checksum2(gbnhdr *hdr, int data_len);
+void init_header(gbnhdr* hdr, int type, uint32_t seq, const char* buf, int len);
+void serialize_gbnhdr(char* buffer, gbnhdr* hdr, int len);
+void deserialize_gbnhdr(char* buffer, gbnhdr* hdr, int data_len);
+
+int timed_recvfrom(int sockfd, void* buffer, size_t blen, int flag,
+                   struct sockaddr* addr, socklen_t* socklen, long timeout);
 
 #endif /* GBN_H_ */
@@ -8,21 +8,73 @@
 
 #include "s_gbn.h"
 #include "s_helper.h"
-#include <signal.h>
+#include "chksum.h"
+#include "pool.h"
+#include "impair.h"
+#include "xport.h"
+#include "trace.h"
+#include "probe.h"
 #include <stdio.h>
 #include <string.h>
-#include <sys/time.h>
+#include <time.h>
+#include <pthread.h>
+
+/* per-connection control blocks, looked up by socket fd in pages of   */
+/* GBN_PAGE_SIZE so lookups never race with the table growing          */
+#define GBN_PAGE_SIZE  256
+#define GBN_MAX_PAGES 4096
+static state_t* gbn_pages[GBN_MAX_PAGES];
+static pthread_mutex_t gbn_pages_lock = PTHREAD_MUTEX_INITIALIZER;
+
+state_t* gbn_state(int sockfd){
+    if (sockfd < 0 || sockfd / GBN_PAGE_SIZE >= GBN_MAX_PAGES)
+        return NULL;
+    state_t* page = __atomic_load_n(&gbn_pages[sockfd / GBN_PAGE_SIZE], __ATOMIC_ACQUIRE);
+    if (page == NULL || !page[sockfd % GBN_PAGE_SIZE].used)
+        return NULL;
+    return &page[sockfd % GBN_PAGE_SIZE];
+}
 
+/* reset (and if needed allocate) the control block for a new socket */
+static state_t* gbn_state_create(int sockfd){
+    if (sockfd < 0 || sockfd / GBN_PAGE_SIZE >= GBN_MAX_PAGES)
+        return NULL;
+    pthread_mutex_lock(&gbn_pages_lock);
+    state_t* page = gbn_pages[sockfd / GBN_PAGE_SIZE];
+    if (page == NULL){
+        page = calloc(GBN_PAGE_SIZE, sizeof(state_t));
+        __atomic_store_n(&gbn_pages[sockfd / GBN_PAGE_SIZE], page, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&gbn_pages_lock);
+    if (page == NULL)
+        return NULL;
+    state_t* s = &page[sockfd % GBN_PAGE_SIZE];
+    /* an fd reused without gbn_close may still own a send buffer */
+    free(s->sndbuf);
+    if (s->impair != NULL){
+        IMP_destroy(s->impair);
+        free(s->impair);
+    }
+    memset(s, 0, sizeof(state_t));
+    s->used = 1;
+    return s;
+}
 
-state_t s;
+/* every state change goes through here so the trace sees it */
+static void set_state(int sockfd, state_t* s, int state){
+    TRC_EVENT(TRC_STATE, GOBACKN, sockfd, state, s->state);
+    s->state = state;
+}
 
  /* serialize from header format to buffer format */
-static void serialize_gbnhdr(char* buffer, gbnhdr* hdr, int len){
+void serialize_gbnhdr(char* buffer, gbnhdr* hdr, int len){
     char* ptr;
     /* idx maintains buffer index */
     int i = 0, idx = 0, num = 0;
+    uint32_t seq = htonl(hdr->seqnum);
     buffer[idx++] = hdr->type;
-    buffer[idx++] = hdr->seqnum;
+    memcpy(buffer + idx, &seq, sizeof(seq));
+    idx += sizeof(seq);
 
            /* No guarantee will use same arch, convert to network byte order */
     num = htons(hdr->checksum);
@@ -36,38 +88,30 @@ static void serialize_gbnhdr(char* buffer, gbnhdr* hdr, int len){
     }
 }
 
+/* one's complement sum of the type word and the two seqnum words */
+static uint16_t hdr_sum(gbnhdr *hdr)
+{
+    uint16_t sum = CK_add((uint16_t)hdr->type << 8, (uint16_t)(hdr->seqnum >> 16));
+    return CK_add(sum, (uint16_t)hdr->seqnum);
+}
+
        /* modified checksum previous one was no good, too many collisions */
-uint16_t checksum2(gbnhdr *hdr)
+/* covers the header words and the first data_len payload bytes; the rest */
+/* of the payload is zero and adds nothing to the sum                     */
+uint16_t checksum2(gbnhdr *hdr, int data_len)
 {
-    int nwords = (sizeof(hdr->type) + sizeof(hdr->seqnum) + sizeof(hdr->data))/sizeof(uint16_t);
-    uint16_t buf_array[nwords];
-    buf_array[0] = (uint16_t)hdr->seqnum + ((uint16_t)hdr->type << 8);
-    int bIndex = 1;
-    for (; bIndex <= sizeof(hdr->data); bIndex++){
-        int wIndex = (bIndex + 1) / 2;
-        if (bIndex % 2 == 1){
-            buf_array[wIndex] = hdr->data[bIndex-1];
-        } else {
-            buf_array[wIndex] = buf_array[wIndex] << 8;
-            buf_array[wIndex] += hdr -> data[bIndex - 1];
-        }
-    }
-    
-    uint16_t *buf = buf_array;
-    uint32_t sum;
-    for (sum = 0; nwords > 0; nwords--)
-        sum += *buf++;
-    sum = (sum >> 16) + (sum & 0xffff);
-    sum += (sum >> 16);
-    return ~sum;
+    return ~CK_add(hdr_sum(hdr), CK_sum(hdr->data, data_len));
 }
 
 /* deserialize from buffer format to header format */
-static void deserialize_gbnhdr(char* buffer, gbnhdr* hdr, int data_len){
+void deserialize_gbnhdr(char* buffer, gbnhdr* hdr, int data_len){
     char* ptr;
     int i = 0, idx = 0;
+    uint32_t seq;
     hdr->type = buffer[idx++];
-    hdr->seqnum = buffer[idx++];
+    memcpy(&seq, buffer + idx, sizeof(seq));
+    hdr->seqnum = ntohl(seq);
+    idx += sizeof(seq);
     
  /* No guarantee will use same arch, convert to host byte order */
     ptr = (char*)&(hdr->checksum);
@@ -95,10 +139,10 @@ uint16_t checksum(uint16_t *buf, int nwords)
 }
 
 /* test checksum to see if header checksum is correct */
-static int test_checksum(gbnhdr* hdr){
+static int test_checksum(gbnhdr* hdr, int data_len){
     int ret_checksum = hdr->checksum;
     hdr->checksum = 0;
-    int cal_checksum = checksum2(hdr);
+    int cal_checksum = checksum2(hdr, data_len);
     DBG_PRINT("Checksum: Original %d, Calculated %d", ret_checksum, cal_checksum);
     if (ret_checksum != cal_checksum){
         DBG_ERROR("Checksum mismatch! %d, %d", ret_checksum, cal_checksum);
@@ -107,44 +151,91 @@ static int test_checksum(gbnhdr* hdr){
     return 0;
 }
 
-/* set checksum in header packet */
-static void set_checksum(gbnhdr* hdr){
-    int ret_checksum;
-                    /* checksum field is set to 0 when calculating */
-    hdr->checksum = 0;
-    ret_checksum = checksum2(hdr);
-    hdr->checksum = ret_checksum;
+/* transport clock: monotonic on sockets, virtual under the simulator */
+static void gbn_clock(struct timespec* ts){
+    uint64_t now = XP_now_usec();
+    ts->tv_sec = now / 1000000;
+    ts->tv_nsec = (now % 1000000) * 1000;
 }
 
-                     /* ignore alarm signal and handler */
-static void ARLMHNDR(int sig){
-    signal(SIGALRM, SIG_IGN);          /* ignore this signal       */
-    signal(SIGALRM, ARLMHNDR);
+/* absolute deadline timeout usec from now */
+static void deadline_after(struct timespec* dl, long timeout){
+    gbn_clock(dl);
+    dl->tv_sec += timeout / 1000000;
+    dl->tv_nsec += (timeout % 1000000) * 1000;
+    if (dl->tv_nsec >= 1000000000){
+        dl->tv_sec++;
+        dl->tv_nsec -= 1000000000;
+    }
+}
+
+/* time left until the deadline, zero once it passed */
+static struct timespec time_left(const struct timespec* dl){
+    struct timespec now, left = {0, 0};
+    gbn_clock(&now);
+    if (now.tv_sec > dl->tv_sec ||
+        (now.tv_sec == dl->tv_sec && now.tv_nsec >= dl->tv_nsec))
+        return left;
+    left.tv_sec = dl->tv_sec - now.tv_sec;
+    left.tv_nsec = dl->tv_nsec - now.tv_nsec;
+    if (left.tv_nsec < 0){
+        left.tv_sec--;
+        left.tv_nsec += 1000000000;
+    }
+    return left;
+}
+
+/* recvfrom that gives up after timeout usec (0 blocks forever, a negative */
+/* timeout only takes what is already queued)                              */
+/* the deadline belongs to this call only, so connections never share it  */
+int timed_recvfrom(int sockfd, void* buffer, size_t blen, int flag,
+                   struct sockaddr* addr, socklen_t* socklen, long timeout){
+    struct timespec dl;
+    if (timeout < 0)
+        flag |= MSG_DONTWAIT;
+    if (timeout > 0){
+        deadline_after(&dl, timeout);
+        for (;;){
+            struct timespec left = time_left(&dl);
+            int ready = XP_poll(sockfd, left.tv_sec * 1000000L + left.tv_nsec / 1000);
+            if (ready > 0)
+                break;
+            if (ready == 0){
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            if (errno != EINTR)
+                return -1;
+        }
+    }
+    return XP_recvfrom(sockfd, buffer, blen, flag, addr, socklen);
 }
 
 /* initialize header packets using this function  */
 
-static void init_header(gbnhdr* hdr, int type, int seq, const char* buf, int len){
-    memset(hdr, 0, sizeof(gbnhdr));
+/* the payload is summed while it is copied in, the unused tail is zeroed */
+void init_header(gbnhdr* hdr, int type, uint32_t seq, const char* buf, int len){
+    uint16_t sum = 0;
     hdr->type = type;
     hdr->seqnum = seq;
-    hdr->checksum = 0;
     if (buf == NULL){
-        memset(hdr->data, 0, DATALEN);
+        len = 0;
     }
     else{
-        memcpy(hdr->data, buf, len);
+        sum = CK_copy_sum(hdr->data, buf, len);
     }
-    set_checksum(hdr);
+    memset(hdr->data + len, 0, DATALEN - len);
+    hdr->checksum = ~CK_add(hdr_sum(hdr), sum);
 }
 
 /* sends header over to the server using the original sendto() function */
 static int sendto_hdr(int sockfd, gbnhdr* hdr, int hdr_len){
     int count = 0;
+    state_t* s = gbn_state(sockfd);
     char buffer[hdr_len];
     memset(buffer, 0, hdr_len);
     serialize_gbnhdr(buffer, hdr, hdr_len);
-    if ((count = sendto(sockfd, buffer, hdr_len, 0, &s.addr, s.len)) != hdr_len){
+    if ((count = XP_sendto(sockfd, buffer, hdr_len, 0, &s->addr, s->len)) != hdr_len){
         DBG_ERROR("Size of sent %d is different than expected %d.", count, hdr_len);
         return -1;
     }
@@ -154,10 +245,11 @@ static int sendto_hdr(int sockfd, gbnhdr* hdr, int hdr_len){
 /* sends header over to server using a fake sendto() function for packet losses*/
 static int sendto_maybe_hdr(int sockfd, gbnhdr* hdr, int hdr_len){
     int count = 0;
+    state_t* s = gbn_state(sockfd);
     char buffer[hdr_len];
     memset(buffer, 0, hdr_len);
     serialize_gbnhdr(buffer, hdr, hdr_len);
-    if ((count = maybe_sendto(sockfd, buffer, hdr_len, 0, &s.addr, s.len)) != hdr_len){
+    if ((count = maybe_sendto(sockfd, buffer, hdr_len, 0, &s->addr, s->len)) != hdr_len){
         DBG_ERROR("Size of sent %d is different than expected %d.", count, hdr_len);
         return -1;
     }
@@ -167,23 +259,26 @@ static int sendto_maybe_hdr(int sockfd, gbnhdr* hdr, int hdr_len){
 
 /* receives header using the recfrom() function */
 
-static int recvfrom_hdr(int sockfd, gbnhdr* hdr, int type, int seq,
-                        struct sockaddr* addr, socklen_t* len, int timed){
+/* timeout is in usec, 0 waits forever, negative never waits */
+static int recvfrom_hdr(int sockfd, gbnhdr* hdr, int type, uint32_t seq,
+                        struct sockaddr* addr, socklen_t* len, long timeout){
     int count = 0;
     char buffer[sizeof(gbnhdr)];
     memset(hdr, 0, sizeof(gbnhdr));
     /* if the given addr is NULL don't receive a struct */
     if (addr == NULL){
-        count = recvfrom(sockfd, buffer, sizeof(gbnhdr), 0, NULL, NULL);
+        count = timed_recvfrom(sockfd, buffer, sizeof(gbnhdr), 0, NULL, NULL, timeout);
     }
     else{
-        count = recvfrom(sockfd, buffer, sizeof(gbnhdr), 0, addr, len);
+        count = timed_recvfrom(sockfd, buffer, sizeof(gbnhdr), 0, addr, len, timeout);
     }
     
  if (count < 1){
-        /* alarm clock was fired */
+        /* deadline passed */
         if (count == -1){
-            DBG_ERROR("Operation timed out.");
+            /* an empty socket is the normal outcome of a poll */
+            if (timeout >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                DBG_ERROR("Operation timed out.");
             return -1;
         }
         else{
@@ -193,8 +288,8 @@ static int recvfrom_hdr(int sockfd, gbnhdr* hdr, int type, int seq,
     }
     /* deserialize and check checksum first, type second and sequence third */
     /* different return codes will signify different failure symptoms for callee */
-    deserialize_gbnhdr(buffer, hdr, count - 4);
-    if (test_checksum(hdr) != 0){
+    deserialize_gbnhdr(buffer, hdr, count - GBN_HDRLEN);
+    if (test_checksum(hdr, count - GBN_HDRLEN) != 0){
         return -4;
     }
     if (hdr->type != type){
@@ -202,184 +297,272 @@ static int recvfrom_hdr(int sockfd, gbnhdr* hdr, int type, int seq,
         return -2;
     }
     if (hdr->seqnum != seq){
-        DBG_ERROR("Return the wrong seqnum %d than expected %d.", hdr->seqnum, seq);
+        DBG_ERROR("Return the wrong seqnum %u than expected %u.", hdr->seqnum, seq);
         return -3;
     }
     return count;
 }
 
-/* use packet to represent one 1024 bytes of data */
-struct packet {
-    char* start_addr;
-    int length;
-};
+/* signed distance from sequence number b to a, valid across wrap-around */
+static int32_t seq_diff(uint32_t a, uint32_t b){
+    return (int32_t)(a - b);
+}
 
-ssize_t gbn_send(int sockfd, const void *buf, size_t len, int flags){
+/* usec left until the deadline, at least 1 so it never means "forever" */
+static long usec_left(const struct timespec* dl){
+    struct timespec left = time_left(dl);
+    long usec = left.tv_sec * 1000000L + left.tv_nsec / 1000;
+    return usec > 0 ? usec : 1;
+}
 
-    if (s.state != ESTABLISHED){
-        DBG_ERROR("ESTABLISHED state");
+/* send buffer slot of sequence number seq */
+static struct gbn_slot* gbn_slot_of(state_t* s, uint32_t seq){
+    return &s->sndbuf[seq & (s->sndcap - 1)];
+}
+
+/* (re)transmit the packet with sequence number seq from the send buffer */
+static int gbn_xmit(int sockfd, state_t* s, uint32_t seq){
+    struct gbn_slot* slot = gbn_slot_of(s, seq);
+    gbnhdr hdr;
+    init_header(&hdr, DATA, seq, (const char*)slot->data, slot->len);
+    if (sendto_maybe_hdr(sockfd, &hdr, slot->len + GBN_HDRLEN) < 1){
+        DBG_ERROR("Error occured while sending");
         return -1;
     }
+    return 0;
+}
 
-    char* buffer = (char*)buf;
-    /* split input buffer into a an array of packets */
-    int i = 0;
-    int send_len = 0;
-    int read_len = len;
-    uint32_t array_len = len % DATALEN == 0? len/DATALEN : len/DATALEN + 1;
-    /*DBG_PRINT("Array Length %d", array_len);*/
-    struct packet* packs = malloc(sizeof(struct packet) * array_len);
-    for (; i < array_len; i++, buffer += DATALEN, read_len -= DATALEN){
-        send_len = read_len < DATALEN ? read_len : DATALEN;
-        packs[i].start_addr = buffer;
-        packs[i].length = send_len;
+/* cumulative ACK, anything outside [snd_base, snd_next) is stale */
+static void gbn_take_ack(int sockfd, state_t* s, uint32_t seq){
+    int32_t acked = seq_diff(seq, s->snd_base);
+    if (acked >= 0 && acked < seq_diff(s->snd_next, s->snd_base)){
+        TRC_EVENT(TRC_ACK, GOBACKN, sockfd, seq, 0);
+        PROBE3(gbn_ack, sockfd, seq, acked + 1);
+        s->snd_base += acked + 1;
+        s->attempts = 0;
+        deadline_after(&s->deadline, s->timeout);
     }
-    
-    /*start sending it using window size 1 */
-    int res = 0;
-    /* on successful sends reset attempts to 0, else on fails increment attempts */
-    int attempts = 0;
-    int packs_sent = 0;
-    s.winsize = 1;
+}
+
+/* the oldest packet in flight timed out: go back and resend the whole  */
+/* window. -1 once the retry limit is reached                           */
+static int gbn_go_back(int sockfd, state_t* s){
+    DBG_PRINT("Timeout, going back to packet %u", s->snd_base);
+    TRC_EVENT(TRC_TIMEOUT, GOBACKN, sockfd, s->snd_base, s->attempts);
+    PROBE3(gbn_timeout, sockfd, s->snd_base, s->snd_next - s->snd_base);
+    if (++s->attempts == 10){
+        DBG_ERROR("Attempts limit reached at packet %u", s->snd_base);
+        return -1;
+    }
+    uint32_t seq;
+    for (seq = s->snd_base; seq != s->snd_next; seq++){
+        gbn_xmit(sockfd, s, seq);
+        TRC_EVENT(TRC_RETRANSMIT, GOBACKN, sockfd, seq, gbn_slot_of(s, seq)->len);
+        PROBE3(gbn_retransmit, sockfd, seq, gbn_slot_of(s, seq)->len);
+    }
+    deadline_after(&s->deadline, s->timeout);
+    return 0;
+}
+
+/* wait for one DATAACK or for the oldest packet in flight to time out */
+static int gbn_wait_ack(int sockfd, state_t* s){
     gbnhdr hdr = {0};
-    /* have a sliding window keeping track of index along with cursor */
-    uint8_t window[2] = {0, 1};
-    uint8_t seq_cur = s.ex_seqnum;
-    /* set window slots */
-    window[0] = s.ex_seqnum;
-    
-    /* setup timer */
-    signal(SIGALRM, ARLMHNDR);
-    struct itimerval timer;
-    timer.it_value.tv_sec = 0;
-    timer.it_value.tv_usec = 250000;
-    timer.it_interval.tv_sec = 0;
-    timer.it_interval.tv_usec = 0;
-
-    do {
-        /* send the packets dpending on the window size */
-        int i;
-        int ack_exp = 0;
-        for (i = 0; i < s.winsize; i++){
-            if (seq_cur == window[i]) {
-                init_header(&hdr, DATA, seq_cur, packs[seq_cur].start_addr, packs[seq_cur].length);
-                if (sendto_maybe_hdr(sockfd, &hdr, packs[seq_cur].length + 4) < 1) {
-                    DBG_ERROR("Error occured while sending");
-                    seq_cur--;
-                    continue;
-                }
-                seq_cur++;
-                ack_exp++;
-            }
+    int res = recvfrom_hdr(sockfd, &hdr, DATAACK, s->snd_base,
+                           NULL, NULL, usec_left(&s->deadline));
+    if (res > 0 || res == -3){
+        gbn_take_ack(sockfd, s, hdr.seqnum);
+        DBG_PRINT("DATAACK: packet %u, res %d", hdr.seqnum, res);
+    }
+    else if (res == -1)
+        return gbn_go_back(sockfd, s);
+    return 0;
+}
+
+/* block until every packet handed to gbn_send has been ACK'd */
+static int gbn_flush(int sockfd, state_t* s){
+    while (s->snd_base != s->snd_next){
+        if (gbn_wait_ack(sockfd, s) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Go-Back-N sender: up to s->window packets in flight, cumulative ACKs. */
+/* The window carries over between calls: gbn_send returns as soon as    */
+/* the last of its data is in flight, and the packets still un-ACK'd     */
+/* stay in the per-connection send buffer. gbn_close flushes them.       */
+ssize_t gbn_send(int sockfd, const void *buf, size_t len, int flags){
+    state_t* s = gbn_state(sockfd);
+    if (s == NULL){
+        DBG_ERROR("No GBN connection on socket %d", sockfd);
+        return -1;
+    }
+
+    if (s->state != ESTABLISHED){
+        DBG_ERROR("ESTABLISHED state");
+        return -1;
+    }
+
+    /* (re)size the send buffer to the window while nothing is in flight; */
+    /* a power of two, as 2^32 is a multiple of it                        */
+    uint32_t cap = 1;
+    while (cap < s->window)
+        cap <<= 1;
+    if (s->sndcap != cap){
+        if (gbn_flush(sockfd, s) < 0)
+            return -1;
+        free(s->sndbuf);
+        s->sndcap = 0;
+        if ((s->sndbuf = malloc(sizeof(struct gbn_slot) * cap)) == NULL){
+            DBG_ERROR("Unable to allocate send buffer");
+            return -1;
         }
-        
-     /* for receiving packets, make sure that the packets are within bounds of window */
-        for (i = 0; i < ack_exp; i++){
-            setitimer(ITIMER_REAL, &timer, NULL);
-            res = recvfrom_hdr(sockfd, &hdr, DATAACK, window[0], NULL, NULL, 0);
-            /* split between windows size cases */
-            if (s.winsize == 1){
-                if (res > 0){ /* packets received are correct */
-                    window[0]++;
-                    packs_sent++;
-                    s.winsize = 2;
-                    attempts = 0;
-                }
-                else{   /* packets received are not correct, reset cursor */
-                    seq_cur = window[0];
-                    s.winsize = 1;
-                    attempts++;
-                }
-            }else{ /* window size 2 */
-                if (res > 0){   /* packets received are correct */
-                    window[0]++;
-                    packs_sent++;
-                    s.winsize = 2;
-                    attempts = 0;
-                }
-                else if(res == -3 && hdr.seqnum == window[1]){
-                    /* packets received came in out of order but within bounds */
-                    /* use cumulative ACK */
-                    packs_sent += 2;
-                    window[0] = window[1] + 1;
-                    s.winsize = 2;
-                    attempts = 0;
-                    break;
-                }
-                else{
-                    /* something failed reset cursor to first un-ACK'd packet */
-                    seq_cur = window[0];
-                    s.winsize = 1;
-                    attempts++;
-                }
-            }
+        s->sndcap = cap;
+    }
+
+    const char* buffer = (const char*)buf;
+    size_t off = 0;
+    PROBE3(gbn_send_start, sockfd, s->snd_next, len);
+    while (off < len){
+        /* fill the window */
+        while (off < len && (uint32_t)seq_diff(s->snd_next, s->snd_base) < s->window){
+            struct gbn_slot* slot = gbn_slot_of(s, s->snd_next);
+            slot->len = len - off < DATALEN ? len - off : DATALEN;
+            memcpy(slot->data, buffer + off, slot->len);
+            /* the timer runs for the oldest packet in flight */
+            if (s->snd_next == s->snd_base)
+                deadline_after(&s->deadline, s->timeout);
+            /* a failed send is a loss, the timeout resends it */
+            gbn_xmit(sockfd, s, s->snd_next);
+            TRC_EVENT(TRC_SEND, GOBACKN, sockfd, s->snd_next, slot->len);
+            PROBE3(gbn_packet_send, sockfd, s->snd_next, slot->len);
+            s->snd_next++;
+            off += slot->len;
         }
-        DBG_PRINT("DATAACK: packet %d, res %d", hdr.seqnum, res);
-        /* make sure the window indices don't go past array size */
-        window[0] = window[0] >= array_len - 1 ? array_len - 1 : window[0];
-        window[1] = window[0] >= array_len - 1 ? array_len - 1: window[0] + s.winsize - 1;
-    } while(packs_sent != array_len && attempts != 10);
+        if (off < len && gbn_wait_ack(sockfd, s) < 0)
+            return -1;
+    }
     DBG_PRINT("Exiting out of gbn_send");
-    return 0;
+    PROBE3(gbn_send_done, sockfd, s->snd_next, len);
+    return len;
 }
 
 
+/* send a DATAACK for seqnum seq */
+static int gbn_ack(int sockfd, uint32_t seq){
+    gbnhdr hdr;
+    init_header(&hdr, DATAACK, seq, NULL, 0);
+    if (sendto_maybe_hdr(sockfd, &hdr, sizeof(gbnhdr)) < 1){
+        /* critical error occured, bail */
+        DBG_ERROR("Can't send to client.");
+        return -1;
+    }
+    DBG_PRINT("Sending packet %u", seq);
+    return 0;
+}
+
 /* the receiver essentially acts like it has window size 1 */
 /* if any packet received out of order, reject and request last ACKed packet */
+/* blocks for the first in-order packet, then keeps copying packets already */
+/* queued on the socket until buf is full; one cumulative ACK covers them.  */
+/* The tail of a packet that does not fit is kept for the next call.        */
+/* Packets of our own gbn_send still in flight are looked after while it    */
+/* waits: their DATAACKs are taken and the window goes back on a timeout,   */
+/* so a request/response exchange works in both directions.                 */
 ssize_t gbn_recv(int sockfd, void *buf, size_t len, int flags){
     int count  = 0;
     gbnhdr hdr = {0};
-    int cflag = 0;
-    do
-    {
-        switch(s.state){
-            case ESTABLISHED:
-                count = recvfrom_hdr(sockfd, &hdr, DATA, s.ex_seqnum, NULL, NULL, 0);
-                DBG_PRINT("Got packet length %d, seq %d from socket", count, hdr.seqnum);
-                /* the type is wrong */
-                if (count == -2) {
-                    if (hdr.type == SYN) {
-                        /* client is still waiting for SYNACK */
-                        init_header(&hdr, SYNACK, 0, NULL, 0);
-                    } else if (hdr.type == FIN) {
-                        /* client sent FIN, have gbn_close deal with it */
-                        s.state = FIN_RCVD;
-                        return 0;
-                    } else {
-                        /* something is horribly wrong */
-                        return -1;
-                    }
-                }
-                else if (count < 0){
-                    if (count == -3 && hdr.seqnum < s.ex_seqnum){ /* lower packet sequence arrived ACK number back */
-                        init_header(&hdr, DATAACK, hdr.seqnum, NULL, 0);
-                    }
-                    else { /* something else went wrong, ack with last sequence (packet larger than sequence) */
-                        init_header(&hdr, DATAACK, s.ex_seqnum - 1, NULL, 0);
-                    }
-                }
-                else { /* received right packet */
-                    /* received right packet, write to file */
-                    memcpy(buf, hdr.data, count - 4);
-                    init_header(&hdr, DATAACK, s.ex_seqnum, NULL, 0);
-                    DBG_PRINT("Writing packet %d to file", hdr.seqnum);
-                    s.ex_seqnum++;
-                    cflag = 1;
-                }
+    char* out = (char*)buf;
+    size_t got = 0, n;
+    int delivered = 0;
+    state_t* s = gbn_state(sockfd);
+    if (s == NULL){
+        DBG_ERROR("No GBN connection on socket %d", sockfd);
+        return -1;
+    }
+
+    PROBE3(gbn_recv_start, sockfd, s->ex_seqnum, len);
+
+    /* leftover of the last packet that did not fit */
+    if (s->rcv_off < s->rcv_len){
+        n = s->rcv_len - s->rcv_off < len ? s->rcv_len - s->rcv_off : len;
+        memcpy(out, s->rcvbuf + s->rcv_off, n);
+        s->rcv_off += n;
+        got += n;
+    }
+
+    while (got < len){
+        if (s->state == FIN_RCVD)
+            break;
+        if (s->state != ESTABLISHED)
+            return -1;
+        /* wait for the first packet only, after that just drain the socket */
+        int first = got == 0 && !delivered;
+        int sending = s->snd_base != s->snd_next;
+        count = recvfrom_hdr(sockfd, &hdr, DATA, s->ex_seqnum, NULL, NULL,
+                             !first ? -1 : sending ? usec_left(&s->deadline) : 0);
+        DBG_PRINT("Got packet length %d, seq %u from socket", count, hdr.seqnum);
+        if (count == -1 && !first)
+            break;  /* nothing more queued */
+        if (count == -1){
+            if (sending && gbn_go_back(sockfd, s) < 0)
+                return -1;
+            continue;
+        }
+        /* the type is wrong */
+        if (count == -2) {
+            if (hdr.type == DATAACK) {
+                gbn_take_ack(sockfd, s, hdr.seqnum);
+            } else if (hdr.type == SYN) {
+                /* client is still waiting for SYNACK */
+                init_header(&hdr, SYNACK, 0, NULL, 0);
                 if (sendto_maybe_hdr(sockfd, &hdr, sizeof(gbnhdr)) < 1){
-                    /* critical error occured, bail */
                     DBG_ERROR("Can't send to client.");
                     return -1;
                 }
-                DBG_PRINT("Sending packet %d", hdr.seqnum);
-                break;
-            default:
+            } else if (hdr.type == FIN) {
+                /* client sent FIN, have gbn_close deal with it */
+                set_state(sockfd, s, FIN_RCVD);
+            } else {
+                /* something is horribly wrong */
                 return -1;
+            }
         }
-    }while(!cflag);
+        else if (count < 0){
+            if (count == -3 && seq_diff(hdr.seqnum, s->ex_seqnum) < 0){ /* lower packet sequence arrived ACK number back */
+                TRC_EVENT(TRC_DUPLICATE, GOBACKN, sockfd, hdr.seqnum, 0);
+                PROBE2(gbn_duplicate, sockfd, hdr.seqnum);
+                if (gbn_ack(sockfd, hdr.seqnum) < 0)
+                    return -1;
+            }
+            else { /* something else went wrong, ack with last sequence (packet larger than sequence) */
+                if (gbn_ack(sockfd, s->ex_seqnum - 1) < 0)
+                    return -1;
+            }
+        }
+        else { /* received right packet */
+            int plen = count - GBN_HDRLEN;
+            n = (size_t)plen < len - got ? (size_t)plen : len - got;
+            memcpy(out + got, hdr.data, n);
+            got += n;
+            if (n < (size_t)plen){
+                memcpy(s->rcvbuf, hdr.data + n, plen - n);
+                s->rcv_off = 0;
+                s->rcv_len = plen - n;
+            }
+            DBG_PRINT("Writing packet %u to file", hdr.seqnum);
+            TRC_EVENT(TRC_RECV, GOBACKN, sockfd, hdr.seqnum, plen);
+            PROBE3(gbn_packet_recv, sockfd, hdr.seqnum, plen);
+            s->ex_seqnum++;
+            delivered++;
+        }
+    }
+    /* one cumulative ACK for every packet taken in this call */
+    if (delivered && gbn_ack(sockfd, s->ex_seqnum - 1) < 0)
+        return -1;
     DBG_PRINT("gbn_recv EXITING");
-    /* -4 for the type, seqnum, check bytes */
-    return count - 4;
+    PROBE3(gbn_recv_done, sockfd, s->ex_seqnum, got);
+    return got;
 }
 
 /* Send FIN, Recv FIN, Send FINACK, Recv FINACK */
@@ -388,16 +571,16 @@ int gbn_close(int sockfd){
     int count = 0;
     int attempt = 0;
     gbnhdr hdr = {0};
-    /* setup timer scaffolding */
-    signal(SIGALRM, ARLMHNDR);
-    struct itimerval timer;
-    timer.it_value.tv_sec = 0;
-    timer.it_value.tv_usec = 250000;
-    timer.it_interval.tv_sec = 0;
-    timer.it_interval.tv_usec = 0;
-    while (s.state != CLOSED){
+    state_t* s = gbn_state(sockfd);
+    if (s == NULL){
+        DBG_ERROR("No GBN connection on socket %d", sockfd);
+        return -1;
+    }
+    /* everything queued by gbn_send must be ACK'd before the FIN */
+    int flushed = s->state == ESTABLISHED ? gbn_flush(sockfd, s) : 0;
+    while (s->state != CLOSED){
         if (attempt == 10) break;
-        switch(s.state){
+        switch(s->state){
             case ESTABLISHED:   /* this must be client, send first FIN */
                 init_header(&hdr, FIN, 0, NULL, 0);
                 if ((count = sendto_maybe_hdr(sockfd, &hdr, sizeof(gbnhdr))) < 1){
@@ -405,17 +588,16 @@ int gbn_close(int sockfd){
                     attempt++;
                     continue;
                 }
-                s.state = FIN_SENT;
+                set_state(sockfd, s, FIN_SENT);
                 break;
             case FIN_SENT:      /* client waits for FINACK to respond */
-                setitimer(ITIMER_REAL, &timer, NULL);
-                if ((count = recvfrom_hdr(sockfd, &hdr, FINACK, 0, NULL, NULL, 0)) < 1){
+                if ((count = recvfrom_hdr(sockfd, &hdr, FINACK, 0, NULL, NULL, s->timeout)) < 1){
                     DBG_ERROR("Error occured while waiting for recvfrom");
-                    s.state = ESTABLISHED;
+                    set_state(sockfd, s, ESTABLISHED);
                     attempt++;
                     continue;
                 }
-                s.state = CLOSED;
+                set_state(sockfd, s, CLOSED);
                 break;
             case FIN_RCVD: /* server comes here to send FINACK to client */
                 init_header(&hdr, FINACK, 0, NULL, 0);
@@ -424,17 +606,23 @@ int gbn_close(int sockfd){
                     attempt++;
                     continue;
                 }
-                s.state = CLOSED;
+                set_state(sockfd, s, CLOSED);
                 break;
             case CLOSED:
                 break;
         }
     }
     if (attempt == 10){     /* max amount of attempts reached, hang up */
-        DBG_ERROR("Attempts limit reached. State: %d.", s.state);
+        DBG_ERROR("Attempts limit reached. State: %d.", s->state);
         return -2;
     }
-    return 0;
+    free(s->sndbuf);
+    s->sndbuf = NULL;
+    s->sndcap = 0;
+    /* let a delayed FIN/FINACK out before the caller closes the socket */
+    if (s->impair != NULL)
+        IMP_drain(s->impair);
+    return flushed;
 }
 
 /* SYN, SYNACK packets will only compose of type and checksum field, no seqnum and data */
@@ -442,15 +630,19 @@ int gbn_connect(int sockfd, const struct sockaddr *server, socklen_t socklen){
     int count;
     int attempts = 0;
     gbnhdr hdr = {0};
+    state_t* s = gbn_state(sockfd);
+    if (s == NULL){
+        DBG_ERROR("No GBN connection on socket %d", sockfd);
+        return -1;
+    }
     /* save server address */
-    memcpy(&s.addr, server, socklen);
-    s.len = socklen;
-    signal(SIGALRM, ARLMHNDR);
+    memcpy(&s->addr, server, socklen);
+    s->len = socklen;
 
     /* FSM starts here, try 10 times */
-    while (s.state != ESTABLISHED) {
+    while (s->state != ESTABLISHED) {
         if (attempts == 10) break;
-        switch (s.state){
+        switch (s->state){
             case CLOSED:
                 /* setup SYN packet */
                 /* use a full buffer for syn packets*/
@@ -463,20 +655,20 @@ int gbn_connect(int sockfd, const struct sockaddr *server, socklen_t socklen){
                 }
                 DBG_PRINT("SYN_SENT Checkpoint");
                 /* update state variables */
-                s.state = SYN_SENT;
+                set_state(sockfd, s, SYN_SENT);
                 break;
             case SYN_SENT:
-                alarm(TIMEOUT);
-                if ((count = recvfrom_hdr(sockfd, &hdr, SYNACK, 0, NULL, NULL, 1)) < 1){
+                if ((count = recvfrom_hdr(sockfd, &hdr, SYNACK, 0, NULL, NULL, TIMEOUT * 1000000L)) < 1){
                     DBG_ERROR("Did not receive FINACK");
                     attempts++;
                     /* reset set to CLOSED and resend */
-                    s.state = CLOSED;
+                    set_state(sockfd, s, CLOSED);
                     continue;
                 }
                 DBG_PRINT("ESTABLISHED Checkpoint");
-                s.state = ESTABLISHED;
-                s.ex_seqnum = 0;
+                set_state(sockfd, s, ESTABLISHED);
+                s->ex_seqnum = 0;
+                s->snd_base = s->snd_next = 0;
                 break;
             case ESTABLISHED:
                 break;
@@ -489,13 +681,47 @@ int gbn_connect(int sockfd, const struct sockaddr *server, socklen_t socklen){
     return 0;
 }
 
+/* set the number of packets gbn_send keeps in flight */
+int gbn_setwindow(int sockfd, uint32_t window){
+    state_t* s = gbn_state(sockfd);
+    if (s == NULL || window < 1 || window > GBN_MAX_WINDOW){
+        DBG_ERROR("Invalid window %u for socket %d", window, sockfd);
+        return -1;
+    }
+    s->window = window;
+    return 0;
+}
+
+int gbn_setimpair(int sockfd, const char* spec){
+    state_t* s = gbn_state(sockfd);
+    struct IMP_Config cfg = {0};
+    struct IMP_Link* link;
+    cfg.loss = LOSS_PRO;
+    cfg.corrupt = CORR_PRO;
+    cfg.reorder_usec = 1000;
+    if (s == NULL || IMP_parse(spec, &cfg) != 0){
+        DBG_ERROR("Invalid impairment \"%s\" for socket %d", spec ? spec : "", sockfd);
+        return -1;
+    }
+    if ((link = malloc(sizeof(*link))) == NULL || IMP_init(link, &cfg) != 0){
+        free(link);
+        return -1;
+    }
+    if (s->impair != NULL){
+        IMP_destroy(s->impair);
+        free(s->impair);
+    }
+    s->impair = link;
+    return 0;
+}
+
 int gbn_listen(int sockfd, int backlog){
 	return 0;
 }
 
 int gbn_bind(int sockfd, const struct sockaddr *server, socklen_t socklen){
     int ret = -1;
-    if ((ret = bind(sockfd, server, socklen)) < 0){
+    if ((ret = XP_bind(sockfd, server, socklen)) < 0){
         /* bind returns -1 if binding to port fails */
         DBG_ERROR("Unable to bind to socket");
     }
@@ -503,16 +729,28 @@ int gbn_bind(int sockfd, const struct sockaddr *server, socklen_t socklen){
 }	
 
 int gbn_socket(int domain, int type, int protocol){
-		
-	/*----- Randomizing the seed. This is used by the rand() function -----*/
-	srand((unsigned)time(0));
-    /* state at socket creation is always close (not connected) */
-    s.state = CLOSED;
     /* return file descriptor for the socket */
     int fd = 0;
-    if ((fd = socket(domain, type, protocol)) < 0){
+    if ((fd = XP_socket(domain, type, protocol)) < 0){
         /* file descriptor can't be negative */
         DBG_ERROR("Unable to create socket");
+        return fd;
+    }
+    TRC_init();
+    state_t* s = gbn_state_create(fd);
+    if (s == NULL){
+        DBG_ERROR("Unable to allocate connection state");
+        XP_close(fd);
+        return -1;
+    }
+    /* state at socket creation is always close (not connected) */
+    s->state = CLOSED;
+    s->timeout = ACK_TIMEOUT;
+    s->window = GBN_WINDOW;
+    if (gbn_setimpair(fd, getenv("GBN_IMPAIR")) < 0 &&
+            gbn_setimpair(fd, NULL) < 0){
+        XP_close(fd);
+        return -1;
     }
 	return fd;
 }
@@ -520,18 +758,25 @@ int gbn_socket(int domain, int type, int protocol){
 int gbn_accept(int sockfd, struct sockaddr *client, socklen_t *socklen){
     int count = 0;
     gbnhdr hdr = {0};
+    state_t* s = gbn_state(sockfd);
+    if (s == NULL){
+        DBG_ERROR("No GBN connection on socket %d", sockfd);
+        return -1;
+    }
+    /* draw impairments apart from the connecting end, which keeps the seed */
+    IMP_salt(s->impair, 1);
 
     /* FSM starts here */
-    while (s.state != ESTABLISHED){
-        switch(s.state){
+    while (s->state != ESTABLISHED){
+        switch(s->state){
             case CLOSED:
                 if ((count = recvfrom_hdr(sockfd, &hdr, SYN, 0, client, socklen, 0)) < 1){
                     DBG_ERROR("Did not receive the SYN packet");
                     continue;
                 }
-                memcpy(&s.addr, client, *socklen);
-                s.len = *socklen;
-                s.state = SYN_RCVD;
+                memcpy(&s->addr, client, *socklen);
+                s->len = *socklen;
+                set_state(sockfd, s, SYN_RCVD);
                 DBG_PRINT("SYN_RCVD checkpoint");
                 break;
             case SYN_RCVD:
@@ -540,8 +785,9 @@ int gbn_accept(int sockfd, struct sockaddr *client, socklen_t *socklen){
                     DBG_ERROR("Counld not send SYNACK");
                     continue;
                 }
-                s.state = ESTABLISHED;
-                s.ex_seqnum = 0;
+                set_state(sockfd, s, ESTABLISHED);
+                s->ex_seqnum = 0;
+                s->snd_base = s->snd_next = 0;
                 DBG_PRINT("ESTABLISHED checkpoint");
                 break;
             case ESTABLISHED:
@@ -554,33 +800,9 @@ int gbn_accept(int sockfd, struct sockaddr *client, socklen_t *socklen){
 ssize_t maybe_sendto(int s, const void *buf, size_t len, int flags, \
                      const struct sockaddr *to, socklen_t tolen){
 
-	char *buffer = malloc(len);
-	memcpy(buffer, buf, len);
-	
-	
-	/*----- Packet not lost -----*/
-	if (rand() > LOSS_PRO*RAND_MAX){
-		/*----- Packet corrupted -----*/
-		if (rand() < CORR_PRO*RAND_MAX){
-			
-			/*----- Selecting a random byte inside the packet -----*/
-			int index = (int)((len-1)*rand()/(RAND_MAX + 1.0));
-
-			/*----- Inverting a bit -----*/
-			char c = buffer[index];
-			if (c & 0x01)
-				c &= 0xFE;
-			else
-				c |= 0x01;
-			buffer[index] = c;
-		}
-
-		/*----- Sending the packet -----*/
-		int retval = sendto(s, buffer, len, flags, to, tolen);
-		free(buffer);
-		return retval;
-	}
-	/*----- Packet lost -----*/
-	else
-		return(len);  /* Simulate a success */
-}
\ No newline at end of file
+	/*----- Loss, corruption etc. come from the socket's seeded impairments -----*/
+	state_t* st = gbn_state(s);
+	if (st == NULL || st->impair == NULL)
+		return XP_sendto(s, buf, len, flags, to, tolen);
+	return IMP_sendto(st->impair, s, buf, len, flags, to, tolen);
+}
@@ -1,23 +1,29 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <time.h>
 #include <stdarg.h>
 #include <string.h>
+#include <pthread.h>
 #include "s_helper.h"
 
 #define LOG_FNAME "send_dbg.txt" //you can change this based on your text
 #define LOG_FNAME2 "recv_dbg.txt"//you can change this based on your text
 
-static int access_count = 0;
 char module_name[200];
 
+/* the log stays open; lines are formatted under the lock */
+static FILE* log_fd = NULL;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void get_current_time(char (*time_str)[], size_t maxsize) {
 
     time_t t;
-    struct tm* timeinfo;
+    struct tm timeinfo;
 
     time(&t);
-    timeinfo = gmtime(&t);
-    strftime(*time_str, maxsize, "%a, %d %b %Y %X %Z", timeinfo);
+    gmtime_r(&t, &timeinfo);
+    strftime(*time_str, maxsize, "%a, %d %b %Y %X %Z", &timeinfo);
 }
 
 int itoa(char* buf, int number){
@@ -26,31 +32,28 @@ int itoa(char* buf, int number){
 
 void dbg_log_print(char* fname, int lnum, char* fmt, ...) {
 
-    FILE* log_fd;
-    char time_str[255];
+    static time_t stamped = -1;
+    static char time_str[255];
     char* pfmt;
     char* sparam;
     int iparam;
     va_list list;
 
-    if (strncmp(module_name, "./s", 3) == 0){
-        if (access_count == 0) {
-            log_fd = fopen(LOG_FNAME, "w");
-        }
-        else {
-            log_fd = fopen(LOG_FNAME, "a+");
+    pthread_mutex_lock(&log_lock);
+    if (log_fd == NULL) {
+        log_fd = fopen(strncmp(module_name, "./s", 3) == 0 ? LOG_FNAME : LOG_FNAME2, "w");
+        if (log_fd == NULL) {
+            pthread_mutex_unlock(&log_lock);
+            return;
         }
     }
-    else{
-        if (access_count == 0) {
-            log_fd = fopen(LOG_FNAME2, "w");
-        }
-        else {
-            log_fd = fopen(LOG_FNAME2, "a+");
-        }
+
+    /* the stamp has a resolution of a second, format it once per second */
+    time_t now = time(NULL);
+    if (now != stamped) {
+        stamped = now;
+        get_current_time(&time_str, sizeof(time_str));
     }
-    
-    get_current_time(&time_str, sizeof(time_str));
     fprintf(log_fd, "%s %s %d>", time_str, fname, lnum );
 
     va_start(list, fmt);
@@ -78,6 +81,6 @@ void dbg_log_print(char* fname, int lnum, char* fmt, ...) {
     va_end(list);
 
     fputc('\n', log_fd);
-    access_count++;
-    fclose(log_fd);
+    fflush(log_fd);
+    pthread_mutex_unlock(&log_lock);
 }
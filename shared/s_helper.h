@@ -9,14 +9,27 @@
 #define GBN_HELPER_H
 
 #include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <stdlib.h>
+#include "sock.h"
+#include "trace.h"
 
 #define STR_ERROR() \
     (errno == 0 ? "None" : strerror(errno))
 #define ERR_CHECK(A, M, ...) \
     if (!(A)) {DBG_ERROR(M, ##__VA_ARGS__); errno = 0; goto error_exit;}
+/* errors go into the event trace as the line and errno; debug builds */
+/* also write the message to the text log                             */
+#ifdef DEBUG_
 #define DBG_ERROR(M, ...) \
-    dbg_log_print(__FILE__, __LINE__, "[ERROR]: %s. " M, STR_ERROR(), ##__VA_ARGS__)
+    do {TRC_EVENT(TRC_ERROR, GOBACKN, -1, __LINE__, errno); \
+        dbg_log_print(__FILE__, __LINE__, "[ERROR]: %s. " M, STR_ERROR(), ##__VA_ARGS__);} while (0)
+#else
+#define DBG_ERROR(M, ...) \
+    TRC_EVENT(TRC_ERROR, GOBACKN, -1, __LINE__, errno)
+#endif
 #define DBG_PRINT(...) \
     /*dbg_log_print(__FILE__, __LINE__, ##__VA_ARGS__)*/
 
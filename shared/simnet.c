@@ -0,0 +1,660 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/uio.h>
+
+#include "pool.h"
+#include "simnet.h"
+
+#define SIM_FD_BASE 3            // handles look like small file descriptors
+#define SIM_RCVBUF 212992        // receive queue limit, as Linux' default
+#define SIM_EPHEMERAL_FIRST 49152
+
+struct SIM_Datagram
+{
+	struct SIM_Datagram *next;
+	uint16_t src_port; // as stored in sin_port
+	size_t len;
+	char data[];
+};
+
+struct SIM_Endpoint
+{
+	bool open;
+	uint64_t id; // tells apart sockets that reuse a handle
+	uint16_t port; // sin_port of the bound address, 0 while unbound
+	uint16_t peer; // sin_port of the connected peer, 0 if none
+	int error; // pending asynchronous error (ECONNREFUSED)
+	struct SIM_Datagram *head, *tail;
+	size_t rx_bytes;
+	uint64_t busy_until; // when the outgoing link drains
+	uint64_t rng;
+};
+
+// A datagram on the wire
+struct SIM_Event
+{
+	uint64_t at;
+	uint64_t order;
+	uint16_t dst_port;
+	int src; // handle of the sender, for ICMP-style errors
+	uint64_t src_id;
+	struct SIM_Datagram *dg;
+};
+
+struct SIM_Waiter
+{
+	struct SIM_Endpoint *ep;
+	uint64_t id; // of the socket waited on; the endpoint may be reused
+	uint64_t deadline;
+	struct SIM_Waiter *next;
+};
+
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	uint64_t now;
+	struct SIM_Link link;
+
+	// Allocated one at a time and reused, never moved or freed: waiters keep
+	// pointers to them across pthread_cond_wait while others open sockets
+	struct SIM_Endpoint **eps;
+	size_t neps;
+	int ports[65536]; // handle bound to each port, 0 if none
+	uint16_t next_ephemeral;
+	uint64_t sockets; // ever created
+
+	struct SIM_Event *heap;
+	size_t len, cap;
+	uint64_t order;
+
+	unsigned attached; // threads taking part
+	unsigned blocked;  // ... of which are waiting in the network
+	struct SIM_Waiter *waiters;
+
+	struct SIM_Stats stats;
+} SIM = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 1000000};
+
+static pthread_once_t SIM_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t SIM_key;
+static __thread bool SIM_attached;
+
+static uint64_t SIM_mix(uint64_t z)
+{
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+static double SIM_uniform(struct SIM_Endpoint *ep)
+{
+	ep->rng += 0x9E3779B97F4A7C15ULL;
+	return (SIM_mix(ep->rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static struct SIM_Endpoint *SIM_ep(int s)
+{
+	if(s < SIM_FD_BASE || (size_t)(s - SIM_FD_BASE) >= SIM.neps ||
+			!SIM.eps[s - SIM_FD_BASE] || !SIM.eps[s - SIM_FD_BASE]->open){
+		errno = EBADF;
+		return NULL;
+	}
+	return SIM.eps[s - SIM_FD_BASE];
+}
+
+// Thread membership: joining happens on the first send or wait, leaving at
+// exit
+
+static void SIM_leave(void *arg)
+{
+	pthread_mutex_lock(&SIM.lock);
+	SIM.attached--;
+	pthread_cond_broadcast(&SIM.wake);
+	pthread_mutex_unlock(&SIM.lock);
+}
+
+static void SIM_makeKey(void)
+{
+	pthread_key_create(&SIM_key, SIM_leave);
+}
+
+// Called with the lock held
+static void SIM_attach(void)
+{
+	if(SIM_attached)
+		return;
+	pthread_once(&SIM_key_once, SIM_makeKey);
+	pthread_setspecific(SIM_key, (void *)1);
+	SIM_attached = true;
+	SIM.attached++;
+}
+
+void SIM_detach(void)
+{
+	if(!SIM_attached)
+		return;
+	pthread_setspecific(SIM_key, NULL);
+	SIM_attached = false;
+	SIM_leave(NULL);
+}
+
+// Event heap, ordered by arrival then by send order
+
+static bool SIM_before(const struct SIM_Event *a, const struct SIM_Event *b)
+{
+	return a->at < b->at || (a->at == b->at && a->order < b->order);
+}
+
+static void SIM_swap(struct SIM_Event *a, struct SIM_Event *b)
+{
+	struct SIM_Event t = *a;
+	*a = *b;
+	*b = t;
+}
+
+static int SIM_push(struct SIM_Event *ev)
+{
+	if(SIM.len == SIM.cap){
+		size_t cap = SIM.cap ? SIM.cap * 2 : 256;
+		struct SIM_Event *heap = realloc(SIM.heap, cap * sizeof(*heap));
+		if(!heap)
+			return -1;
+		SIM.heap = heap;
+		SIM.cap = cap;
+	}
+	size_t i = SIM.len++;
+	SIM.heap[i] = *ev;
+	while(i > 0 && SIM_before(&SIM.heap[i], &SIM.heap[(i - 1) / 2])){
+		SIM_swap(&SIM.heap[i], &SIM.heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	return 0;
+}
+
+static void SIM_pop(void)
+{
+	size_t i = 0;
+	SIM.heap[0] = SIM.heap[--SIM.len];
+	while(true){
+		size_t l = 2 * i + 1, r = l + 1, m = i;
+		if(l < SIM.len && SIM_before(&SIM.heap[l], &SIM.heap[m]))
+			m = l;
+		if(r < SIM.len && SIM_before(&SIM.heap[r], &SIM.heap[m]))
+			m = r;
+		if(m == i)
+			return;
+		SIM_swap(&SIM.heap[i], &SIM.heap[m]);
+		i = m;
+	}
+}
+
+// Hand a datagram to the socket bound to its port
+static void SIM_deliver(struct SIM_Event *ev)
+{
+	int h = SIM.ports[ev->dst_port];
+	struct SIM_Endpoint *ep = h ? SIM.eps[h - SIM_FD_BASE] : NULL;
+	if(!ep || !ep->open){
+		// like ICMP port unreachable on a connected UDP socket
+		struct SIM_Endpoint *src = SIM_ep(ev->src);
+		if(src && src->id == ev->src_id && src->peer == ev->dst_port)
+			src->error = ECONNREFUSED;
+		SIM.stats.unreachable++;
+		POOL_free(ev->dg);
+		return;
+	}
+	if(ep->rx_bytes + ev->dg->len > SIM_RCVBUF){
+		SIM.stats.rcvbuf_drops++;
+		POOL_free(ev->dg);
+		return;
+	}
+	ev->dg->next = NULL;
+	if(ep->tail)
+		ep->tail->next = ev->dg;
+	else
+		ep->head = ev->dg;
+	ep->tail = ev->dg;
+	ep->rx_bytes += ev->dg->len;
+	SIM.stats.delivered++;
+}
+
+static bool SIM_ready(const struct SIM_Waiter *w)
+{
+	return !w->ep->open || w->ep->id != w->id || w->ep->head || w->ep->error ||
+		SIM.now >= w->deadline;
+}
+
+// Move the clock to the next arrival or wait deadline. Returns false if
+// nothing is scheduled, or if a waiter already has something to do and just
+// has not woken up yet.
+static bool SIM_advance(void)
+{
+	uint64_t next = UINT64_MAX;
+	struct SIM_Waiter *w;
+	for(w = SIM.waiters; w; w = w->next){
+		if(SIM_ready(w))
+			return false;
+		if(w->deadline < next)
+			next = w->deadline;
+	}
+	if(SIM.len && SIM.heap[0].at < next)
+		next = SIM.heap[0].at;
+	if(next == UINT64_MAX)
+		return false;
+	if(next > SIM.now)
+		__atomic_store_n(&SIM.now, next, __ATOMIC_RELEASE);
+	while(SIM.len && SIM.heap[0].at <= SIM.now){
+		struct SIM_Event ev = SIM.heap[0];
+		SIM_pop();
+		SIM_deliver(&ev);
+	}
+	pthread_cond_broadcast(&SIM.wake);
+	return true;
+}
+
+// Wait for ep to have a datagram or error. Called with the lock held.
+static int SIM_wait(struct SIM_Endpoint *ep, int64_t usec)
+{
+	struct SIM_Waiter me;
+	int ret;
+	me.ep = ep;
+	me.id = ep->id;
+	me.deadline = usec >= 0 ? SIM.now + usec : UINT64_MAX;
+	me.next = SIM.waiters;
+	SIM.waiters = &me;
+	SIM_attach();
+	SIM.blocked++;
+	while(true){
+		if(SIM_ready(&me)){
+			ret = SIM.now < me.deadline || ep->head || ep->error || !ep->open ||
+				ep->id != me.id;
+			break;
+		}
+		// the last one to block moves time forward for everybody
+		if(SIM.blocked < SIM.attached || !SIM_advance())
+			pthread_cond_wait(&SIM.wake, &SIM.lock);
+	}
+	SIM.blocked--;
+	struct SIM_Waiter **pp = &SIM.waiters;
+	while(*pp != &me)
+		pp = &(*pp)->next;
+	*pp = me.next;
+	return ret;
+}
+
+static uint16_t SIM_ephemeral(int s)
+{
+	unsigned tries;
+	for(tries = 0; tries < 65536 - SIM_EPHEMERAL_FIRST; tries++){
+		if(SIM.next_ephemeral < SIM_EPHEMERAL_FIRST)
+			SIM.next_ephemeral = SIM_EPHEMERAL_FIRST;
+		uint16_t port = htons(SIM.next_ephemeral++);
+		if(!SIM.ports[port]){
+			SIM.ports[port] = s;
+			return port;
+		}
+	}
+	return 0;
+}
+
+static int SIM_socket(int domain, int type, int protocol)
+{
+	size_t i;
+	pthread_mutex_lock(&SIM.lock);
+	for(i = 0; i < SIM.neps && SIM.eps[i] && SIM.eps[i]->open; i++)
+		;
+	if(i == SIM.neps){
+		size_t n = SIM.neps ? SIM.neps * 2 : 16;
+		struct SIM_Endpoint **eps = realloc(SIM.eps, n * sizeof(*eps));
+		if(!eps){
+			pthread_mutex_unlock(&SIM.lock);
+			errno = ENOMEM;
+			return -1;
+		}
+		memset(eps + SIM.neps, 0, (n - SIM.neps) * sizeof(*eps));
+		SIM.eps = eps;
+		SIM.neps = n;
+	}
+	if(!SIM.eps[i] && (SIM.eps[i] = malloc(sizeof(*SIM.eps[i]))) == NULL){
+		pthread_mutex_unlock(&SIM.lock);
+		errno = ENOMEM;
+		return -1;
+	}
+	struct SIM_Endpoint *ep = SIM.eps[i];
+	memset(ep, 0, sizeof(*ep));
+	ep->open = true;
+	ep->id = ++SIM.sockets;
+	ep->rng = SIM_mix(SIM.link.seed ^ (i + 1) * 0x9E3779B97F4A7C15ULL);
+	pthread_mutex_unlock(&SIM.lock);
+	return i + SIM_FD_BASE;
+}
+
+static int SIM_bind(int s, const struct sockaddr *addr, socklen_t len)
+{
+	const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+	int ret = -1;
+	pthread_mutex_lock(&SIM.lock);
+	struct SIM_Endpoint *ep = SIM_ep(s);
+	if(!ep)
+		goto out;
+	if(ep->port || len < sizeof(*in)){
+		errno = EINVAL;
+		goto out;
+	}
+	if(in->sin_port == 0){
+		ep->port = SIM_ephemeral(s);
+		ret = ep->port ? 0 : -1;
+		if(ret)
+			errno = EADDRINUSE;
+		goto out;
+	}
+	if(SIM.ports[in->sin_port]){
+		errno = EADDRINUSE;
+		goto out;
+	}
+	SIM.ports[in->sin_port] = s;
+	ep->port = in->sin_port;
+	ret = 0;
+out:
+	pthread_mutex_unlock(&SIM.lock);
+	return ret;
+}
+
+static int SIM_connect(int s, const struct sockaddr *addr, socklen_t len)
+{
+	const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+	int ret = -1;
+	pthread_mutex_lock(&SIM.lock);
+	struct SIM_Endpoint *ep = SIM_ep(s);
+	if(ep && len >= sizeof(*in)){
+		if(!ep->port)
+			ep->port = SIM_ephemeral(s);
+		ep->peer = in->sin_port;
+		ret = 0;
+	} else if(ep){
+		errno = EINVAL;
+	}
+	pthread_mutex_unlock(&SIM.lock);
+	return ret;
+}
+
+// Send at virtual time at, or now if that has passed. A later time is
+// spent before the datagram reaches the link, like a wait on the sending
+// host; the link's loss is still drawn in send order.
+static ssize_t SIM_sendto_at(int s, const void *buf, size_t len, int flags,
+	const struct sockaddr *to, socklen_t tolen, uint64_t at)
+{
+	struct SIM_Link *link = &SIM.link;
+	pthread_mutex_lock(&SIM.lock);
+	uint64_t now = at > SIM.now ? at : SIM.now;
+	struct SIM_Endpoint *ep = SIM_ep(s);
+	if(!ep){
+		pthread_mutex_unlock(&SIM.lock);
+		return -1;
+	}
+	uint16_t dst = to ? ((const struct sockaddr_in *)to)->sin_port : ep->peer;
+	if(!dst){
+		pthread_mutex_unlock(&SIM.lock);
+		errno = EDESTADDRREQ;
+		return -1;
+	}
+	// a sender is about to wait for the answer; until it joins, the other
+	// side alone would run the clock past its timeouts
+	SIM_attach();
+	if(!ep->port)
+		ep->port = SIM_ephemeral(s);
+	SIM.stats.sent++;
+
+	if(link->loss > 0 && SIM_uniform(ep) < link->loss){
+		SIM.stats.lost++;
+		pthread_mutex_unlock(&SIM.lock);
+		return len;
+	}
+
+	struct SIM_Event ev = {now, SIM.order++, dst, s, ep->id, NULL};
+	if(link->rate_bps){
+		uint64_t start = ep->busy_until > now ? ep->busy_until : now;
+		uint64_t backlog = (start - now) * link->rate_bps / 8000000;
+		if(link->queue_bytes && backlog + len > link->queue_bytes){
+			SIM.stats.queue_drops++;
+			pthread_mutex_unlock(&SIM.lock);
+			return len;
+		}
+		ep->busy_until = start + ((uint64_t)len * 8000000 + link->rate_bps - 1) / link->rate_bps;
+		ev.at = ep->busy_until;
+	}
+	ev.at += link->delay_usec;
+
+	if((ev.dg = POOL_alloc(sizeof(*ev.dg) + len)) == NULL){
+		pthread_mutex_unlock(&SIM.lock);
+		errno = ENOBUFS;
+		return -1;
+	}
+	ev.dg->src_port = ep->port;
+	ev.dg->len = len;
+	memcpy(ev.dg->data, buf, len);
+
+	if(ev.at <= SIM.now){
+		SIM_deliver(&ev);
+		pthread_cond_broadcast(&SIM.wake);
+	} else if(SIM_push(&ev) != 0){
+		POOL_free(ev.dg);
+		pthread_mutex_unlock(&SIM.lock);
+		errno = ENOBUFS;
+		return -1;
+	}
+	pthread_mutex_unlock(&SIM.lock);
+	return len;
+}
+
+static ssize_t SIM_sendto(int s, const void *buf, size_t len, int flags,
+	const struct sockaddr *to, socklen_t tolen)
+{
+	return SIM_sendto_at(s, buf, len, flags, to, tolen, 0);
+}
+
+static ssize_t SIM_recvmsg(int s, struct msghdr *msg, int flags)
+{
+	ssize_t ret = -1;
+	pthread_mutex_lock(&SIM.lock);
+	struct SIM_Endpoint *ep = SIM_ep(s);
+	uint64_t id = ep ? ep->id : 0;
+	while(ep){
+		if(!ep->open || ep->id != id){
+			errno = EBADF; // closed while we waited
+			break;
+		}
+		if(ep->error){
+			errno = ep->error;
+			ep->error = 0;
+			break;
+		}
+		struct SIM_Datagram *dg = ep->head;
+		if(!dg){
+			if(flags & MSG_DONTWAIT){
+				errno = EAGAIN;
+				break;
+			}
+			SIM_wait(ep, -1);
+			continue;
+		}
+		if(!(flags & MSG_PEEK)){
+			if((ep->head = dg->next) == NULL)
+				ep->tail = NULL;
+			ep->rx_bytes -= dg->len;
+		}
+
+		size_t off = 0;
+		size_t i;
+		for(i = 0; i < (size_t)msg->msg_iovlen && off < dg->len; i++){
+			size_t n = msg->msg_iov[i].iov_len;
+			if(n > dg->len - off)
+				n = dg->len - off;
+			memcpy(msg->msg_iov[i].iov_base, dg->data + off, n);
+			off += n;
+		}
+		msg->msg_flags = off < dg->len ? MSG_TRUNC : 0;
+		if(msg->msg_name){
+			struct sockaddr_in from = {0};
+			from.sin_family = AF_INET;
+			from.sin_port = dg->src_port;
+			from.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			if(msg->msg_namelen > sizeof(from))
+				msg->msg_namelen = sizeof(from);
+			memcpy(msg->msg_name, &from, msg->msg_namelen);
+		}
+		ret = off;
+		if(!(flags & MSG_PEEK))
+			POOL_free(dg);
+		break;
+	}
+	pthread_mutex_unlock(&SIM.lock);
+	return ret;
+}
+
+static int SIM_poll(int s, int64_t usec)
+{
+	int ret = -1;
+	pthread_mutex_lock(&SIM.lock);
+	struct SIM_Endpoint *ep = SIM_ep(s);
+	if(ep)
+		ret = SIM_wait(ep, usec);
+	pthread_mutex_unlock(&SIM.lock);
+	return ret;
+}
+
+static int SIM_getsockname(int s, struct sockaddr *addr, socklen_t *len)
+{
+	int ret = -1;
+	pthread_mutex_lock(&SIM.lock);
+	struct SIM_Endpoint *ep = SIM_ep(s);
+	if(ep){
+		struct sockaddr_in in = {0};
+		in.sin_family = AF_INET;
+		in.sin_port = ep->port;
+		in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if(*len > sizeof(in))
+			*len = sizeof(in);
+		memcpy(addr, &in, *len);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&SIM.lock);
+	return ret;
+}
+
+static int SIM_close(int s)
+{
+	pthread_mutex_lock(&SIM.lock);
+	struct SIM_Endpoint *ep = SIM_ep(s);
+	if(!ep){
+		pthread_mutex_unlock(&SIM.lock);
+		return -1;
+	}
+	while(ep->head){
+		struct SIM_Datagram *dg = ep->head;
+		ep->head = dg->next;
+		POOL_free(dg);
+	}
+	if(ep->port && SIM.ports[ep->port] == s)
+		SIM.ports[ep->port] = 0;
+	memset(ep, 0, sizeof(*ep));
+	pthread_cond_broadcast(&SIM.wake);
+	pthread_mutex_unlock(&SIM.lock);
+	return 0;
+}
+
+static uint64_t SIM_now(void)
+{
+	return __atomic_load_n(&SIM.now, __ATOMIC_ACQUIRE);
+}
+
+const struct XP_Ops SIM_ops = {
+	"sim",
+	true,
+	SIM_socket,
+	SIM_bind,
+	SIM_connect,
+	SIM_sendto,
+	SIM_recvmsg,
+	SIM_poll,
+	SIM_getsockname,
+	SIM_close,
+	SIM_now,
+	SIM_sendto_at
+};
+
+void SIM_configure(const struct SIM_Link *link)
+{
+	pthread_mutex_lock(&SIM.lock);
+	SIM.link = *link;
+	pthread_mutex_unlock(&SIM.lock);
+}
+
+void SIM_drain(void)
+{
+	pthread_mutex_lock(&SIM.lock);
+	while(SIM.len){
+		struct SIM_Event ev = SIM.heap[0];
+		SIM_pop();
+		if(ev.at > SIM.now)
+			__atomic_store_n(&SIM.now, ev.at, __ATOMIC_RELEASE);
+		SIM_deliver(&ev);
+	}
+	pthread_cond_broadcast(&SIM.wake);
+	pthread_mutex_unlock(&SIM.lock);
+}
+
+void SIM_stats(struct SIM_Stats *stats)
+{
+	pthread_mutex_lock(&SIM.lock);
+	*stats = SIM.stats;
+	pthread_mutex_unlock(&SIM.lock);
+}
+
+int SIM_parse(const char *spec, struct SIM_Link *link)
+{
+	char buf[256];
+	char *save = NULL, *tok;
+	if(!spec)
+		return 0;
+	if(strlen(spec) >= sizeof(buf))
+		return -1;
+	strcpy(buf, spec);
+
+	for(tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)){
+		char *val = strchr(tok, '='), *end;
+		double v;
+		if(!val)
+			return -1;
+		*val++ = '\0';
+		v = strtod(val, &end);
+		if(end == val || v < 0)
+			return -1;
+		switch(*end){
+		case 'k': case 'K': v *= 1e3; ++end; break;
+		case 'm': case 'M': v *= 1e6; ++end; break;
+		case 'g': case 'G': v *= 1e9; ++end; break;
+		}
+		if(*end != '\0')
+			return -1;
+		if(strcasecmp(tok, "rate") == 0)
+			link->rate_bps = (uint64_t)v;
+		else if(strcasecmp(tok, "delay") == 0)
+			link->delay_usec = (uint32_t)v;
+		else if(strcasecmp(tok, "queue") == 0)
+			link->queue_bytes = (uint32_t)v;
+		else if(strcasecmp(tok, "loss") == 0)
+			link->loss = v;
+		else if(strcasecmp(tok, "seed") == 0)
+			link->seed = (uint64_t)v;
+		else
+			return -1;
+	}
+	return 0;
+}
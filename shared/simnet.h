@@ -0,0 +1,49 @@
+#ifndef SIMNET_H_202610191830
+#define SIMNET_H_202610191830
+
+#include <stdint.h>
+
+#include "xport.h"
+
+/**
+ * In-memory datagram network on a virtual clock, as an XP_Ops backend.
+ * Sockets are addressed by port alone. Each one sends through its own link
+ * with the configured bandwidth, propagation delay, drop-tail queue and
+ * Bernoulli loss, drawn from a generator seeded per socket.
+ *
+ * Time only passes while every thread taking part is blocked in the network
+ * (XP_poll or a blocking receive); the clock then jumps to the next datagram
+ * arrival or wait deadline. A thread joins when it first sends or blocks and
+ * leaves when it exits or calls SIM_detach(), so a one-second retransmission timeout
+ * costs no wall-clock time at all. Threads that wait on anything else, like a
+ * condition variable or a ring, hold the clock still while they do.
+ **/
+struct SIM_Link
+{
+	uint64_t rate_bps;    // 0 for unlimited
+	uint32_t delay_usec;  // one-way propagation delay
+	uint32_t queue_bytes; // drop-tail limit of a capped link, 0 for unlimited
+	double loss;          // Bernoulli loss probability
+	uint64_t seed;
+};
+
+struct SIM_Stats
+{
+	uint64_t sent, delivered;
+	uint64_t lost, queue_drops, rcvbuf_drops, unreachable;
+};
+
+extern const struct XP_Ops SIM_ops;
+
+// Link used by datagrams sent from now on; the seed applies to new sockets
+void SIM_configure(const struct SIM_Link *link);
+// "rate=10m,delay=20000,queue=64k,loss=0.01,seed=1" on top of link
+int SIM_parse(const char *spec, struct SIM_Link *link);
+void SIM_stats(struct SIM_Stats *stats);
+// Let everything still on the wire arrive, moving the clock past it. Call
+// between independent transfers so stray datagrams do not leak into the next.
+void SIM_drain(void);
+// Stop holding the clock for the calling thread
+void SIM_detach(void);
+
+#endif
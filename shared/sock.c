@@ -1,21 +1,65 @@
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <errno.h>
 #include <string.h>
 #include <time.h>
 #include <signal.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include <unistd.h>
 //#include <sys/type.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include "global.h"
 #include "sock.h"
+#include "chksum.h"
+#include "spsc.h"
+#include "timerwheel.h"
+#include "impair.h"
+#include "xport.h"
+#include "metrics.h"
+#include "trace.h"
+#include "probe.h"
+
+// Packets buffered between the packetizer and the transmitter
+#define RDT_PIPELINE_DEPTH 64
+// Selective Repeat receive window in packets; must divide the 256 sequence numbers
+#define RDT_SR_WINDOW 32
+// Packets Selective Repeat keeps in flight unless RDT_set_window says otherwise
+#define RDT_SR_DEFAULT_WINDOW 10
+// Resolution of the shared timer wheel
+#define RDT_TIMER_TICK_USEC 100
+// Smallest receive ring, in packets
+#define RDT_RECV_MIN_PACKETS 10
+// Most pipes open at once. The table is reserved at this size up front so it
+// never moves; only the slots handed out so far are ever touched.
+#define RDT_MAX_PIPES 65536
+// Recent SYNs a listening pipe remembers, to answer retransmissions of them
+#define RDT_SYN_MEMORY 1024
+// SYNACKs RDT_accept sends before giving up on a client and listening again
+#define RDT_SYNACK_TRIES 5
+// FINs RDT_close sends without hearing back before taking the peer for gone
+#define RDT_FIN_TRIES 5
+
+// A protocol timer (retransmission, close...) owned by one pipe. Timers of all
+// pipes share one wheel; when one fires it is queued on its pipe's expired
+// list and the pipe's owner acts on it the next time it collects.
+struct RDT_Timer
+{
+	struct TW_Timer tw;
+	int pipe_idx;
+	bool queued; // on the pipe's expired list
+	struct RDT_Timer *next_expired;
+	struct RDT_Timer **pprev_expired;
+};
 
 struct RDT_Pipe
 {
@@ -33,6 +77,7 @@ struct RDT_Pipe
 	uint8_t stateflags;
 
 	uint32_t msec_timeout;
+	struct RDT_Timer *expired; // fired timers not yet collected by the owner
 
 	/* TODO: add backlog things here */
 
@@ -41,9 +86,53 @@ struct RDT_Pipe
 	uint8_t loc_seq;
 	uint8_t rem_seq;
 
-	size_t rbuf_len;
-	size_t rbuf_pos;
+	// In-order payload not yet taken by the application. Whole packets are
+	// appended and the capacity is a multiple of RDT_PAYLOAD_LEN, so a packet
+	// never wraps around the end of the ring.
 	char *rbuf;
+	size_t rbuf_cap;
+	size_t rbuf_head; // bytes consumed so far
+	size_t rbuf_tail; // bytes appended so far
+	// One entry per packet slot of the ring: 0, or one more than the payload
+	// bytes of a packet that ends an RDT_sendmsg message
+	uint8_t *rbuf_eor;
+
+	// Selective Repeat sender window, set by RDT_set_window; without a call
+	// the sender uses RDT_SR_DEFAULT_WINDOW
+	bool sr_configured;
+	int sr_window;
+	// Selective Repeat receive window, indexed by seqnum % RDT_SR_WINDOW
+	struct RDT_Packet *sr_win;
+	bool *sr_have;
+
+	// Integrity check in use on this pipe, and the one asked for locally. The
+	// handshake always uses the Internet checksum; the stronger of the two
+	// ends' choices applies once connected.
+	enum RDT_Integrity integrity;
+	enum RDT_Integrity integrity_pref;
+
+	// Simulated network impairments on data and ACK packets, NULL for none
+	struct IMP_Link *impair;
+
+	// Counters for RDT_info_stats, kept by whichever side touches them. They
+	// live in the pipe's slot of the metrics segment, where rdtstat sees them.
+	struct RDT_Stats *stats;
+	// Latency histograms (usec) for RDT_info_latency, in the slot as well
+	struct HST_Hist *rtt_hist;
+	struct HST_Hist *delivery_hist;
+
+	// Listening pipes: SYNs already given a pipe of their own, a ring
+	struct RDT_Syn *syns;
+	int syn_next;
+	uint32_t accepted; // pipes accepted so far, numbering their impairments
+};
+
+// A SYN RDT_accept has answered: the client's initial sequence number and
+// the pipe it was given (plus one, so zeroed entries are empty)
+struct RDT_Syn
+{
+	int conn;
+	uint8_t seqnum;
 };
 
 struct RDT_Header
@@ -54,38 +143,79 @@ struct RDT_Header
 	// Bit 0: FIN
 	// Bit 1: SYN
 	// Bit 2: RST
-	// Bit 3: PSH (Not Used)
+	// Bit 3: EOR - last packet of an RDT_sendmsg message; acknum then holds
+	//        how many of its payload bytes are the message's
 	// Bit 4: ACK
 	// Bit 5: URG (Not Used)
-	// 000A0RSF
+	// 000AERSF
 	uint8_t flags; 
 	uint8_t rwnd; // receiver window - number of 100-byte packets receiver can accept
-	uint16_t checksum; // computed checksum - in network order
+	uint32_t checksum; // integrity check of the pipe's mode - in network order
 };
 
 struct RDT_Packet
 {
 	struct RDT_Header header;
-	char payload[100]; // should be zero-padded if not full
+	char payload[RDT_PAYLOAD_LEN]; // should be zero-padded if not full
 };
+// sock.h publishes the size for RDT_packet_build callers
+typedef char RDT_PacketLenCheck[sizeof(struct RDT_Packet) == RDT_PACKET_LEN ? 1 : -1];
 
 struct RDT_PacketListEntry
 {
 	uint8_t seqnum;
+	uint8_t len; // payload bytes ahead of the padding
 	bool acked;
 	struct RDT_Packet packet;
 };
 
-struct PacketNode
+// Selective Repeat packets in flight, kept in a ring indexed by seqnum %
+// RDT_SR_WINDOW. Per-slot state lives in parallel arrays so an ACK touches
+// one slot and the acked bitmap, never the packet bodies of its neighbours.
+struct RDT_SRQueue
+{
+  uint8_t base;				// seqnum of the oldest packet in flight
+  int count;				// packets in flight
+  uint32_t acked;			// one bit per slot (RDT_SR_WINDOW <= 32)
+  uint64_t sent_usec[RDT_SR_WINDOW];	// last transmission time
+  uint16_t retransmits[RDT_SR_WINDOW];	// times the slot was sent again
+  uint8_t lens[RDT_SR_WINDOW];		// payload bytes ahead of the padding
+  struct RDT_Timer timers[RDT_SR_WINDOW];
+  struct RDT_Packet packets[RDT_SR_WINDOW];
+};
+
+// State shared by the stages of one pipelined RDT_send call. The packetizer
+// feeds checksummed packets to the transmitter, and for windowed protocols an
+// ACK processor thread feeds validated ACK headers back to it.
+struct RDT_SendPipeline
 {
-  struct RDT_PacketListEntry packet;
-  struct PacketNode *next;
+	int pipe_idx;
+	const char *buf;
+	size_t len;
+	uint8_t first_seq;
+	bool message; // RDT_sendmsg: the last packet ends a message
+
+	struct SPSC_Ring packets; // packetizer -> transmitter
+	struct SPSC_Ring acks;    // ACK processor -> transmitter
+	bool done;                // set by the transmitter to stop the ACK processor
+
+	// Single-threaded pipeline: everything is packetized up front and the
+	// transmitter reads ACKs itself. Used for short sends, and on virtual-time
+	// transports, whose clock must not move while a helper thread is busy.
+	bool inline_acks;
 };
 
 // Internal Data Table
 bool RDT_initialized = false;	   // has the table been initialized?
-size_t RDT_allocated = 0;		   // Number of slots allocated in the table
-struct RDT_Pipe *RDT_pipes = NULL; // The table itself
+size_t RDT_allocated = 0;		   // Number of slots handed out so far
+struct RDT_Pipe *RDT_pipes = NULL; // The table itself, RDT_MAX_PIPES slots
+static size_t RDT_free_hint = 0;   // every slot below this one is in use
+// Guards creating and freeing slots; a pipe itself belongs to its caller
+static pthread_mutex_t RDT_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Timer wheel shared by every pipe
+static struct TW_Wheel RDT_wheel;
+static pthread_mutex_t RDT_wheel_lock = PTHREAD_MUTEX_INITIALIZER;
 
 #define CREATED(i) ((RDT_pipes[i].stateflags & 0x01) > 0)
 #define BOUND(i) ((RDT_pipes[i].stateflags & 0x02) > 0)
@@ -106,45 +236,376 @@ struct RDT_Pipe *RDT_pipes = NULL; // The table itself
  * If the buffer has a zero-filled checksum field, this will compute the checksum.
  * If the buffer does not have a zero-filled checksum field, this will check the
  * checksum. If the result is 0, the check passes.
+ * The sum itself runs on the vectorized kernel in chksum.c.
  **/
 uint16_t RDT_inet_chksum(void* buf, size_t len)
 {
-	// convert to 16-bit words
-	uint16_t* words = (uint16_t*)buf;
-	size_t wlen = len / sizeof(*words);
-	// sum all words
-	uint32_t sum = 0;
-        int i = 0;
-	for(i = 0; i < wlen; ++i){
-		sum += ntohs(words[i]);
+	return CK_sum(buf, len) ^ 0xFFFF; // flip all bits
+}
+
+// CRC32C of a packet, taken with its checksum field zeroed
+static uint32_t RDT_crc(struct RDT_Packet *packet)
+{
+	uint32_t saved = packet->header.checksum;
+	packet->header.checksum = 0;
+	uint32_t crc = CK_crc32c(0, packet, sizeof(*packet));
+	packet->header.checksum = saved;
+	return crc;
+}
+
+// Fill in the checksum field according to an integrity mode
+static void RDT_sealWith(enum RDT_Integrity mode, struct RDT_Packet *packet)
+{
+	packet->header.checksum = 0;
+	switch(mode){
+	case RDT_INTEGRITY_NONE:
+		break;
+	case RDT_INTEGRITY_CRC32C:
+		packet->header.checksum = htonl(RDT_crc(packet));
+		break;
+	default:
+		packet->header.checksum = htonl(RDT_inet_chksum(packet, sizeof(*packet)));
+#ifdef DEBUG_
+		assert(RDT_inet_chksum(packet, sizeof(*packet)) == 0);
+#endif
+		break;
+	}
+}
+
+// ... and according to the pipe's
+static void RDT_seal(int pipe_idx, struct RDT_Packet *packet)
+{
+	RDT_sealWith(RDT_pipes[pipe_idx].integrity, packet);
+}
+
+// Check a received packet according to an integrity mode. The header and
+// payload may sit apart, as when the payload went into the ring.
+static bool RDT_intactWith(enum RDT_Integrity mode, const struct RDT_Header *header,
+		const char *payload)
+{
+	struct RDT_Header zeroed;
+	switch(mode){
+	case RDT_INTEGRITY_NONE:
+		return true; // the UDP checksum is all we have
+	case RDT_INTEGRITY_CRC32C:
+		zeroed = *header;
+		zeroed.checksum = 0;
+		return ntohl(header->checksum) ==
+			CK_crc32c(CK_crc32c(0, &zeroed, sizeof(zeroed)), payload, RDT_PAYLOAD_LEN);
+	default:
+		return (CK_add(CK_sum(header, sizeof(*header)),
+			CK_sum(payload, RDT_PAYLOAD_LEN)) ^ 0xFFFF) == 0;
+	}
+}
+
+static bool RDT_intactParts(int pipe_idx, const struct RDT_Header *header,
+		const char *payload)
+{
+	if(RDT_intactWith(RDT_pipes[pipe_idx].integrity, header, payload))
+		return true;
+	RDT_pipes[pipe_idx].stats->checksum_failures++;
+	return false;
+}
+
+// Build a data packet around up to RDT_PAYLOAD_LEN bytes of src, zero-padded,
+// marked as the end of a message if eor. The Internet checksum is summed
+// while the payload is copied in.
+static void RDT_buildPacket(enum RDT_Integrity mode, struct RDT_Packet *packet,
+		uint8_t seqnum, const char *src, size_t n, bool eor)
+{
+	memset(&packet->header, 0, sizeof(packet->header));
+	packet->header.seqnum = seqnum;
+	packet->header.acknum = eor ? n : 0;
+	packet->header.rwnd = 1; // TODO: Update for various protocols
+	packet->header.flags = eor ? 0x08 : 0;
+	memset(packet->payload + n, 0, RDT_PAYLOAD_LEN - n);
+	if(mode == RDT_INTEGRITY_INET){
+		// copy up to 100 bytes from buf to the payload, summing on the way
+		uint16_t sum = CK_copy_sum(packet->payload, src, n);
+		sum = CK_add(CK_sum(&packet->header, sizeof(packet->header)), sum);
+		packet->header.checksum = htonl(sum ^ 0xFFFF);
+#ifdef DEBUG_
+		assert(RDT_inet_chksum(packet, sizeof(*packet)) == 0);
+#endif
+	} else {
+		memcpy(packet->payload, src, n);
+		RDT_sealWith(mode, packet);
+	}
+}
+
+// Send a data-phase packet through the pipe's impairments, if any. The
+// handshakes bypass them: a lost final ACK of either one is never recovered.
+static int RDT_sendPacket(int pipe_idx, const struct RDT_Packet *packet)
+{
+	if(RDT_pipes[pipe_idx].impair)
+		return IMP_sendto(RDT_pipes[pipe_idx].impair, RDT_pipes[pipe_idx].sock_fd,
+			packet, sizeof(*packet), 0, NULL, 0);
+	return XP_send(RDT_pipes[pipe_idx].sock_fd, packet, sizeof(*packet), 0);
+}
+
+static bool RDT_intact(int pipe_idx, struct RDT_Packet *packet)
+{
+	return RDT_intactParts(pipe_idx, &packet->header, packet->payload);
+}
+
+// Receive ring bookkeeping, see struct RDT_Pipe
+static size_t RDT_rbufUsed(int pipe_idx)
+{
+	return RDT_pipes[pipe_idx].rbuf_tail - RDT_pipes[pipe_idx].rbuf_head;
+}
+
+// Where the next packet's payload goes, NULL if the ring has no room for it
+static char *RDT_rbufSlot(int pipe_idx)
+{
+	struct RDT_Pipe *pipe = &RDT_pipes[pipe_idx];
+	if(pipe->rbuf_cap - RDT_rbufUsed(pipe_idx) < RDT_PAYLOAD_LEN)
+		return NULL;
+	return pipe->rbuf + pipe->rbuf_tail % pipe->rbuf_cap;
+}
+
+// Payload bytes a receiver keeps of a packet: all of them, short of an EOR
+static size_t RDT_payloadLen(const struct RDT_Header *header)
+{
+	return header->flags & 0x08 ? min(header->acknum, RDT_PAYLOAD_LEN) : RDT_PAYLOAD_LEN;
+}
+
+// Returns whether the packet ended a message
+static bool RDT_rbufCommit(int pipe_idx, const struct RDT_Header *header)
+{
+	struct RDT_Pipe *pipe = &RDT_pipes[pipe_idx];
+	bool eor = (header->flags & 0x08) == 0x08;
+	size_t slot = pipe->rbuf_tail / RDT_PAYLOAD_LEN % (pipe->rbuf_cap / RDT_PAYLOAD_LEN);
+	pipe->rbuf_eor[slot] = eor ? RDT_payloadLen(header) + 1 : 0;
+	pipe->rbuf_tail += RDT_PAYLOAD_LEN;
+	return eor;
+}
+
+// A data packet read by a sender, which happens when the peer answers before
+// our last ACK wait is over, or when it missed an ACK of ours. Take it the way
+// the receiver would have: SP delivers the next packet into the ring and SR
+// buffers anything in its window, and either ACKs it. A retransmission of
+// something delivered is ACKed again, since the peer is stuck until it hears.
+static void RDT_strayData(int pipe_idx, const struct RDT_Packet *packet)
+{
+	struct RDT_Pipe *pipe = &RDT_pipes[pipe_idx];
+	if((packet->header.flags & ~0x08) != 0)
+		return; // FIN and the like are for the receiver or RDT_close
+	uint8_t ahead = packet->header.seqnum - pipe->rem_seq;
+	uint8_t behind = pipe->rem_seq - packet->header.seqnum;
+	if(pipe->protocol == SELECTIVE_REPEAT && ahead < RDT_SR_WINDOW){
+		int slot = packet->header.seqnum % RDT_SR_WINDOW;
+		if(!pipe->sr_have[slot]){
+			pipe->sr_win[slot] = *packet;
+			pipe->sr_have[slot] = true;
+			pipe->stats->packets_received++;
+		} else {
+			pipe->stats->duplicates++;
+		}
+	} else if(pipe->protocol == SINGLE_PACKET && ahead == 0){
+		char *slot = RDT_rbufSlot(pipe_idx);
+		if(slot == NULL)
+			return; // no room, it comes again
+		memcpy(slot, packet->payload, RDT_PAYLOAD_LEN);
+		RDT_rbufCommit(pipe_idx, &packet->header);
+		pipe->rem_seq++;
+		pipe->stats->packets_received++;
+	} else if(behind == 0 || behind > RDT_SR_WINDOW){
+		return;
+	} else {
+		pipe->stats->duplicates++;
+	}
+	DBG_PRINTF("RDT_send: ACKing data %d that came in while sending\n",
+		packet->header.seqnum);
+	struct RDT_Packet ack = {0};
+	ack.header.flags |= 0x10;
+	ack.header.acknum = packet->header.seqnum;
+	ack.header.rwnd = pipe->protocol == SELECTIVE_REPEAT ? RDT_SR_WINDOW : 1;
+	RDT_seal(pipe_idx, &ack);
+	RDT_sendPacket(pipe_idx, &ack);
+}
+
+// Parse an RDT_INTEGRITY setting; unknown names give the Internet checksum
+static enum RDT_Integrity RDT_integrityByName(const char *name)
+{
+	if(name && strcmp(name, "none") == 0)
+		return RDT_INTEGRITY_NONE;
+	if(name && strcmp(name, "crc32c") == 0)
+		return RDT_INTEGRITY_CRC32C;
+	return RDT_INTEGRITY_INET;
+}
+
+// Transport clock in microseconds, used for retransmission timers. Monotonic
+// on real sockets, virtual under the simulator.
+static uint64_t RDT_now_usec(void)
+{
+	return XP_now_usec();
+}
+
+// Fold an RTT sample into the pipe's estimate, as RFC 6298 does
+static void RDT_rttSample(int pipe_idx, uint64_t usec)
+{
+	struct RDT_Stats *st = RDT_pipes[pipe_idx].stats;
+	uint32_t rtt = min(usec, UINT32_MAX);
+	HST_record(RDT_pipes[pipe_idx].rtt_hist, usec);
+	if(st->srtt_usec == 0){
+		st->srtt_usec = max(rtt, 1);
+		st->rttvar_usec = rtt / 2;
+		return;
 	}
-	sum = (sum & 0x0000FFFF) + (sum & 0xFFFF0000); // add carry over
-	sum = (sum & 0x0000FFFF) + (sum & 0xFFFF0000); // add carry over of previous step
-	uint16_t chksum = (uint16_t)sum ^ 0xFFFF; // Truncate and flip all bits
-	return chksum;
+	uint32_t err = rtt > st->srtt_usec ? rtt - st->srtt_usec : st->srtt_usec - rtt;
+	st->rttvar_usec = st->rttvar_usec - st->rttvar_usec / 4 + err / 4;
+	st->srtt_usec = max(st->srtt_usec - st->srtt_usec / 8 + rtt / 8, 1);
+}
+
+// Publish the pipe's RTO and window after either changes. There is no
+// congestion control, so the configured window is the whole story.
+static void RDT_statsConfig(int pipe_idx)
+{
+	struct RDT_Pipe *pipe = &RDT_pipes[pipe_idx];
+	pipe->stats->rto_usec = pipe->msec_timeout * 1000;
+	if(pipe->protocol == SELECTIVE_REPEAT)
+		pipe->stats->cwnd = max(1, min(pipe->sr_configured ? pipe->sr_window :
+			RDT_SR_DEFAULT_WINDOW, RDT_SR_WINDOW));
+	else
+		pipe->stats->cwnd = 1;
+}
+
+// Wait up to usec microseconds for the pipe's socket to become readable
+static int RDT_pollData(int pipe_idx, uint64_t usec)
+{
+	return XP_poll(RDT_pipes[pipe_idx].sock_fd, usec);
 }
 
 int RDT_waitForData(int pipe_idx)
 {
-	fd_set socks;
-	FD_ZERO(&socks);
-	FD_SET(RDT_pipes[pipe_idx].sock_fd, &socks);
-	struct timeval timeout = {0};
-	timeout.tv_sec = RDT_pipes[pipe_idx].msec_timeout / 1000;
-	timeout.tv_usec = (RDT_pipes[pipe_idx].msec_timeout % 1000) * 1000;
-
-	return select(
-		RDT_pipes[pipe_idx].sock_fd + 1,
-		&socks,
-		NULL,
-		NULL,
-		&timeout
-	);
+	return RDT_pollData(pipe_idx, (uint64_t)RDT_pipes[pipe_idx].msec_timeout * 1000);
+}
+
+// Called by the wheel, with RDT_wheel_lock held
+static void RDT_timerFired(struct TW_Timer *tw)
+{
+	struct RDT_Timer *timer = tw->data;
+	struct RDT_Timer **head = &RDT_pipes[timer->pipe_idx].expired;
+	timer->next_expired = *head;
+	timer->pprev_expired = head;
+	if(*head)
+		(*head)->pprev_expired = &timer->next_expired;
+	*head = timer;
+	timer->queued = true;
+}
+
+// Drop a fired timer from its pipe's expired list. Caller holds RDT_wheel_lock.
+static void RDT_timerDequeue(struct RDT_Timer *timer)
+{
+	if(!timer->queued)
+		return;
+	*timer->pprev_expired = timer->next_expired;
+	if(timer->next_expired)
+		timer->next_expired->pprev_expired = timer->pprev_expired;
+	timer->queued = false;
+}
+
+static void RDT_timerInit(struct RDT_Timer *timer, int pipe_idx)
+{
+	memset(timer, 0, sizeof(*timer));
+	TW_timer_init(&timer->tw, RDT_timerFired, timer);
+	timer->pipe_idx = pipe_idx;
+}
+
+// (Re)arm a timer to fire usec from now, discarding any uncollected expiry
+static void RDT_timerArm(struct RDT_Timer *timer, uint64_t usec)
+{
+	pthread_mutex_lock(&RDT_wheel_lock);
+	RDT_timerDequeue(timer);
+	TW_arm(&RDT_wheel, &timer->tw, RDT_now_usec() + usec);
+	pthread_mutex_unlock(&RDT_wheel_lock);
+}
+
+// Stop a timer. Afterwards it is neither armed nor queued and can be freed.
+static void RDT_timerCancel(struct RDT_Timer *timer)
+{
+	pthread_mutex_lock(&RDT_wheel_lock);
+	TW_cancel(&RDT_wheel, &timer->tw);
+	RDT_timerDequeue(timer);
+	pthread_mutex_unlock(&RDT_wheel_lock);
+}
+
+// Run the shared wheel up to now and take the pipe's fired timers
+static struct RDT_Timer *RDT_timersExpired(int pipe_idx)
+{
+	pthread_mutex_lock(&RDT_wheel_lock);
+	TW_advance(&RDT_wheel, RDT_now_usec());
+	struct RDT_Timer *list = RDT_pipes[pipe_idx].expired;
+	RDT_pipes[pipe_idx].expired = NULL;
+	struct RDT_Timer *timer;
+	for(timer = list; timer != NULL; timer = timer->next_expired)
+		timer->queued = false;
+	pthread_mutex_unlock(&RDT_wheel_lock);
+	return list;
+}
+
+// Microseconds until the shared wheel next needs to run, capped at max_usec
+static uint64_t RDT_timersNextWait(uint64_t max_usec)
+{
+	pthread_mutex_lock(&RDT_wheel_lock);
+	uint64_t due = TW_next_deadline(&RDT_wheel);
+	pthread_mutex_unlock(&RDT_wheel_lock);
+	uint64_t now = RDT_now_usec();
+	if(due <= now)
+		return 0;
+	return min(due - now, max_usec);
+}
+
+/**
+ * Wait for data on the pipe or for one of its armed timers to fire.
+ * Returns >0 when data is ready, <0 on error, and 0 once timers fired, in
+ * which case *expired holds the collected list.
+ **/
+static int RDT_waitForDataOrTimers(int pipe_idx, struct RDT_Timer **expired)
+{
+	uint64_t timeout = (uint64_t)RDT_pipes[pipe_idx].msec_timeout * 1000;
+	while(true){
+		int ret = RDT_pollData(pipe_idx, RDT_timersNextWait(timeout));
+		if(ret != 0)
+			return ret;
+		*expired = RDT_timersExpired(pipe_idx);
+		if(*expired)
+			return 0;
+	}
+}
+
+static pthread_once_t RDT_init_once = PTHREAD_ONCE_INIT;
+
+// Runs once per process; if it fails, RDT_initialized stays false and every
+// RDT_socket call fails
+static void RDT_init(void)
+{
+	srand(time(NULL));
+	TW_init(&RDT_wheel, RDT_TIMER_TICK_USEC, RDT_now_usec());
+	// calloc hands large blocks straight from the kernel, so untouched
+	// slots cost address space only
+	RDT_pipes = calloc(RDT_MAX_PIPES, sizeof(*RDT_pipes));
+	if (RDT_pipes == NULL)
+		return;
+	if (MET_open(RDT_MAX_PIPES) != 0)
+	{
+		free(RDT_pipes);
+		RDT_pipes = NULL;
+		return;
+	}
+	TRC_init();
+	RDT_initialized = true;
 }
 
 int RDT_socket(enum RDT_Protocol protocol)
 {
-	int sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	pthread_once(&RDT_init_once, RDT_init);
+	if (!RDT_initialized)
+	{
+		DBG_FPRINTF(stderr, "createRDTPipe(): pipe table unavailable\n");
+		return -1;
+	}
+	int sock_fd = XP_socket(AF_INET, SOCK_DGRAM, 0);
 	if (sock_fd < 0)
 	{
 		// socket creation failed
@@ -153,18 +614,12 @@ int RDT_socket(enum RDT_Protocol protocol)
 		return -1;
 	}
 
-	if (!RDT_initialized)
-	{
-		srand(time(NULL));
-		RDT_pipes = calloc(10, sizeof(*RDT_pipes));
-		RDT_allocated = 10; // start by allocating 10 slots
-		RDT_initialized = true;
-	}
+	pthread_mutex_lock(&RDT_table_lock);
 
-	// find earliest open slot
+	// find earliest open slot, or take a fresh one past the end
 	int newIdx = -1;
-	int i = 0;
-	for (i = 0; i < RDT_allocated; ++i)
+	size_t i;
+	for (i = RDT_free_hint; i < RDT_allocated; ++i)
 	{
 		if (!CREATED(i))
 		{
@@ -172,32 +627,49 @@ int RDT_socket(enum RDT_Protocol protocol)
 			break;
 		}
 	}
-
-	// if there aren't any, realloc, doubling size
-	if (newIdx == -1)
+	if (newIdx == -1 && RDT_allocated < RDT_MAX_PIPES)
 	{
 		newIdx = RDT_allocated;
-		RDT_allocated *= 2;
-		RDT_pipes = realloc(RDT_pipes, RDT_allocated * sizeof(*RDT_pipes));
-		// This ensures flags are fully cleared - no zombie slots
-		memset(
-			RDT_pipes + (RDT_allocated / 2),
-			0,
-			(RDT_allocated / 2) * sizeof(*RDT_pipes)
-		);
+		__atomic_store_n(&RDT_allocated, RDT_allocated + 1, __ATOMIC_RELEASE);
+	}
+	if (newIdx == -1)
+	{
+		pthread_mutex_unlock(&RDT_table_lock);
+		DBG_FPRINTF(stderr, "createRDTPipe(): no free pipe slots\n");
+		XP_close(sock_fd);
+		return -1;
 	}
+	RDT_free_hint = newIdx + 1;
+	CREATE(newIdx); // claims the slot
+	pthread_mutex_unlock(&RDT_table_lock);
 
 	RDT_pipes[newIdx].sock_fd = sock_fd;
 	RDT_pipes[newIdx].protocol = protocol;
+	RDT_pipes[newIdx].stats = MET_stats(newIdx);
+	RDT_pipes[newIdx].rtt_hist = MET_rtt(newIdx);
+	RDT_pipes[newIdx].delivery_hist = MET_delivery(newIdx);
+	MET_pipeOpen(newIdx, protocol);
+	TRC_EVENT(TRC_STATE, protocol, newIdx, MET_OPEN, MET_FREE);
 
 	// TODO: change this for real things
 	RDT_pipes[newIdx].msec_timeout = 1000;
-	int buflen = 1000;
-	RDT_pipes[newIdx].rbuf = calloc(1, buflen);
-	RDT_pipes[newIdx].rbuf_len = buflen;
-	RDT_pipes[newIdx].rbuf_pos = 0;
+	// size the receive ring to the window we advertise
+	int window = protocol == SELECTIVE_REPEAT ? RDT_SR_WINDOW : 1;
+	RDT_pipes[newIdx].rbuf_cap = RDT_PAYLOAD_LEN * max(window, RDT_RECV_MIN_PACKETS);
+	RDT_pipes[newIdx].rbuf = malloc(RDT_pipes[newIdx].rbuf_cap);
+	RDT_pipes[newIdx].rbuf_eor = calloc(RDT_pipes[newIdx].rbuf_cap / RDT_PAYLOAD_LEN, 1);
+	RDT_pipes[newIdx].rbuf_head = 0;
+	RDT_pipes[newIdx].rbuf_tail = 0;
 	/* TODO: Protocol data initialization here */
-	CREATE(newIdx);
+	if(protocol == SELECTIVE_REPEAT){
+		RDT_pipes[newIdx].sr_win = calloc(RDT_SR_WINDOW, sizeof(struct RDT_Packet));
+		RDT_pipes[newIdx].sr_have = calloc(RDT_SR_WINDOW, sizeof(bool));
+	}
+	RDT_pipes[newIdx].integrity = RDT_INTEGRITY_INET;
+	RDT_pipes[newIdx].integrity_pref = RDT_integrityByName(getenv("RDT_INTEGRITY"));
+	RDT_statsConfig(newIdx);
+	if(RDT_set_impairment(newIdx, getenv("RDT_IMPAIR")) != 0)
+		DBG_FPRINTF(stderr, "RDT_socket: Ignoring malformed RDT_IMPAIR\n");
 
 	return newIdx;
 }
@@ -218,7 +690,7 @@ int RDT_bind(int pipe_idx, const char *addr, uint16_t port)
 	memset(RDT_pipes[pipe_idx].local.sin_zero, 0, 8);
 
 	// bind the socket to the address
-	int ret = bind(
+	int ret = XP_bind(
 		RDT_pipes[pipe_idx].sock_fd,
 		(struct sockaddr *)&RDT_pipes[pipe_idx].local,
 		sizeof(struct sockaddr_in)
@@ -230,6 +702,7 @@ int RDT_bind(int pipe_idx, const char *addr, uint16_t port)
 		return errno;
 	}
 	BIND(pipe_idx);
+	MET_pipeState(pipe_idx, MET_OPEN, &RDT_pipes[pipe_idx].local);
 	return 0;
 }
 
@@ -243,11 +716,82 @@ int RDT_listen(int pipe_idx, int backlog)
 
 	/* listen() normally only works for SOCK_STREAM or SOCK_SEQPACKET,
 	   so this will do the same thing for our RDT sockets. */
-	// TODO: Set up backlog things
+	// The backlog is the socket's receive buffer: SYNs wait there for accept
+	if (!RDT_pipes[pipe_idx].syns)
+		RDT_pipes[pipe_idx].syns = calloc(RDT_SYN_MEMORY, sizeof(struct RDT_Syn));
+	if (!RDT_pipes[pipe_idx].syns)
+		return -1;
 	LISTEN(pipe_idx);
+	MET_pipeState(pipe_idx, MET_LISTENING, NULL);
+	TRC_EVENT(TRC_STATE, RDT_pipes[pipe_idx].protocol, pipe_idx, MET_LISTENING, MET_OPEN);
 	return 0;
 }
 
+// Is this SYN a retransmission of one the listening pipe has already given a
+// pipe to? It is as long as that pipe is still open to the same client.
+static bool RDT_synSeen(int pipe_idx, const struct sockaddr_in *cli, uint8_t seqnum)
+{
+	struct RDT_Syn *syns = RDT_pipes[pipe_idx].syns;
+	int i;
+	for(i = 0; i < RDT_SYN_MEMORY; ++i){
+		int conn = syns[i].conn - 1;
+		if(conn >= 0 && syns[i].seqnum == seqnum && CREATED(conn) &&
+				RDT_pipes[conn].remote.sin_addr.s_addr == cli->sin_addr.s_addr &&
+				RDT_pipes[conn].remote.sin_port == cli->sin_port)
+			return true;
+	}
+	return false;
+}
+
+static void RDT_synRemember(int pipe_idx, uint8_t seqnum, int conn)
+{
+	struct RDT_Syn *syn = &RDT_pipes[pipe_idx].syns[RDT_pipes[pipe_idx].syn_next];
+	RDT_pipes[pipe_idx].syn_next = (RDT_pipes[pipe_idx].syn_next + 1) % RDT_SYN_MEMORY;
+	syn->conn = conn + 1;
+	syn->seqnum = seqnum;
+}
+
+// A pipe for one accepted connection: a new socket on the listener's address
+// and a port of its own, with the listener's settings
+static int RDT_acceptPipe(int pipe_idx)
+{
+	struct RDT_Pipe *lis = &RDT_pipes[pipe_idx];
+	int conn = RDT_socket(lis->protocol);
+	if(conn < 0)
+		return -1;
+	struct RDT_Pipe *pipe = &RDT_pipes[conn];
+	pipe->local = lis->local;
+	pipe->local.sin_port = 0;
+	socklen_t len = sizeof(pipe->local);
+	if(XP_bind(pipe->sock_fd, (struct sockaddr *)&pipe->local, sizeof(pipe->local)) != 0 ||
+			XP_getsockname(pipe->sock_fd, (struct sockaddr *)&pipe->local, &len) != 0){
+		DBG_FPRINTF(stderr, "RDT_accept: Binding the new pipe: %s\n", strerror(errno));
+		RDT_close(conn);
+		return -1;
+	}
+	BIND(conn);
+	MET_pipeState(conn, MET_OPEN, &pipe->local);
+	pipe->msec_timeout = lis->msec_timeout;
+	pipe->integrity_pref = lis->integrity_pref;
+	pipe->sr_window = lis->sr_window;
+	pipe->sr_configured = lis->sr_configured;
+	RDT_statsConfig(conn);
+	RDT_set_impairment(conn, NULL);
+	if(lis->impair){
+		struct IMP_Link *link = malloc(sizeof(*link));
+		if(link && IMP_init(link, &lis->impair->cfg) == 0){
+			// apart from the connecting end and from earlier connections
+			IMP_salt(link, ++lis->accepted);
+			pipe->impair = link;
+		} else
+			free(link);
+	}
+	return conn;
+}
+
+// Waits for a SYN on the listening pipe and answers it from a new pipe, which
+// is returned connected; the listening pipe keeps listening. The client learns
+// the new pipe's port from the SYNACK's source address (see RDT_connect).
 int RDT_accept(int pipe_idx)
 {
 	if (pipe_idx >= RDT_allocated)
@@ -257,12 +801,11 @@ int RDT_accept(int pipe_idx)
 			CONNECTED(pipe_idx))
 		return -1;
 
-	struct RDT_Packet syn = {0};
-	struct sockaddr_in cli_addr = {0};
-	socklen_t cli_addr_len = sizeof(cli_addr);
-	bool wait = true;
-	do{
-		int ret = recvfrom(
+	for(;;){
+		struct RDT_Packet syn = {0};
+		struct sockaddr_in cli_addr = {0};
+		socklen_t cli_addr_len = sizeof(cli_addr);
+		int ret = XP_recvfrom(
 			RDT_pipes[pipe_idx].sock_fd,
 			&syn,
 			sizeof(syn),
@@ -270,96 +813,117 @@ int RDT_accept(int pipe_idx)
 			(struct sockaddr *)&cli_addr,
 			&cli_addr_len
 		);
+		if(ret < 0 && errno != EINTR){
+			DBG_FPRINTF(stderr, "RDT_accept: Error reading SYN: %s\n", strerror(errno));
+			return -1;
+		}
 		if(ret != sizeof(syn)){
 			DBG_FPRINTF(stderr, "RDT_accept: Incoming connection not valid\n");
 			continue;
 		}
-		if(RDT_inet_chksum(&syn, sizeof(syn)) != 0){
+		if(!RDT_intact(pipe_idx, &syn)){
 			DBG_FPRINTF(stderr, "RDT_accept: Incoming packet failed checksum\n");
 			continue;
 		}
-		if(syn.header.flags & 2 != 2){
+		if((syn.header.flags & 0x12) != 0x02){
 			DBG_FPRINTF(stderr, "RDT_accept: Incoming packet is not a SYN\n");
 			continue;
 		}
+		if(RDT_synSeen(pipe_idx, &cli_addr, syn.header.seqnum)){
+			// its SYNACK is on the way, or it is connected already
+			DBG_PRINTF("RDT_accept: Repeated SYN from %s:%d\n",
+				inet_ntoa(cli_addr.sin_addr), cli_addr.sin_port);
+			continue;
+		}
 
 		DBG_PRINTF("RDT_accept: Received SYN from %s:%d\n", inet_ntoa(cli_addr.sin_addr), 
 			cli_addr.sin_port);
 
-		wait = false;
-	} while(wait);
-
-	// See comment below
-	connect(RDT_pipes[pipe_idx].sock_fd, (struct sockaddr*)&cli_addr, sizeof(cli_addr));
-	RDT_pipes[pipe_idx].remote = cli_addr; // should be trivially copyable
-	RDT_pipes[pipe_idx].loc_seq = rand() % 256;
-	RDT_pipes[pipe_idx].rem_seq = syn.header.seqnum;
-
-	struct RDT_Packet synack = {0};
-	synack.header.seqnum = RDT_pipes[pipe_idx].loc_seq;
-	synack.header.acknum = RDT_pipes[pipe_idx].rem_seq;
-	synack.header.flags = 0x12; // 00010010
-	synack.header.rwnd = 1; // TODO: protocol defined; maybe leave as is for 3wh
-	int chksum = RDT_inet_chksum(&synack, sizeof(synack));
-	synack.header.checksum = htons(chksum);
-#ifdef DEBUG_
-	assert(RDT_inet_chksum(&synack, sizeof(synack)) == 0);
-#endif
-
-	// Transmit SYNACK message and wait for ACK
-	bool retransmit = true;
-	while(retransmit){
-		DBG_PRINTF("RDT_accept: Sending SYNACK response to %s:%d\n",
-			inet_ntoa(cli_addr.sin_addr), cli_addr.sin_port);
-		int ret = send(RDT_pipes[pipe_idx].sock_fd, &synack, sizeof(synack), 0);
-		if(ret != sizeof(synack)){
-			DBG_FPRINTF(stderr, "RDT_accept: SYNACK message did not send correct "
-				"number of bytes.\n");
+		int conn = RDT_acceptPipe(pipe_idx);
+		if(conn < 0)
 			return -1;
-		}
-		struct RDT_Packet ack = {0};
+		// From here on the new socket only hears from this client
+		XP_connect(RDT_pipes[conn].sock_fd, (struct sockaddr*)&cli_addr, sizeof(cli_addr));
+		RDT_pipes[conn].remote = cli_addr; // should be trivially copyable
+		RDT_pipes[conn].loc_seq = rand() % 256;
+		RDT_pipes[conn].rem_seq = syn.header.seqnum;
+		RDT_synRemember(pipe_idx, syn.header.seqnum, conn);
+
+		// The SYN's first payload byte asks for an integrity mode; settle on the
+		// stronger of it and ours and announce the result in the SYNACK
+		enum RDT_Integrity integrity = RDT_pipes[conn].integrity_pref;
+		if((uint8_t)syn.payload[0] > integrity && (uint8_t)syn.payload[0] <= RDT_INTEGRITY_CRC32C)
+			integrity = (uint8_t)syn.payload[0];
 
-		ret = RDT_waitForData(pipe_idx);
-		if(ret == 0){
-			DBG_PRINTF("RDT_accept: Timeout waiting for ACK\n");
-			continue;
-		} else if(ret < 0){
-			DBG_FPRINTF(stderr, "RDT_accept: Error waiting for ACK: %s\n",
-				strerror(errno));
-				return -1;
-		}
+		struct RDT_Packet synack = {0};
+		synack.payload[0] = integrity;
+		synack.header.seqnum = RDT_pipes[conn].loc_seq;
+		synack.header.acknum = RDT_pipes[conn].rem_seq;
+		synack.header.flags = 0x12; // 00010010
+		synack.header.rwnd = 1; // TODO: protocol defined; maybe leave as is for 3wh
+		RDT_seal(conn, &synack);
+
+		// Transmit SYNACK message and wait for ACK
+		int tries;
+		for(tries = 0; tries < RDT_SYNACK_TRIES; ++tries){
+			DBG_PRINTF("RDT_accept: Sending SYNACK response to %s:%d\n",
+				inet_ntoa(cli_addr.sin_addr), cli_addr.sin_port);
+			ret = XP_send(RDT_pipes[conn].sock_fd, &synack, sizeof(synack), 0);
+			if(ret != sizeof(synack)){
+				DBG_FPRINTF(stderr, "RDT_accept: SYNACK message did not send correct "
+					"number of bytes.\n");
+				break;
+			}
+			struct RDT_Packet ack = {0};
 
-		ret = recv(RDT_pipes[pipe_idx].sock_fd, &ack, sizeof(ack), 0);
-		if(ret == -1){
-			DBG_FPRINTF(stderr, "RDT_accept: Error reading ACK: %s", strerror(errno));
-			return -1;
-		}
+			ret = RDT_waitForData(conn);
+			if(ret == 0){
+				DBG_PRINTF("RDT_accept: Timeout waiting for ACK\n");
+				continue;
+			} else if(ret < 0){
+				DBG_FPRINTF(stderr, "RDT_accept: Error waiting for ACK: %s\n",
+					strerror(errno));
+				break;
+			}
 
-		if(RDT_inet_chksum(&ack, sizeof(ack)) != 0){
-			DBG_PRINTF("RDT_accept: Message received corrupt\n");
-			continue;
-		}
-		
-		if((ack.header.flags & 0x10) != 0x10){
-			DBG_PRINTF("RDT_accept: Message received not an ACK\n");
-			continue;
-		}
+			ret = XP_recv(RDT_pipes[conn].sock_fd, &ack, sizeof(ack), 0);
+			if(ret == -1){
+				DBG_FPRINTF(stderr, "RDT_accept: Error reading ACK: %s", strerror(errno));
+				break;
+			}
 
-		if(ack.header.acknum != RDT_pipes[pipe_idx].loc_seq){
-			DBG_PRINTF("RDT_accept: Message received ACKing incorrect seqnum\n");
-			continue;
-		}
+			if(!RDT_intact(conn, &ack)){
+				DBG_PRINTF("RDT_accept: Message received corrupt\n");
+				continue;
+			}
+			
+			if((ack.header.flags & 0x10) != 0x10){
+				DBG_PRINTF("RDT_accept: Message received not an ACK\n");
+				continue;
+			}
+
+			if(ack.header.acknum != RDT_pipes[conn].loc_seq){
+				DBG_PRINTF("RDT_accept: Message received ACKing incorrect seqnum\n");
+				continue;
+			}
 
-		DBG_PRINTF("RDT_accept: Received ACK from %s:%d\n", inet_ntoa(cli_addr.sin_addr),
+			DBG_PRINTF("RDT_accept: Received ACK from %s:%d\n", inet_ntoa(cli_addr.sin_addr),
+				cli_addr.sin_port);
+			RDT_pipes[conn].loc_seq++;
+			RDT_pipes[conn].integrity = integrity;
+			CONNECT(conn);
+			MET_pipeConnected(conn, &cli_addr, true);
+			TRC_EVENT(TRC_STATE, RDT_pipes[conn].protocol, conn, MET_CONNECTED, MET_OPEN);
+			PROBE3(accept, pipe_idx, conn, ntohs(cli_addr.sin_port));
+			return conn;
+		}
+		// the client went away; wait for the next one
+		DBG_FPRINTF(stderr, "RDT_accept: Giving up on %s:%d\n", inet_ntoa(cli_addr.sin_addr),
 			cli_addr.sin_port);
-		retransmit = false;
+		RDT_close(conn);
 	}
-	RDT_pipes[pipe_idx].loc_seq++;
-	CONNECT(pipe_idx);
-	return pipe_idx;
 }
 
-// FIXME: Update connect to allow a port change for accept()'s new socket
 int RDT_connect(int pipe_idx, const char *addr, uint16_t port)
 {
 	if (pipe_idx >= RDT_allocated){
@@ -379,42 +943,31 @@ int RDT_connect(int pipe_idx, const char *addr, uint16_t port)
 	RDT_pipes[pipe_idx].remote.sin_port = port;
 	inet_aton(addr, &RDT_pipes[pipe_idx].remote.sin_addr);
 	memset(RDT_pipes[pipe_idx].remote.sin_zero, 0, 8);
-
-	// From man 2 connect:
-	// "If the socket sockfd is of type SOCK_DGRAM, then addr is the address to which
-	// datagrams are sent by default, and the only address from which datagrams are
-	// received"
-	// This is wonderful. It will allow automatic source verification.
-	connect(
-		RDT_pipes[pipe_idx].sock_fd,
-		(struct sockaddr*)&RDT_pipes[pipe_idx].remote,
-		sizeof(struct sockaddr_in)
-	);
 	RDT_pipes[pipe_idx].loc_seq = rand() % 256; // choose initial sequence number
 
 	struct RDT_Packet syn = {0};
+	syn.payload[0] = RDT_pipes[pipe_idx].integrity_pref; // see RDT_accept
 	syn.header.seqnum = RDT_pipes[pipe_idx].loc_seq;
 	syn.header.flags |= 2; // SYN bit
 	syn.header.rwnd = 1; // TODO: protocol defined; maybe leave as is for 3wh
-	uint16_t ckh = RDT_inet_chksum(&syn, sizeof(syn));
-	syn.header.checksum = htons(ckh);
-
-#ifdef DEBUG_
-	// Verify checksum computed properly
-	assert(RDT_inet_chksum(&syn, sizeof(syn)) == 0);
-#endif
+	RDT_seal(pipe_idx, &syn);
 
-	// Transmit SYN message and wait for SYNACK
+	// Transmit SYN message and wait for SYNACK. The SYN goes to the listening
+	// port but the SYNACK comes from the port of the pipe accept made for us.
+	enum RDT_Integrity integrity = RDT_INTEGRITY_INET;
 	bool retransmit = true;
 	while(retransmit){
 		DBG_PRINTF("RDT_Connect: Sending SYN request to %s:%d\n", addr, port);
-		int ret = send(RDT_pipes[pipe_idx].sock_fd, &syn, sizeof(syn), 0);
+		int ret = XP_sendto(RDT_pipes[pipe_idx].sock_fd, &syn, sizeof(syn), 0,
+			(struct sockaddr*)&RDT_pipes[pipe_idx].remote, sizeof(struct sockaddr_in));
 		if(ret != sizeof(syn)){
 			DBG_FPRINTF(stderr, "RDT_Connect: SYN message did not send correct "
 				"number of bytes.\n");
 			return -1;
 		}
 		struct RDT_Packet synack = {0};
+		struct sockaddr_in from = {0};
+		socklen_t from_len = sizeof(from);
 
 		ret = RDT_waitForData(pipe_idx);
 		if(ret == 0){
@@ -426,13 +979,19 @@ int RDT_connect(int pipe_idx, const char *addr, uint16_t port)
 			return -1;
 		}
 
-		ret = recv(RDT_pipes[pipe_idx].sock_fd, &synack, sizeof(synack), 0);
+		ret = XP_recvfrom(RDT_pipes[pipe_idx].sock_fd, &synack, sizeof(synack), 0,
+			(struct sockaddr*)&from, &from_len);
 		if(ret == -1){
 			DBG_FPRINTF(stderr, "RDT_Connect: Error reading SYNACK: %s", strerror(errno));
 			return -1;
 		}
 
-		if(RDT_inet_chksum(&synack, sizeof(synack)) != 0){
+		if(from.sin_addr.s_addr != RDT_pipes[pipe_idx].remote.sin_addr.s_addr){
+			DBG_PRINTF("RDT_Connect: Message received from another host\n");
+			continue;
+		}
+
+		if(!RDT_intact(pipe_idx, &synack)){
 			DBG_PRINTF("RDT_Connect: Message received corrupt\n");
 			continue;
 		}
@@ -447,284 +1006,467 @@ int RDT_connect(int pipe_idx, const char *addr, uint16_t port)
 			continue;
 		}
 
-		DBG_PRINTF("RDT_Connect: Received SYNACK from %s:%d\n", addr, port);
+		DBG_PRINTF("RDT_Connect: Received SYNACK from %s:%d\n", addr, from.sin_port);
+		RDT_pipes[pipe_idx].remote.sin_port = from.sin_port;
 		RDT_pipes[pipe_idx].rem_seq = synack.header.seqnum;
+		integrity = (uint8_t)synack.payload[0] <= RDT_INTEGRITY_CRC32C ?
+			(uint8_t)synack.payload[0] : RDT_INTEGRITY_INET;
 		retransmit = false;
 	}
 
+	// From man 2 connect:
+	// "If the socket sockfd is of type SOCK_DGRAM, then addr is the address to which
+	// datagrams are sent by default, and the only address from which datagrams are
+	// received"
+	// This is wonderful. It will allow automatic source verification.
+	XP_connect(
+		RDT_pipes[pipe_idx].sock_fd,
+		(struct sockaddr*)&RDT_pipes[pipe_idx].remote,
+		sizeof(struct sockaddr_in)
+	);
+
 	// SYN sent, SYNACK received
 	struct RDT_Packet ack = {0};
 	ack.header.acknum = RDT_pipes[pipe_idx].rem_seq;
+	// the SYNACK took a seqnum of its own: RDT_accept starts its data after it
+	RDT_pipes[pipe_idx].rem_seq++;
 	ack.header.flags = 0x10;
 	ack.header.rwnd = 1; //TODO: same as above
-	ckh = RDT_inet_chksum(&ack, sizeof(ack));
-	ack.header.checksum = htons(ckh);
-#ifdef DEBUG_
-	// Verify checksum computed properly
-	assert(RDT_inet_chksum(&ack, sizeof(ack)) == 0);
-#endif
+	RDT_seal(pipe_idx, &ack);
 
-	DBG_PRINTF("RDT_Connect: Sending ACK to %s:%d\n", addr, port);
-	int ret = send(RDT_pipes[pipe_idx].sock_fd, &ack, sizeof(ack), 0);
+	DBG_PRINTF("RDT_Connect: Sending ACK to %s:%d\n", addr,
+		RDT_pipes[pipe_idx].remote.sin_port);
+	int ret = XP_send(RDT_pipes[pipe_idx].sock_fd, &ack, sizeof(ack), 0);
 	if(ret != sizeof(ack)){
 		DBG_FPRINTF(stderr, "RDT_Connect: Error sending ACK: %s\n", strerror(errno));
 		return -1;
 	}
+	RDT_pipes[pipe_idx].integrity = integrity;
 	CONNECT(pipe_idx);
+	MET_pipeConnected(pipe_idx, &RDT_pipes[pipe_idx].remote, false);
+	TRC_EVENT(TRC_STATE, RDT_pipes[pipe_idx].protocol, pipe_idx, MET_CONNECTED, MET_OPEN);
+	PROBE3(connect, pipe_idx, ntohs(RDT_pipes[pipe_idx].local.sin_port),
+		ntohs(RDT_pipes[pipe_idx].remote.sin_port));
 	return 0;
 }
 
-// Sending algorithm for Single Packet RDT Protocol
-int RDT_send_SP(int pipe_idx, struct RDT_PacketListEntry* packlist, int list_len)
+// Packetizer stage: split the caller's buffer into checksummed packets
+static void *RDT_packetizer(void *arg)
 {
-  int i = 0;
-	for(i = 0; i < list_len; ++i){
-		bool resend = true;
-		while(resend){
-			DBG_PRINTF("Sending packet %d to %s:%d\n", packlist[i].seqnum,
-				inet_ntoa(RDT_pipes[pipe_idx].remote.sin_addr),
-				RDT_pipes[pipe_idx].remote.sin_port);
+	struct RDT_SendPipeline *pl = arg;
+	size_t i, p = 0;
+	for(i = 0, p = 0; p < pl->len; ++i, p += 100){
+		struct RDT_PacketListEntry *entry = SPSC_write_slot(&pl->packets);
+		if(!entry){
+			// transmitter gave up
+			break;
+		}
+		size_t n = min(RDT_PAYLOAD_LEN, pl->len - p);
+		DBG_PRINTF("RDT_send: Creating packet %d\n", (int)(uint8_t)(pl->first_seq + i));
+		entry->seqnum = pl->first_seq + i;
+		entry->len = n;
+		entry->acked = 0;
+
+		RDT_buildPacket(RDT_pipes[pl->pipe_idx].integrity, &entry->packet,
+			entry->seqnum, pl->buf + p, n, pl->message && p + n == pl->len);
+		SPSC_write_commit(&pl->packets);
+	}
+	SPSC_close(&pl->packets);
+	return NULL;
+}
 
-			int ret = send(RDT_pipes[pipe_idx].sock_fd, &packlist[i].packet,
-				sizeof(packlist[i].packet), 0);
-			if(ret != sizeof(packlist[i].packet)){
-				DBG_FPRINTF(stderr, "RDT_send_SP: Error sending packet: %s\n",
-					strerror(errno));
-				continue;
-			}
+// Read one packet off the socket and keep its header if it is a valid ACK
+static bool RDT_readAck(int pipe_idx, struct RDT_Header *header)
+{
+	struct RDT_Packet ack = {0};
+	int ret = XP_recv(RDT_pipes[pipe_idx].sock_fd, &ack, sizeof(ack), 0);
+	if(ret == -1){
+		DBG_FPRINTF(stderr, "RDT_ackProcessor: Error reading ACK: %s\n",
+			strerror(errno));
+		return false;
+	}
 
-			ret = RDT_waitForData(pipe_idx);
-			if(ret == 0){
-				DBG_PRINTF("RDT_send_SP: Timeout waiting for ACK\n");
-				continue;
-			} else if(ret < 0){
-				DBG_FPRINTF(stderr, "RDT_send_SP: Error waiting for ACK: %s\n",
-					strerror(errno));
-				continue; // Should this ever happen?
-			}
+	if(!RDT_intact(pipe_idx, &ack)){
+		DBG_PRINTF("RDT_ackProcessor: ACK failed checksum\n");
+		return false;
+	}
 
-			struct RDT_Packet ack = {0};
-			ret = recv(RDT_pipes[pipe_idx].sock_fd, &ack, sizeof(ack), 0);
-			if(ret == -1){
-				DBG_FPRINTF(stderr, "RDT_send_SP: Error reading ACK: %s\n",
-					strerror(errno));
-				continue; // As before, if we have stuff to read, should this ever happen?
-			}
+	if((ack.header.flags & 0x10) != 0x10){
+		DBG_PRINTF("RDT_ackProcessor: Message received not an ACK\n");
+		RDT_strayData(pipe_idx, &ack);
+		return false;
+	}
+	*header = ack.header;
+	return true;
+}
 
-			if(RDT_inet_chksum(&ack, sizeof(ack)) != 0){
-				DBG_PRINTF("RDT_send_SP: ACK failed checksum\n");
-				continue;
-			}
+// ACK processor stage: validate incoming ACKs and hand them to the transmitter
+static void *RDT_ackProcessor(void *arg)
+{
+	struct RDT_SendPipeline *pl = arg;
+	int pipe_idx = pl->pipe_idx;
+	while(!__atomic_load_n(&pl->done, __ATOMIC_ACQUIRE)){
+		// short wait so the thread notices the end of the transfer promptly
+		int ret = RDT_pollData(pipe_idx, 10000);
+		if(ret <= 0)
+			continue;
 
-			if((ack.header.flags & 0x10) != 0x10){
-				DBG_PRINTF("RDT_send_SP: Message received not an ACK\n");
-				continue;
-			}
+		struct RDT_Header ack;
+		if(!RDT_readAck(pipe_idx, &ack))
+			continue;
 
-			if(ack.header.acknum != packlist[i].seqnum){
-				DBG_PRINTF("RDT_send_SP: Message received ACKing incorrect seqnum\n");
-				continue;
-			}
+		if(!SPSC_push(&pl->acks, &ack))
+			break;
+	}
+	return NULL;
+}
+
+// Next validated ACK for the transmitter, waiting up to usec for one
+static bool RDT_nextAck(struct RDT_SendPipeline *pl, struct RDT_Header *ack, uint64_t usec)
+{
+	if(!pl->inline_acks)
+		return usec ? SPSC_pop_timed(&pl->acks, ack, usec) : SPSC_try_pop(&pl->acks, ack);
+	while(RDT_pollData(pl->pipe_idx, usec) > 0){
+		if(RDT_readAck(pl->pipe_idx, ack))
+			return true;
+		usec = 0;
+	}
+	return false;
+}
 
-			DBG_PRINTF("RDT_send_SP: Received ACK for %d from %s:%d\n", packlist[i].seqnum,
+// Sending algorithm for Single Packet RDT Protocol
+int RDT_send_SP(struct RDT_SendPipeline *pl)
+{
+	int pipe_idx = pl->pipe_idx;
+	struct RDT_PacketListEntry *entry;
+	struct RDT_Timer rto;
+	RDT_timerInit(&rto, pipe_idx);
+	struct RDT_Stats *st = RDT_pipes[pipe_idx].stats;
+	PROBE3(send_start, pipe_idx, pl->first_seq, pl->len);
+	while((entry = SPSC_read_slot(&pl->packets)) != NULL){
+		bool resend = true;
+		int sends = 0;
+		uint64_t sent_usec = RDT_now_usec();
+		st->in_flight = 1;
+		while(resend){
+			DBG_PRINTF("Sending packet %d to %s:%d\n", entry->seqnum,
 				inet_ntoa(RDT_pipes[pipe_idx].remote.sin_addr),
 				RDT_pipes[pipe_idx].remote.sin_port);
-			RDT_pipes[pipe_idx].loc_seq++;
-			resend = false;
+
+			int ret = RDT_sendPacket(pipe_idx, &entry->packet);
+			if(ret != sizeof(entry->packet)){
+				DBG_FPRINTF(stderr, "RDT_send_SP: Error sending packet: %s\n",
+					strerror(errno));
+				continue;
+			}
+			st->packets_sent++;
+			TRC_EVENT(sends > 0 ? TRC_RETRANSMIT : TRC_SEND, SINGLE_PACKET, pipe_idx,
+				entry->seqnum, entry->len);
+			if(sends++ > 0){
+				st->retransmits++;
+				PROBE3(retransmit, pipe_idx, entry->seqnum, entry->len);
+			} else {
+				PROBE3(packet_send, pipe_idx, entry->seqnum, entry->len);
+			}
+			RDT_timerArm(&rto, (uint64_t)RDT_pipes[pipe_idx].msec_timeout * 1000);
+
+			// Anything but our ACK is set aside and the wait goes on: only the
+			// timer resends, or every duplicate would breed another one
+			while(resend){
+				struct RDT_Timer *expired = NULL;
+				ret = RDT_waitForDataOrTimers(pipe_idx, &expired);
+				if(ret == 0){
+					DBG_PRINTF("RDT_send_SP: Timeout waiting for ACK\n");
+					st->timeouts++;
+					TRC_EVENT(TRC_TIMEOUT, SINGLE_PACKET, pipe_idx, entry->seqnum, sends - 1);
+					PROBE3(timeout, pipe_idx, entry->seqnum, sends - 1);
+					break;
+				} else if(ret < 0){
+					DBG_FPRINTF(stderr, "RDT_send_SP: Error waiting for ACK: %s\n",
+						strerror(errno));
+					break; // Should this ever happen?
+				}
+
+				struct RDT_Packet ack = {0};
+				ret = XP_recv(RDT_pipes[pipe_idx].sock_fd, &ack, sizeof(ack), 0);
+				if(ret == -1){
+					DBG_FPRINTF(stderr, "RDT_send_SP: Error reading ACK: %s\n",
+						strerror(errno));
+					continue; // As before, if we have stuff to read, should this ever happen?
+				}
+
+				if(!RDT_intact(pipe_idx, &ack)){
+					DBG_PRINTF("RDT_send_SP: ACK failed checksum\n");
+					continue;
+				}
+
+				if((ack.header.flags & 0x10) != 0x10){
+					DBG_PRINTF("RDT_send_SP: Message received not an ACK\n");
+					RDT_strayData(pipe_idx, &ack);
+					continue;
+				}
+
+				if(ack.header.acknum != entry->seqnum){
+					DBG_PRINTF("RDT_send_SP: Message received ACKing incorrect seqnum\n");
+					continue;
+				}
+
+				DBG_PRINTF("RDT_send_SP: Received ACK for %d from %s:%d\n", entry->seqnum,
+					inet_ntoa(RDT_pipes[pipe_idx].remote.sin_addr),
+					RDT_pipes[pipe_idx].remote.sin_port);
+				RDT_pipes[pipe_idx].loc_seq++;
+				uint64_t rtt = 0;
+				if(sends == 1) // Karn: a resent packet's ACK is ambiguous
+					RDT_rttSample(pipe_idx, rtt = RDT_now_usec() - sent_usec);
+				TRC_EVENT(TRC_ACK, SINGLE_PACKET, pipe_idx, entry->seqnum, rtt);
+				PROBE3(ack, pipe_idx, entry->seqnum, rtt);
+				resend = false;
+			}
 		}
+		SPSC_read_release(&pl->packets);
 	}
+	st->in_flight = 0;
+	RDT_timerCancel(&rto);
+	PROBE3(send_done, pipe_idx, RDT_pipes[pipe_idx].loc_seq, pl->len);
 	return 0;
 }
 
-int RDT_send_gbN(int pipe_idx, struct RDT_PacketListEntry* packlist, int list_len)
+int RDT_send_gbN(struct RDT_SendPipeline *pl)
 {
 	return -1;
 }
 
-int RDT_send_SR(int pipe_idx, struct RDT_PacketListEntry* packlist, int list_len)
-{
-  int count = 0;
-  int i = 0;
-  int windowSize = 10;			// Window Size
-  int lowestSeqNotAcked = 0;		// Lowest sequence number that has been sent but no Acked
-  int CORRUPT_PROBA = 0;		// Probability of bit corruption
-  int numTransmits = 0;			// Number of transmits
-  int numRetransmits = 0;		// Number of retransmits
-  int numTOevents = 0;			// Number of timeout events
-  int numBytes = 0;			// Number of bytes transmitted
-  int numCorrupts = 0;			// Number of packets corrupted
-  clock_t start_t = 0;			// Start time
-  clock_t finish_t = 0;			// Finish time
-  clock_t elapsed = 0;			// Time elapsed to complete file transmission
-  struct PacketNode* head = (struct PacketNode*) malloc(sizeof(struct PacketNode));  // List of sent packets
-
-  printf("Enter window size: ");
-  scanf("%d", &windowSize);
-  getchar();
-
-  printf("Enter corruption probability: ");
-  scanf("%d", &CORRUPT_PROBA);
-  getchar();
-
-  start_t = clock();
-  for (i = 0; i < list_len; ++i)
-    {
-      bool resend = true;
-      while(count < windowSize){
-	DBG_PRINTF("Sending packet %d to %s:%d\n", packlist[i].seqnum,
-		   inet_ntoa(RDT_pipes[pipe_idx].remote.sin_addr),
-		   RDT_pipes[pipe_idx].remote.sin_port);
-
-	// Artificially corrupt a bit with CORRUPT_PROBA chance
-	if ((rand() % 100 + 1) < CORRUPT_PROBA)
-	  {
-	    packlist[i].packet.payload[0] ^= 1UL << 2;
-	    numCorrupts++;
-	  }
-	int ret = send(RDT_pipes[pipe_idx].sock_fd, &packlist[i].packet,
-		       sizeof(packlist[i].packet), 0);
-	if(ret != sizeof(packlist[i].packet)){
+// Transmit the SR packet in slot and arm its retransmission timer
+static int RDT_transmit_SR(int pipe_idx, struct RDT_SRQueue *q, int slot)
+{
+	q->sent_usec[slot] = RDT_now_usec();
+	RDT_timerArm(&q->timers[slot], (uint64_t)RDT_pipes[pipe_idx].msec_timeout * 1000);
+	int ret = RDT_sendPacket(pipe_idx, &q->packets[slot]);
+	if(ret != sizeof(q->packets[slot])){
 	  DBG_FPRINTF(stderr, "RDT_send_SR: Error sending packet: %s\n",
 		      strerror(errno));
-	  continue;
-	} // end if (ret != sizeof(packlist[i].packet))
-
-	// Keep track of sent packets
-	lowestSeqNotAcked = packlist[i].seqnum;
-	head -> next = (struct PacketNode*) malloc(sizeof(struct PacketNode));
-	count++;
-	numTransmits++;
-	numBytes += sizeof(packlist[i].packet.payload);
-
-	ret = RDT_waitForData(pipe_idx);
-	if(ret == 0){
-	  DBG_PRINTF("RDT_send_SR: Timeout waiting for ACK\n");
-	  numTOevents++;
-	  
-	  int ret = send(RDT_pipes[pipe_idx].sock_fd, &packlist[i].packet,
-		       sizeof(packlist[i].packet), 0);
-	  if(ret != sizeof(packlist[i].packet)){
-	    DBG_FPRINTF(stderr, "RDT_send_SR: Error sending packet: %s\n",
-			strerror(errno));
-	    continue;
-	  } // end if (ret != sizeof(packlist[i].packet))
-	  continue;
-	} // end if (ret == 0)
-	else if(ret < 0){
-	  DBG_FPRINTF(stderr, "RDT_send_SR: Error waiting for ACK: %s\n",
-		      strerror(errno));
-	  continue; // Should this ever happen?
-	} // end else if (ret < 0)
-	
-	struct RDT_Packet ack = {0};
-	ret = recv(RDT_pipes[pipe_idx].sock_fd, &ack, sizeof(ack), 0);
-	if(ret == -1){
-	  DBG_FPRINTF(stderr, "RDT_send_SR: Error reading ACK: %s\n",
-		      strerror(errno));
-	  continue; // As before, if we have stuff to read, should this ever happen?
-	} // end if (ret == -1)
-	
-	if(RDT_inet_chksum(&ack, sizeof(ack)) != 0){
-	  DBG_PRINTF("RDT_send_SR: ACK failed checksum\n");
-	  continue;
-	} // end if (RDT_inet_chksum(&ack, sizeof(ack)) != 0)
-	
-	if((ack.header.flags & 0x10) != 0x10){
-	  DBG_PRINTF("RDT_send_SR: Message received not an ACK\n");
-	  continue;
-	} // end if((ack.header.flags & 0x10) != 0x10)
-	
-	if(ack.header.acknum != packlist[i].seqnum){
-	  DBG_PRINTF("RDT_send_SR: Message received ACKing incorrect seqnum\n");
-	  continue;
-	} // end if(ack.header.acknum != packlist[i].seqnum)
-	
-	DBG_PRINTF("RDT_send_SR: Received ACK for %d from %s:%d\n", packlist[i].seqnum,
-		   inet_ntoa(RDT_pipes[pipe_idx].remote.sin_addr),
-		   RDT_pipes[pipe_idx].remote.sin_port);
-	RDT_pipes[pipe_idx].loc_seq++;
-	
-	int j = 0;
-	struct PacketNode* nodeptr = head;
-	for (j = 0; j < windowSize; j++)
-	  {
-	    if (packlist[i].seqnum == nodeptr->next->packet.seqnum)
-	      {
-		struct PacketNode* temp = nodeptr->next;
-		nodeptr->next = nodeptr->next->next;
-		free(temp);
-		count--;
-	      } // end if (packlist[i].seqnum == nodeptr->next->packet.seqnum)
-	    nodeptr = nodeptr->next;
-	  } // end for (j = 0; j < windowSize; j++)
-
-	if (lowestSeqNotAcked < head->next->packet.seqnum)
-	  {
-	    lowestSeqNotAcked = head->next->packet.seqnum;
-	  } // end if (lowestSeqNotAcked < head->next->packet.seqnum)
-	
-	resend = false;
-      } // end  while(head != NULL && count < windowSize)
-    } // end for (i = 0; i < list_len; ++i)
-
-  finish_t = clock();
-  elapsed = finish_t - start_t;
-
-  printf("numTransmits: %d\n", numTransmits);
-  printf("numRetransmits: %d\n", numRetransmits);
-  printf("numTOevents: %d\n", numTOevents);
-  printf("numBytes: %d\n", numBytes);
-  printf("numCorrupts: %d\n", numCorrupts);
-  printf("elapsed: %d\n", elapsed);
+	  return -1;
+	}
+	RDT_pipes[pipe_idx].stats->packets_sent++;
+	return 0;
+}
+
+// Mark the packet an ACK refers to, if it is in flight. O(1): the seqnum picks the slot.
+static void RDT_ackSlot_SR(int pipe_idx, struct RDT_SRQueue *q, uint8_t acknum)
+{
+  uint8_t off = acknum - q->base;
+  if (off >= q->count)
+    return;				// stale or duplicate ACK
+  int slot = acknum % RDT_SR_WINDOW;
+  if (q->acked & (1u << slot))
+    return;
+  DBG_PRINTF("RDT_send_SR: Received ACK for %d\n", acknum);
+  q->acked |= 1u << slot;
+  RDT_timerCancel(&q->timers[slot]);
+  uint64_t rtt = 0;
+  if (q->retransmits[slot] == 0)	// Karn: a resent packet's ACK is ambiguous
+    RDT_rttSample(pipe_idx, rtt = RDT_now_usec() - q->sent_usec[slot]);
+  TRC_EVENT(TRC_ACK, SELECTIVE_REPEAT, pipe_idx, acknum, rtt);
+  PROBE3(ack, pipe_idx, acknum, rtt);
+}
+
+int RDT_send_SR(struct RDT_SendPipeline *pl)
+{
+  int pipe_idx = pl->pipe_idx;
+  int windowSize;			// Window Size
+  struct RDT_SRQueue q;			// Packets in flight
+  uint64_t timeout_usec = (uint64_t)RDT_pipes[pipe_idx].msec_timeout * 1000;
+  int i;
+
+  // The receiver only buffers RDT_SR_WINDOW packets
+  windowSize = RDT_pipes[pipe_idx].sr_configured ? RDT_pipes[pipe_idx].sr_window :
+    RDT_SR_DEFAULT_WINDOW;
+  windowSize = max(1, min(windowSize, RDT_SR_WINDOW));
+
+  q.base = pl->first_seq;
+  q.count = 0;
+  q.acked = 0;
+  for (i = 0; i < RDT_SR_WINDOW; i++)
+    {
+      q.retransmits[i] = 0;
+      RDT_timerInit(&q.timers[i], pipe_idx);
+    }
+
+  pthread_t ack_thread;
+  if (!pl->inline_acks)
+    {
+      if (SPSC_init(&pl->acks, RDT_PIPELINE_DEPTH, sizeof(struct RDT_Header)) != 0)
+	return -1;
+      // so the idle wait below hears from the packetizer as well
+      SPSC_share_bell(&pl->acks, &pl->packets);
+      if (pthread_create(&ack_thread, NULL, RDT_ackProcessor, pl) != 0)
+	{
+	  DBG_FPRINTF(stderr, "RDT_send_SR: Could not start ACK processor\n");
+	  SPSC_destroy(&pl->acks);
+	  return -1;
+	}
+    }
+
+  PROBE3(send_start, pipe_idx, pl->first_seq, pl->len);
+  bool more = true;
+  while (more || q.count > 0)
+    {
+      bool progress = false;
+
+      // Fill the window from the packetizer, straight into the next slot
+      while (more && q.count < windowSize)
+	{
+	  if (SPSC_size(&pl->packets) == 0)
+	    {
+	      more = !SPSC_drained(&pl->packets);
+	      break;
+	    }
+	  struct RDT_PacketListEntry *entry = SPSC_read_slot(&pl->packets);
+	  int slot = (uint8_t)(q.base + q.count) % RDT_SR_WINDOW;
+	  q.packets[slot] = entry->packet;
+	  q.lens[slot] = entry->len;
+	  SPSC_read_release(&pl->packets);
+	  q.retransmits[slot] = 0;
+	  DBG_PRINTF("Sending packet %d to %s:%d\n", q.packets[slot].header.seqnum,
+		     inet_ntoa(RDT_pipes[pipe_idx].remote.sin_addr),
+		     RDT_pipes[pipe_idx].remote.sin_port);
+	  RDT_transmit_SR(pipe_idx, &q, slot);
+	  TRC_EVENT(TRC_SEND, SELECTIVE_REPEAT, pipe_idx, q.packets[slot].header.seqnum,
+		    q.lens[slot]);
+	  PROBE3(packet_send, pipe_idx, q.packets[slot].header.seqnum, q.lens[slot]);
+	  q.count++;
+	  progress = true;
+	} // end while (more && q.count < windowSize)
+
+      // Apply ACKs handed over by the ACK processor
+      struct RDT_Header ack;
+      while (RDT_nextAck(pl, &ack, 0))
+	{
+	  RDT_ackSlot_SR(pipe_idx, &q, ack.acknum);
+	  progress = true;
+	} // end while (RDT_nextAck(pl, &ack, 0))
+
+      // Retransmit every unacknowledged packet whose timer expired
+      bool timedout = false;
+      struct RDT_Timer* timer = RDT_timersExpired(pipe_idx);
+      while (timer != NULL)
+	{
+	  struct RDT_Timer* next = timer->next_expired;
+	  int slot = timer - q.timers;
+	  if (!(q.acked & (1u << slot)))
+	    {
+	      DBG_PRINTF("RDT_send_SR: Timeout waiting for ACK %d\n", q.packets[slot].header.seqnum);
+	      TRC_EVENT(TRC_TIMEOUT, SELECTIVE_REPEAT, pipe_idx, q.packets[slot].header.seqnum,
+			q.retransmits[slot]);
+	      PROBE3(timeout, pipe_idx, q.packets[slot].header.seqnum, q.retransmits[slot]);
+	      RDT_transmit_SR(pipe_idx, &q, slot);
+	      TRC_EVENT(TRC_RETRANSMIT, SELECTIVE_REPEAT, pipe_idx, q.packets[slot].header.seqnum,
+			q.lens[slot]);
+	      PROBE3(retransmit, pipe_idx, q.packets[slot].header.seqnum, q.lens[slot]);
+	      q.retransmits[slot]++;
+	      RDT_pipes[pipe_idx].stats->retransmits++;
+	      timedout = true;
+	    }
+	  timer = next;
+	} // end while (timer != NULL)
+      if (timedout)
+	RDT_pipes[pipe_idx].stats->timeouts++;
+
+      // Slide the window past the acknowledged prefix. Their timers were
+      // cancelled when the ACK was applied, so nothing refers to them now.
+      while (q.count > 0 && (q.acked & (1u << (q.base % RDT_SR_WINDOW))))
+	{
+	  q.acked &= ~(1u << (q.base % RDT_SR_WINDOW));
+	  q.base++;
+	  q.count--;
+	  RDT_pipes[pipe_idx].loc_seq++;
+	} // end while (q.count > 0 && ...)
+      RDT_pipes[pipe_idx].stats->in_flight = q.count;
+
+      if (progress || timedout || (!more && q.count == 0))
+	continue;
+
+      // Nothing to do: sleep until an ACK arrives, a timer expires, or the
+      // packetizer catches up
+      uint64_t wait = RDT_timersNextWait(timeout_usec);
+      if (pl->inline_acks)
+	{
+	  if (RDT_nextAck(pl, &ack, wait))
+	    RDT_ackSlot_SR(pipe_idx, &q, ack.acknum);
+	}
+      else
+	{
+	  struct SPSC_Ring *rings[] = {&pl->acks, &pl->packets};
+	  SPSC_wait(rings, more && q.count < windowSize ? 2 : 1, wait);
+	}
+    } // end while (more || q.count > 0)
+
+  if (!pl->inline_acks)
+    {
+      __atomic_store_n(&pl->done, true, __ATOMIC_RELEASE);
+      SPSC_close(&pl->acks);
+      pthread_join(ack_thread, NULL);
+      SPSC_destroy(&pl->acks);
+    }
+
+  PROBE3(send_done, pipe_idx, RDT_pipes[pipe_idx].loc_seq, pl->len);
   return 0;
 }
 
 // These next two are highly dependent on the protocol
-int RDT_send(int pipe_idx, const void *buf, size_t len)
+// Sending is pipelined: a packetizer thread builds and checksums packets while
+// the protocol's transmitter sends them. Short sends are packetized inline.
+static int RDT_sendData(int pipe_idx, const void *buf, size_t len, bool message)
 {
 #ifdef DEBUG_
-		fwrite(buf, 1, 100, stdout);
+		fwrite(buf, 1, min(100, len), stdout);
 #endif
 	if (pipe_idx >= RDT_allocated)
 		return -1;
 	if(!CREATED(pipe_idx) || !BOUND(pipe_idx) || !CONNECTED(pipe_idx))
 		return -1;
 
+	// RDT_send returns once everything is ACKed: the call is the delivery time
+	uint64_t enqueued = RDT_now_usec();
 	int list_len = len / 100 + ((len % 100) > 0 ? 1 : 0);
-	struct RDT_PacketListEntry *packlist = calloc(list_len, sizeof(*packlist));
-	// populate packet list
-	size_t i, p = 0;
-	for(i = 0, p = 0; i < list_len && p < len; ++i, p += 100){
-		DBG_PRINTF("RDT_send: Creating packet %d\n",
-			(int)(RDT_pipes[pipe_idx].loc_seq + i));
-		packlist[i].seqnum = RDT_pipes[pipe_idx].loc_seq + i;
-		packlist[i].acked = 0;
-
-		packlist[i].packet.header.seqnum = packlist[i].seqnum;
-		packlist[i].packet.header.acknum = 0;
-		packlist[i].packet.header.rwnd = 1; // TODO: Update for various protocols
-		packlist[i].packet.header.flags = 0;
-		// copy up to 100 bytes from buf to the payload
-		memcpy(&packlist[i].packet.payload, buf + p, min(100, len - p));
-
-		uint16_t chksum = RDT_inet_chksum(&packlist[i].packet, sizeof(packlist[i].packet));
-		packlist[i].packet.header.checksum = htons(chksum);
-#ifdef DEBUG_
-		assert(RDT_inet_chksum(&packlist[i].packet, sizeof(packlist[i].packet)) == 0);
-#endif
+	struct RDT_SendPipeline pl = {0};
+	pl.pipe_idx = pipe_idx;
+	pl.buf = buf;
+	pl.len = len;
+	pl.message = message;
+	pl.first_seq = RDT_pipes[pipe_idx].loc_seq;
+	// A send that fits in one SR window has nothing for an ACK thread to
+	// overlap with; starting and stopping one only adds to its latency.
+	pl.inline_acks = XP_virtual() || list_len <= RDT_SR_WINDOW;
+	size_t depth = pl.inline_acks ? max(list_len, 1) : RDT_PIPELINE_DEPTH;
+	if(SPSC_init(&pl.packets, depth, sizeof(struct RDT_PacketListEntry)) != 0)
+		return -1;
+
+	pthread_t packetizer;
+	bool threaded = list_len > depth;
+	if(threaded){
+		if(pthread_create(&packetizer, NULL, RDT_packetizer, &pl) != 0){
+			DBG_FPRINTF(stderr, "RDT_send: Could not start packetizer\n");
+			SPSC_destroy(&pl.packets);
+			return -1;
+		}
+	} else {
+		// Everything fits in the ring, so no need for another thread
+		RDT_packetizer(&pl);
 	}
 
-	DBG_PRINTF("RDT_send: Packet List created\n");
+	DBG_PRINTF("RDT_send: Packet pipeline started\n");
+	int ret = -1;
 	switch(RDT_pipes[pipe_idx].protocol)
 	{
 		case SINGLE_PACKET:
-			RDT_send_SP(pipe_idx, packlist, list_len);
+			ret = RDT_send_SP(&pl);
 			break;
 		case GOBACKN:
-			RDT_send_gbN(pipe_idx, packlist, list_len);
+			ret = RDT_send_gbN(&pl);
 			break;
 		case SELECTIVE_REPEAT:
-			RDT_send_SR(pipe_idx, packlist, list_len);
+			ret = RDT_send_SR(&pl);
 			break;
 		default:
 			DBG_FPRINTF(stderr, "RDT_send: Invalid protocol: %d\n",
@@ -732,218 +1474,330 @@ int RDT_send(int pipe_idx, const void *buf, size_t len)
 			break;
 	}
 
-	free(packlist);
+	if(threaded){
+		// Release the packetizer if the transmitter stopped early
+		SPSC_close(&pl.packets);
+		pthread_join(packetizer, NULL);
+	}
+	SPSC_destroy(&pl.packets);
+	if(ret != 0)
+		return -1;
+	RDT_pipes[pipe_idx].stats->bytes_sent += len;
+	HST_record(RDT_pipes[pipe_idx].delivery_hist, RDT_now_usec() - enqueued);
+	return len;
+}
+
+int RDT_send(int pipe_idx, const void *buf, size_t len)
+{
+	return RDT_sendData(pipe_idx, buf, len, false);
 }
 
-// By the time this function is reached, the buffer will have already emptied the pipe
-// read buffer
-int RDT_recv_SP(int pipe_idx, void *buf, size_t len)
+// The same packets as RDT_send, the last one flagged EOR with its length
+int RDT_sendmsg(int pipe_idx, const void *buf, size_t len)
+{
+	if(len == 0)
+		return -1;
+	return RDT_sendData(pipe_idx, buf, len, true);
+}
+
+// Receive into the pipe's ring until it holds want bytes, it is full, the
+// remote side closes or a message ends. The payload is scattered straight into
+// the ring slot and only committed once it checks out.
+int RDT_recv_SP(int pipe_idx, size_t want)
 {
 	uint8_t seqnum = RDT_pipes[pipe_idx].rem_seq;
-	int packets = len / 100 + ((len % 100) > 0 ? 1 : 0);
-	size_t copied = 0;
-	int i = 0;
-	for(i = 0; i < packets;){
+	char *slot;
+	PROBE3(recv_start, pipe_idx, seqnum, want);
+	while(RDT_rbufUsed(pipe_idx) < want && (slot = RDT_rbufSlot(pipe_idx)) != NULL){
 		DBG_PRINTF("RDT_recv_SP: Reading packet %d\n", seqnum);
-		struct RDT_Packet packet = {0};
+		struct RDT_Header header = {0};
 		struct RDT_Packet ack = {0};
-		int ret = recv(RDT_pipes[pipe_idx].sock_fd, &packet, sizeof(packet), 0);
-		if(ret != sizeof(packet)){
+		struct iovec iov[2] = {
+			{&header, sizeof(header)},
+			{slot, RDT_PAYLOAD_LEN}
+		};
+		struct msghdr msg = {0};
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 2;
+		int ret = XP_recvmsg(RDT_pipes[pipe_idx].sock_fd, &msg, 0);
+		if(ret != sizeof(struct RDT_Packet)){
 			DBG_FPRINTF(stderr, "RDT_recv_SP: Error reading packet\n");
 			continue;
 		}
 		
-		if(RDT_inet_chksum(&packet, sizeof(packet)) != 0){
+		if(!RDT_intactParts(pipe_idx, &header, slot)){
 			DBG_PRINTF("RDT_recv_SP: Packet failed checksum\n");
 			continue;
 		}
 
-		if((packet.header.flags & 0x01) == 0x01){
-			DBG_PRINTF("RDT_recv_SP: Message received is a FIN\n");
-			ack.header.flags |= 0x10;
-			ack.header.acknum = packet.header.seqnum;
-			ack.header.rwnd = 1;
-			int chksum = RDT_inet_chksum(&ack, sizeof(ack));
-			ack.header.checksum = htons(chksum);
-#ifdef DEBUG_
-			assert(RDT_inet_chksum(&ack, sizeof(ack)) == 0);
-#endif
-			send(RDT_pipes[pipe_idx].sock_fd, &ack, sizeof(ack), 0);
-			REMOTECLOSE(pipe_idx);
-			break;
-		}
-#ifdef DEBUG_
-		// If things are set up properly, this should be fine.
-		assert(seqnum == packet.header.seqnum);
-#endif
-		size_t copy = min(100, len - (i * 100));
-		memcpy(buf + (i * 100), &packet.payload, copy);
-		copied += copy;
-		if(copy < 100){
-			// save the remainder of the packet into the read buffer
-			memcpy(RDT_pipes[pipe_idx].rbuf, &packet.payload + copy, 100 - copy);
-			RDT_pipes[pipe_idx].rbuf_pos = 100 - copy;
+		if((header.flags & 0x10) == 0x10){
+			// a late duplicate ACK for something we sent earlier
+			DBG_PRINTF("RDT_recv_SP: Stray ACK %d\n", header.acknum);
+			continue;
 		}
 
-		DBG_PRINTF("RDT_recv_SP: Sending ACK for %d\n", seqnum);
 		ack.header.flags |= 0x10;
-		ack.header.acknum = packet.header.seqnum;
+		ack.header.acknum = header.seqnum;
 		ack.header.rwnd = 1;
-		int chksum = RDT_inet_chksum(&ack, sizeof(ack));
-		ack.header.checksum = htons(chksum);
+		RDT_seal(pipe_idx, &ack);
 
-		send(RDT_pipes[pipe_idx].sock_fd, &ack, sizeof(ack), 0);
-		++i; ++seqnum;
+		if((header.flags & 0x01) == 0x01){
+			DBG_PRINTF("RDT_recv_SP: Message received is a FIN\n");
+			XP_send(RDT_pipes[pipe_idx].sock_fd, &ack, sizeof(ack), 0);
+			REMOTECLOSE(pipe_idx);
+			break;
+		}
+
+		DBG_PRINTF("RDT_recv_SP: Sending ACK for %d\n", header.seqnum);
+		RDT_sendPacket(pipe_idx, &ack);
+		if(header.seqnum != seqnum){
+			// a retransmission whose ACK got lost: ACKed again, not delivered again
+			DBG_PRINTF("RDT_recv_SP: Duplicate packet %d\n", header.seqnum);
+			RDT_pipes[pipe_idx].stats->duplicates++;
+			TRC_EVENT(TRC_DUPLICATE, SINGLE_PACKET, pipe_idx, header.seqnum, 0);
+			PROBE2(duplicate, pipe_idx, header.seqnum);
+			continue;
+		}
+		bool eor = RDT_rbufCommit(pipe_idx, &header);
+		RDT_pipes[pipe_idx].stats->packets_received++;
+		TRC_EVENT(TRC_RECV, SINGLE_PACKET, pipe_idx, header.seqnum, RDT_payloadLen(&header));
+		PROBE3(packet_recv, pipe_idx, header.seqnum, RDT_payloadLen(&header));
+		++seqnum;
+		if(eor)
+			break; // a whole message is in, for RDT_recvmsg
 	}
 	RDT_pipes[pipe_idx].rem_seq = seqnum;
-	return copied;
+	PROBE3(recv_done, pipe_idx, seqnum, RDT_rbufUsed(pipe_idx));
+	return 0;
 }
 
-int RDT_recv_gbN(int pipe_idx, void *buf, size_t len)
+int RDT_recv_gbN(int pipe_idx, size_t want)
 {
 	return -1;
 }
 
-int RDT_recv_SR(int pipe_idx, void *buf, size_t len)
+// Acknowledge an SR data packet, advertising the receive window
+static void RDT_ack_SR(int pipe_idx, uint8_t seqnum)
+{
+	struct RDT_Packet ack = {0};
+	DBG_PRINTF("RDT_recv_SR: Sending ACK for %d\n", seqnum);
+	ack.header.flags |= 0x10;
+	ack.header.acknum = seqnum;
+	ack.header.rwnd = RDT_SR_WINDOW;
+	RDT_seal(pipe_idx, &ack);
+	RDT_sendPacket(pipe_idx, &ack);
+}
+
+// Receive into the pipe's ring until it holds want bytes, it is full, the
+// remote side closes or a message ends
+int RDT_recv_SR(int pipe_idx, size_t want)
 {
 	uint8_t seqnum = RDT_pipes[pipe_idx].rem_seq;
-	int packets = len / 100 + ((len % 100) > 0 ? 1 : 0);
-	size_t copied = 0;
-	int i = 0;
-	int windowSize = 10;
-	int lastSeqAcked = 0;
-	int numBytes = 0;
-	int numErrors = 0;
+	struct RDT_Packet *win = RDT_pipes[pipe_idx].sr_win;
+	bool *have = RDT_pipes[pipe_idx].sr_have;
+	char *ring;
+	PROBE3(recv_start, pipe_idx, seqnum, want);
 
-	for (i = 0; i < packets;)
+	while (RDT_rbufUsed(pipe_idx) < want && (ring = RDT_rbufSlot(pipe_idx)) != NULL)
 	{
-		DBG_PRINTF("RDT_recv_SP: Reading packet %d\n", seqnum);
+		// Deliver buffered packets that are now in order
+		int slot = seqnum % RDT_SR_WINDOW;
+		if (have[slot])
+		{
+			memcpy(ring, win[slot].payload, RDT_PAYLOAD_LEN);
+			have[slot] = false;
+			++seqnum;
+			if (RDT_rbufCommit(pipe_idx, &win[slot].header))
+				break; // a whole message is in, for RDT_recvmsg
+			continue;
+		} // end if (have[slot])
+
+		DBG_PRINTF("RDT_recv_SR: Reading packet %d\n", seqnum);
 		struct RDT_Packet packet = {0};
-		struct RDT_Packet ack = {0};
-		int ret = recv(RDT_pipes[pipe_idx].sock_fd, &packet, sizeof(packet), 0);
+		int ret = XP_recv(RDT_pipes[pipe_idx].sock_fd, &packet, sizeof(packet), 0);
 		if (ret != sizeof(packet))
 		{
-			DBG_FPRINTF(stderr, "RDT_recv_SP: Error reading packet\n");
-			numErrors++;
+			DBG_FPRINTF(stderr, "RDT_recv_SR: Error reading packet\n");
 			continue;
 		} // end if (ret != sizeof(packet))
 
-		if (RDT_inet_chksum(&packet, sizeof(packet)) != 0)
+		if (!RDT_intact(pipe_idx, &packet))
 		{
-			DBG_PRINTF("RDT_recv_SP: Packet failed checksum\n");
-			numErrors++;
+			DBG_PRINTF("RDT_recv_SR: Packet failed checksum\n");
 			continue;
-		} // end if if(RDT_inet_chksum(&packet, sizeof(packet)) != 0){
+		} // end if (!RDT_intact(pipe_idx, &packet))
+
+		if ((packet.header.flags & 0x10) == 0x10)
+		{
+			// a late duplicate ACK for something we sent earlier
+			DBG_PRINTF("RDT_recv_SR: Stray ACK %d\n", packet.header.acknum);
+			continue;
+		} // end if ((packet.header.flags & 0x10) == 0x10)
 
 		if ((packet.header.flags & 0x01) == 0x01)
 		{
-			DBG_PRINTF("RDT_recv_SP: Message received is a FIN\n");
-			ack.header.flags |= 0x10;
-			ack.header.acknum = packet.header.seqnum;
-			ack.header.rwnd = 1;
-			int chksum = RDT_inet_chksum(&ack, sizeof(ack));
-			ack.header.checksum = htons(chksum);
-#ifdef DEBUG_
-			assert(RDT_inet_chksum(&ack, sizeof(ack)) == 0);
-#endif
-			send(RDT_pipes[pipe_idx].sock_fd, &ack, sizeof(ack), 0);
+			DBG_PRINTF("RDT_recv_SR: Message received is a FIN\n");
+			RDT_ack_SR(pipe_idx, packet.header.seqnum);
 			REMOTECLOSE(pipe_idx);
 			break;
-		} // end if((packet.header.flags & 0x01) == 0x01){
-#ifdef DEBUG_
-		// If things are set up properly, this should be fine.
-		assert(seqnum == packet.header.seqnum);
-#endif
-		size_t copy = min(100, len - (i * 100));
-		memcpy(buf + (i * 100), &packet.payload, copy);
-		copied += copy;
-		if (copy < 100)
-		{
-			// save the remainder of the packet into the read buffer
-			memcpy(RDT_pipes[pipe_idx].rbuf, &packet.payload + copy, 100 - copy);
-			RDT_pipes[pipe_idx].rbuf_pos = 100 - copy;
-		} // end if (copy < 100)
+		} // end if ((packet.header.flags & 0x01) == 0x01)
 
-		if (packet.header.seqnum >= lastSeqAcked && packet.header.seqnum < lastSeqAcked + windowSize)
+		uint8_t ahead = packet.header.seqnum - seqnum;
+		uint8_t behind = seqnum - packet.header.seqnum;
+		if (ahead < RDT_SR_WINDOW)
 		{
-			numBytes += sizeof(packet.payload);
-			DBG_PRINTF("RDT_recv_SP: Sending ACK for %d\n", seqnum);
-			ack.header.flags |= 0x10;
-			ack.header.acknum = packet.header.seqnum;
-			ack.header.rwnd = 1;
-			int chksum = RDT_inet_chksum(&ack, sizeof(ack));
-			ack.header.checksum = htons(chksum);
-
-			lastSeqAcked = packet.header.seqnum;
-
-			send(RDT_pipes[pipe_idx].sock_fd, &ack, sizeof(ack), 0);
-			++i;
-			++seqnum;
-		} // end if (packet.header.seqnum >= lastSeqAcked && packet.header.seqnum < lastSeqAcked + windowSize)
+			// Within the window: buffer it until everything before it arrives
+			int pslot = packet.header.seqnum % RDT_SR_WINDOW;
+			if (!have[pslot])
+			{
+				win[pslot] = packet;
+				have[pslot] = true;
+				RDT_pipes[pipe_idx].stats->packets_received++;
+				TRC_EVENT(TRC_RECV, SELECTIVE_REPEAT, pipe_idx, packet.header.seqnum,
+					RDT_payloadLen(&packet.header));
+				PROBE3(packet_recv, pipe_idx, packet.header.seqnum,
+					RDT_payloadLen(&packet.header));
+			}
+			else
+			{
+				RDT_pipes[pipe_idx].stats->duplicates++;
+				TRC_EVENT(TRC_DUPLICATE, SELECTIVE_REPEAT, pipe_idx, packet.header.seqnum, 0);
+				PROBE2(duplicate, pipe_idx, packet.header.seqnum);
+			}
+			RDT_ack_SR(pipe_idx, packet.header.seqnum);
+		} // end if (ahead < RDT_SR_WINDOW)
+		else if (behind <= RDT_SR_WINDOW)
+		{
+			// Already delivered; our ACK was lost, so send it again
+			RDT_pipes[pipe_idx].stats->duplicates++;
+			TRC_EVENT(TRC_DUPLICATE, SELECTIVE_REPEAT, pipe_idx, packet.header.seqnum, 0);
+			PROBE2(duplicate, pipe_idx, packet.header.seqnum);
+			RDT_ack_SR(pipe_idx, packet.header.seqnum);
+		}
 		else
 		{
-			DBG_PRINTF("RDT_recv_SR: Packet not valid in window");
-			numErrors++;
+			DBG_PRINTF("RDT_recv_SR: Packet not valid in window\n");
 		}
-	} // end for(i = 0; i < packets;)
+	} // end while (RDT_rbufUsed(pipe_idx) < want ...)
 	RDT_pipes[pipe_idx].rem_seq = seqnum;
-
-	printf("numBytes: %d\n", numBytes);
-	printf("numErrors: %d\n", numErrors);
-
-	return copied;
+	PROBE3(recv_done, pipe_idx, seqnum, RDT_rbufUsed(pipe_idx));
+	return 0;
 }
 
-int RDT_recv(int pipe_idx, void *buf, size_t len)
+// Top the receive ring up to want bytes using the pipe's protocol
+static void RDT_recvFill(int pipe_idx, size_t want)
 {
-	if (pipe_idx >= RDT_allocated)
-		return -1;
-	if(!CREATED(pipe_idx) || !BOUND(pipe_idx) || !CONNECTED(pipe_idx))
-		return -1;
-
-	// Read any residual data from pipe buffer into buf
-	int start = 0;
-	if(RDT_pipes[pipe_idx].rbuf_pos > 0){
-		// start is number of characters to move to buf
-		// named start because it is where we start writing data from the network
-		start = min(RDT_pipes[pipe_idx].rbuf_pos, len);
-		// Copy the data over
-		memcpy(buf, RDT_pipes[pipe_idx].rbuf, start);
-		// Now, if we didn't use all the data in the buffer, slide any remaining data over
-		if(start < RDT_pipes[pipe_idx].rbuf_pos){
-			// Move data starting at start and going until the end of the known data
-			// to beginning of the buffer
-			memmove(RDT_pipes[pipe_idx].rbuf, RDT_pipes[pipe_idx].rbuf + start,
-				RDT_pipes[pipe_idx].rbuf_pos - start);
-			// No need to zero out the data, because we can assume that only things before
-			// rbuf_pos are valid.
-		}
-		// Update rbuf_pos to take into account the removed data
-		RDT_pipes[pipe_idx].rbuf_pos -= start;
-	}
-
-	if(start == len){
-		return start;
-	}
-
-	DBG_PRINTF("RDT_recv: Extra buffer read\n");
 	switch(RDT_pipes[pipe_idx].protocol)
 	{
 		case SINGLE_PACKET:
-			start += RDT_recv_SP(pipe_idx, buf + start, len - start);
+			RDT_recv_SP(pipe_idx, want);
 			break;
 		case GOBACKN:
-			start += RDT_recv_gbN(pipe_idx, buf + start, len - start);
+			RDT_recv_gbN(pipe_idx, want);
 			break;
 		case SELECTIVE_REPEAT:
-			start += RDT_recv_SR(pipe_idx, buf + start, len - start);
+			RDT_recv_SR(pipe_idx, want);
 			break;
 		default:
 			DBG_FPRINTF(stderr, "RDT_recv: Invalid protocol: %d\n",
 				RDT_pipes[pipe_idx].protocol);
 			break;
 	}
-	return start;
+}
+
+int RDT_recv_peek(int pipe_idx, const void **data, size_t want)
+{
+	if (pipe_idx >= RDT_allocated)
+		return -1;
+	if(!CREATED(pipe_idx) || !BOUND(pipe_idx) || !CONNECTED(pipe_idx))
+		return -1;
+
+	struct RDT_Pipe *pipe = &RDT_pipes[pipe_idx];
+	if(want == 0)
+		want = 1;
+	if(RDT_rbufUsed(pipe_idx) < want && !REMOTECLOSED(pipe_idx)){
+		DBG_PRINTF("RDT_recv: Extra buffer read\n");
+		RDT_recvFill(pipe_idx, want);
+	}
+
+	// only hand out the run up to the end of the ring
+	size_t head = pipe->rbuf_head % pipe->rbuf_cap;
+	*data = pipe->rbuf + head;
+	return min(RDT_rbufUsed(pipe_idx), pipe->rbuf_cap - head);
+}
+
+int RDT_recv_consume(int pipe_idx, size_t len)
+{
+	if (pipe_idx >= RDT_allocated)
+		return -1;
+	if(!CREATED(pipe_idx) || len > RDT_rbufUsed(pipe_idx))
+		return -1;
+
+	RDT_pipes[pipe_idx].rbuf_head += len;
+	RDT_pipes[pipe_idx].stats->bytes_received += len;
+	return 0;
+}
+
+int RDT_recv(int pipe_idx, void *buf, size_t len)
+{
+	if (pipe_idx >= RDT_allocated)
+		return -1;
+	if(!CREATED(pipe_idx) || !BOUND(pipe_idx) || !CONNECTED(pipe_idx))
+		return -1;
+
+	// Copy out of the receive ring, refilling it until len bytes are read or
+	// the remote side closes
+	size_t copied = 0;
+	while(copied < len){
+		const void *data;
+		int avail = RDT_recv_peek(pipe_idx, &data, len - copied);
+		if(avail <= 0)
+			break;
+		size_t copy = min((size_t)avail, len - copied);
+		memcpy((char *)buf + copied, data, copy);
+		RDT_recv_consume(pipe_idx, copy);
+		copied += copy;
+	}
+	return copied;
+}
+
+// One message, straight from the ring into buf: whole packets up to the one
+// flagged EOR, without the padding after its last byte. A ring's worth at a
+// time is asked for, since filling stops at the end of a message anyway.
+int RDT_recvmsg(int pipe_idx, void *buf, size_t len, bool *truncated)
+{
+	if (pipe_idx >= RDT_allocated)
+		return -1;
+	if(!CREATED(pipe_idx) || !BOUND(pipe_idx) || !CONNECTED(pipe_idx))
+		return -1;
+
+	struct RDT_Pipe *pipe = &RDT_pipes[pipe_idx];
+	size_t copied = 0, whole = 0;
+	if(truncated)
+		*truncated = false;
+	for(;;){
+		// from the consumed point to the end of its packet
+		size_t within = pipe->rbuf_head % RDT_PAYLOAD_LEN;
+		if(RDT_rbufUsed(pipe_idx) < RDT_PAYLOAD_LEN - within && !REMOTECLOSED(pipe_idx))
+			RDT_recvFill(pipe_idx, pipe->rbuf_cap);
+		if(RDT_rbufUsed(pipe_idx) < RDT_PAYLOAD_LEN - within)
+			break; // closed, mid-message at worst
+		size_t slot = pipe->rbuf_head / RDT_PAYLOAD_LEN % (pipe->rbuf_cap / RDT_PAYLOAD_LEN);
+		uint8_t eor = pipe->rbuf_eor[slot];
+		size_t valid = eor ? eor - 1u : RDT_PAYLOAD_LEN;
+		size_t n = valid > within ? valid - within : 0;
+		size_t copy = min(n, len - copied);
+		memcpy((char *)buf + copied, pipe->rbuf + pipe->rbuf_head % pipe->rbuf_cap, copy);
+		if(copy < n && truncated)
+			*truncated = true;
+		copied += copy;
+		whole += n;
+		pipe->rbuf_head += RDT_PAYLOAD_LEN - within;
+		if(eor)
+			break;
+	}
+	pipe->stats->bytes_received += whole;
+	return copied;
 }
 
 // TODO: Handle ACKing other side until it finishes
@@ -953,6 +1807,7 @@ void RDT_close(int pipe_idx)
 		return;
 	if(!CREATED(pipe_idx))
 		return;
+	PROBE3(close, pipe_idx, RDT_pipes[pipe_idx].loc_seq, RDT_pipes[pipe_idx].rem_seq);
 
 	if(CONNECTED(pipe_idx)){
 		// Implement finishing handshakes
@@ -961,57 +1816,67 @@ void RDT_close(int pipe_idx)
 		fin.header.seqnum = RDT_pipes[pipe_idx].loc_seq;
 		fin.header.flags = 0x01;
 		fin.header.rwnd = 1;
-		uint16_t chksum = RDT_inet_chksum(&fin, sizeof(fin));
-		fin.header.checksum = htons(chksum);
-#ifdef DEBUG_
-		assert(RDT_inet_chksum(&fin, sizeof(fin)) == 0);
-#endif
+		RDT_seal(pipe_idx, &fin);
 
 		struct RDT_Packet remfin = {0};
+		struct RDT_Timer fin_timer;
+		RDT_timerInit(&fin_timer, pipe_idx);
 		// Transmit SYN message and wait for SYNACK
 		bool retransmit = true;
+		int silent = 0;
 		while (retransmit)
 		{
+			if (silent == RDT_FIN_TRIES)
+			{
+				DBG_FPRINTF(stderr, "RDT_close: Giving up on %s:%d\n",
+					inet_ntoa(RDT_pipes[pipe_idx].remote.sin_addr),
+					RDT_pipes[pipe_idx].remote.sin_port
+				);
+				REMOTECLOSE(pipe_idx);
+				break;
+			}
 			DBG_PRINTF("RDT_close: Sending FIN request to %s:%d\n",
 				inet_ntoa(RDT_pipes[pipe_idx].remote.sin_addr),
 				RDT_pipes[pipe_idx].remote.sin_port
 			);
 
-			int ret = send(RDT_pipes[pipe_idx].sock_fd, &fin, sizeof(fin), 0);
+			int ret = XP_send(RDT_pipes[pipe_idx].sock_fd, &fin, sizeof(fin), 0);
 			if (ret != sizeof(fin))
 			{
 				DBG_FPRINTF(stderr, "RDT_close: SYN message did not send correct "
 					"number of bytes.\n");
+				silent++;
 				continue;
 			}
 			struct RDT_Packet ack = {0};
+			RDT_timerArm(&fin_timer, (uint64_t)RDT_pipes[pipe_idx].msec_timeout * 1000);
 
-			ret = RDT_waitForData(pipe_idx);
+			struct RDT_Timer *expired = NULL;
+			ret = RDT_waitForDataOrTimers(pipe_idx, &expired);
 			if (ret == 0)
 			{
 				DBG_PRINTF("RDT_close: Timeout waiting for ACK\n");
+				PROBE2(fin_timeout, pipe_idx, fin.header.seqnum);
+				silent++;
 				continue;
 			}
 			else if (ret < 0)
 			{
 				DBG_FPRINTF(stderr, "RDT_close: Error waiting for ACK: %s\n",
 					strerror(errno));
+				silent++;
 				continue;
 			}
 
-			ret = recv(RDT_pipes[pipe_idx].sock_fd, &ack, sizeof(ack), 0);
+			ret = XP_recv(RDT_pipes[pipe_idx].sock_fd, &ack, sizeof(ack), 0);
 			if (ret == -1)
 			{
 				DBG_FPRINTF(stderr, "RDT_close: Error reading ACK: %s\n", strerror(errno));
-				static int retry = 3;
-				if(retry == 0){
-					break;
-				}
-				retry -= 1;
+				silent++;
 				continue;
 			}
 
-			if (RDT_inet_chksum(&ack, sizeof(ack)) != 0)
+			if (!RDT_intact(pipe_idx, &ack))
 			{
 				DBG_PRINTF("RDT_close: Message received corrupt\n");
 				continue;
@@ -1026,13 +1891,12 @@ void RDT_close(int pipe_idx)
 					locack.header.acknum = remfin.header.seqnum;
 					locack.header.rwnd = 0;
 					locack.header.flags = 0x10;
-					uint16_t chksum = RDT_inet_chksum(&locack, sizeof(locack));
-					locack.header.checksum = htons(chksum);
-#ifdef DEBUG_
-					assert(RDT_inet_chksum(&locack, sizeof(locack)) == 0);
-#endif
-					send(RDT_pipes[pipe_idx].sock_fd, &locack, sizeof(locack), 0);
+					RDT_seal(pipe_idx, &locack);
+					XP_send(RDT_pipes[pipe_idx].sock_fd, &locack, sizeof(locack), 0);
 					REMOTECLOSE(pipe_idx);
+				} else {
+					// the peer missed the ACK of its last data and sends it again
+					RDT_strayData(pipe_idx, &ack);
 				}
 				DBG_PRINTF("RDT_close: Message received not an ACK\n");
 				continue;
@@ -1051,8 +1915,9 @@ void RDT_close(int pipe_idx)
 			LOCALCLOSE(pipe_idx);
 			retransmit = false;
 		}
+		RDT_timerCancel(&fin_timer);
 		if(!REMOTECLOSED(pipe_idx) && (remfin.header.flags & 0x01) == 0){
-			int ret = recv(RDT_pipes[pipe_idx].sock_fd, &remfin, sizeof(remfin), 0);
+			int ret = XP_recv(RDT_pipes[pipe_idx].sock_fd, &remfin, sizeof(remfin), 0);
 			if(ret == -1){
 				DBG_PRINTF("RDT_close: Error receiving FIN message:%s\n", strerror(errno));
 				REMOTECLOSE(pipe_idx);
@@ -1064,23 +1929,46 @@ void RDT_close(int pipe_idx)
 			ack.header.acknum = remfin.header.seqnum;
 			ack.header.rwnd = 0;
 			ack.header.flags = 0x10;
-			uint16_t chksum = RDT_inet_chksum(&ack, sizeof(ack));
-			ack.header.checksum = htons(chksum);
-#ifdef DEBUG_
-			assert(RDT_inet_chksum(&ack, sizeof(ack)) == 0);
-#endif
-			send(RDT_pipes[pipe_idx].sock_fd, &ack, sizeof(ack), 0);
+			RDT_seal(pipe_idx, &ack);
+			XP_send(RDT_pipes[pipe_idx].sock_fd, &ack, sizeof(ack), 0);
 			REMOTECLOSE(pipe_idx);
 		}
 	}
 
+	if(RDT_pipes[pipe_idx].impair){
+		IMP_destroy(RDT_pipes[pipe_idx].impair);
+		free(RDT_pipes[pipe_idx].impair);
+	}
 	int ret = 0;
-	if ((ret = close(RDT_pipes[pipe_idx].sock_fd)) != 0)
+	if ((ret = XP_close(RDT_pipes[pipe_idx].sock_fd)) != 0)
 	{
 		DBG_FPRINTF(stderr, "RDT_close(%d): %s\n", pipe_idx, strerror(errno));
 	}
 	free(RDT_pipes[pipe_idx].rbuf);
+	free(RDT_pipes[pipe_idx].rbuf_eor);
+	free(RDT_pipes[pipe_idx].sr_win);
+	free(RDT_pipes[pipe_idx].sr_have);
+	free(RDT_pipes[pipe_idx].syns);
+	MET_pipeClose(pipe_idx);
+	TRC_EVENT(TRC_STATE, RDT_pipes[pipe_idx].protocol, pipe_idx, MET_FREE,
+		CONNECTED(pipe_idx) ? MET_CONNECTED : LISTENING(pipe_idx) ? MET_LISTENING : MET_OPEN);
+	pthread_mutex_lock(&RDT_table_lock);
 	memset(RDT_pipes + pipe_idx, 0, sizeof(*RDT_pipes));
+	if ((size_t)pipe_idx < RDT_free_hint)
+		RDT_free_hint = pipe_idx;
+	pthread_mutex_unlock(&RDT_table_lock);
+}
+
+void RDT_packet_build(enum RDT_Integrity mode, void *packet, uint8_t seqnum,
+		const void *payload, size_t len)
+{
+	RDT_buildPacket(mode, packet, seqnum, payload, min(len, RDT_PAYLOAD_LEN), false);
+}
+
+bool RDT_packet_intact(enum RDT_Integrity mode, const void *packet)
+{
+	const struct RDT_Packet *p = packet;
+	return RDT_intactWith(mode, &p->header, p->payload);
 }
 
 int RDT_info_addr_loc(int pipe_idx, char *buf, size_t len)
@@ -1141,6 +2029,107 @@ enum RDT_Protocol RDT_info_protocol(int pipe_idx)
 	return RDT_pipes[pipe_idx].protocol;
 }
 
+enum RDT_Integrity RDT_info_integrity(int pipe_idx)
+{
+	if (pipe_idx >= RDT_allocated)
+		return -1;
+
+	return RDT_pipes[pipe_idx].integrity;
+}
+
+int RDT_set_integrity(int pipe_idx, enum RDT_Integrity mode)
+{
+	if (pipe_idx >= RDT_allocated)
+		return -1;
+	if (!CREATED(pipe_idx) || CONNECTED(pipe_idx) || mode > RDT_INTEGRITY_CRC32C)
+		return -1;
+
+	RDT_pipes[pipe_idx].integrity_pref = mode;
+	return 0;
+}
+
+int RDT_set_impairment(int pipe_idx, const char *spec)
+{
+	if (pipe_idx >= RDT_allocated)
+		return -1;
+	if (!CREATED(pipe_idx))
+		return -1;
+
+	struct IMP_Link *link = NULL;
+	if (spec && *spec)
+	{
+		struct IMP_Config cfg = {0};
+		cfg.reorder_usec = 1000;
+		if (IMP_parse(spec, &cfg) != 0)
+			return -1;
+		if ((link = malloc(sizeof(*link))) == NULL)
+			return -1;
+		if (IMP_init(link, &cfg) != 0)
+		{
+			free(link);
+			return -1;
+		}
+	}
+	if (RDT_pipes[pipe_idx].impair)
+	{
+		IMP_destroy(RDT_pipes[pipe_idx].impair);
+		free(RDT_pipes[pipe_idx].impair);
+	}
+	RDT_pipes[pipe_idx].impair = link;
+	return 0;
+}
+
+int RDT_info_impairment(int pipe_idx, struct IMP_Stats *stats)
+{
+	if (pipe_idx >= RDT_allocated)
+		return -1;
+	if (!CREATED(pipe_idx) || !RDT_pipes[pipe_idx].impair)
+		return -1;
+
+	pthread_mutex_lock(&RDT_pipes[pipe_idx].impair->lock);
+	*stats = RDT_pipes[pipe_idx].impair->stats;
+	pthread_mutex_unlock(&RDT_pipes[pipe_idx].impair->lock);
+	return 0;
+}
+
+int RDT_info_stats(int pipe_idx, struct RDT_Stats *stats)
+{
+	if (pipe_idx >= RDT_allocated)
+		return -1;
+	if (!CREATED(pipe_idx))
+		return -1;
+
+	*stats = *RDT_pipes[pipe_idx].stats;
+	return 0;
+}
+
+int RDT_info_latency(int pipe_idx, struct HST_Hist *rtt, struct HST_Hist *delivery)
+{
+	if (pipe_idx >= RDT_allocated)
+		return -1;
+	if (!CREATED(pipe_idx))
+		return -1;
+
+	if (rtt)
+		*rtt = *RDT_pipes[pipe_idx].rtt_hist;
+	if (delivery)
+		*delivery = *RDT_pipes[pipe_idx].delivery_hist;
+	return 0;
+}
+
+int RDT_set_window(int pipe_idx, int window)
+{
+	if (pipe_idx >= RDT_allocated)
+		return -1;
+	if (!CREATED(pipe_idx) || window < 1)
+		return -1;
+
+	RDT_pipes[pipe_idx].sr_window = window;
+	RDT_pipes[pipe_idx].sr_configured = true;
+	RDT_statsConfig(pipe_idx);
+	return 0;
+}
+
 bool RDT_info_created(int pipe_idx)
 {
 	if (pipe_idx >= RDT_allocated)
@@ -1,21 +1,83 @@
 #ifndef SOCK_H_202004061734
 #define SOCK_H_202004061734
 
+// Payload bytes carried by each RDT packet. Every RDT_send except the last one
+// of a transfer should be a multiple of this, since short packets are padded.
+#define RDT_PAYLOAD_LEN 100
+// Header plus payload, the size of every RDT datagram
+#define RDT_PACKET_LEN (8 + RDT_PAYLOAD_LEN)
+
+struct IMP_Stats; // impair.h
+struct HST_Hist;  // hist.h
+
+// Transport statistics of one pipe, in the spirit of TCP_INFO. Times are in
+// microseconds; RTT samples come from ACKs of packets sent only once.
+struct RDT_Stats
+{
+	uint32_t srtt_usec;         // smoothed RTT, 0 before the first sample
+	uint32_t rttvar_usec;       // RTT variation
+	uint32_t rto_usec;          // retransmission timeout in use
+	uint32_t cwnd;              // packets the sender keeps in flight at most
+	uint32_t in_flight;         // packets sent and not yet ACKed
+	uint64_t bytes_sent;        // application bytes RDT_send delivered
+	uint64_t bytes_received;    // application bytes taken by RDT_recv
+	uint64_t packets_sent;      // data packets, retransmissions included
+	uint64_t packets_received;  // new in-window data packets
+	uint64_t retransmits;       // data packets sent again
+	uint64_t timeouts;          // retransmission timer expiries
+	uint64_t duplicates;        // data packets received again
+	uint64_t checksum_failures; // packets of any kind that failed the check
+};
+
 enum RDT_Protocol {
 	SINGLE_PACKET,
 	GOBACKN,
 	SELECTIVE_REPEAT
 };
 
+// Per-packet integrity check, weakest first. Each end asks for one before
+// connecting (RDT_set_integrity, or the RDT_INTEGRITY environment variable:
+// "none", "inet" or "crc32c") and the handshake settles on the stronger.
+enum RDT_Integrity {
+	RDT_INTEGRITY_NONE,   // rely on the UDP checksum alone
+	RDT_INTEGRITY_INET,   // 16-bit Internet checksum (default)
+	RDT_INTEGRITY_CRC32C  // CRC32C, hardware accelerated where available
+};
+
 // ACTIONS
 int RDT_socket(enum RDT_Protocol protocol);
+// Ports are in network byte order, as in sin_port
 int RDT_bind(int pipe_idx, const char* addr, uint16_t port);
 int RDT_listen(int pipe_idx, int backlog); // don't know if I need
 int RDT_accept(int pipe_idx);
 int RDT_connect(int pipe_idx, const char* addr, uint16_t port);
 int RDT_send(int pipe_idx, const void* buf, size_t len);
 int RDT_recv(int pipe_idx, void* buf, size_t len);
+// Zero-copy receive: peek waits until at least want bytes are buffered (or the
+// ring is full, or the remote side closed) and points *data into the pipe's
+// receive ring. It returns the contiguous bytes available there, which can be
+// fewer than are buffered when the data wraps around the end of the ring; 0
+// means the remote side closed and nothing is left. consume releases bytes
+// once the application is done with them.
+int RDT_recv_peek(int pipe_idx, const void** data, size_t want);
+int RDT_recv_consume(int pipe_idx, size_t len);
+// Message mode: each RDT_sendmsg (of at least one byte) comes out of one
+// RDT_recvmsg whole, however the packets carrying it were split and
+// reordered. A message longer than len is cut to len bytes, the rest is
+// dropped and *truncated (if not NULL) set. recvmsg returns the bytes stored,
+// 0 once the remote side closed and -1 on errors. Stream and message calls
+// should not be mixed on one pipe.
+int RDT_sendmsg(int pipe_idx, const void* buf, size_t len);
+int RDT_recvmsg(int pipe_idx, void* buf, size_t len, bool* truncated);
 void RDT_close(int pipe_idx);
+int RDT_set_integrity(int pipe_idx, enum RDT_Integrity mode);
+// Packets Selective Repeat keeps in flight (at most its receive window),
+// 10 without a call.
+int RDT_set_window(int pipe_idx, int window);
+// Simulate a lossy network under the pipe's data and ACK packets, e.g.
+// "loss=0.01,corrupt=0.001,delay=5000,jitter=1000,seed=7" (see impair.h for
+// every key). NULL or "" removes it. New pipes take the RDT_IMPAIR variable.
+int RDT_set_impairment(int pipe_idx, const char* spec);
 
 // INFO
 int RDT_info_addr_loc(int pipe_idx, char* buf, size_t len);
@@ -23,6 +85,25 @@ uint16_t RDT_info_port_loc(int pipe_idx);
 int RDT_info_addr_rem(int pipe_idx, char* buf, size_t len);
 uint16_t RDT_info_port_rem(int pipe_idx);
 enum RDT_Protocol RDT_info_protocol(int pipe_idx);
+enum RDT_Integrity RDT_info_integrity(int pipe_idx);
+// Counters of the pipe's impairment layer; -1 if it has none
+int RDT_info_impairment(int pipe_idx, struct IMP_Stats* stats);
+// Snapshot of the pipe's statistics. It is taken without locking, so one
+// polled while a transfer runs can be a packet ahead in some counters.
+int RDT_info_stats(int pipe_idx, struct RDT_Stats* stats);
+// Copies of the pipe's latency histograms, in usec: ACK RTT samples, and
+// RDT_send calls from the call to the ACK of their last packet. Either may
+// be NULL; HST_merge adds up those of several pipes.
+int RDT_info_latency(int pipe_idx, struct HST_Hist* rtt, struct HST_Hist* delivery);
+
+// KERNELS
+// The per-packet work behind RDT_send and RDT_recv, for benchmarks. build
+// fills RDT_PACKET_LEN bytes at packet with a data packet carrying up to
+// RDT_PAYLOAD_LEN bytes of payload; intact checks one as a receiver does.
+uint16_t RDT_inet_chksum(void* buf, size_t len);
+void RDT_packet_build(enum RDT_Integrity mode, void* packet, uint8_t seqnum,
+	const void* payload, size_t len);
+bool RDT_packet_intact(enum RDT_Integrity mode, const void* packet);
 
 // STATE FLAGS
 bool RDT_info_created(int pipe_idx);
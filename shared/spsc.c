@@ -0,0 +1,237 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include "pool.h"
+#include "spsc.h"
+
+#define SPSC_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define SPSC_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+// Checks of the ring before a side goes to sleep on the bell
+#define SPSC_SPINS 64
+
+static void SPSC_deadline(struct timespec *end, uint64_t usec)
+{
+	clock_gettime(CLOCK_MONOTONIC, end);
+	end->tv_sec += usec / 1000000;
+	end->tv_nsec += (usec % 1000000) * 1000;
+	if(end->tv_nsec >= 1000000000){
+		end->tv_sec += 1;
+		end->tv_nsec -= 1000000000;
+	}
+}
+
+// A side about to sleep counts itself on the bell before it looks at the
+// ring again, and the other side looks for sleepers after moving the ring.
+// With a full fence on both sides, one of them sees the other.
+static void SPSC_doze(struct SPSC_Bell *bell)
+{
+	pthread_mutex_lock(&bell->lock);
+	__atomic_add_fetch(&bell->sleepers, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static void SPSC_rise(struct SPSC_Bell *bell)
+{
+	__atomic_sub_fetch(&bell->sleepers, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&bell->lock);
+}
+
+// Wake whoever sleeps on the ring's bell, once the ring moved or closed
+static void SPSC_ring(struct SPSC_Ring *ring)
+{
+	struct SPSC_Bell *bell = ring->bell;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&bell->sleepers, __ATOMIC_RELAXED) == 0)
+		return;
+	pthread_mutex_lock(&bell->lock);
+	pthread_cond_broadcast(&bell->cond);
+	pthread_mutex_unlock(&bell->lock);
+}
+
+int SPSC_init(struct SPSC_Ring *ring, size_t capacity, size_t elem_size)
+{
+	size_t cap = 1;
+	while(cap < capacity)
+		cap <<= 1;
+
+	memset(ring, 0, sizeof(*ring));
+	// rings come and go with each transfer, so recycle their slots
+	ring->slots = POOL_alloc(cap * elem_size);
+	if(!ring->slots)
+		return -1;
+	ring->mask = cap - 1;
+	ring->elem_size = elem_size;
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_mutex_init(&ring->own_bell.lock, NULL);
+	pthread_cond_init(&ring->own_bell.cond, &attr);
+	pthread_condattr_destroy(&attr);
+	ring->bell = &ring->own_bell;
+	return 0;
+}
+
+void SPSC_destroy(struct SPSC_Ring *ring)
+{
+	POOL_free(ring->slots);
+	pthread_mutex_destroy(&ring->own_bell.lock);
+	pthread_cond_destroy(&ring->own_bell.cond);
+	memset(ring, 0, sizeof(*ring));
+}
+
+void SPSC_close(struct SPSC_Ring *ring)
+{
+	SPSC_STORE(&ring->closed, true);
+	SPSC_ring(ring);
+}
+
+size_t SPSC_size(struct SPSC_Ring *ring)
+{
+	return SPSC_LOAD(&ring->tail) - SPSC_LOAD(&ring->head);
+}
+
+bool SPSC_drained(struct SPSC_Ring *ring)
+{
+	// closed is published after the final commit, so check it first
+	return SPSC_LOAD(&ring->closed) && SPSC_size(ring) == 0;
+}
+
+void SPSC_share_bell(struct SPSC_Ring *ring, struct SPSC_Ring *other)
+{
+	ring->bell = other->bell;
+}
+
+static bool SPSC_ready(struct SPSC_Ring *const *rings, size_t n)
+{
+	for(size_t i = 0; i < n; i++)
+		if(SPSC_size(rings[i]) > 0 || SPSC_LOAD(&rings[i]->closed))
+			return true;
+	return false;
+}
+
+bool SPSC_wait(struct SPSC_Ring *const *rings, size_t n, uint64_t usec)
+{
+	struct SPSC_Bell *bell = rings[0]->bell;
+	struct timespec end;
+	bool ready;
+	if(SPSC_ready(rings, n))
+		return true;
+	SPSC_deadline(&end, usec);
+	SPSC_doze(bell);
+	while(!(ready = SPSC_ready(rings, n)) &&
+			pthread_cond_timedwait(&bell->cond, &bell->lock, &end) != ETIMEDOUT)
+		;
+	SPSC_rise(bell);
+	return ready;
+}
+
+void *SPSC_write_slot(struct SPSC_Ring *ring)
+{
+	void *slot;
+	for(int i = 0; i < SPSC_SPINS; i++)
+		if((slot = SPSC_try_write_slot(ring)) != NULL || SPSC_LOAD(&ring->closed))
+			return slot;
+	SPSC_doze(ring->bell);
+	while((slot = SPSC_try_write_slot(ring)) == NULL && !SPSC_LOAD(&ring->closed))
+		pthread_cond_wait(&ring->bell->cond, &ring->bell->lock);
+	SPSC_rise(ring->bell);
+	return slot;
+}
+
+void *SPSC_try_write_slot(struct SPSC_Ring *ring)
+{
+	size_t tail = ring->tail;
+	if(tail - SPSC_LOAD(&ring->head) > ring->mask)
+		return NULL;
+	return ring->slots + (tail & ring->mask) * ring->elem_size;
+}
+
+void SPSC_write_commit(struct SPSC_Ring *ring)
+{
+	SPSC_STORE(&ring->tail, ring->tail + 1);
+	SPSC_ring(ring);
+}
+
+void *SPSC_read_slot(struct SPSC_Ring *ring)
+{
+	// closed is published after the final commit, so look for an element again
+	void *slot;
+	for(int i = 0; i < SPSC_SPINS; i++)
+		if((slot = SPSC_try_read_slot(ring)) != NULL || SPSC_LOAD(&ring->closed))
+			return slot ? slot : SPSC_try_read_slot(ring);
+	SPSC_doze(ring->bell);
+	while((slot = SPSC_try_read_slot(ring)) == NULL && !SPSC_LOAD(&ring->closed))
+		pthread_cond_wait(&ring->bell->cond, &ring->bell->lock);
+	SPSC_rise(ring->bell);
+	return slot ? slot : SPSC_try_read_slot(ring);
+}
+
+void *SPSC_try_read_slot(struct SPSC_Ring *ring)
+{
+	size_t head = ring->head;
+	if(SPSC_LOAD(&ring->tail) == head)
+		return NULL;
+	return ring->slots + (head & ring->mask) * ring->elem_size;
+}
+
+void SPSC_read_release(struct SPSC_Ring *ring)
+{
+	SPSC_STORE(&ring->head, ring->head + 1);
+	SPSC_ring(ring);
+}
+
+bool SPSC_try_push(struct SPSC_Ring *ring, const void *elem)
+{
+	size_t tail = ring->tail;
+	if(tail - SPSC_LOAD(&ring->head) > ring->mask)
+		return false;
+	memcpy(ring->slots + (tail & ring->mask) * ring->elem_size, elem, ring->elem_size);
+	SPSC_STORE(&ring->tail, tail + 1);
+	SPSC_ring(ring);
+	return true;
+}
+
+bool SPSC_try_pop(struct SPSC_Ring *ring, void *elem)
+{
+	size_t head = ring->head;
+	if(SPSC_LOAD(&ring->tail) == head)
+		return false;
+	memcpy(elem, ring->slots + (head & ring->mask) * ring->elem_size, ring->elem_size);
+	SPSC_STORE(&ring->head, head + 1);
+	SPSC_ring(ring);
+	return true;
+}
+
+bool SPSC_push(struct SPSC_Ring *ring, const void *elem)
+{
+	void *slot = SPSC_write_slot(ring);
+	if(!slot)
+		return false;
+	memcpy(slot, elem, ring->elem_size);
+	SPSC_write_commit(ring);
+	return true;
+}
+
+bool SPSC_pop(struct SPSC_Ring *ring, void *elem)
+{
+	void *slot = SPSC_read_slot(ring);
+	if(!slot)
+		return false;
+	memcpy(elem, slot, ring->elem_size);
+	SPSC_read_release(ring);
+	return true;
+}
+
+bool SPSC_pop_timed(struct SPSC_Ring *ring, void *elem, uint64_t usec)
+{
+	struct SPSC_Ring *rings[] = {ring};
+	if(SPSC_try_pop(ring, elem))
+		return true;
+	return SPSC_wait(rings, 1, usec) && SPSC_try_pop(ring, elem);
+}
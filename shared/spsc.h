@@ -0,0 +1,74 @@
+#ifndef SPSC_H_202610190915
+#define SPSC_H_202610190915
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#define SPSC_CACHELINE 64
+
+/**
+ * Single-producer, single-consumer ring of fixed-size slots.
+ * Exactly one thread may write into the ring and exactly one thread may read
+ * from it; no locks are taken on either side. The producer closes the ring to
+ * tell the consumer that no more elements will arrive. The consumer may also
+ * close it to make a producer blocked on a full ring give up.
+ *
+ * A side that has to wait, for room or for an element, sleeps on the ring's
+ * bell and the other side wakes it; neither side takes the bell's lock
+ * unless someone sleeps. Rings may share a bell, so that one thread can wait
+ * on several of them with SPSC_wait.
+ **/
+struct SPSC_Bell
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond; // on CLOCK_MONOTONIC
+	unsigned sleepers;
+};
+
+struct SPSC_Ring
+{
+	// consumer side: index of the next slot to read
+	size_t head;
+	char pad_head[SPSC_CACHELINE - sizeof(size_t)];
+	// producer side: index of the next slot to write
+	size_t tail;
+	char pad_tail[SPSC_CACHELINE - sizeof(size_t)];
+
+	size_t mask;      // capacity - 1, capacity is a power of two
+	size_t elem_size; // bytes per slot
+	bool closed;      // set by the producer once it is done
+	char *slots;
+	struct SPSC_Bell *bell; // own_bell unless shared with SPSC_share_bell
+	struct SPSC_Bell own_bell;
+};
+
+int SPSC_init(struct SPSC_Ring *ring, size_t capacity, size_t elem_size);
+void SPSC_destroy(struct SPSC_Ring *ring);
+void SPSC_close(struct SPSC_Ring *ring);
+size_t SPSC_size(struct SPSC_Ring *ring);
+bool SPSC_drained(struct SPSC_Ring *ring);
+// Have ring use other's bell; call before either side of ring starts
+void SPSC_share_bell(struct SPSC_Ring *ring, struct SPSC_Ring *other);
+// Sleep until one of the n rings, which share a bell, has an element or is
+// closed, or usec passes. Returns whether one does.
+bool SPSC_wait(struct SPSC_Ring *const *rings, size_t n, uint64_t usec);
+
+// Copying interface
+bool SPSC_try_push(struct SPSC_Ring *ring, const void *elem);
+bool SPSC_try_pop(struct SPSC_Ring *ring, void *elem);
+bool SPSC_push(struct SPSC_Ring *ring, const void *elem);
+bool SPSC_pop(struct SPSC_Ring *ring, void *elem);
+bool SPSC_pop_timed(struct SPSC_Ring *ring, void *elem, uint64_t usec);
+
+// In-place interface: fill or read the slot directly, then commit/release it.
+// The try_ forms return NULL instead of waiting for room or for an element.
+void *SPSC_write_slot(struct SPSC_Ring *ring);
+void *SPSC_try_write_slot(struct SPSC_Ring *ring);
+void SPSC_write_commit(struct SPSC_Ring *ring);
+void *SPSC_read_slot(struct SPSC_Ring *ring);
+void *SPSC_try_read_slot(struct SPSC_Ring *ring);
+void SPSC_read_release(struct SPSC_Ring *ring);
+
+#endif
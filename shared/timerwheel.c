@@ -0,0 +1,162 @@
+#include <stddef.h>
+
+#include "timerwheel.h"
+
+static void TW_link(struct TW_Timer *head, struct TW_Timer *timer)
+{
+	timer->prev = head->prev;
+	timer->next = head;
+	head->prev->next = timer;
+	head->prev = timer;
+}
+
+static void TW_unlink(struct TW_Timer *timer)
+{
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->next = timer->prev = NULL;
+}
+
+// Put an armed timer in the slot matching how far away it is
+static void TW_place(struct TW_Wheel *wheel, struct TW_Timer *timer)
+{
+	uint64_t expires = timer->expires;
+	uint64_t delta;
+	if(expires < wheel->tick){
+		// Already due: fire on the next processed tick
+		expires = wheel->tick;
+	}
+	delta = expires - wheel->tick;
+
+	int level = 0;
+	while(level < TW_LEVELS - 1 && delta >= ((uint64_t)1 << (TW_SLOT_BITS * (level + 1))))
+		++level;
+	if(level == TW_LEVELS - 1 &&
+			delta >= ((uint64_t)1 << (TW_SLOT_BITS * TW_LEVELS))){
+		// Beyond the wheel's range: park at the far end, it will be re-cascaded
+		expires = wheel->tick + ((uint64_t)1 << (TW_SLOT_BITS * TW_LEVELS)) - 1;
+	}
+	size_t slot = (expires >> (TW_SLOT_BITS * level)) & TW_SLOT_MASK;
+	TW_link(&wheel->slots[level][slot], timer);
+}
+
+void TW_init(struct TW_Wheel *wheel, uint64_t tick_usec, uint64_t now_usec)
+{
+	int l, s;
+	for(l = 0; l < TW_LEVELS; ++l){
+		for(s = 0; s < TW_SLOTS; ++s){
+			wheel->slots[l][s].next = &wheel->slots[l][s];
+			wheel->slots[l][s].prev = &wheel->slots[l][s];
+		}
+	}
+	wheel->tick_usec = tick_usec > 0 ? tick_usec : 1;
+	wheel->tick = now_usec / wheel->tick_usec;
+	wheel->count = 0;
+}
+
+void TW_timer_init(struct TW_Timer *timer, TW_Callback fire, void *data)
+{
+	timer->next = timer->prev = NULL;
+	timer->expires = 0;
+	timer->fire = fire;
+	timer->data = data;
+	timer->armed = false;
+}
+
+void TW_arm(struct TW_Wheel *wheel, struct TW_Timer *timer, uint64_t expires_usec)
+{
+	if(timer->armed)
+		TW_unlink(timer);
+	else
+		++wheel->count;
+	// Round up so a timer never fires before its deadline
+	timer->expires = (expires_usec + wheel->tick_usec - 1) / wheel->tick_usec;
+	timer->armed = true;
+	TW_place(wheel, timer);
+}
+
+void TW_cancel(struct TW_Wheel *wheel, struct TW_Timer *timer)
+{
+	if(!timer->armed)
+		return;
+	TW_unlink(timer);
+	timer->armed = false;
+	--wheel->count;
+}
+
+// Move every timer in a higher level slot down to where it now belongs
+static size_t TW_cascade(struct TW_Wheel *wheel, int level, size_t slot)
+{
+	struct TW_Timer *head = &wheel->slots[level][slot];
+	struct TW_Timer *timer = head->next;
+	head->next = head->prev = head;
+	while(timer != head){
+		struct TW_Timer *next = timer->next;
+		TW_place(wheel, timer);
+		timer = next;
+	}
+	return slot;
+}
+
+int TW_advance(struct TW_Wheel *wheel, uint64_t now_usec)
+{
+	uint64_t target = now_usec / wheel->tick_usec;
+	int fired = 0;
+
+	while(wheel->tick <= target){
+		if(wheel->count == 0){
+			// Nothing armed, skip ahead
+			wheel->tick = target + 1;
+			break;
+		}
+
+		size_t index = wheel->tick & TW_SLOT_MASK;
+		if(index == 0){
+			int level;
+			for(level = 1; level < TW_LEVELS; ++level){
+				size_t slot = (wheel->tick >> (TW_SLOT_BITS * level)) & TW_SLOT_MASK;
+				if(TW_cascade(wheel, level, slot) != 0)
+					break;
+			}
+		}
+
+		// Detach the due slot first: callbacks may re-arm into it
+		struct TW_Timer *head = &wheel->slots[0][index];
+		struct TW_Timer due = {0};
+		due.next = due.prev = &due;
+		if(head->next != head){
+			due.next = head->next;
+			due.prev = head->prev;
+			due.next->prev = &due;
+			due.prev->next = &due;
+			head->next = head->prev = head;
+		}
+		++wheel->tick;
+
+		while(due.next != &due){
+			struct TW_Timer *timer = due.next;
+			TW_unlink(timer);
+			timer->armed = false;
+			--wheel->count;
+			++fired;
+			if(timer->fire)
+				timer->fire(timer);
+		}
+	}
+	return fired;
+}
+
+uint64_t TW_next_deadline(struct TW_Wheel *wheel)
+{
+	if(wheel->count == 0)
+		return UINT64_MAX;
+
+	uint64_t i;
+	for(i = 0; i < TW_SLOTS; ++i){
+		uint64_t tick = wheel->tick + i;
+		struct TW_Timer *head = &wheel->slots[0][tick & TW_SLOT_MASK];
+		if((tick & TW_SLOT_MASK) == 0 || head->next != head)
+			return tick * wheel->tick_usec;
+	}
+	return (wheel->tick + TW_SLOTS) * wheel->tick_usec;
+}
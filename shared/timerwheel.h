@@ -0,0 +1,58 @@
+#ifndef TIMERWHEEL_H_202610191140
+#define TIMERWHEEL_H_202610191140
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// 4 levels of 64 slots: at a 100us tick the wheel spans about 28 minutes
+#define TW_LEVELS 4
+#define TW_SLOT_BITS 6
+#define TW_SLOTS (1 << TW_SLOT_BITS)
+#define TW_SLOT_MASK (TW_SLOTS - 1)
+
+struct TW_Timer;
+typedef void (*TW_Callback)(struct TW_Timer *timer);
+
+/**
+ * A timer is embedded in whatever it times (a packet, a pipe...).
+ * The wheel never allocates; arming and cancelling only relink the timer.
+ **/
+struct TW_Timer
+{
+	struct TW_Timer *next;
+	struct TW_Timer *prev;
+	uint64_t expires; // tick at which the timer fires
+	TW_Callback fire;
+	void *data;
+	bool armed;
+};
+
+/**
+ * Hierarchical timing wheel. Level 0 holds timers due within the next 64
+ * ticks, one tick per slot; each higher level covers 64 times the range of
+ * the one below and is cascaded down as time reaches it. Arm and cancel
+ * are O(1). The wheel is not thread safe; callers sharing one must lock.
+ **/
+struct TW_Wheel
+{
+	uint64_t tick_usec; // resolution
+	uint64_t tick;      // next tick to process
+	uint64_t count;     // timers currently armed
+	struct TW_Timer slots[TW_LEVELS][TW_SLOTS]; // list heads
+};
+
+void TW_init(struct TW_Wheel *wheel, uint64_t tick_usec, uint64_t now_usec);
+void TW_timer_init(struct TW_Timer *timer, TW_Callback fire, void *data);
+
+// Arm (or re-arm) timer to fire once now_usec reaches expires_usec
+void TW_arm(struct TW_Wheel *wheel, struct TW_Timer *timer, uint64_t expires_usec);
+void TW_cancel(struct TW_Wheel *wheel, struct TW_Timer *timer);
+
+// Fire every timer due by now_usec. Returns the number of timers fired.
+int TW_advance(struct TW_Wheel *wheel, uint64_t now_usec);
+
+// Earliest time at which TW_advance may have work to do, UINT64_MAX if idle.
+// This can be earlier than the next expiry when a cascade is pending.
+uint64_t TW_next_deadline(struct TW_Wheel *wheel);
+
+#endif
@@ -0,0 +1,114 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "drain.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TRC_X86
+#include <x86intrin.h>
+#endif
+
+bool TRC_on = false;
+
+static void TRC_begin(void);
+static bool TRC_drain(void);
+static void TRC_end(void);
+
+static struct DRN_Set TRC_rings = {TRC_RING_RECORDS, sizeof(struct TRC_Record), TRC_DRAIN_MSEC,
+	&TRC_on, TRC_begin, TRC_drain, TRC_end, NULL, PTHREAD_MUTEX_INITIALIZER};
+static pthread_once_t TRC_once = PTHREAD_ONCE_INIT;
+static __thread struct DRN_Ring *TRC_mine;
+
+static uint64_t TRC_monoNs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint64_t TRC_stamp(void)
+{
+#ifdef TRC_X86
+	return __rdtsc();
+#else
+	return TRC_monoNs();
+#endif
+}
+
+void TRC_record(enum TRC_Event event, uint8_t protocol, int32_t pipe, uint32_t a, uint32_t b)
+{
+	struct DRN_Ring *r = TRC_mine ? TRC_mine : (TRC_mine = DRN_attach(&TRC_rings));
+	if(!r)
+		return;
+	struct TRC_Record rec = {TRC_stamp(), a, b, pipe, event, protocol, r->thread};
+	if(!SPSC_try_push(&r->ring, &rec))
+		__atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+}
+
+// The decoder maps stamps to time between pairs of these. Lock held.
+static void TRC_clock(void)
+{
+	uint64_t ns = TRC_monoNs();
+	struct TRC_Record rec = {TRC_stamp(), ns >> 32, (uint32_t)ns, -1, TRC_CLOCK, 0, 0};
+	fwrite(&rec, sizeof(rec), 1, TRC_rings.out);
+}
+
+static void TRC_begin(void)
+{
+	struct TRC_FileHeader hdr = {TRC_MAGIC, TRC_VERSION, sizeof(struct TRC_Record)};
+	hdr.pid = getpid();
+#ifdef TRC_X86
+	hdr.tsc = 1;
+#endif
+	fwrite(&hdr, sizeof(hdr), 1, TRC_rings.out);
+	TRC_clock();
+}
+
+// Each ring in turn; the decoder orders records by stamp
+static bool TRC_drain(void)
+{
+	struct DRN_Ring *r;
+	struct TRC_Record rec;
+	bool wrote = false;
+	for(r = TRC_rings.rings; r; r = r->next){
+		while(SPSC_try_pop(&r->ring, &rec)){
+			fwrite(&rec, sizeof(rec), 1, TRC_rings.out);
+			wrote = true;
+		}
+		uint64_t dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+		if(dropped != r->reported){
+			struct TRC_Record lost = {TRC_stamp(), (uint32_t)(dropped - r->reported), 0, -1,
+				TRC_DROPPED, 0, r->thread};
+			fwrite(&lost, sizeof(lost), 1, TRC_rings.out);
+			r->reported = dropped;
+			wrote = true;
+		}
+	}
+	if(wrote)
+		TRC_clock();
+	return wrote;
+}
+
+static void TRC_end(void)
+{
+	TRC_clock();
+}
+
+static void TRC_start(void)
+{
+	const char *path = getenv("RDT_TRACE");
+	if(path && *path && DRN_start(&TRC_rings, path))
+		TRC_on = true;
+}
+
+void TRC_init(void)
+{
+	pthread_once(&TRC_once, TRC_start);
+}
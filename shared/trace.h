@@ -0,0 +1,66 @@
+#ifndef TRACE_H_202610192330
+#define TRACE_H_202610192330
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Packet event trace: fixed-size binary records stamped with the TSC (with
+ * CLOCK_MONOTONIC nanoseconds where there is none). Every thread records
+ * into a lock-free ring of its own; a background thread drains the rings
+ * every TRC_DRAIN_MSEC to the file named by the RDT_TRACE variable (a
+ * forked child writes to that name plus ".<pid>"), along with clock records
+ * that let the decoder, rdtstat -T, turn stamps into time. An event that
+ * finds its ring full is counted and dropped; the writer never waits.
+ *
+ * Without RDT_TRACE nothing is recorded and TRC_EVENT costs a load and a
+ * branch.
+ **/
+#define TRC_MAGIC "RDTTRC1"
+#define TRC_VERSION 1
+#define TRC_RING_RECORDS 8192 // per thread, a power of two
+#define TRC_DRAIN_MSEC 10
+
+// What a and b of a record hold is given for each event
+enum TRC_Event {
+	TRC_SEND,       // seqnum, payload bytes: first transmission
+	TRC_RETRANSMIT, // seqnum, payload bytes
+	TRC_ACK,        // seqnum acknowledged, RTT sample in usec (0 if none)
+	TRC_TIMEOUT,    // seqnum whose timer expired, retransmissions so far
+	TRC_RECV,       // seqnum, payload bytes: new data taken in
+	TRC_DUPLICATE,  // seqnum, 0: data received again
+	TRC_STATE,      // new state, old state (MET_State, or the GBN enum)
+	TRC_ERROR,      // source line, errno
+	TRC_DROPPED,    // events the record's thread lost, 0 (by the drainer)
+	TRC_CLOCK       // CLOCK_MONOTONIC ns, high and low word (by the drainer)
+};
+
+struct TRC_Record
+{
+	uint64_t tsc;
+	uint32_t a, b;
+	int32_t pipe;     // RDT pipe index, or GBN socket fd
+	uint8_t event;    // enum TRC_Event
+	uint8_t protocol; // enum RDT_Protocol; GOBACKN stands for the gbn_* sockets
+	uint16_t thread;  // ring the record came through, from 1
+};
+
+struct TRC_FileHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size; // sizeof(struct TRC_Record), checked by the decoder
+	int32_t pid;
+	uint32_t tsc;         // 1 if stamps are TSC ticks, 0 if nanoseconds
+};
+
+extern bool TRC_on;
+
+// Start tracing if RDT_TRACE is set; any number of calls, from any thread
+void TRC_init(void);
+void TRC_record(enum TRC_Event event, uint8_t protocol, int32_t pipe, uint32_t a, uint32_t b);
+
+#define TRC_EVENT(event, protocol, pipe, a, b) \
+	do{ if(TRC_on) TRC_record(event, protocol, pipe, a, b); }while(0)
+
+#endif
@@ -0,0 +1,365 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "global.h"
+#include "sock.h"
+#include "s_gbn.h"
+#include "impair.h"
+#include "xport.h"
+#include "xfer.h"
+
+#define XFER_WRITE_LEN (RDT_PAYLOAD_LEN * 1000)
+
+struct XFER_State
+{
+	const struct XFER_Params *params;
+	const char *data;
+	size_t len;
+	size_t write_len;
+	char *out;
+	size_t got;
+	int server, client;
+	uint64_t sent;
+	// ping-pong
+	size_t count, done;
+	uint64_t *rtt_usec;
+	uint64_t connect_start, connected, accepted, finished;
+};
+
+static const char *XFER_names[] = {"SP", "SR", "GBN", "RDT-GBN"};
+
+const char *XFER_name(enum XFER_Proto proto)
+{
+	return proto <= XFER_RDT_GBN ? XFER_names[proto] : "?";
+}
+
+int XFER_parse(const char *name, enum XFER_Proto *proto)
+{
+	int i;
+	for(i = 0; i <= XFER_RDT_GBN; ++i){
+		if(strcasecmp(name, XFER_names[i]) == 0){
+			*proto = i;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static void *XFER_rdtReceiver(void *arg)
+{
+	struct XFER_State *x = arg;
+	int conn = RDT_accept(x->server);
+	while(RDT_info_connected(conn)){
+		int copied = RDT_recv(conn, x->out + x->got,
+			min(x->write_len, x->len - x->got));
+		if(copied > 0)
+			x->got += copied;
+		if(x->got == x->len && copied == 0)
+			break;
+	}
+	RDT_close(conn);
+	RDT_close(x->server);
+	return NULL;
+}
+
+static void *XFER_rdtSender(void *arg)
+{
+	struct XFER_State *x = arg;
+	struct IMP_Stats stats;
+	size_t off;
+	RDT_connect(x->client, "127.0.0.1", htons(x->params->port));
+	for(off = 0; off < x->len; off += x->write_len)
+		RDT_send(x->client, x->data + off, min(x->write_len, x->len - off));
+	if(RDT_info_impairment(x->client, &stats) == 0)
+		x->sent = stats.sent;
+	RDT_close(x->client);
+	return NULL;
+}
+
+static void *XFER_gbnReceiver(void *arg)
+{
+	struct XFER_State *x = arg;
+	struct sockaddr_in client;
+	socklen_t socklen = sizeof(client);
+	if(gbn_accept(x->server, (struct sockaddr *)&client, &socklen) == 0){
+		ssize_t n;
+		while(x->got < x->len &&
+				(n = gbn_recv(x->server, x->out + x->got, x->len - x->got, 0)) > 0)
+			x->got += n;
+		// take the FIN
+		char c;
+		if(x->got == x->len)
+			gbn_recv(x->server, &c, 1, 0);
+		gbn_close(x->server);
+	}
+	XP_close(x->server);
+	return NULL;
+}
+
+static void *XFER_gbnSender(void *arg)
+{
+	struct XFER_State *x = arg;
+	struct sockaddr_in server = {0};
+	size_t off;
+	server.sin_family = AF_INET;
+	server.sin_port = htons(x->params->port);
+	server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(gbn_connect(x->client, (struct sockaddr *)&server, sizeof(server)) == 0){
+		for(off = 0; off < x->len; off += x->write_len)
+			gbn_send(x->client, x->data + off, min(x->write_len, x->len - off), 0);
+		gbn_close(x->client);
+	}
+	state_t *s = gbn_state(x->client);
+	if(s && s->impair){
+		pthread_mutex_lock(&s->impair->lock);
+		x->sent = s->impair->stats.sent;
+		pthread_mutex_unlock(&s->impair->lock);
+	}
+	XP_close(x->client);
+	return NULL;
+}
+
+static int XFER_setup(struct XFER_State *x)
+{
+	const struct XFER_Params *p = x->params;
+	if(p->proto == XFER_GBN){
+		struct sockaddr_in server = {0};
+		server.sin_family = AF_INET;
+		server.sin_port = htons(p->port);
+		server.sin_addr.s_addr = htonl(INADDR_ANY);
+		x->server = gbn_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		x->client = gbn_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		if(x->server < 0 || x->client < 0)
+			return -1;
+		// no built-in LOSS_PRO/CORR_PRO unless asked for
+		const char *spec = p->impair ? p->impair : "loss=0,corrupt=0";
+		if(gbn_setimpair(x->server, spec) < 0 || gbn_setimpair(x->client, spec) < 0)
+			return -1;
+		if(p->window > 0){
+			gbn_setwindow(x->server, p->window);
+			gbn_setwindow(x->client, p->window);
+		}
+		return gbn_bind(x->server, (struct sockaddr *)&server, sizeof(server));
+	}
+
+	enum RDT_Protocol protocol = p->proto == XFER_SR ? SELECTIVE_REPEAT : SINGLE_PACKET;
+	x->server = RDT_socket(protocol);
+	x->client = RDT_socket(protocol);
+	if(x->server < 0 || x->client < 0)
+		return -1;
+	// an impairment link is always there so its counters can be read
+	const char *spec = p->impair && *p->impair ? p->impair : "loss=0";
+	if(RDT_set_impairment(x->server, spec) != 0 || RDT_set_impairment(x->client, spec) != 0)
+		return -1;
+	if(RDT_bind(x->server, "127.0.0.1", htons(p->port)) != 0 ||
+			RDT_bind(x->client, "127.0.0.1", htons(p->port + 1)) != 0)
+		return -1;
+	RDT_listen(x->server, 1);
+	RDT_set_window(x->server, p->window > 0 ? p->window : 10);
+	RDT_set_window(x->client, p->window > 0 ? p->window : 10);
+	return 0;
+}
+
+static double XFER_cpu(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int XFER_run(const struct XFER_Params *params, const char *data, size_t len,
+	char *out, struct XFER_Result *result)
+{
+	struct XFER_State x = {0};
+	size_t off;
+	x.params = params;
+	x.data = data;
+	x.len = len;
+	x.out = out;
+	x.write_len = params->write_len ? params->write_len : XFER_WRITE_LEN;
+
+	memset(result, 0, sizeof(*result));
+	result->payload = params->proto == XFER_GBN ? DATALEN : RDT_PAYLOAD_LEN;
+	// every write ends in a packet of its own
+	for(off = 0; off < len; off += x.write_len){
+		size_t n = min(x.write_len, len - off);
+		result->ideal += (n + result->payload - 1) / result->payload;
+	}
+	if(params->proto == XFER_GBN)
+		result->ideal += 2; // SYN and FIN go through the same path
+	if(params->proto == XFER_RDT_GBN)
+		return 0; // RDT_send_gbN/RDT_recv_gbN are stubs
+	result->supported = true;
+
+	if(XFER_setup(&x) != 0)
+		return -1;
+
+	pthread_t rx, tx;
+	bool gbn = params->proto == XFER_GBN;
+	double cpu = XFER_cpu();
+	uint64_t start = XP_now_usec();
+	pthread_create(&rx, NULL, gbn ? XFER_gbnReceiver : XFER_rdtReceiver, &x);
+	pthread_create(&tx, NULL, gbn ? XFER_gbnSender : XFER_rdtSender, &x);
+	pthread_join(tx, NULL);
+	pthread_join(rx, NULL);
+	result->usec = XP_now_usec() - start;
+	result->cpu_sec = XFER_cpu() - cpu;
+
+	result->bytes = x.got;
+	result->sent = x.sent;
+	result->ok = x.got == len && memcmp(data, out, len) == 0;
+	return 0;
+}
+
+// Echo count messages of x->len bytes back to the client
+static void *XFER_rdtEcho(void *arg)
+{
+	struct XFER_State *x = arg;
+	size_t i;
+	int conn = RDT_accept(x->server);
+	x->accepted = XP_now_usec();
+	for(i = 0; i < x->count && conn >= 0; ++i){
+		if(RDT_recvmsg(conn, x->out, x->len, NULL) != (int)x->len)
+			break;
+		if(RDT_sendmsg(conn, x->out, x->len) != (int)x->len)
+			break;
+	}
+	RDT_close(conn);
+	RDT_close(x->server);
+	return NULL;
+}
+
+static void *XFER_rdtPing(void *arg)
+{
+	struct XFER_State *x = arg;
+	char *echo = malloc(x->len);
+	x->connect_start = XP_now_usec();
+	RDT_connect(x->client, "127.0.0.1", htons(x->params->port));
+	x->connected = XP_now_usec();
+	for(x->done = 0; echo && x->done < x->count; ++x->done){
+		uint64_t start = XP_now_usec();
+		if(RDT_sendmsg(x->client, x->data, x->len) != (int)x->len ||
+				RDT_recvmsg(x->client, echo, x->len, NULL) != (int)x->len ||
+				memcmp(echo, x->data, x->len) != 0)
+			break;
+		x->rtt_usec[x->done] = XP_now_usec() - start;
+	}
+	x->finished = XP_now_usec();
+	RDT_close(x->client);
+	free(echo);
+	return NULL;
+}
+
+// gbn_recv hands back whatever is queued, so gather a whole message
+static bool XFER_gbnRecvAll(int sockfd, char *buf, size_t len)
+{
+	size_t got = 0;
+	ssize_t n;
+	while(got < len && (n = gbn_recv(sockfd, buf + got, len - got, 0)) > 0)
+		got += n;
+	return got == len;
+}
+
+static void *XFER_gbnEcho(void *arg)
+{
+	struct XFER_State *x = arg;
+	struct sockaddr_in client;
+	socklen_t socklen = sizeof(client);
+	size_t i;
+	if(gbn_accept(x->server, (struct sockaddr *)&client, &socklen) == 0){
+		x->accepted = XP_now_usec();
+		for(i = 0; i < x->count; ++i){
+			if(!XFER_gbnRecvAll(x->server, x->out, x->len) ||
+					gbn_send(x->server, x->out, x->len, 0) != (ssize_t)x->len)
+				break;
+		}
+		// take the FIN
+		char c;
+		gbn_recv(x->server, &c, 1, 0);
+		gbn_close(x->server);
+	}
+	XP_close(x->server);
+	return NULL;
+}
+
+static void *XFER_gbnPing(void *arg)
+{
+	struct XFER_State *x = arg;
+	struct sockaddr_in server = {0};
+	char *echo = malloc(x->len);
+	server.sin_family = AF_INET;
+	server.sin_port = htons(x->params->port);
+	server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	x->connect_start = XP_now_usec();
+	if(echo && gbn_connect(x->client, (struct sockaddr *)&server, sizeof(server)) == 0){
+		x->connected = XP_now_usec();
+		for(x->done = 0; x->done < x->count; ++x->done){
+			uint64_t start = XP_now_usec();
+			if(gbn_send(x->client, x->data, x->len, 0) != (ssize_t)x->len ||
+					!XFER_gbnRecvAll(x->client, echo, x->len) ||
+					memcmp(echo, x->data, x->len) != 0)
+				break;
+			x->rtt_usec[x->done] = XP_now_usec() - start;
+		}
+		x->finished = XP_now_usec();
+		gbn_close(x->client);
+	}
+	XP_close(x->client);
+	free(echo);
+	return NULL;
+}
+
+int XFER_ping(const struct XFER_Params *params, const char *msg, size_t len,
+	size_t count, uint64_t *rtt_usec, struct XFER_Ping *result)
+{
+	struct XFER_State x = {0};
+	x.params = params;
+	memset(result, 0, sizeof(*result));
+	if(params->proto == XFER_RDT_GBN)
+		return 0;
+	result->supported = true;
+
+	// RDT messages keep their boundaries (RDT_sendmsg), so each echo is the
+	// message as sent; on the wire it still takes whole padded packets
+	result->len = len;
+	if(params->proto != XFER_GBN)
+		result->len = (len + RDT_PAYLOAD_LEN - 1) / RDT_PAYLOAD_LEN * RDT_PAYLOAD_LEN;
+	char *out = malloc(len ? len : 1);
+	if(!out)
+		return -1;
+	x.data = msg;
+	x.out = out;
+	x.len = len;
+	x.count = count;
+	x.rtt_usec = rtt_usec;
+
+	if(XFER_setup(&x) != 0){
+		free(out);
+		return -1;
+	}
+
+	pthread_t rx, tx;
+	bool gbn = params->proto == XFER_GBN;
+	pthread_create(&rx, NULL, gbn ? XFER_gbnEcho : XFER_rdtEcho, &x);
+	pthread_create(&tx, NULL, gbn ? XFER_gbnPing : XFER_rdtPing, &x);
+	pthread_join(tx, NULL);
+	pthread_join(rx, NULL);
+
+	if(x.connected){
+		result->connect_usec = x.connected - x.connect_start;
+		result->usec = x.finished - x.connected;
+	}
+	if(x.accepted)
+		result->accept_usec = x.accepted - x.connect_start;
+	result->done = x.done;
+	result->ok = x.done == count;
+	free(out);
+	return 0;
+}
@@ -0,0 +1,69 @@
+#ifndef XFER_H_202610191930
+#define XFER_H_202610191930
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * One complete transfer between two threads of the calling process, over the
+ * current transport (real loopback or the simulator): connect, send the
+ * buffer in writes of write_len bytes, close, and check what arrived; or the
+ * same with small messages echoed back one at a time. Used by the simulator
+ * and the benchmarks.
+ **/
+enum XFER_Proto
+{
+	XFER_SP,      // RDT single packet
+	XFER_SR,      // RDT selective repeat
+	XFER_GBN,     // s_gbn3.c go-back-N
+	XFER_RDT_GBN  // RDT go-back-N, not implemented (RDT_send_gbN)
+};
+
+struct XFER_Params
+{
+	enum XFER_Proto proto;
+	int window;        // SR and GBN packets in flight, 0 for the default
+	size_t write_len;  // bytes per send call, 0 for 100000
+	const char *impair; // impairment spec (impair.h), NULL for none
+	uint16_t port;     // server port; the client binds port + 1
+};
+
+struct XFER_Result
+{
+	bool supported;
+	bool ok;             // everything arrived intact
+	size_t bytes;        // bytes delivered
+	uint64_t usec;       // transport clock from connect to both sides closed
+	double cpu_sec;      // process CPU time over the same span
+	uint64_t sent;       // datagrams the sender handed to the network
+	uint64_t ideal;      // datagrams needed without any loss
+	size_t payload;      // payload bytes per data packet
+};
+
+struct XFER_Ping
+{
+	bool supported;
+	bool ok;               // every message came back intact
+	size_t len;            // bytes per message on the wire
+	size_t done;           // round trips completed
+	uint64_t connect_usec; // connect call, SYN to established
+	uint64_t accept_usec;  // from the connect call until accept returned
+	uint64_t usec;         // all round trips, handshake excluded
+};
+
+const char *XFER_name(enum XFER_Proto proto);
+int XFER_parse(const char *name, enum XFER_Proto *proto);
+
+// Returns -1 if the sockets could not be set up
+int XFER_run(const struct XFER_Params *params, const char *data, size_t len,
+	char *out, struct XFER_Result *result);
+
+// Request/response over one connection: the client sends len bytes of msg,
+// the server echoes them, count times. rtt_usec gets one round trip per
+// message. RDT sends len as a message (RDT_sendmsg) in whole packets,
+// result->len on the wire.
+int XFER_ping(const struct XFER_Params *params, const char *msg, size_t len,
+	size_t count, uint64_t *rtt_usec, struct XFER_Ping *result);
+
+#endif
@@ -0,0 +1,177 @@
+#define _GNU_SOURCE /* ppoll */
+
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "xport.h"
+#include "capture.h"
+
+// UDP backend: straight through to the kernel
+
+static int XP_udpPoll(int s, int64_t usec)
+{
+	struct pollfd pfd = {s, POLLIN, 0};
+	struct timespec ts;
+	if(usec >= 0){
+		ts.tv_sec = usec / 1000000;
+		ts.tv_nsec = (usec % 1000000) * 1000;
+	}
+	return ppoll(&pfd, 1, usec >= 0 ? &ts : NULL, NULL);
+}
+
+static uint64_t XP_udpNow(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+const struct XP_Ops XP_udp = {
+	"udp",
+	false,
+	socket,
+	bind,
+	connect,
+	sendto,
+	recvmsg,
+	XP_udpPoll,
+	getsockname,
+	close,
+	XP_udpNow,
+	NULL
+};
+
+static const struct XP_Ops *XP_ops = &XP_udp;
+
+void XP_use(const struct XP_Ops *ops)
+{
+	XP_ops = ops ? ops : &XP_udp;
+}
+
+const struct XP_Ops *XP_current(void)
+{
+	return XP_ops;
+}
+
+// With RDT_CAPTURE set every datagram through here is also copied to the
+// capture (capture.h)
+
+int XP_socket(int domain, int type, int protocol)
+{
+	CAP_init();
+	return XP_ops->socket(domain, type, protocol);
+}
+
+int XP_bind(int s, const struct sockaddr *addr, socklen_t len)
+{
+	int ret = XP_ops->bind(s, addr, len);
+	if(CAP_on && ret == 0)
+		CAP_bound(s);
+	return ret;
+}
+
+int XP_connect(int s, const struct sockaddr *addr, socklen_t len)
+{
+	int ret = XP_ops->connect(s, addr, len);
+	if(CAP_on && ret == 0)
+		CAP_connected(s, addr);
+	return ret;
+}
+
+ssize_t XP_send(int s, const void *buf, size_t len, int flags)
+{
+	return XP_sendto(s, buf, len, flags, NULL, 0);
+}
+
+ssize_t XP_sendto(int s, const void *buf, size_t len, int flags,
+	const struct sockaddr *to, socklen_t tolen)
+{
+	ssize_t ret = XP_ops->sendto(s, buf, len, flags, to, tolen);
+	if(CAP_on && ret >= 0)
+		CAP_sent(s, buf, ret, to);
+	return ret;
+}
+
+ssize_t XP_sendto_at(int s, const void *buf, size_t len, int flags,
+	const struct sockaddr *to, socklen_t tolen, uint64_t at)
+{
+	if(!XP_ops->sendto_at){
+		errno = ENOSYS;
+		return -1;
+	}
+	ssize_t ret = XP_ops->sendto_at(s, buf, len, flags, to, tolen, at);
+	if(CAP_on && ret >= 0)
+		CAP_sent(s, buf, ret, to);
+	return ret;
+}
+
+ssize_t XP_recv(int s, void *buf, size_t len, int flags)
+{
+	return XP_recvfrom(s, buf, len, flags, NULL, NULL);
+}
+
+ssize_t XP_recvfrom(int s, void *buf, size_t len, int flags,
+	struct sockaddr *from, socklen_t *fromlen)
+{
+	struct iovec iov = {buf, len};
+	struct msghdr msg = {0};
+	msg.msg_name = from;
+	msg.msg_namelen = fromlen ? *fromlen : 0;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	ssize_t ret = XP_recvmsg(s, &msg, flags);
+	if(ret >= 0 && fromlen)
+		*fromlen = msg.msg_namelen;
+	return ret;
+}
+
+ssize_t XP_recvmsg(int s, struct msghdr *msg, int flags)
+{
+	if(!CAP_on)
+		return XP_ops->recvmsg(s, msg, flags);
+	// the capture wants the sender even when the caller does not
+	struct sockaddr_storage from;
+	bool borrowed = msg->msg_name == NULL;
+	if(borrowed){
+		msg->msg_name = &from;
+		msg->msg_namelen = sizeof(from);
+	}
+	ssize_t ret = XP_ops->recvmsg(s, msg, flags);
+	if(ret >= 0 && !(flags & MSG_PEEK))
+		CAP_received(s, msg, ret);
+	if(borrowed){
+		msg->msg_name = NULL;
+		msg->msg_namelen = 0;
+	}
+	return ret;
+}
+
+int XP_poll(int s, int64_t usec)
+{
+	return XP_ops->poll(s, usec);
+}
+
+int XP_getsockname(int s, struct sockaddr *addr, socklen_t *len)
+{
+	return XP_ops->getsockname(s, addr, len);
+}
+
+int XP_close(int s)
+{
+	if(CAP_on)
+		CAP_closed(s);
+	return XP_ops->close(s);
+}
+
+uint64_t XP_now_usec(void)
+{
+	return XP_ops->now_usec();
+}
+
+bool XP_virtual(void)
+{
+	return XP_ops->virtual_time;
+}
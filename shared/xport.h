@@ -0,0 +1,65 @@
+#ifndef XPORT_H_202610191800
+#define XPORT_H_202610191800
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/**
+ * Datagram transport under the RDT and GBN code. Every socket call and the
+ * protocols' clock go through the backend picked with XP_use(): UDP sockets
+ * on the monotonic clock by default, or an in-memory network on a virtual
+ * clock (simnet.h). Pick the backend before creating any socket; handles and
+ * clock readings from one backend mean nothing to the other.
+ **/
+struct XP_Ops
+{
+	const char *name;
+	bool virtual_time; // the clock only moves while every party waits
+	int (*socket)(int domain, int type, int protocol);
+	int (*bind)(int s, const struct sockaddr *addr, socklen_t len);
+	int (*connect)(int s, const struct sockaddr *addr, socklen_t len);
+	ssize_t (*sendto)(int s, const void *buf, size_t len, int flags,
+		const struct sockaddr *to, socklen_t tolen);
+	ssize_t (*recvmsg)(int s, struct msghdr *msg, int flags);
+	// >0 readable (or an error is pending), 0 on timeout, -1 on error.
+	// A negative usec waits forever.
+	int (*poll)(int s, int64_t usec);
+	int (*getsockname)(int s, struct sockaddr *addr, socklen_t *len);
+	int (*close)(int s);
+	uint64_t (*now_usec)(void);
+	// Virtual clocks: sendto with the datagram held back until now_usec()
+	// reaches at, as the impairment layer's delay line would. NULL if the
+	// backend cannot hold datagrams.
+	ssize_t (*sendto_at)(int s, const void *buf, size_t len, int flags,
+		const struct sockaddr *to, socklen_t tolen, uint64_t at);
+};
+
+extern const struct XP_Ops XP_udp;
+
+void XP_use(const struct XP_Ops *ops);
+const struct XP_Ops *XP_current(void);
+
+// Thin wrappers with the BSD socket signatures
+int XP_socket(int domain, int type, int protocol);
+int XP_bind(int s, const struct sockaddr *addr, socklen_t len);
+int XP_connect(int s, const struct sockaddr *addr, socklen_t len);
+ssize_t XP_send(int s, const void *buf, size_t len, int flags);
+ssize_t XP_sendto(int s, const void *buf, size_t len, int flags,
+	const struct sockaddr *to, socklen_t tolen);
+// Virtual clocks only; -1 with ENOSYS if the backend has no sendto_at
+ssize_t XP_sendto_at(int s, const void *buf, size_t len, int flags,
+	const struct sockaddr *to, socklen_t tolen, uint64_t at);
+ssize_t XP_recv(int s, void *buf, size_t len, int flags);
+ssize_t XP_recvfrom(int s, void *buf, size_t len, int flags,
+	struct sockaddr *from, socklen_t *fromlen);
+ssize_t XP_recvmsg(int s, struct msghdr *msg, int flags);
+int XP_poll(int s, int64_t usec);
+int XP_getsockname(int s, struct sockaddr *addr, socklen_t *len);
+int XP_close(int s);
+uint64_t XP_now_usec(void);
+bool XP_virtual(void);
+
+#endif
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "xport.h"
+#include "simnet.h"
+#include "xfer.h"
+
+// Runs transfers between two threads of this process over the in-memory
+// network. Virtual time is what the protocol would have taken on the link;
+// the wall-clock cost is only the CPU spent simulating it.
+
+#define SIM_SERVER_PORT 5000
+
+int main(int argc, char **argv)
+{
+	if(argc < 4 || argc > 6){
+		fprintf(stderr, "Usage: %s <SP|SR|GBN> <bytes> <runs> [link] [window]\n"
+			"  link: rate=<bps>,delay=<usec>,queue=<bytes>,loss=<p>,seed=<n>\n",
+			argv[0]);
+		return 1;
+	}
+
+	struct XFER_Params params = {0};
+	if(XFER_parse(argv[1], &params.proto) != 0){
+		fprintf(stderr, "Protocol Unknown: %s\n", argv[1]);
+		return 1;
+	}
+	size_t len = strtoul(argv[2], NULL, 10);
+	int runs = atoi(argv[3]);
+	params.window = argc > 5 ? atoi(argv[5]) : 0;
+	params.port = SIM_SERVER_PORT;
+
+	struct SIM_Link link = {0};
+	if(argc > 4 && SIM_parse(argv[4], &link) != 0){
+		fprintf(stderr, "Bad link description: %s\n", argv[4]);
+		return 1;
+	}
+	SIM_configure(&link);
+	XP_use(&SIM_ops);
+
+	char *data = malloc(len);
+	char *out = malloc(len);
+	if(!data || !out){
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	srand(1);
+	size_t i;
+	for(i = 0; i < len; ++i)
+		data[i] = rand();
+
+	uint64_t total_usec = 0;
+	double cpu_sec = 0;
+	int failed = 0, run;
+	for(run = 0; run < runs; ++run){
+		struct XFER_Result res;
+		memset(out, 0, len);
+		if(XFER_run(&params, data, len, out, &res) != 0){
+			fprintf(stderr, "Run %d: socket setup failed\n", run);
+			return 1;
+		}
+		if(!res.supported){
+			fprintf(stderr, "%s is not implemented\n", XFER_name(params.proto));
+			return 1;
+		}
+		// nothing left on the wire for the next run to trip over
+		SIM_drain();
+		total_usec += res.usec;
+		cpu_sec += res.cpu_sec;
+		failed += !res.ok;
+		printf("run %d: %s %.3f ms virtual\n", run, res.ok ? "ok" : "CORRUPT",
+			res.usec / 1000.0);
+	}
+
+	struct SIM_Stats st;
+	SIM_stats(&st);
+	printf("%d runs, %d failed, %.3f s virtual, %.3f s CPU\n", runs, failed,
+		total_usec / 1e6, cpu_sec);
+	printf("datagrams: %llu sent, %llu delivered, %llu lost, %llu queue drops\n",
+		(unsigned long long)st.sent, (unsigned long long)st.delivered,
+		(unsigned long long)st.lost, (unsigned long long)st.queue_drops);
+	free(data);
+	free(out);
+	return failed != 0;
+}